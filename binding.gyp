@@ -9,7 +9,15 @@
         "src/utils.cc",
         "src/bubo.cc",
         "src/strings-table.cc",
-        "src/test.cc"
+        "src/snapshot.cc",
+        "src/mapped-file.cc",
+        "src/shared-set.cc",
+        "src/sharded-set.cc",
+        "src/thread-pool.cc",
+        "src/set-ops.cc",
+        "src/hyperloglog.cc",
+        "src/test.cc",
+        "src/bench.cc"
       ],
       "include_dirs": [
             "<!(node -e \"require('nan')\")"
@@ -1,2 +1,81 @@
+var Readable = require('stream').Readable;
 var addon = require('bindings')('bubo.node');
-module.exports = addon.Bubo;
+var Bubo = addon.Bubo;
+
+// The native async methods call back once done; these return Promises instead.
+['addManyAsync', 'containsManyAsync'].forEach(function(name) {
+    var method = Bubo.prototype[name];
+
+    Bubo.prototype[name] = function(points) {
+        var self = this;
+        return new Promise(function(resolve, reject) {
+            method.call(self, points, function(err, flags) {
+                if (err) {
+                    return reject(err);
+                }
+                resolve(flags);
+            });
+        });
+    };
+});
+
+// Iteration over the objects of the set, which readEntries() decodes batchSize at a time.
+
+Bubo.prototype.entries = function(batchSize) {
+    var self = this;
+    var cursor = {};
+    var batch = [];
+    var index = 0;
+
+    var iterator = {
+        next: function() {
+            if (index === batch.length) {
+                batch = self.readEntries(cursor, batchSize);
+                index = 0;
+                if (batch.length === 0) {
+                    return {done: true, value: undefined};
+                }
+            }
+            return {done: false, value: batch[index++]};
+        }
+    };
+    iterator[Symbol.iterator] = function() { return iterator; };
+    return iterator;
+};
+
+Bubo.prototype.forEach = function(callback, thisArg, batchSize) {
+    var cursor = {};
+    var batch;
+
+    while ((batch = this.readEntries(cursor, batchSize)).length > 0) {
+        for (var i = 0; i < batch.length; i++) {
+            callback.call(thisArg, batch[i], this);
+        }
+    }
+};
+
+Bubo.prototype.stream = function(options) {
+    var self = this;
+    var batchSize = options && options.batchSize;
+    var asStrings = !!(options && options.asStrings);
+    var cursor = {};
+    var stream = new Readable({objectMode: true, highWaterMark: batchSize || 1024});
+
+    stream._read = function() {
+        var batch;
+        try {
+            batch = self.readEntries(cursor, batchSize, asStrings);
+        } catch (err) {
+            return stream.emit('error', err);
+        }
+        if (batch.length === 0) {
+            return stream.push(null);
+        }
+        for (var i = 0; i < batch.length; i++) {
+            stream.push(batch[i]);
+        }
+    };
+    return stream;
+};
+
+module.exports = Bubo;
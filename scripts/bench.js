@@ -0,0 +1,12 @@
+var minimist = require('minimist');
+
+var options = minimist(process.argv.slice(2));
+var NUM_ENTRIES = options.num_entries || 1000000;
+
+var Bubo = require('../index');
+var bubo = new Bubo();
+
+var results = {};
+bubo.bench(results, NUM_ENTRIES);
+
+console.log(JSON.stringify(results, null, 4));
@@ -8,7 +8,13 @@ var num_points = Math.pow(VALUES_PER_KEY, NUM_KEYS);
 var logging_interval = num_points / 100;
 
 var Bubo = require('../index');
-var bubo = new Bubo();
+// --typed_values: store numbers as numbers rather than as strings (see the typedValues option).
+var bubo_options = {typedValues: !!options.typed_values};
+// --bloom_filter: give the set a bloomFilter sized for its points.
+if (options.bloom_filter) {
+    bubo_options.bloomFilter = num_points;
+}
+var bubo = new Bubo(bubo_options);
 
 var values = [];
 function boundedInt(max) {
@@ -24,9 +30,13 @@ function boundedInt(max) {
     };
 }
 
-for (var k = 0; k < NUM_KEYS; k++) {
-    values.push(boundedInt(VALUES_PER_KEY));
+function reset_values() {
+    values = [];
+    for (var k = 0; k < NUM_KEYS; k++) {
+        values.push(boundedInt(VALUES_PER_KEY));
+    }
 }
+reset_values();
 
 function next_value(point_number, key_number) {
     if (point_number && point_number % Math.pow(VALUES_PER_KEY,key_number) === 0) {
@@ -36,6 +46,12 @@ function next_value(point_number, key_number) {
     return values[key_number].value();
 }
 
+// --numeric: use numbers (half of them integers) as values rather than strings.
+function point_value(point_number, key_number) {
+    var value = next_value(point_number, key_number);
+    return options.numeric ? value * 1.5 : 'value' + value;
+}
+
 var time = Date.now();
 for (var i = 0; i < num_points; i++) {
     if (i % logging_interval === 0) {
@@ -44,11 +60,107 @@ for (var i = 0; i < num_points; i++) {
 
     var point = {};
     for (var j = 0; j < NUM_KEYS; j++) {
-        point['key'+j] = 'value' + next_value(i, j);
+        point['key'+j] = point_value(i, j);
     }
 
     bubo.add(point);
 }
+var add_sec = (Date.now() - time)/1000;
 
 global.gc();
 console.log('Finished! Stored', i, 'points, final memory usage:', process.memoryUsage());
+
+// --lookups: time contains() for as many stored points and as many absent ones.
+if (options.lookups) {
+    var hits = 0;
+    var found = 0;
+    time = Date.now();
+    for (i = 0; i < num_points; i++) {
+        var hit_point = {};
+        for (j = 0; j < NUM_KEYS; j++) {
+            hit_point['key'+j] = point_value(i, j);
+        }
+        if (bubo.contains(hit_point)) { hits++; }
+    }
+    console.log('looked up %d stored points (%d found) in %d sec', num_points, hits, (Date.now() - time)/1000);
+
+    // every value is known, but the combinations are not in the set.
+    time = Date.now();
+    for (i = 0; i < num_points; i++) {
+        var miss_point = {};
+        for (j = 0; j < NUM_KEYS; j++) {
+            miss_point['key'+j] = point_value(i, j);
+        }
+        miss_point['key'+NUM_KEYS] = 'value0';
+        if (bubo.contains(miss_point)) { found++; }
+    }
+    console.log('looked up %d absent points (%d found) in %d sec', num_points, found, (Date.now() - time)/1000);
+}
+
+// --misses: time contains() for as many points that are not in the set, first with values the
+// set has never seen, which are answered from the dictionary without growing it, then with known
+// values in combinations that are not stored, which go to the hash table (or its bloomFilter).
+if (options.misses) {
+    var strings_bytes = function() {
+        var stats = {};
+        bubo.stats(stats);
+        return stats.strings_table.used_bytes;
+    };
+    var time_misses = function(what, points) {
+        var before = strings_bytes();
+        var found = 0;
+        var time = Date.now();
+        for (var p = 0; p < points.length; p++) {
+            if (bubo.contains(points[p])) { found++; }
+        }
+        var sec = (Date.now() - time)/1000;
+        console.log('looked up %d %s (%d found) in %d sec, %d lookups/sec%s, dictionary grew by %d bytes',
+                    points.length, what, found, sec, Math.round(points.length / sec),
+                    options.bloom_filter ? ' with bloomFilter' : '', strings_bytes() - before);
+    };
+
+    // The points are made up front, for the times to be those of contains() alone.
+    var fresh_points = [];
+    var partial_points = [];
+    for (i = 0; i < num_points; i++) {
+        var fresh_point = {};
+        var partial_point = {};
+        for (j = 0; j < NUM_KEYS; j++) {
+            var value = point_value(i, j);
+            fresh_point['key'+j] = j ? value : 'fresh' + i;
+            if (j < NUM_KEYS - 1) {
+                partial_point['key'+j] = value;
+            }
+        }
+        fresh_points.push(fresh_point);
+        partial_points.push(partial_point);
+    }
+    time_misses('points with unseen values', fresh_points);
+    time_misses('absent points with known values', partial_points);
+}
+
+// --batch N: add the same points to a new set with addMany(), N points per call.
+if (options.batch) {
+    var batch_bubo = new Bubo(bubo_options);
+    var batch = [];
+    var added = 0;
+
+    reset_values();
+    time = Date.now();
+    for (i = 0; i < num_points; i++) {
+        var batch_point = {};
+        for (j = 0; j < NUM_KEYS; j++) {
+            batch_point['key'+j] = point_value(i, j);
+        }
+        batch.push(batch_point);
+
+        if (batch.length === options.batch || i === num_points - 1) {
+            var is_new = batch_bubo.addMany(batch);
+            for (var f = 0; f < is_new.length; f++) {
+                added += is_new[f];
+            }
+            batch = [];
+        }
+    }
+    console.log('added %d points in batches of %d in %d sec, vs %d sec one at a time', added, options.batch, (Date.now() - time)/1000, add_sec);
+}
@@ -0,0 +1,65 @@
+var minimist = require('minimist');
+var workerThreads = require('worker_threads');
+
+var Bubo = require('../index');
+
+// Adds the points of one worker's share of the passes to the set shared under workerData.name.
+function work(data) {
+    var bubo = new Bubo({shared: data.name});
+    var start = data.index * data.num_ops / data.workers;
+    var end = (data.index + 1) * data.num_ops / data.workers;
+
+    for (var op = start; op < end; op++) {
+        var i = op % data.num_points;
+        bubo.add({
+            host: 'web-' + (i % 5000) + '.example.com',
+            pop: 'pop-' + (i % 20),
+            name: 'system.cpu.' + Math.floor(i / 100000) + '.user',
+            service: 'svc-' + (i % 50)
+        });
+    }
+}
+
+if (!workerThreads.isMainThread) {
+    work(workerThreads.workerData);
+    return;
+}
+
+var options = minimist(process.argv.slice(2));
+var NUM_POINTS = options.num_points || 1000000;
+// Every point is added this many times, the first time as a new point.
+var PASSES = options.passes || 4;
+var WORKERS = String(options.workers || '1,2,4,8,16').split(',').map(Number);
+
+function run(workers, done) {
+    var name = 'workers-bench-' + workers;
+    var owner = new Bubo({shared: name});
+    var remaining = workers;
+    var start = process.hrtime();
+
+    for (var w = 0; w < workers; w++) {
+        var worker = new workerThreads.Worker(__filename, {workerData: {
+            name: name, index: w, workers: workers, num_points: NUM_POINTS, num_ops: NUM_POINTS * PASSES
+        }});
+        worker.on('error', function(err) { throw err; });
+        worker.on('exit', function() {
+            if (--remaining > 0) {
+                return;
+            }
+            var elapsed = process.hrtime(start);
+            var seconds = elapsed[0] + elapsed[1] / 1e9;
+            var stats = {};
+            owner.stats(stats);
+            console.log(workers + ' workers: ' + Math.round(NUM_POINTS * PASSES / seconds) + ' adds/s, ' +
+                        stats.attrs_table.attr_entries + ' points');
+            done();
+        });
+    }
+}
+
+var next = 0;
+(function run_next() {
+    if (next < WORKERS.length) {
+        run(WORKERS[next++], run_next);
+    }
+})();
@@ -1,25 +1,206 @@
 #include <assert.h>
 #include <string.h>
+#include <algorithm>
 #include <cstring>
+#include <limits>
 #include "attrs-table.h"
+#include "set-ops.h"
 #include "utils.h"
 #include "strings-table.h"
 #include "persistent-string.h"
 
-static EntryToken* entryTokens[100];
 static const int MAX_BUFFER_SIZE = 16 << 10;
 
-AttributesTable::AttributesTable(StringsTable* strings_table)
-    : attributes_hash_set_(),
+// The most a typed value other than a string takes in an attr_str, a Date's string being the longest.
+static const int MAX_TYPED_VALUE_STR_LEN = 128;
+
+// What a tuple adds to an attr_str, "tag=value,", once encode_value() filled in its token.
+static inline size_t tuple_str_len(const EntryToken* et) {
+    return StringsTable::str_len(et->tag_) + 2 + (et->val_ ? StringsTable::str_len(et->val_) : MAX_TYPED_VALUE_STR_LEN);
+}
+
+AttributesTable::AttributesTable(StringsTable* strings_table, const BytePtrHash& hash, uint32_t num_shards)
+    : sharded_set_(new ShardedSet(num_shards, hash)),
+      owns_sharded_set_(true),
       strings_table_(strings_table)
 {
-    for (int i = 0; i < 100; i++) {
-      entryTokens[i] = new EntryToken();
+}
+
+AttributesTable::AttributesTable(AttributesTable* shared, StripedLock* lock)
+    : sharded_set_(shared->sharded_set_),
+      owns_sharded_set_(false),
+      lock_(lock),
+      strings_table_(shared->strings_table_),
+      ignored_attributes_(shared->ignored_attributes_),
+      typed_values_(shared->typed_values_),
+      sketch_(shared->sketch_),
+      keep_entries_(shared->keep_entries_),
+      max_bytes_(shared->max_bytes_)
+{
+}
+
+void AttributesTable::set_concurrent(StripedLock* lock) {
+    sharded_set_->set_concurrent();
+    if (lock) {
+        lock_ = lock;
     }
 }
 
 void AttributesTable::set_ignored_attributes(std::vector<std::string> *ignored_attributes) {
     ignored_attributes_ = ignored_attributes;
+    // cached shapes have the previously ignored keys left out.
+    clear_shapes();
+}
+
+void AttributesTable::set_incremental_resize(uint32_t step_groups) {
+    sharded_set_->set_incremental_resize(step_groups);
+}
+
+void AttributesTable::set_auto_compact(double dead_ratio, bool auto_compact) {
+    sharded_set_->set_auto_compact(dead_ratio, auto_compact ? DEFAULT_COMPACT_STEP_GROUPS : 0);
+}
+
+bool AttributesTable::compact(uint32_t step_groups) {
+    ExclusiveGuard guard(lock_);
+    return sharded_set_->compact(step_groups);
+}
+
+void AttributesTable::set_filter(uint64_t expected_entries) {
+    sharded_set_->set_filter(expected_entries);
+}
+
+void AttributesTable::rebuild_filter() {
+    ExclusiveGuard guard(lock_);
+    sharded_set_->rebuild_filter();
+}
+
+void AttributesTable::set_generations(uint32_t max_generations) {
+    sharded_set_->set_generations(max_generations);
+}
+
+uint64_t AttributesTable::rotate() {
+    ExclusiveGuard guard(lock_);
+    return sharded_set_->rotate();
+}
+
+void AttributesTable::set_max_bytes(uint64_t max_bytes) {
+    max_bytes_ = max_bytes;
+    sharded_set_->set_clock(max_bytes > 0);
+}
+
+uint64_t AttributesTable::entries_max_bytes() const {
+    if (max_bytes_ == 0) {
+        return 0;
+    }
+    uint64_t strings_bytes = strings_table_->bytes();
+    return max_bytes_ > strings_bytes ? max_bytes_ - strings_bytes : 1;
+}
+
+void AttributesTable::save(SnapshotWriter* writer) {
+    sharded_set_->save(writer);
+}
+
+bool AttributesTable::load(SnapshotReader* reader) {
+    // The cached tags point into the strings table the snapshot comes with.
+    clear_shapes();
+    bool ok = sharded_set_->load(reader);
+    if (ok && sketch_) {
+        fill_sketch();
+    }
+    return ok;
+}
+
+bool AttributesTable::set_mapped(const std::string& dir) {
+    return sharded_set_->set_mapped(dir);
+}
+
+bool AttributesTable::sync(SnapshotWriter* writer) {
+    return sharded_set_->sync(writer);
+}
+
+bool AttributesTable::open_mapped(const std::string& dir, SnapshotReader* reader, bool read_only) {
+    clear_shapes();
+    bool ok = sharded_set_->open_mapped(dir, reader, read_only);
+    if (ok && sketch_) {
+        fill_sketch();
+    }
+    return ok;
+}
+
+void AttributesTable::set_sketch(uint32_t precision, bool keep_entries) {
+    delete sketch_;
+    sketch_ = new HyperLogLog(precision, typed_values_ ? SKETCH_FLAG_TYPED_VALUES : 0);
+    keep_entries_ = keep_entries;
+}
+
+double AttributesTable::cardinality() const {
+    SharedGuard guard(lock_);
+    return sketch_ ? sketch_->estimate() : sharded_set_->size();
+}
+
+void AttributesTable::serialize_sketch(std::string* out) const {
+    sketch_->serialize(out);
+}
+
+bool AttributesTable::merge_sketch(const BYTE* data, size_t len) {
+    return sketch_->merge_serialized(data, len);
+}
+
+bool AttributesTable::insert_entry(const BYTE* entry, int entry_len) {
+    bool grew = sketch_ && sketch_->add(sketch_hash(entry, entry_len));
+    last_evicted_ = 0;
+    return keep_entries_ ? sharded_set_->insert(entry, entry_len, entries_max_bytes(), &last_evicted_) : grew;
+}
+
+void AttributesTable::insert_batch(const EntryBatch& batch, uint8_t* flags) {
+    if (keep_entries_) {
+        sharded_set_->insert_batch(batch, flags, entries_max_bytes());
+    }
+    if (!sketch_) {
+        return;
+    }
+    for (size_t i = 0; i < batch.size(); i++) {
+        bool grew = sketch_->add(sketch_hash(batch.entry(i), batch.lens_[i]));
+        if (!keep_entries_) {
+            flags[batch.rows_[i]] = grew;
+        }
+    }
+}
+
+uint64_t AttributesTable::sketch_hash(const BYTE* entry, int entry_len) const {
+    static thread_local std::string buf;
+    buf.clear();
+
+    // Every string with its NUL, and every value after its kind, so that the tuples cannot run together.
+    bool ok = decode_tuples(entry, entry_len, [&](const StringsTable::TagEntry* te, uint32_t kind, uint64_t code, double d) {
+        buf.append(te->tag_, StringsTable::str_len(te->tag_) + 1);
+        buf.push_back((char)kind);
+        if (kind == VAL_STRING) {
+            const char* val = StringsTable::find_val_str(te, code);
+            if (!val) {
+                return false;
+            }
+            buf.append(val, StringsTable::str_len(val) + 1);
+        } else if (kind == VAL_DOUBLE || kind == VAL_DATE) {
+            buf.append((const char*)&d, sizeof(d));
+        } else {
+            buf.append((const char*)&code, sizeof(code));
+        }
+        return true;
+    });
+    if (!ok) {
+        // Only for an entry the owner of a read-only set is writing meanwhile.
+        return bubo_utils::wyhash_byte_sequence(entry, entry_len, SKETCH_HASH_SEED);
+    }
+    return bubo_utils::wyhash_byte_sequence((const BYTE*)buf.data(), buf.size(), SKETCH_HASH_SEED);
+}
+
+void AttributesTable::fill_sketch() {
+    sketch_->clear();
+    ScanCursor cursor;
+    sharded_set_->scan(&cursor, std::numeric_limits<uint32_t>::max(), [this](const BYTE* entry, int entry_len) {
+        sketch_->add(sketch_hash(entry, entry_len));
+    });
 }
 
 
@@ -27,73 +208,105 @@ bool AttributesTable::add(const v8::Local<v8::Object>& pt, bool should_get_attr_
                              v8::Local<v8::String>& attr_str, int* error) {
     int entrylen = 0;
 
+    if (lock_) {
+        // Points whose tags and values are all known only need the lock shared, and their shard's.
+        SharedGuard guard(lock_);
+        if (prepare_entry_buffer(pt, &entrylen, should_get_attr_str, attr_str, error, false)) {
+            return !insert_entry(entry_buf_, entrylen);
+        }
+        if (*error) {
+            return false;
+        }
+    }
+
+    ExclusiveGuard guard(lock_);
     prepare_entry_buffer(pt, &entrylen, should_get_attr_str, attr_str, error);
 
     if (*error) {
         return false;
     }
 
-    return !attributes_hash_set_.insert(entry_buf_, entrylen);
+    return !insert_entry(entry_buf_, entrylen);
 }
 
 bool AttributesTable::contains(const v8::Local<v8::Object>& pt, int* error) {
     int entrylen = 0;
     v8::Local<v8::String> dummy;
+    SharedGuard guard(lock_);
 
-    prepare_entry_buffer(pt, &entrylen, false, dummy, error);
-
-    if (*error) {
+    // An unknown tag or value means the point cannot be in the set.
+    if (!prepare_entry_buffer(pt, &entrylen, false, dummy, error, false)) {
         return false;
     }
 
-    return attributes_hash_set_.contains(entry_buf_, entrylen);
+    return has_entry(entry_buf_, entrylen);
 }
 
 void AttributesTable::remove(const v8::Local<v8::Object>& pt) {
 
     int entrylen = 0;
     v8::Local<v8::String> dummy;
-    int* dummyInt = nullptr;
-    prepare_entry_buffer(pt, &entrylen, false, dummy, dummyInt);
+    int error = 0;
+    SharedGuard guard(lock_);
+    if (!prepare_entry_buffer(pt, &entrylen, false, dummy, &error, false)) {
+        return;
+    }
 
-    attributes_hash_set_.erase(entry_buf_);
+    sharded_set_->erase(entry_buf_, entrylen);
 }
 
 AttributesTable::~AttributesTable() {
-    attributes_hash_set_.clear();
-}
-
-char* mystrcat( char* dest, const char* src, int* total_buffer_size );
-
-// http://www.joelonsoftware.com/articles/fog0000000319.html
-char* mystrcat( char* dest, const char* src, int* total_buffer_size ) {
-     while (*dest) dest++;
-     while ((*dest++ = *src++) && (*total_buffer_size)++ < MAX_BUFFER_SIZE);
-     return --dest;
+    clear_shapes();
+    if (owns_sharded_set_) {
+        delete sharded_set_;
+        delete sketch_;
+    }
 }
 
 inline bool _contains(std::vector<std::string> *vector, std::string string) {
     return std::find(vector->begin(), vector->end(), string) != vector->end();
 }
 
-/* Returns true if all the tags and tag-names are found in the internal maps */
-bool AttributesTable::prepare_entry_buffer(const v8::Local<v8::Object>& pt,
-                                           int* entry_len,
-                                           bool get_attr_str,
-                                           v8::Local<v8::String>& attr_str,
-                                           int* error) {
-    int total_buffer_size = 0;
-    static char g_attrstr_buf[MAX_BUFFER_SIZE] __attribute__ ((aligned (8)));
-    g_attrstr_buf[0] = '\0';
+/* Returns the cached shape with exactly the given keys, in the same order, or NULL. */
+AttributesTable::Shape* AttributesTable::find_shape(const v8::Local<v8::Array>& keys) {
+    uint32_t length = keys->Length();
 
-    v8::Local<v8::Array> keys = Nan::GetOwnPropertyNames(pt).ToLocalChecked();
-    std::vector<EntryToken*> tokens;
-    bool all_found = true;
+    for (size_t s = 0; s < shapes_.size(); s++) {
+        Shape* shape = shapes_[s];
+        if (shape->num_keys_ != length) {
+            continue;
+        }
+
+        // Property names are internalized strings, so this is mostly pointer comparisons.
+        bool match = true;
+        for (uint32_t i = 0; i < length && match; i++) {
+            match = Nan::New(shape->keys_[i])->StrictEquals(Nan::Get(keys, i).ToLocalChecked());
+        }
+
+        if (match) {
+            shapes_.erase(shapes_.begin() + s);
+            shapes_.insert(shapes_.begin(), shape);
+            shape_cache_hits_ ++;
+            return shape;
+        }
+    }
+
+    shape_cache_misses_ ++;
+    return NULL;
+}
+
+/*
+ * Resolves the tags of a new shape and caches it, evicting the least recently used one if needed.
+ * Unless add is true, returns NULL, caching nothing, if any of the tags is unknown.
+ */
+AttributesTable::Shape* AttributesTable::add_shape(const v8::Local<v8::Array>& keys, bool add, bool* all_found) {
     uint32_t length = keys->Length();
+    Shape* shape = new Shape(length);
 
     for (u_int32_t i = 0; i < length; ++i) {
         v8::Local<v8::Value> key = Nan::Get(keys, i).ToLocalChecked();
-        v8::Local<v8::String> key_str(key->ToString());
+        shape->keys_[i].Reset(key);
+
         v8::String::Utf8Value tag(key);
         std::string tag_str(*tag);
 
@@ -101,58 +314,181 @@ bool AttributesTable::prepare_entry_buffer(const v8::Local<v8::Object>& pt,
             continue;
         }
 
-        v8::String::Utf8Value val(Nan::Get(pt, key_str).ToLocalChecked());
+        ShapeTag st;
+        st.key_index_ = i;
+        if (!add) {
+            if (!strings_table_->find_tag(*tag, &st.token_, &st.tag_entry_)) {
+                delete shape;
+                return NULL;
+            }
+        } else {
+            *all_found = strings_table_->check_and_add_tag(*tag, &st.token_, &st.tag_entry_) && *all_found;
+        }
+        assert(st.token_.tag_seq_no_ > 0);
+        shape->tags_.push_back(st);
+    }
+
+    std::sort(shape->tags_.begin(), shape->tags_.end(), [](const ShapeTag& a, const ShapeTag& b) {
+        return bubo_utils::cmp_entry_token(&a.token_, &b.token_);
+    });
+
+    if (shapes_.size() >= SHAPE_CACHE_SIZE) {
+        delete shapes_.back();
+        shapes_.pop_back();
+    }
+    shapes_.insert(shapes_.begin(), shape);
+
+    return shape;
+}
 
-        EntryToken* et = entryTokens[i];
-        all_found = strings_table_->check_and_add(*tag, *val, et) && all_found;
-        assert(et->tag_seq_no_ > 0 && et->val_seq_no_ > 0);
-        tokens.push_back(et);
+void AttributesTable::clear_shapes() {
+    for (size_t s = 0; s < shapes_.size(); s++) {
+        delete shapes_[s];
     }
+    shapes_.clear();
+}
+
+static int encode_double(uint32_t kind, double d, BYTE* out) {
+    out[0] = kind;
+    memcpy(out + 1, &d, sizeof(d));
+    return 1 + sizeof(d);
+}
+
+static int encode_constant(uint32_t constant, BYTE* out) {
+    out[0] = (constant << VAL_KIND_BITS) | VAL_CONST;
+    return 1;
+}
+
+int AttributesTable::encode_value(const v8::Local<v8::Value>& value, StringsTable::TagEntry* tag_entry,
+                                  EntryToken* et, BYTE* out, bool add, bool* found) {
+    int encoded_len = 0;
+
+    if (typed_values_) {
+        et->val_ = NULL;
+        et->val_seq_no_ = 0;
+        *found = true;
 
-    std::sort(tokens.begin(), tokens.end(), bubo_utils::cmp_entry_token);
+        if (value->IsNumber()) {
+            double d = Nan::To<double>(value).FromJust();
+            // -0 is the same value as 0, and all NaNs are the same value.
+            if (value->IsInt32() || d == 0) {
+                int32_t n = (int32_t)d;
+                uint64_t zigzag = ((uint32_t)n << 1) ^ (uint32_t)(n >> 31);
+                bubo_utils::encode_packed64((zigzag << VAL_KIND_BITS) | VAL_INT, out, &encoded_len);
+                return encoded_len;
+            }
+            if (d != d) {
+                d = std::numeric_limits<double>::quiet_NaN();
+            }
+            return encode_double(VAL_DOUBLE, d, out);
+        }
+
+        if (value->IsDate()) {
+            return encode_double(VAL_DATE, value.As<v8::Date>()->ValueOf(), out);
+        }
+
+        if (value->IsNull()) {
+            return encode_constant(VAL_CONST_NULL, out);
+        }
+        if (value->IsFalse()) {
+            return encode_constant(VAL_CONST_FALSE, out);
+        }
+        if (value->IsTrue()) {
+            return encode_constant(VAL_CONST_TRUE, out);
+        }
+        if (value->IsUndefined()) {
+            return encode_constant(VAL_CONST_UNDEFINED, out);
+        }
+        // Strings, and anything else as its string, below.
+    }
+
+    v8::String::Utf8Value val(value);
+    if (!add) {
+        *found = strings_table_->find_val(tag_entry, *val, et);
+        if (!*found) {
+            return 0;
+        }
+    } else {
+        *found = strings_table_->check_and_add_val(tag_entry, *val, et);
+    }
+    assert(et->val_seq_no_ > 0);
+
+    if (typed_values_) {
+        bubo_utils::encode_packed64(((uint64_t)et->val_seq_no_ << VAL_KIND_BITS) | VAL_STRING, out, &encoded_len);
+    } else {
+        bubo_utils::encode_packed(et->val_seq_no_, out, &encoded_len);
+    }
+    return encoded_len;
+}
+
+/* Returns true if all the tags and tag-names are found in the internal maps */
+bool AttributesTable::prepare_entry_buffer(const v8::Local<v8::Object>& pt,
+                                           int* entry_len,
+                                           bool get_attr_str,
+                                           v8::Local<v8::String>& attr_str,
+                                           int* error,
+                                           bool add) {
+    v8::Local<v8::Array> keys = Nan::GetOwnPropertyNames(pt).ToLocalChecked();
+    bool all_found = true;
+
+    Shape* shape = find_shape(keys);
+    if (shape == NULL) {
+        shape = add_shape(keys, add, &all_found);
+        if (shape == NULL) {
+            return false;
+        }
+    }
 
     BYTE* entry_buf_ptr = entry_buf_;
-    char* attr_buff_ptr = g_attrstr_buf;
 
     int encoded_len = 0;
+    size_t attr_len = 0;
 
-    u_int32_t tags_count = tokens.size();
+    u_int32_t tags_count = shape->tags_.size();
+    if (tags_count * MAX_TUPLE_LEN + 5 > sizeof(entry_buf_)) {
+        *error = ATTRS_ERR_POINT_TOO_BIG;
+        return false;
+    }
     bubo_utils::encode_packed(tags_count, entry_buf_ptr, &encoded_len);
     entry_buf_ptr += encoded_len;
 
     for (size_t i = 0; i < tags_count; i++) {
 
-        EntryToken* et = tokens.at(i);
+        ShapeTag& st = shape->tags_[i];
+        EntryToken* et = &st.token_;
 
-        encoded_len = 0;
-        bubo_utils::encode_packed(et->tag_seq_no_, entry_buf_ptr, &encoded_len);
-        entry_buf_ptr += encoded_len;
+        v8::Local<v8::Value> key = Nan::Get(keys, st.key_index_).ToLocalChecked();
+        v8::Local<v8::Value> value = Nan::Get(pt, key).ToLocalChecked();
 
         encoded_len = 0;
-        bubo_utils::encode_packed(et->val_seq_no_, entry_buf_ptr, &encoded_len);
+        bubo_utils::encode_packed(et->tag_seq_no_, entry_buf_ptr, &encoded_len);
         entry_buf_ptr += encoded_len;
 
-        if (get_attr_str) {
-            if (i != 0) {
-                attr_buff_ptr = mystrcat(attr_buff_ptr, ",", &total_buffer_size);
-            }
-            attr_buff_ptr = mystrcat(attr_buff_ptr, et->tag_, &total_buffer_size);
-            attr_buff_ptr = mystrcat(attr_buff_ptr, "=", &total_buffer_size);
-            attr_buff_ptr = mystrcat(attr_buff_ptr, et->val_, &total_buffer_size);
+        bool found = true;
+        entry_buf_ptr += encode_value(value, st.tag_entry_, et, entry_buf_ptr, add, &found);
+        if (!found && !add) {
+            return false;
         }
+        all_found = found && all_found;
+        attr_len += tuple_str_len(et);
     }
 
-    if (total_buffer_size >= MAX_BUFFER_SIZE) {
-        *error = 1;
+    *entry_len = entry_buf_ptr - entry_buf_;
+
+    // The size rule holds whether or not the caller wants attr_str, so batches take what add() takes.
+    if (point_too_big(entry_buf_, *entry_len, attr_len)) {
+        *error = ATTRS_ERR_POINT_TOO_BIG;
         return false;
     }
 
     if (get_attr_str) {
-        attr_str = Nan::New<v8::String>(g_attrstr_buf).ToLocalChecked();
+        if (attr_len < MAX_BUFFER_SIZE) {
+            attr_str_.clear();
+            entry_attr_str(entry_buf_, *entry_len, &attr_str_);
+        }
+        attr_str = Nan::New<v8::String>(attr_str_.data(), (int)attr_str_.size()).ToLocalChecked();
     }
 
-    *entry_len = entry_buf_ptr - entry_buf_;
-
     // NOTE: "all_found == true" doesn't necessarily mean we have this entry.
     // This just means that each tag & tagname is known. But the order in which
     // they appear can vary within an entry.
@@ -160,51 +496,612 @@ bool AttributesTable::prepare_entry_buffer(const v8::Local<v8::Object>& pt,
 }
 
 
-void AttributesTable::stats(v8::Local<v8::Object>& stats) const {
+void AttributesTable::add_columns(const v8::Local<v8::Object>& columns, uint32_t row_count,
+                                  uint8_t* flags, int* error) {
+    if (!batched()) {
+        process_columns(columns, row_count, true, flags, error, NULL);
+        return;
+    }
+
+    batch_.clear();
+    if (lock_) {
+        // As for add(), rows whose tags and values are all known only need the lock shared.
+        SharedGuard guard(lock_);
+        process_columns(columns, row_count, false, flags, error, &batch_);
+        if (*error) {
+            return;
+        }
+        if (batch_.size() == row_count) {
+            insert_batch(batch_, flags);
+            return;
+        }
+        batch_.clear();
+    }
+
+    ExclusiveGuard guard(lock_);
+    process_columns(columns, row_count, true, flags, error, &batch_);
+    if (!*error) {
+        insert_batch(batch_, flags);
+    }
+}
+
+void AttributesTable::contains_columns(const v8::Local<v8::Object>& columns, uint32_t row_count,
+                                       uint8_t* flags, int* error) {
+    SharedGuard guard(lock_);
+    if (!batched()) {
+        process_columns(columns, row_count, false, flags, error, NULL);
+        return;
+    }
+
+    batch_.clear();
+    process_columns(columns, row_count, false, flags, error, &batch_);
+    if (!*error) {
+        sharded_set_->contains_batch(batch_, flags);
+    }
+}
+
+void AttributesTable::add_many(const v8::Local<v8::Array>& points, uint8_t* flags, int* error) {
+    if (!batched()) {
+        uint32_t length = points->Length();
+        v8::Local<v8::String> attrs;
+        for (uint32_t i = 0; i < length; i++) {
+            Nan::HandleScope scope;
+            v8::Local<v8::Object> pt = Nan::Get(points, i).ToLocalChecked().As<v8::Object>();
+            flags[i] = !add(pt, false, attrs, error);
+            if (*error) {
+                return;
+            }
+        }
+        return;
+    }
 
-    static PersistentString attr_entries("attr_entries");
+    batch_.clear();
+    encode_many(points, true, flags, error, &batch_);
+    if (!*error) {
+        run_batch(batch_, true, flags);
+    }
+}
 
-    static PersistentString blob_allocated_bytes("blob_allocated_bytes");
-    static PersistentString blob_used_bytes("blob_used_bytes");
+void AttributesTable::contains_many(const v8::Local<v8::Array>& points, uint8_t* flags, int* error) {
+    if (!batched()) {
+        uint32_t length = points->Length();
+        for (uint32_t i = 0; i < length; i++) {
+            Nan::HandleScope scope;
+            v8::Local<v8::Object> pt = Nan::Get(points, i).ToLocalChecked().As<v8::Object>();
+            flags[i] = contains(pt, error);
+            if (*error) {
+                return;
+            }
+        }
+        return;
+    }
 
-    static PersistentString ht_spine_len("ht_spine_len");
-    static PersistentString ht_spine_use("ht_spine_use");
-    static PersistentString ht_entries("ht_entries");
-    static PersistentString ht_bytes("ht_bytes");
-    static PersistentString ht_collision_slots("ht_collision_slots");
-    static PersistentString ht_total_chain_len("ht_total_chain_len");
-    static PersistentString ht_max_chain_len("ht_max_chain_len");
-    static PersistentString ht_1_2("ht_dist_1_2");
-    static PersistentString ht_3_5("ht_dist_3_5");
-    static PersistentString ht_6_9("ht_dist_6_9");
-    static PersistentString ht_10_("ht_dist_10_");
-    static PersistentString ht_avg_chain_len("ht_avg_chain_len");
+    batch_.clear();
+    encode_many(points, false, flags, error, &batch_);
+    if (!*error) {
+        run_batch(batch_, false, flags);
+    }
+}
 
-    static PersistentString ht_total_bytes("ht_total_bytes");
+void AttributesTable::encode_many(const v8::Local<v8::Array>& points, bool add, uint8_t* flags, int* error,
+                                  EntryBatch* batch) {
+    if (!add) {
+        SharedGuard guard(lock_);
+        encode_points(points, false, flags, error, batch);
+        return;
+    }
 
-    Nan::Set(stats, attr_entries, Nan::New<v8::Number>(attributes_hash_set_.size()));
+    if (lock_) {
+        // As for add(), points whose tags and values are all known only need the lock shared.
+        SharedGuard guard(lock_);
+        if (encode_points(points, false, flags, error, batch) || *error) {
+            return;
+        }
+        batch->clear();
+    }
 
-    BuboHashStat bhs;
-    memset(&bhs, 0, sizeof(BuboHashStat));
+    ExclusiveGuard guard(lock_);
+    encode_points(points, true, flags, error, batch);
+}
+
+void AttributesTable::run_batch(const EntryBatch& batch, bool add, uint8_t* flags) {
+    if (batch.size() <= RUN_BATCH_CHUNK_ENTRIES) {
+        SharedGuard guard(lock_);
+        run_chunk(batch, add, flags);
+        return;
+    }
+
+    // The lock is let go between chunks, for the main thread to take it exclusively meanwhile.
+    EntryBatch chunk;
+    for (size_t begin = 0; begin < batch.size(); begin += RUN_BATCH_CHUNK_ENTRIES) {
+        size_t end = std::min(batch.size(), begin + RUN_BATCH_CHUNK_ENTRIES);
+        chunk.clear();
+        for (size_t i = begin; i < end; i++) {
+            chunk.add(batch.entry(i), batch.lens_[i], batch.rows_[i]);
+        }
+        SharedGuard guard(lock_);
+        run_chunk(chunk, add, flags);
+    }
+}
+
+void AttributesTable::run_chunk(const EntryBatch& batch, bool add, uint8_t* flags) {
+    if (add) {
+        insert_batch(batch, flags);
+    } else {
+        sharded_set_->contains_batch(batch, flags);
+    }
+}
+
+bool AttributesTable::encode_points(const v8::Local<v8::Array>& points, bool add, uint8_t* flags, int* error,
+                                    EntryBatch* batch) {
+    uint32_t length = points->Length();
+    v8::Local<v8::String> dummy;
+    bool all_known = true;
+
+    for (uint32_t i = 0; i < length; i++) {
+        Nan::HandleScope scope;
+        v8::Local<v8::Object> pt = Nan::Get(points, i).ToLocalChecked().As<v8::Object>();
+        int entrylen = 0;
+
+        bool known = prepare_entry_buffer(pt, &entrylen, false, dummy, error, add);
+        if (*error) {
+            return false;
+        }
+        // With add, the entry is complete even if some tags or values were new.
+        if (!known && !add) {
+            flags[i] = 0;
+            all_known = false;
+            continue;
+        }
+        batch->add(entry_buf_, entrylen, i);
+    }
+    return all_known;
+}
+
+void AttributesTable::process_columns(const v8::Local<v8::Object>& columns, uint32_t row_count, bool add,
+                                      uint8_t* flags, int* error, EntryBatch* batch) {
+    struct Column {
+        v8::Local<v8::Array> values_;
+        StringsTable::TagEntry* tag_entry_;
+        EntryToken token_;
+    };
+
+    v8::Local<v8::Array> keys = Nan::GetOwnPropertyNames(columns).ToLocalChecked();
+    uint32_t length = keys->Length();
+    std::vector<Column> cols;
+    cols.reserve(length);
+
+    for (uint32_t i = 0; i < length; ++i) {
+        v8::Local<v8::Value> key = Nan::Get(keys, i).ToLocalChecked();
+        v8::String::Utf8Value tag(key);
+        std::string tag_str(*tag);
+
+        if (ignored_attributes_ != NULL && _contains(ignored_attributes_, tag_str)) {
+            continue;
+        }
+
+        v8::Local<v8::Value> values = Nan::Get(columns, key).ToLocalChecked();
+        if (!values->IsArray()) {
+            *error = ATTRS_ERR_BAD_COLUMN;
+            return;
+        }
+
+        cols.push_back(Column());
+        Column& col = cols.back();
+        col.values_ = values.As<v8::Array>();
+        if (add) {
+            strings_table_->check_and_add_tag(*tag, &col.token_, &col.tag_entry_);
+        } else if (!strings_table_->find_tag(*tag, &col.token_, &col.tag_entry_)) {
+            col.tag_entry_ = NULL;
+        }
+    }
+
+    // Every row lists its tags in the same order, so sorting them once is enough. Rows
+    // that have a tag the strings table does not know cannot be in the set.
+    std::vector<Column*> sorted;
+    std::vector<Column*> unknown;
+    for (size_t c = 0; c < cols.size(); c++) {
+        if (cols[c].tag_entry_ == NULL) {
+            unknown.push_back(&cols[c]);
+        } else {
+            sorted.push_back(&cols[c]);
+        }
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const Column* a, const Column* b) {
+        return bubo_utils::cmp_entry_token(&a->token_, &b->token_);
+    });
+
+    // The count takes at most 5 bytes.
+    if (sorted.size() * MAX_TUPLE_LEN + 5 > sizeof(entry_buf_)) {
+        *error = ATTRS_ERR_POINT_TOO_BIG;
+        return;
+    }
+
+    for (uint32_t row = 0; row < row_count; row++) {
+        Nan::HandleScope scope;
+
+        BYTE* entry_buf_ptr = entry_buf_ + 5;
+        uint32_t tags_count = 0;
+        int encoded_len = 0;
+        size_t attr_len = 0;
+        bool known = true;
+
+        for (size_t c = 0; c < unknown.size() && known; c++) {
+            known = Nan::Get(unknown[c]->values_, row).ToLocalChecked()->IsUndefined();
+        }
+
+        for (size_t c = 0; c < sorted.size() && known; c++) {
+            Column* col = sorted[c];
+            v8::Local<v8::Value> value = Nan::Get(col->values_, row).ToLocalChecked();
+            if (value->IsUndefined()) {
+                continue;
+            }
+
+            EntryToken* et = &col->token_;
+            bool found;
+
+            bubo_utils::encode_packed(et->tag_seq_no_, entry_buf_ptr, &encoded_len);
+            entry_buf_ptr += encoded_len;
+            entry_buf_ptr += encode_value(value, col->tag_entry_, et, entry_buf_ptr, add, &found);
+            known = found || add;
+            tags_count ++;
+            if (known) {
+                attr_len += tuple_str_len(et);
+            }
+        }
+
+        if (!known) {
+            flags[row] = 0;
+            continue;
+        }
+
+        // The tuples were written past room for the largest count; move the count next to them.
+        BYTE count_buf[5];
+        bubo_utils::encode_packed(tags_count, count_buf, &encoded_len);
+        BYTE* entry = entry_buf_ + 5 - encoded_len;
+        memcpy(entry, count_buf, encoded_len);
+        int entry_len = entry_buf_ptr - entry;
+
+        if (point_too_big(entry, entry_len, attr_len)) {
+            *error = ATTRS_ERR_POINT_TOO_BIG;
+            return;
+        }
+
+        if (batch) {
+            batch->add(entry, entry_len, row);
+        } else if (add) {
+            flags[row] = insert_entry(entry, entry_len);
+        } else {
+            flags[row] = has_entry(entry, entry_len);
+        }
+    }
+}
 
-    attributes_hash_set_.get_stats(&bhs);
 
+ScanResult AttributesTable::read_entries(ScanCursor* cursor, uint32_t max_entries, v8::Local<v8::Array>& points,
+                                         bool as_strings) {
+    SharedGuard guard(lock_);
+    uint32_t num_points = points->Length();
+
+    return sharded_set_->scan(cursor, max_entries, [&](const BYTE* entry, int entry_len) {
+        if (as_strings) {
+            attr_str_.clear();
+            if (entry_attr_str(entry, entry_len, &attr_str_)) {
+                Nan::Set(points, num_points++, Nan::New<v8::String>(attr_str_.data(), (int)attr_str_.size()).ToLocalChecked());
+            }
+            return;
+        }
+        v8::Local<v8::Object> pt = Nan::New<v8::Object>();
+        if (decode_entry(entry, entry_len, pt)) {
+            Nan::Set(points, num_points++, pt);
+        }
+    });
+}
+
+uint64_t AttributesTable::size() const {
+    SharedGuard guard(lock_);
+    return sharded_set_->size();
+}
+
+ScanResult AttributesTable::read_batch(ScanCursor* cursor, uint32_t max_entries, EntryBatch* batch) {
+    SharedGuard guard(lock_);
+
+    return sharded_set_->scan(cursor, max_entries, [&](const BYTE* entry, int entry_len) {
+        batch->add(entry, entry_len, batch->size());
+    });
+}
+
+void AttributesTable::resolve_batch(const EntryBatch& batch, EntryTranslator* translator) {
+    SharedGuard guard(lock_);
+
+    for (size_t i = 0; i < batch.size(); i++) {
+        translator->resolve(batch.entry(i), batch.lens_[i]);
+    }
+}
+
+void AttributesTable::translate_batch(const EntryBatch& batch, EntryTranslator* translator, EntryBatch* translated) {
+    auto translate_all = [&]() {
+        for (size_t i = 0; i < batch.size(); i++) {
+            translator->translate(batch.entry(i), batch.lens_[i], batch.rows_[i], translated);
+        }
+    };
+
+    // Only adding to the strings table needs the lock exclusively.
+    if (translator->adds()) {
+        ExclusiveGuard guard(lock_);
+        translate_all();
+    } else {
+        SharedGuard guard(lock_);
+        translate_all();
+    }
+}
+
+template<typename Fn>
+bool AttributesTable::decode_tuples(const BYTE* entry, int entry_len, Fn fn) const {
+    const BYTE* end = entry + entry_len;
+    int decoded_len = 0;
+
+    uint32_t num_tuples = bubo_utils::decode_packed(entry, &decoded_len);
+    const BYTE* p = entry + decoded_len;
+
+    for (uint32_t i = 0; i < num_tuples; i++) {
+        if (p >= end) {
+            return false;
+        }
+        const StringsTable::TagEntry* te = strings_table_->find_tag_entry(bubo_utils::decode_packed(p, &decoded_len));
+        p += decoded_len;
+        if (!te || p >= end) {
+            return false;
+        }
+
+        uint64_t code = typed_values_ ? bubo_utils::decode_packed64(p, &decoded_len)
+                                      : (uint64_t)bubo_utils::decode_packed(p, &decoded_len) << VAL_KIND_BITS;
+        p += decoded_len;
+        double d = 0;
+
+        uint32_t kind = code & VAL_KIND_MASK;
+        if (kind == VAL_DOUBLE || kind == VAL_DATE) {
+            if (end - p < (ptrdiff_t)sizeof(d)) {
+                return false;
+            }
+            memcpy(&d, p, sizeof(d));
+            p += sizeof(d);
+        }
+        if (!fn(te, kind, code >> VAL_KIND_BITS, d)) {
+            return false;
+        }
+    }
+    return p == end;
+}
+
+bool AttributesTable::decode_entry(const BYTE* entry, int entry_len, v8::Local<v8::Object>& pt) const {
+    return decode_tuples(entry, entry_len, [&](const StringsTable::TagEntry* te, uint32_t kind, uint64_t code, double d) {
+        v8::Local<v8::Value> value;
+
+        switch (kind) {
+        case VAL_STRING: {
+            const char* val = StringsTable::find_val_str(te, code);
+            if (!val) {
+                return false;
+            }
+            value = Nan::New<v8::String>(val, StringsTable::str_len(val)).ToLocalChecked();
+            break;
+        }
+        case VAL_INT:
+            value = Nan::New<v8::Number>((int32_t)((code >> 1) ^ -(code & 1)));
+            break;
+        case VAL_DOUBLE:
+            value = Nan::New<v8::Number>(d);
+            break;
+        case VAL_DATE:
+            value = Nan::New<v8::Date>(d).ToLocalChecked();
+            break;
+        case VAL_CONST:
+            switch (code) {
+            case VAL_CONST_NULL:    value = Nan::Null(); break;
+            case VAL_CONST_FALSE:   value = Nan::False(); break;
+            case VAL_CONST_TRUE:    value = Nan::True(); break;
+            default:                value = Nan::Undefined(); break;
+            }
+            break;
+        default:
+            return false;
+        }
+        Nan::Set(pt, Nan::New<v8::String>(te->tag_, StringsTable::str_len(te->tag_)).ToLocalChecked(), value);
+        return true;
+    });
+}
+
+bool AttributesTable::point_too_big(const BYTE* entry, int entry_len, size_t attr_len) {
+    if (attr_len < MAX_BUFFER_SIZE) {
+        return false;
+    }
+    attr_str_.clear();
+    entry_attr_str(entry, entry_len, &attr_str_);
+    return attr_str_.size() >= MAX_BUFFER_SIZE;
+}
+
+bool AttributesTable::entry_attr_str(const BYTE* entry, int entry_len, std::string* out) const {
+    static const char* const constants[] = { "null", "false", "true", "undefined" };
+    size_t start = out->size();
+
+    return decode_tuples(entry, entry_len, [&](const StringsTable::TagEntry* te, uint32_t kind, uint64_t code, double d) {
+        if (out->size() != start) {
+            out->push_back(',');
+        }
+        out->append(te->tag_, StringsTable::str_len(te->tag_));
+        out->push_back('=');
+
+        switch (kind) {
+        case VAL_STRING: {
+            const char* val = StringsTable::find_val_str(te, code);
+            if (!val) {
+                return false;
+            }
+            out->append(val, StringsTable::str_len(val));
+            break;
+        }
+        case VAL_INT:
+            bubo_utils::append_number((int32_t)((code >> 1) ^ -(code & 1)), out);
+            break;
+        case VAL_DOUBLE:
+            bubo_utils::append_number(d, out);
+            break;
+        case VAL_DATE: {
+            v8::Local<v8::Value> date = Nan::New<v8::Date>(d).ToLocalChecked();
+            v8::String::Utf8Value date_str(date);
+            out->append(*date_str, date_str.length());
+            break;
+        }
+        case VAL_CONST:
+            out->append(constants[code <= VAL_CONST_UNDEFINED ? code : VAL_CONST_UNDEFINED]);
+            break;
+        default:
+            return false;
+        }
+        return true;
+    });
+}
+
+void AttributesTable::stats(v8::Local<v8::Object>& stats, bool detailed) const {
+
+    static thread_local PersistentString attr_entries("attr_entries");
+    static thread_local PersistentString shape_cache_hits("shape_cache_hits");
+    static thread_local PersistentString shape_cache_misses("shape_cache_misses");
+    static thread_local PersistentString shape_cache_hit_rate("shape_cache_hit_rate");
+    static thread_local PersistentString shape_cache_size("shape_cache_size");
+
+    static thread_local PersistentString blob_allocated_bytes("blob_allocated_bytes");
+    static thread_local PersistentString blob_used_bytes("blob_used_bytes");
+    static thread_local PersistentString blob_dead_bytes("blob_dead_bytes");
+    static thread_local PersistentString blob_compactions("blob_compactions");
+
+    static thread_local PersistentString ht_spine_len("ht_spine_len");
+    static thread_local PersistentString ht_spine_use("ht_spine_use");
+    static thread_local PersistentString ht_entries("ht_entries");
+    static thread_local PersistentString ht_bytes("ht_bytes");
+    static thread_local PersistentString ht_tombstones("ht_tombstones");
+    static thread_local PersistentString ht_displaced("ht_displaced");
+    static thread_local PersistentString ht_total_probe_len("ht_total_probe_len");
+    static thread_local PersistentString ht_max_probe_len("ht_max_probe_len");
+    static thread_local PersistentString ht_1_2("ht_dist_1_2");
+    static thread_local PersistentString ht_3_5("ht_dist_3_5");
+    static thread_local PersistentString ht_6_9("ht_dist_6_9");
+    static thread_local PersistentString ht_10_("ht_dist_10_");
+    static thread_local PersistentString ht_avg_probe_len("ht_avg_probe_len");
+    static thread_local PersistentString ht_resize_old_len("ht_resize_old_len");
+    static thread_local PersistentString ht_resize_migrated("ht_resize_migrated");
+
+    static thread_local PersistentString filter_bytes("filter_bytes");
+    static thread_local PersistentString filter_capacity("filter_capacity");
+    static thread_local PersistentString filter_stale("filter_stale");
+    static thread_local PersistentString filter_fpr("filter_fpr");
+
+    static thread_local PersistentString sketch_bytes("sketch_bytes");
+    static thread_local PersistentString sketch_cardinality("sketch_cardinality");
+
+    static thread_local PersistentString ht_total_bytes("ht_total_bytes");
+
+    static thread_local PersistentString max_bytes("max_bytes");
+    static thread_local PersistentString accounted_bytes("accounted_bytes");
+    static thread_local PersistentString evictions("evictions");
+
+    uint64_t lookups = shape_cache_hits_ + shape_cache_misses_;
+    Nan::Set(stats, shape_cache_hits, Nan::New<v8::Number>(shape_cache_hits_));
+    Nan::Set(stats, shape_cache_misses, Nan::New<v8::Number>(shape_cache_misses_));
+    Nan::Set(stats, shape_cache_hit_rate, Nan::New<v8::Number>(lookups ? (double)shape_cache_hits_ / lookups : 0));
+    Nan::Set(stats, shape_cache_size, Nan::New<v8::Number>(shapes_.size()));
+
+    BuboHashStat bhs;
+    sharded_set_->get_stats(&bhs, detailed);
+
+    Nan::Set(stats, attr_entries, Nan::New<v8::Number>(bhs.entries));
     Nan::Set(stats, ht_spine_len, Nan::New<v8::Number>(bhs.spine_len));
     Nan::Set(stats, ht_spine_use, Nan::New<v8::Number>(bhs.spine_use));
     Nan::Set(stats, ht_entries, Nan::New<v8::Number>(bhs.entries));
     Nan::Set(stats, ht_bytes, Nan::New<v8::Number>(bhs.ht_bytes));
-    Nan::Set(stats, ht_collision_slots, Nan::New<v8::Number>(bhs.collision_slots));
-    Nan::Set(stats, ht_total_chain_len, Nan::New<v8::Number>(bhs.total_chain_len));
-    Nan::Set(stats, ht_max_chain_len, Nan::New<v8::Number>(bhs.max_chain_len));
-    Nan::Set(stats, ht_1_2, Nan::New<v8::Number>(bhs.dist_1_2));
-    Nan::Set(stats, ht_3_5, Nan::New<v8::Number>(bhs.dist_3_5));
-    Nan::Set(stats, ht_6_9, Nan::New<v8::Number>(bhs.dist_6_9));
-    Nan::Set(stats, ht_10_, Nan::New<v8::Number>(bhs.dist_10_));
-    Nan::Set(stats, ht_avg_chain_len, Nan::New<v8::Number>(bhs.avg_chain_len));
+    Nan::Set(stats, ht_tombstones, Nan::New<v8::Number>(bhs.tombstones));
+    if (detailed) {
+        Nan::Set(stats, ht_displaced, Nan::New<v8::Number>(bhs.displaced));
+        Nan::Set(stats, ht_total_probe_len, Nan::New<v8::Number>(bhs.total_probe_len));
+        Nan::Set(stats, ht_max_probe_len, Nan::New<v8::Number>(bhs.max_probe_len));
+        Nan::Set(stats, ht_1_2, Nan::New<v8::Number>(bhs.dist_1_2));
+        Nan::Set(stats, ht_3_5, Nan::New<v8::Number>(bhs.dist_3_5));
+        Nan::Set(stats, ht_6_9, Nan::New<v8::Number>(bhs.dist_6_9));
+        Nan::Set(stats, ht_10_, Nan::New<v8::Number>(bhs.dist_10_));
+        Nan::Set(stats, ht_avg_probe_len, Nan::New<v8::Number>(bhs.avg_probe_len));
+    }
+    Nan::Set(stats, ht_resize_old_len, Nan::New<v8::Number>(bhs.resize_old_len));
+    Nan::Set(stats, ht_resize_migrated, Nan::New<v8::Number>(bhs.resize_migrated));
 
     Nan::Set(stats, blob_allocated_bytes, Nan::New<v8::Number>(bhs.blob_allocated_bytes));
     Nan::Set(stats, blob_used_bytes, Nan::New<v8::Number>(bhs.blob_used_bytes));
+    Nan::Set(stats, blob_dead_bytes, Nan::New<v8::Number>(bhs.blob_dead_bytes));
+    Nan::Set(stats, blob_compactions, Nan::New<v8::Number>(bhs.blob_compactions));
+
+    Nan::Set(stats, filter_bytes, Nan::New<v8::Number>(bhs.filter_bytes));
+    Nan::Set(stats, filter_capacity, Nan::New<v8::Number>(bhs.filter_capacity));
+    Nan::Set(stats, filter_stale, Nan::New<v8::Number>(bhs.filter_stale));
+    if (detailed) {
+        Nan::Set(stats, filter_fpr, Nan::New<v8::Number>(bhs.filter_fpr));
+    }
+
+    if (sketch_) {
+        Nan::Set(stats, sketch_bytes, Nan::New<v8::Number>(sketch_->bytes()));
+        Nan::Set(stats, sketch_cardinality, Nan::New<v8::Number>(sketch_->estimate()));
+    }
 
     Nan::Set(stats, ht_total_bytes, Nan::New<v8::Number>(bhs.bytes));
 
+    if (max_bytes_) {
+        Nan::Set(stats, max_bytes, Nan::New<v8::Number>(max_bytes_));
+        Nan::Set(stats, accounted_bytes, Nan::New<v8::Number>(sharded_set_->bytes() + strings_table_->bytes()));
+        Nan::Set(stats, evictions, Nan::New<v8::Number>(bhs.evictions));
+    }
+
+    // The main stats of every shard, for a sharded set.
+    uint32_t num_shards = sharded_set_->num_shards();
+    if (num_shards > 1) {
+        static thread_local PersistentString shards_str("shards");
+        v8::Local<v8::Array> shards = Nan::New<v8::Array>(num_shards);
+
+        for (uint32_t s = 0; s < num_shards; s++) {
+            sharded_set_->get_shard_stats(s, &bhs, detailed);
+            v8::Local<v8::Object> shard = Nan::New<v8::Object>();
+            Nan::Set(shard, ht_entries, Nan::New<v8::Number>(bhs.entries));
+            Nan::Set(shard, ht_spine_len, Nan::New<v8::Number>(bhs.spine_len));
+            Nan::Set(shard, ht_tombstones, Nan::New<v8::Number>(bhs.tombstones));
+            Nan::Set(shard, ht_resize_old_len, Nan::New<v8::Number>(bhs.resize_old_len));
+            Nan::Set(shard, blob_allocated_bytes, Nan::New<v8::Number>(bhs.blob_allocated_bytes));
+            Nan::Set(shard, blob_dead_bytes, Nan::New<v8::Number>(bhs.blob_dead_bytes));
+            if (detailed) {
+                Nan::Set(shard, ht_max_probe_len, Nan::New<v8::Number>(bhs.max_probe_len));
+                Nan::Set(shard, filter_fpr, Nan::New<v8::Number>(bhs.filter_fpr));
+            }
+            Nan::Set(shard, ht_total_bytes, Nan::New<v8::Number>(bhs.bytes));
+            Nan::Set(shards, s, shard);
+        }
+        Nan::Set(stats, shards_str, shards);
+    }
+
+    // The sizes of every generation, oldest first, for a windowed set.
+    if (sharded_set_->max_generations() > 1) {
+        static thread_local PersistentString generations_str("generations");
+        uint32_t num_generations = sharded_set_->num_generations();
+        v8::Local<v8::Array> generations = Nan::New<v8::Array>(num_generations);
+
+        for (uint32_t g = 0; g < num_generations; g++) {
+            sharded_set_->get_generation_stats(g, &bhs);
+            v8::Local<v8::Object> generation = Nan::New<v8::Object>();
+            Nan::Set(generation, ht_entries, Nan::New<v8::Number>(bhs.entries));
+            Nan::Set(generation, ht_spine_len, Nan::New<v8::Number>(bhs.spine_len));
+            Nan::Set(generation, blob_allocated_bytes, Nan::New<v8::Number>(bhs.blob_allocated_bytes));
+            Nan::Set(generation, blob_used_bytes, Nan::New<v8::Number>(bhs.blob_used_bytes));
+            Nan::Set(generation, blob_dead_bytes, Nan::New<v8::Number>(bhs.blob_dead_bytes));
+            Nan::Set(generation, ht_total_bytes, Nan::New<v8::Number>(bhs.bytes));
+            Nan::Set(generations, g, generation);
+        }
+        Nan::Set(stats, generations_str, generations);
+    }
+
 }
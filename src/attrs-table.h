@@ -6,31 +6,269 @@
 #include <string>
 #include "bubo-types.h"
 #include "bubo-ht.h"
+#include "strings-table.h"
+#include "shared-set.h"
+#include "sharded-set.h"
+#include "hyperloglog.h"
+#include "utils.h"
 
-class StringsTable;
+class EntryTranslator;
+
+// Values set in the error argument of the AttributesTable methods.
+#define ATTRS_ERR_POINT_TOO_BIG 1
+#define ATTRS_ERR_BAD_COLUMN    2
+
+/*
+ * With typed values, the value part of a tuple starts with a packed code whose low
+ * VAL_KIND_BITS bits give the kind of value, and whose remaining bits (code >> VAL_KIND_BITS)
+ * give:
+ *   VAL_STRING: the sequence number of the value in the strings table
+ *   VAL_INT:    the zigzag encoded int32
+ *   VAL_DOUBLE: nothing; the code is followed by the 8 bytes of the double
+ *   VAL_CONST:  one of the VAL_CONST_* below
+ *   VAL_DATE:   nothing; the code is followed by the 8 bytes of the time value, as a double
+ */
+#define VAL_KIND_BITS   3
+#define VAL_KIND_MASK   ((1 << VAL_KIND_BITS) - 1)
+#define VAL_STRING      0
+#define VAL_INT         1
+#define VAL_DOUBLE      2
+#define VAL_CONST       3
+#define VAL_DATE        4
+
+#define VAL_CONST_NULL      0
+#define VAL_CONST_FALSE     1
+#define VAL_CONST_TRUE      2
+#define VAL_CONST_UNDEFINED 3
+
+// Largest encoded tuple: a 5 byte tag, and a 1 byte code followed by a double.
+#define MAX_TUPLE_LEN 14
+
+// Number of groups of the hash set scanned by compact() when the caller does not say.
+#define DEFAULT_COMPACT_CALL_GROUPS 1024
+
+// Number of entries read_entries() decodes when the caller does not say.
+#define DEFAULT_READ_ENTRIES 1024
+
+// Most entries of a batch that run_batch() adds or looks up with the lock of the table held.
+#define RUN_BATCH_CHUNK_ENTRIES 16384
+
+// Number of distinct key lists (shapes) remembered by an AttributesTable.
+#define SHAPE_CACHE_SIZE 16
+
+// Seed of the hashes of the entries fed to a sketch, the same for every table so that their sketches merge.
+#define SKETCH_HASH_SEED 0x62756275ULL
+
+// HyperLogLog flags of the sketch of a table with typed values, whose entries hash differently.
+#define SKETCH_FLAG_TYPED_VALUES 1
 
 class AttributesTable {
 public:
-	AttributesTable(StringsTable* strings_table);
+    // The entries are split between num_shards shards (see ShardedSet).
+	AttributesTable(StringsTable* strings_table, const BytePtrHash& hash = BytePtrHash(), uint32_t num_shards = 1);
+
+    /*
+     * A table in front of the strings table and the entries of shared, for one of the threads
+     * sharing them (see SharedSet), with its settings. Everything that touches them holds lock:
+     * add(), contains() and the like lock it themselves, the other methods need the caller to.
+     * Only what adds to the strings table locks it exclusively; the rest locks it shared, along
+     * with the lock of the shard of each entry. shared must have been set_concurrent().
+     */
+    AttributesTable(AttributesTable* shared, StripedLock* lock);
+
+    /*
+     * Lets the tables of several threads use the entries of this one at the same time. With
+     * lock, this table's own methods also take it, as those of a front table do.
+     */
+    void set_concurrent(StripedLock* lock = NULL);
 	void set_ignored_attributes(std::vector<std::string> *ignored_attributes);
+	void set_incremental_resize(uint32_t step_groups);
+
+    /*
+     * Sets the share of dead bytes a chunk of entries needs to be compacted, and whether add()
+     * and remove() compact on their own. See BuboHashSet::compact().
+     */
+    void set_auto_compact(double dead_ratio, bool auto_compact);
+
+    // Does up to step_groups groups of compaction work. Returns true if there is more to do.
+    bool compact(uint32_t step_groups);
+
+    /*
+     * Puts a filter sized for expected_entries in front of the entries, for lookups of the points
+     * that are not there (0 for none), and fills it anew. See BuboHashSet::set_filter().
+     */
+    void set_filter(uint64_t expected_entries);
+    void rebuild_filter();
+
+    /*
+     * Keeps the entries in up to max_generations generations, which rotate() turns over, for a
+     * windowed set (see ShardedSet::set_generations()). Must be set before anything is added.
+     */
+    void set_generations(uint32_t max_generations);
+    uint32_t max_generations() const { return sharded_set_->max_generations(); }
+
+    /*
+     * Starts a new generation, and drops the oldest one past max_generations, with the entries
+     * that were not added again since.
+     *
+     * Return value: the number of entries dropped.
+     */
+    uint64_t rotate();
+
+    /*
+     * Caps the memory of the table at max_bytes (0 for no cap): that of its entries, as
+     * ShardedSet::bytes() counts it, plus that of the strings table, as StringsTable::bytes()
+     * does. Once an add() or a batch goes past it, the entries least recently added or found are
+     * evicted (see ShardedSet::set_clock()); the strings of their tags and values stay. Must be
+     * set before anything is added.
+     */
+    void set_max_bytes(uint64_t max_bytes);
+    uint64_t max_bytes() const { return max_bytes_; }
+
+    // Number of entries evicted by the last add(). Those of the batches only show in stats().
+    uint64_t last_evicted() const { return last_evicted_; }
+
+    /*
+     * Writes the entries to (resp. replaces them with those of) a snapshot. The strings table is
+     * saved and loaded separately, before. load() returns false if the snapshot is truncated or
+     * inconsistent, in which case the table is left empty.
+     */
+    void save(SnapshotWriter* writer);
+    bool load(SnapshotReader* reader);
+
+    /*
+     * Keeps the entries in files of dir, mapped into memory. See BuboHashSet::set_mapped(),
+     * sync() and open_mapped(); as for save() and load(), the strings table is separate.
+     */
+    bool set_mapped(const std::string& dir);
+    bool sync(SnapshotWriter* writer);
+    bool open_mapped(const std::string& dir, SnapshotReader* reader, bool read_only);
+
+    /*
+     * Encodes numbers, booleans, null, undefined and Dates as themselves rather than as their
+     * string, so that only strings go through the strings table (see VAL_KIND_BITS). 1 and "1"
+     * then are different values. Must be set before anything is added.
+     */
+    void set_typed_values(bool typed_values) { typed_values_ = typed_values; }
+    bool typed_values() const { return typed_values_; }
+
+    /*
+     * Feeds the entries added to a HyperLogLog sketch of the given precision, for cardinality(),
+     * next to the sharded set, or instead of it without keep_entries. add() and the like then
+     * only feed the sketch, and their is-new flags tell whether it grew, which only entries never
+     * added before make it do (but not all of them). Must be set after set_typed_values(), and
+     * before anything is added.
+     */
+    void set_sketch(uint32_t precision, bool keep_entries);
+    bool has_sketch() const { return sketch_ != NULL; }
+    bool keeps_entries() const { return keep_entries_; }
+
+    // Estimated number of distinct entries ever added, with a sketch. Else the number of entries.
+    double cardinality() const;
+
+    /*
+     * Appends the serialized sketch to out (resp. merges one in, returning false unless it has
+     * the same precision and typed values). See HyperLogLog.
+     */
+    void serialize_sketch(std::string* out) const;
+    bool merge_sketch(const BYTE* data, size_t len);
+    StringsTable* strings_table() const { return strings_table_; }
     virtual ~AttributesTable();
 
+    // Number of entries.
+    uint64_t size() const;
+
 	bool add(const v8::Local<v8::Object>& pt, bool should_get_attr_str, v8::Local<v8::String>& attr_str, int* error);
+	// contains() and remove() only look tags and values up, and never grow the strings table.
 	bool contains(const v8::Local<v8::Object>& pt, int* error);
     void remove(const v8::Local<v8::Object>& pt);
-    void stats(v8::Local<v8::Object>& stats) const;
 
     /*
-     * An entry into the attributes_hash_set_ is a pointer to a byte sequence of the form:
+     * Adds (add_columns) or looks up (contains_columns) row_count points given as columns:
+     * an object mapping each tag to an array that holds the value of row i at index i. A row
+     * whose value is undefined (or missing) for a tag does not have that tag. Each tag is
+     * resolved once per call rather than once per row.
+     *
+     * @flags: receives one byte per row: 1 if the point was new (resp. is present), 0 otherwise.
+     */
+    void add_columns(const v8::Local<v8::Object>& columns, uint32_t row_count, uint8_t* flags, int* error);
+    void contains_columns(const v8::Local<v8::Object>& columns, uint32_t row_count, uint8_t* flags, int* error);
+
+    /*
+     * Adds (add_many) or looks up (contains_many) every point of an array, setting flags as the
+     * columns methods do. With more than one shard, or for a shared table, the entries of all
+     * the points are encoded first, and then go to the shards in one batch; a point that is too
+     * big then leaves the set as it was.
+     */
+    void add_many(const v8::Local<v8::Array>& points, uint8_t* flags, int* error);
+    void contains_many(const v8::Local<v8::Array>& points, uint8_t* flags, int* error);
+
+    /*
+     * The two halves of a batched add_many() or contains_many(), for running the second one
+     * later on another thread: encode_many() appends the entries of the points to batch, with
+     * the flags of the points it leaves out, and run_batch() adds them or looks them up. Any
+     * thread may call run_batch() on a table with a lock, which it holds shared for up to
+     * RUN_BATCH_CHUNK_ENTRIES entries at a time, so that the methods that take it exclusively
+     * wait for one chunk rather than the whole batch.
+     */
+    void encode_many(const v8::Local<v8::Array>& points, bool add, uint8_t* flags, int* error, EntryBatch* batch);
+    void run_batch(const EntryBatch& batch, bool add, uint8_t* flags);
+
+    /*
+     * Sets the stats of the table on stats, from counters, in a time that does not depend on the
+     * number of entries. With detailed, also the probe lengths and the false positive rate of the
+     * filters, which go over the tables and the filters.
+     */
+    void stats(v8::Local<v8::Object>& stats, bool detailed = false) const;
+
+    /*
+     * Appends the points of up to max_entries entries from cursor on to points, and moves
+     * cursor past them (see ShardedSet::scan()). The points have the tags of their entries,
+     * without the ignored ones, and their values: strings, or with typed values, what they
+     * were added as. With as_strings, the points are their attr_str instead (see
+     * entry_attr_str()).
+     */
+    ScanResult read_entries(ScanCursor* cursor, uint32_t max_entries, v8::Local<v8::Array>& points,
+                            bool as_strings = false);
+
+    /*
+     * The steps of the set operations (see combine_sets()), each of which takes the table's lock
+     * for itself: read_batch() appends up to max_entries entries from cursor on to batch, as
+     * they are, with their index in batch as their row; resolve_batch() has translator note the
+     * strings of the entries of batch, which were read from this table; translate_batch()
+     * appends those that translator can translate for this table to translated.
+     */
+    ScanResult read_batch(ScanCursor* cursor, uint32_t max_entries, EntryBatch* batch);
+    void resolve_batch(const EntryBatch& batch, EntryTranslator* translator);
+    void translate_batch(const EntryBatch& batch, EntryTranslator* translator, EntryBatch* translated);
+
+    /*
+     * Sets the tags and values of an entry on pt. Returns false if the entry does not decode,
+     * which only happens for entries that the owner of a read-only set is writing meanwhile.
+     */
+    bool decode_entry(const BYTE* entry, int entry_len, v8::Local<v8::Object>& pt) const;
+
+    /*
+     * Appends 'tag1=value1,tag2=value2,..' for an entry to out, as add() makes the attr_str of
+     * its point. Only the string of a Date needs V8; the rest comes from the reverse arrays of
+     * the strings table. Returns false if the entry does not decode, as for decode_entry().
+     */
+    bool entry_attr_str(const BYTE* entry, int entry_len, std::string* out) const;
+
+    /*
+     * An entry into the sharded_set_ is a pointer to a byte sequence of the form:
      *    +-------------+---------+-----------+---------+-----------+--
      *    | num entries | tag1seq | value1seq | tag2seq | value2seq |..
      *    +-------------+---------+-----------+---------+-----------+--
-     * where each value is in the packed encoding format.
+     * where each value is in the packed encoding format. With typed values, each value part
+     * is encoded as described for VAL_KIND_BITS, and may be followed by 8 raw bytes, so
+     * bubo_utils::get_entry_len() does not apply to such entries.
      *
      * prepare_entry_buffer() obtains the sequence numbers corresponding to the tags and
      * tagnames from the strings table and creates the entry buffer in entry_buffer_.
 	 *
      * Optionally, one can ask for the attr_str to be filled in with the tags and tag_names.
+     * Either way, a point whose attr_str would come to 16KB or more sets ATTRS_ERR_POINT_TOO_BIG.
      *
      * @pt: The javascript object whose tag/val members are added to the entry buffer.
      *      (note: Certain attributes may be ignored)
@@ -38,23 +276,146 @@ public:
      * @get_attr_str: boolean specifying whether we want attr_str to be filled in.
      * @attr_str: optional v8::String reference to be filled with 'tag1=tagname1,tag2=tagname2,..'
      *
+     * @add: if false, only looks the tags and tagnames up, leaving the strings table untouched,
+     *       and stops as soon as one is unknown, leaving the entry buffer incomplete.
+     *
      * Return value: true if all tags and tagnames are found. False otherwise.
      */
     bool prepare_entry_buffer(const v8::Local<v8::Object>& pt,
                               int* entry_len,
                               bool get_attr_str,
                               v8::Local<v8::String>& attr_str,
-						      int* error);
+						      int* error,
+						      bool add = true);
 
     // For tests
     BYTE* get_entry_buf() { return entry_buf_; }
 
 protected:
-	BuboHashSet<BytePtrHash, BytePtrEqual> attributes_hash_set_;
+    /*
+     * A shape is the list of keys of a point, in enumeration order. Points that share a shape
+     * (as most points of a given series do) get the same tags, so prepare_entry_buffer()
+     * caches, per shape, the tags already resolved in the strings table, without the ignored
+     * keys, and sorted the way entries list them. Only the values are left to resolve per point.
+     */
+    struct ShapeTag {
+        uint32_t key_index_;                // index of the key in the point's key list
+        StringsTable::TagEntry* tag_entry_;
+        EntryToken token_;                  // tag part filled in once, value part per point
+    };
+
+    struct Shape {
+        uint32_t num_keys_;
+        Nan::Persistent<v8::Value>* keys_;
+        std::vector<ShapeTag> tags_;
+
+        Shape(uint32_t num_keys) : num_keys_(num_keys), keys_(new Nan::Persistent<v8::Value>[num_keys]) {}
+        ~Shape() {
+            for (uint32_t i = 0; i < num_keys_; i++) {
+                keys_[i].Reset();
+            }
+            delete [] keys_;
+        }
+    };
+
+    // Most recently used first.
+    std::vector<Shape*> shapes_;
+    uint64_t shape_cache_hits_ = 0;
+    uint64_t shape_cache_misses_ = 0;
+
+    Shape* find_shape(const v8::Local<v8::Array>& keys);
+    Shape* add_shape(const v8::Local<v8::Array>& keys, bool add, bool* all_found);
+    void clear_shapes();
+
+	ShardedSet* sharded_set_;
+	bool owns_sharded_set_;
+	StripedLock* lock_ = NULL;     // for a table shared between threads
 	StringsTable* strings_table_;
 	std::vector<std::string>* ignored_attributes_ = NULL;
+	bool typed_values_ = false;
+	HyperLogLog* sketch_ = NULL;    // goes with sharded_set_
+	bool keep_entries_ = true;
+	uint64_t max_bytes_ = 0;
+	uint64_t last_evicted_ = 0;
 
+	// Scratch space of prepare_entry_buffer(), per table so that tables of different threads have their own.
 	BYTE entry_buf_[16 << 10] __attribute__ ((aligned (8)));
+	std::string attr_str_;
+	EntryBatch batch_;
+
+	// Whether the set goes through batches: with more than one shard, or for a shared table.
+	inline bool batched() const {
+	    return lock_ || sharded_set_->num_shards() > 1;
+	}
+
+	/*
+	 * Adds an entry (resp. every entry of a batch, setting flags as ShardedSet::insert_batch()
+	 * does) to the sharded set and to the sketch, whichever there are. Returns true if it was new.
+	 */
+	bool insert_entry(const BYTE* entry, int entry_len);
+	void insert_batch(const EntryBatch& batch, uint8_t* flags);
+
+	// The part of run_batch() done with the lock held, on a chunk of its batch.
+	void run_chunk(const EntryBatch& batch, bool add, uint8_t* flags);
+
+	// What max_bytes_ leaves to the entries (0 for no cap), at least a byte. Needs the lock shared.
+	uint64_t entries_max_bytes() const;
+
+	/*
+	 * The hash of an entry for the sketch, made from the strings of its tags and values rather
+	 * than their sequence numbers, so that a point hashes the same in every table. Needs the
+	 * lock shared.
+	 */
+	uint64_t sketch_hash(const BYTE* entry, int entry_len) const;
+
+	// Feeds the entries of the sharded set to the emptied sketch, once they are loaded.
+	void fill_sketch();
+
+	// Whether the entry is in the set: with lookup() for a shared table, which may run alongside other lookups.
+	inline bool has_entry(const BYTE* entry, int entry_len) {
+	    return lock_ ? sharded_set_->lookup(entry, entry_len) : sharded_set_->contains(entry, entry_len);
+	}
+
+	/*
+	 * Writes the value part of a tuple for the given value of the tag in tag_entry at out, and
+	 * returns its length. Values not encoded as themselves are looked up (and added) in the
+	 * strings table, and et->val_ is set to the interned string; otherwise et->val_ is NULL.
+	 *
+	 * @add: if false, unknown values are not added, and nothing is written for them.
+	 * @found: set to false if the value was not in the strings table.
+	 */
+	int encode_value(const v8::Local<v8::Value>& value, StringsTable::TagEntry* tag_entry,
+	                 EntryToken* et, BYTE* out, bool add, bool* found);
+
+	/*
+	 * Calls fn(tag_entry, kind, code, d) for every tuple of an entry, and returns false as soon as
+	 * it does, or if the entry does not decode. kind is one of the VAL_* (VAL_STRING for every
+	 * value without typed values), code what the value code holds besides (see VAL_KIND_BITS),
+	 * and d the double of VAL_DOUBLE and VAL_DATE.
+	 */
+	template<typename Fn>
+	bool decode_tuples(const BYTE* entry, int entry_len, Fn fn) const;
+
+	/*
+	 * Encodes every row, and adds it (or looks it up), or with batch, appends its entry to batch
+	 * for the caller to run. Rows with a tag or value that is not in the strings table (which
+	 * only happens unless add) get a 0 flag, and no entry.
+	 */
+	void process_columns(const v8::Local<v8::Object>& columns, uint32_t row_count, bool add,
+	                     uint8_t* flags, int* error, EntryBatch* batch);
+
+	/*
+	 * Encodes every point into batch, with flags and errors as for process_columns(). Returns
+	 * false if any point has a tag or value that is not in the strings table.
+	 */
+	bool encode_points(const v8::Local<v8::Array>& points, bool add, uint8_t* flags, int* error, EntryBatch* batch);
+
+	/*
+	 * True if the attr_str of an entry comes to MAX_BUFFER_SIZE or more. attr_len is a bound
+	 * on that length summed from the entry's strings, so the string is only built (in
+	 * attr_str_) once the bound reaches the limit.
+	 */
+	bool point_too_big(const BYTE* entry, int entry_len, size_t attr_len);
 };
 
 
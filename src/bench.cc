@@ -0,0 +1,416 @@
+#include <stdlib.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bench.h"
+#include "bubo-types.h"
+#include "bubo-ht.h"
+#include "blob-store.h"
+#include "strings-table.h"
+#include "attrs-table.h"
+#include "shared-set.h"
+#include "sharded-set.h"
+#include "utils.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Sums results of the timed loops into this, so that the compiler cannot drop them.
+static volatile uint64_t bench_sink;
+
+static double ns_per_op(bench_clock::time_point start, uint64_t ops) {
+    std::chrono::duration<double, std::nano> elapsed = bench_clock::now() - start;
+    return elapsed.count() / ops;
+}
+
+static void set_number(v8::Local<v8::Object>& obj, const char* name, double value) {
+    Nan::Set(obj, Nan::New(name).ToLocalChecked(), Nan::New<v8::Number>(value));
+}
+
+/*
+ * Fills buf with an entry in the attributes table format, with num_tuples tags and
+ * values derived from seed (so different seeds give different entries). Returns its length.
+ */
+static int make_entry(BYTE* buf, int num_tuples, uint32_t seed) {
+    int len = 0, encoded_len = 0;
+
+    bubo_utils::encode_packed(num_tuples, buf, &encoded_len);
+    len += encoded_len;
+
+    for (int i = 0; i < num_tuples; i++) {
+        bubo_utils::encode_packed(i + 1, buf + len, &encoded_len);
+        len += encoded_len;
+        uint32_t val = (i < 3) ? (seed >> (10 * i)) % 1024 : (seed * 2654435761u >> i) % 16;
+        bubo_utils::encode_packed(val + 1, buf + len, &encoded_len);
+        len += encoded_len;
+    }
+    return len;
+}
+
+/*
+ * Cost of finding the length of a stored entry: decoding the record header, against
+ * walking the entry with get_entry_len(), and the cost of a whole successful lookup.
+ */
+static void bench_entry_len(v8::Local<v8::Object>& results, int num_entries) {
+    BYTE buf[256];
+
+    for (int num_tuples = 10; num_tuples <= 30; num_tuples += 10) {
+        BuboHashSet<BytePtrHash, BytePtrEqual> set;
+        BlobStore store;
+        std::vector<const BYTE*> records;
+        uint64_t sum = 0;
+
+        for (int i = 0; i < num_entries; i++) {
+            int len = make_entry(buf, num_tuples, i);
+            set.insert(buf, len);
+            records.push_back(store.record(store.add(buf, len)));
+        }
+
+        bench_clock::time_point start = bench_clock::now();
+        for (int i = 0; i < num_entries; i++) {
+            int len = 0;
+            BlobStore::record_data(records[i], &len);
+            sum += len;
+        }
+        double record_len_ns = ns_per_op(start, num_entries);
+
+        start = bench_clock::now();
+        for (int i = 0; i < num_entries; i++) {
+            int len = 0;
+            sum += bubo_utils::get_entry_len(BlobStore::record_data(records[i], &len));
+        }
+        double get_entry_len_ns = ns_per_op(start, num_entries);
+
+        start = bench_clock::now();
+        for (int i = 0; i < num_entries; i++) {
+            int len = make_entry(buf, num_tuples, i);
+            sum += set.contains(buf, len);
+        }
+        double lookup_ns = ns_per_op(start, num_entries);
+
+        bench_sink += sum;
+
+        v8::Local<v8::Object> r = Nan::New<v8::Object>();
+        set_number(r, "record_len_ns", record_len_ns);
+        set_number(r, "get_entry_len_ns", get_entry_len_ns);
+        set_number(r, "lookup_ns", lookup_ns);
+        Nan::Set(results, Nan::New(("entry_len_" + std::to_string(num_tuples)).c_str()).ToLocalChecked(), r);
+    }
+}
+
+/*
+ * Encodes num_entries time series like points (host, pop, name, service and env tags) into
+ * entries the way AttributesTable does, and appends them to entries, with their offsets.
+ */
+static void make_tag_entries(int num_entries, std::vector<BYTE>* entries, std::vector<size_t>* offsets,
+                             std::vector<std::string>* strings) {
+    StringsTable strings_table;
+    EntryToken tokens[5];
+    std::vector<EntryToken*> sorted;
+    BYTE buf[256];
+    char val[5][64];
+    const char* tags[5] = { "host", "pop", "name", "service", "env" };
+
+    for (int i = 0; i < num_entries; i++) {
+        snprintf(val[0], sizeof(val[0]), "web-%04d.dc%d.example.com", (i / 20) % 5000, (i / 20) % 7);
+        snprintf(val[1], sizeof(val[1]), "pop-%02d", i % 20);
+        snprintf(val[2], sizeof(val[2]), "system.cpu.%d.user", (i / 100000) % 200);
+        snprintf(val[3], sizeof(val[3]), "svc-%d", ((i / 20) % 5000) % 50);
+        snprintf(val[4], sizeof(val[4]), "%s", (i % 3) ? "prod" : "staging");
+
+        sorted.clear();
+        for (int t = 0; t < 5; t++) {
+            if (!strings_table.check_and_add(tags[t], val[t], &tokens[t]) && t < 4) {
+                strings->push_back(val[t]);
+            }
+            sorted.push_back(&tokens[t]);
+        }
+        std::sort(sorted.begin(), sorted.end(), bubo_utils::cmp_entry_token);
+
+        int len = 0, encoded_len = 0;
+        bubo_utils::encode_packed(sorted.size(), buf, &encoded_len);
+        len += encoded_len;
+        for (size_t t = 0; t < sorted.size(); t++) {
+            bubo_utils::encode_packed(sorted[t]->tag_seq_no_, buf + len, &encoded_len);
+            len += encoded_len;
+            bubo_utils::encode_packed(sorted[t]->val_seq_no_, buf + len, &encoded_len);
+            len += encoded_len;
+        }
+
+        offsets->push_back(entries->size());
+        entries->insert(entries->end(), buf, buf + len);
+    }
+    offsets->push_back(entries->size());
+}
+
+/*
+ * Throughput and table distribution of each hash function on realistic tag data, both for
+ * the encoded entries (BuboHashSet) and for the tag values (StringsTable).
+ */
+static void bench_hash_functions(v8::Local<v8::Object>& results, int num_entries) {
+    std::vector<BYTE> entries;
+    std::vector<size_t> offsets;
+    std::vector<std::string> strings;
+    make_tag_entries(num_entries, &entries, &offsets, &strings);
+
+    const char* names[2] = { "hash_jenkins", "hash_wyhash" };
+    BuboHashFunction functions[2] = { BUBO_HASH_JENKINS, BUBO_HASH_WYHASH };
+
+    for (int f = 0; f < 2; f++) {
+        BytePtrHash hash(functions[f], 0x5eed);
+        CharPtrHash string_hash(functions[f], 0x5eed);
+        BuboHashSet<BytePtrHash, BytePtrEqual> set(DEFAULT_INIT_HASH_TABLE_SZ, DEFAULT_MAX_HASH_TABLE_SZ, hash);
+        uint64_t sum = 0;
+
+        bench_clock::time_point start = bench_clock::now();
+        for (int i = 0; i < num_entries; i++) {
+            sum += hash(&entries[offsets[i]], offsets[i + 1] - offsets[i]);
+        }
+        double hash_ns = ns_per_op(start, num_entries);
+
+        start = bench_clock::now();
+        for (size_t i = 0; i < strings.size(); i++) {
+            sum += string_hash(strings[i].c_str());
+        }
+        double string_hash_ns = strings.empty() ? 0 : ns_per_op(start, strings.size());
+
+        start = bench_clock::now();
+        for (int i = 0; i < num_entries; i++) {
+            sum += set.insert(&entries[offsets[i]], offsets[i + 1] - offsets[i]);
+        }
+        double insert_ns = ns_per_op(start, num_entries);
+
+        start = bench_clock::now();
+        for (int i = 0; i < num_entries; i++) {
+            sum += set.contains(&entries[offsets[i]], offsets[i + 1] - offsets[i]);
+        }
+        double lookup_ns = ns_per_op(start, num_entries);
+
+        bench_sink += sum;
+
+        BuboHashStat stat;
+        set.get_detailed_stats(&stat);
+
+        v8::Local<v8::Object> r = Nan::New<v8::Object>();
+        set_number(r, "hash_ns", hash_ns);
+        set_number(r, "string_hash_ns", string_hash_ns);
+        set_number(r, "insert_ns", insert_ns);
+        set_number(r, "lookup_ns", lookup_ns);
+        set_number(r, "entries", stat.entries);
+        set_number(r, "ht_displaced", stat.displaced);
+        set_number(r, "ht_max_probe_len", stat.max_probe_len);
+        set_number(r, "ht_avg_probe_len", stat.avg_probe_len);
+        set_number(r, "ht_dist_1_2", stat.dist_1_2);
+        set_number(r, "ht_dist_3_5", stat.dist_3_5);
+        set_number(r, "ht_dist_6_9", stat.dist_6_9);
+        set_number(r, "ht_dist_10_", stat.dist_10_);
+        Nan::Set(results, Nan::New(names[f]).ToLocalChecked(), r);
+    }
+}
+
+/*
+ * Appends the value part of a tuple for a number the way AttributesTable does with typed
+ * values: a zigzag encoded integer, or a double in 8 raw bytes. Returns its length.
+ */
+static int encode_typed_number(double d, BYTE* out) {
+    int encoded_len = 0;
+    if (d == (int32_t)d) {
+        int32_t n = (int32_t)d;
+        uint64_t zigzag = ((uint32_t)n << 1) ^ (uint32_t)(n >> 31);
+        bubo_utils::encode_packed64((zigzag << VAL_KIND_BITS) | VAL_INT, out, &encoded_len);
+        return encoded_len;
+    }
+    out[0] = VAL_DOUBLE;
+    memcpy(out + 1, &d, sizeof(d));
+    return 1 + sizeof(d);
+}
+
+/*
+ * Cost of adding points whose values are numbers: stringifying and interning each value
+ * in the strings table, against encoding it as itself (the typedValues option). Each point
+ * has a small integer, a counter that never repeats, and two doubles. The times cover
+ * encoding the entries and inserting them into a set.
+ */
+static void bench_numeric_values(v8::Local<v8::Object>& results, int num_entries) {
+    const char* tags[4] = { "code", "count", "cpu", "load" };
+    BYTE buf[256];
+    char str[32];
+
+    for (int typed = 0; typed < 2; typed++) {
+        StringsTable strings_table;
+        BuboHashSet<BytePtrHash, BytePtrEqual> set;
+        EntryToken tokens[4];
+        StringsTable::TagEntry* tag_entries[4];
+        uint64_t sum = 0;
+
+        for (int t = 0; t < 4; t++) {
+            strings_table.check_and_add_tag(tags[t], &tokens[t], &tag_entries[t]);
+        }
+
+        bench_clock::time_point start = bench_clock::now();
+        for (int i = 0; i < num_entries; i++) {
+            double vals[4] = { (double)(i % 1000), (double)i, (i % 100000) * 0.01, (i % 7) * 1.5 };
+            int len = 0, encoded_len = 0;
+
+            bubo_utils::encode_packed(4, buf, &encoded_len);
+            len += encoded_len;
+            for (int t = 0; t < 4; t++) {
+                bubo_utils::encode_packed(tokens[t].tag_seq_no_, buf + len, &encoded_len);
+                len += encoded_len;
+                if (typed) {
+                    len += encode_typed_number(vals[t], buf + len);
+                } else {
+                    snprintf(str, sizeof(str), "%.17g", vals[t]);
+                    strings_table.check_and_add_val(tag_entries[t], str, &tokens[t]);
+                    bubo_utils::encode_packed(tokens[t].val_seq_no_, buf + len, &encoded_len);
+                    len += encoded_len;
+                }
+            }
+            sum += set.insert(buf, len);
+        }
+        double add_ns = ns_per_op(start, num_entries);
+
+        bench_sink += sum;
+
+        v8::Local<v8::Object> r = Nan::New<v8::Object>();
+        set_number(r, "add_ns", add_ns);
+        size_t interned = 0;
+        for (int t = 0; t < 4; t++) {
+            interned += strings_table.get_num_vals(tags[t]);
+        }
+        set_number(r, "interned_values", interned);
+        Nan::Set(results, Nan::New(typed ? "numeric_typed" : "numeric_strings").ToLocalChecked(), r);
+    }
+}
+
+// A single mutex, taken for lookups as for inserts, to compare StripedLock with.
+struct BenchMutex {
+    std::mutex mutex_;
+    void lock_shared() { mutex_.lock(); }
+    void unlock_shared() { mutex_.unlock(); }
+    void lock() { mutex_.lock(); }
+    void unlock() { mutex_.unlock(); }
+};
+
+/*
+ * Goes over the entries four times with num_threads threads, each taking its share of the
+ * passes, the way AttributesTable adds to a shared set: a lookup with the lock shared, and an
+ * insert with it exclusive for what was not found. Returns the wall clock time per operation.
+ */
+template<typename L>
+static double run_shared_set(L* lock, int num_threads, const std::vector<BYTE>& entries,
+                             const std::vector<size_t>& offsets, int num_entries, int num_present) {
+    BuboHashSet<BytePtrHash, BytePtrEqual> set;
+    for (int i = 0; i < num_present; i++) {
+        set.insert(&entries[offsets[i]], offsets[i + 1] - offsets[i]);
+    }
+
+    uint64_t num_ops = 4 * (uint64_t)num_entries;
+    std::vector<std::thread> threads;
+    std::vector<uint64_t> sums(num_threads, 0);
+
+    bench_clock::time_point start = bench_clock::now();
+    for (int t = 0; t < num_threads; t++) {
+        threads.push_back(std::thread([&, t]() {
+            uint64_t sum = 0;
+            for (uint64_t op = num_ops * t / num_threads; op < num_ops * (t + 1) / num_threads; op++) {
+                int i = op % num_entries;
+                const BYTE* entry = &entries[offsets[i]];
+                int len = offsets[i + 1] - offsets[i];
+
+                lock->lock_shared();
+                bool found = set.lookup(entry, len);
+                lock->unlock_shared();
+                if (!found) {
+                    lock->lock();
+                    sum += set.insert(entry, len);
+                    lock->unlock();
+                }
+            }
+            sums[t] = sum;
+        }));
+    }
+    for (int t = 0; t < num_threads; t++) {
+        threads[t].join();
+    }
+    double ns = ns_per_op(start, num_ops);
+
+    for (int t = 0; t < num_threads; t++) {
+        bench_sink += sums[t];
+    }
+    return ns;
+}
+
+/*
+ * Throughput of a set shared by 1 to 16 threads, with the striped lock of shared sets and with
+ * a single mutex, on a set that has most (90%) of the entries already, as a set that has seen
+ * most of its series does.
+ */
+static void bench_shared_set(v8::Local<v8::Object>& results, int num_entries) {
+    std::vector<BYTE> entries;
+    std::vector<size_t> offsets;
+    std::vector<std::string> strings;
+    make_tag_entries(num_entries, &entries, &offsets, &strings);
+
+    v8::Local<v8::Object> r = Nan::New<v8::Object>();
+    for (int num_threads = 1; num_threads <= 16; num_threads *= 2) {
+        StripedLock striped;
+        BenchMutex mutex;
+        double striped_ns = run_shared_set(&striped, num_threads, entries, offsets, num_entries, num_entries * 9 / 10);
+        double mutex_ns = run_shared_set(&mutex, num_threads, entries, offsets, num_entries, num_entries * 9 / 10);
+
+        set_number(r, ("striped_" + std::to_string(num_threads) + "_threads_ns").c_str(), striped_ns);
+        set_number(r, ("mutex_" + std::to_string(num_threads) + "_threads_ns").c_str(), mutex_ns);
+    }
+    Nan::Set(results, Nan::New("shared_set").ToLocalChecked(), r);
+}
+
+/*
+ * Time per entry of inserting all the entries into an empty set in batches of 64K, and of then
+ * looking them all up, with 1 to 16 shards. The times include the resizes of the shards, which
+ * run in parallel along with the rest.
+ */
+static void bench_sharded_set(v8::Local<v8::Object>& results, int num_entries) {
+    std::vector<BYTE> entries;
+    std::vector<size_t> offsets;
+    std::vector<std::string> strings;
+    make_tag_entries(num_entries, &entries, &offsets, &strings);
+
+    const int batch_size = 64 << 10;
+    std::vector<EntryBatch> batches((num_entries + batch_size - 1) / batch_size);
+    for (int i = 0; i < num_entries; i++) {
+        batches[i / batch_size].add(&entries[offsets[i]], offsets[i + 1] - offsets[i], i % batch_size);
+    }
+    std::vector<uint8_t> flags(batch_size);
+
+    v8::Local<v8::Object> r = Nan::New<v8::Object>();
+    for (uint32_t num_shards = 1; num_shards <= 16; num_shards *= 4) {
+        ShardedSet set(num_shards, BytePtrHash());
+        uint64_t sum = 0;
+
+        bench_clock::time_point start = bench_clock::now();
+        for (size_t b = 0; b < batches.size(); b++) {
+            set.insert_batch(batches[b], &flags[0]);
+            sum += flags[0];
+        }
+        set_number(r, ("insert_" + std::to_string(num_shards) + "_shards_ns").c_str(), ns_per_op(start, num_entries));
+
+        start = bench_clock::now();
+        for (size_t b = 0; b < batches.size(); b++) {
+            set.contains_batch(batches[b], &flags[0]);
+            sum += flags[0];
+        }
+        set_number(r, ("contains_" + std::to_string(num_shards) + "_shards_ns").c_str(), ns_per_op(start, num_entries));
+        bench_sink += sum;
+    }
+    Nan::Set(results, Nan::New("sharded_set").ToLocalChecked(), r);
+}
+
+void benchall(v8::Local<v8::Object>& results, int num_entries) {
+    bench_entry_len(results, num_entries);
+    bench_hash_functions(results, num_entries);
+    bench_numeric_values(results, num_entries);
+    bench_shared_set(results, num_entries);
+    bench_sharded_set(results, num_entries);
+}
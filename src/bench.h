@@ -0,0 +1,11 @@
+#pragma once
+
+#include "nan.h"
+
+/*
+ * Native micro benchmarks of the data structures behind Bubo. Each one adds an object
+ * of timings (in nanoseconds per operation) to results.
+ *
+ * @num_entries: number of entries each benchmark works on.
+ */
+void benchall(v8::Local<v8::Object>& results, int num_entries);
@@ -1,38 +1,385 @@
+#include <assert.h>
+#include <new>
 #include "blob-store.h"
 #include "utils.h"
 
-BYTE* BlobStore::add(const BYTE* seq_str, int len) {
-	if (curr_blob_mem_end_ - curr_blob_mem_pos_ < len ) {
-		curr_blob_->next_ = new Blob(blob_size_);
-		curr_blob_ = curr_blob_->next_;
-		curr_blob_mem_pos_ = curr_blob_->mem_;
-		curr_blob_mem_end_ = curr_blob_mem_pos_ + blob_size_;
+BlobRef BlobStore::add(const BYTE* seq_str, int len) {
+	BYTE header[5];
+	int header_len = 0;
+	bubo_utils::encode_packed(len, header, &header_len);
+
+	BlobRef ref = 0;
+	if (take_free(header_len + len, &ref)) {
+		BYTE* rec = (BYTE*)record(ref);
+		memcpy(rec, header, header_len);
+		memcpy(rec + header_len, seq_str, len);
+		return ref;
+	}
+
+	if (curr_blob_mem_end_ - curr_blob_mem_pos_ < header_len + len) {
+		new_blob();
 	}
-	BYTE* ret_ptr = curr_blob_mem_pos_;
+	ref = ((BlobRef)curr_blob_ << 32) | (uint32_t)(curr_blob_mem_pos_ - blobs_[curr_blob_].mem_);
+	memcpy(curr_blob_mem_pos_, header, header_len);
+	curr_blob_mem_pos_ += header_len;
 	memcpy(curr_blob_mem_pos_, seq_str, len);
 	curr_blob_mem_pos_ += len;
 
-	return ret_ptr;
+	return ref;
+}
+
+void BlobStore::remove(BlobRef ref) {
+	size_t size = record_size(record(ref));
+
+	if (in_compaction(ref)) {
+		// Goes away with the chunk.
+		blobs_[compact_blob_].dead_ += size;
+		dead_bytes_ += size;
+	} else {
+		push_free(ref, size);
+	}
 }
 
-void BlobStore::remove_blob(Blob* p) {
-	if (!p) {
+void BlobStore::new_blob() {
+	uint32_t id = 0;
+	while (id < blobs_.size() && blobs_[id].mem_ != NULL) {
+		id++;
+	}
+	if (id == blobs_.size()) {
+		blobs_.push_back(Blob());
+	}
+
+	Blob& blob = blobs_[id];
+	blob.dead_ = 0;
+	blob.file_ = NULL;
+	if (map_dir_.empty()) {
+		blob.mem_ = new BYTE[blob_size_];
+	} else {
+		// Out of disk space is out of memory here.
+		blob.file_ = new MappedFile();
+		if (!blob.file_->create(blob_path(id), blob_size_)) {
+			delete blob.file_;
+			blob.file_ = NULL;
+			throw std::bad_alloc();
+		}
+		blob.mem_ = blob.file_->mem();
+	}
+	num_blobs_ ++;
+
+	curr_blob_ = id;
+	curr_blob_mem_pos_ = blob.mem_;
+	curr_blob_mem_end_ = blob.mem_ + blob_size_;
+}
+
+void BlobStore::free_blob(uint32_t id, bool remove_file) {
+	Blob& blob = blobs_[id];
+	if (blob.mem_ == NULL) {
 		return;
+	}
+	if (blob.file_) {
+		if (remove_file) {
+			blob.file_->remove();
+		}
+		delete blob.file_;
 	} else {
-		remove_blob(p->next_);
-		delete p;
+		delete [] blob.mem_;
+	}
+	blob.mem_ = NULL;
+	blob.file_ = NULL;
+	num_blobs_ --;
+}
+
+void BlobStore::reset() {
+	for (size_t b = 0; b < blobs_.size(); b++) {
+		free_blob(b, true);
+	}
+	blobs_.clear();
+	for (size_t size = 0; size < BLOB_FREE_CLASSES; size++) {
+		free_[size].clear();
+	}
+	memset(nonempty_, 0, sizeof(nonempty_));
+	free_large_.clear();
+	dead_bytes_ = 0;
+	compact_blob_ = NO_BLOB;
+	curr_blob_ = NO_BLOB;
+	curr_blob_mem_pos_ = curr_blob_mem_end_ = NULL;
+}
+
+std::string BlobStore::blob_path(uint32_t id) const {
+	return map_dir_ + "/blob." + std::to_string(id);
+}
+
+void BlobStore::push_free(BlobRef ref, size_t size) {
+	if (size < BLOB_FREE_CLASSES) {
+		free_[size].push_back(ref);
+		nonempty_[size / 64] |= 1ull << (size % 64);
+	} else {
+		free_large_.push_back(std::make_pair(ref, size));
+	}
+	blobs_[ref >> 32].dead_ += size;
+	dead_bytes_ += size;
+}
+
+/*
+ * Takes a record off the free list of records of exactly size bytes (smaller than
+ * BLOB_FREE_CLASSES). The caller accounts for the bytes.
+ */
+BlobRef BlobStore::pop_free(size_t size) {
+	std::vector<BlobRef>& list = free_[size];
+	BlobRef ref = list.back();
+	list.pop_back();
+	if (list.empty()) {
+		nonempty_[size / 64] &= ~(1ull << (size % 64));
+	}
+	return ref;
+}
+
+// Sets ref to the start of size bytes of free records. Returns false if none fits.
+bool BlobStore::take_free(size_t size, BlobRef* ref) {
+	if (dead_bytes_ == 0) {
+		return false;
+	}
+
+	bool found = false;
+	size_t rec_size = 0;
+
+	if (size < BLOB_FREE_CLASSES && !free_[size].empty()) {
+		*ref = pop_free(size);
+		rec_size = size;
+		found = true;
+	}
+
+	// The smallest free record that leaves room for a record after this one.
+	for (size_t c = size + BLOB_MIN_RECORD; !found && c < BLOB_FREE_CLASSES; c = (c | 63) + 1) {
+		uint64_t bits = nonempty_[c / 64] & (~0ull << (c % 64));
+		if (bits) {
+			rec_size = (c & ~(size_t)63) + __builtin_ctzll(bits);
+			*ref = pop_free(rec_size);
+			found = true;
+		}
+	}
+
+	for (size_t i = 0; i < free_large_.size() && !found; i++) {
+		if (free_large_[i].second == size || free_large_[i].second >= size + BLOB_MIN_RECORD) {
+			*ref = free_large_[i].first;
+			rec_size = free_large_[i].second;
+			free_large_[i] = free_large_.back();
+			free_large_.pop_back();
+			found = true;
+		}
+	}
+
+	if (!found) {
+		return false;
+	}
+
+	blobs_[*ref >> 32].dead_ -= rec_size;
+	dead_bytes_ -= rec_size;
+	if (rec_size > size) {
+		push_free(*ref + size, rec_size - size);
+	}
+	return true;
+}
+
+bool BlobStore::begin_compaction(double min_dead_ratio) {
+	assert(compact_blob_ == NO_BLOB);
+
+	uint32_t sparsest = NO_BLOB;
+	for (uint32_t b = 0; b < blobs_.size(); b++) {
+		if (blobs_[b].mem_ != NULL && b != curr_blob_ &&
+		    (sparsest == NO_BLOB || blobs_[b].dead_ > blobs_[sparsest].dead_)) {
+			sparsest = b;
+		}
+	}
+	if (sparsest == NO_BLOB || blobs_[sparsest].dead_ == 0 ||
+	    blobs_[sparsest].dead_ < min_dead_ratio * blob_size_) {
+		return false;
+	}
+	compact_blob_ = sparsest;
+
+	// Nothing may be added to the chunk anymore.
+	for (size_t size = 0; size < BLOB_FREE_CLASSES; size++) {
+		std::vector<BlobRef>& list = free_[size];
+		for (size_t i = 0; i < list.size(); ) {
+			if (in_compaction(list[i])) {
+				list[i] = list.back();
+				list.pop_back();
+			} else {
+				i++;
+			}
+		}
+		if (list.empty()) {
+			nonempty_[size / 64] &= ~(1ull << (size % 64));
+		}
 	}
+	for (size_t i = 0; i < free_large_.size(); ) {
+		if (in_compaction(free_large_[i].first)) {
+			free_large_[i] = free_large_.back();
+			free_large_.pop_back();
+		} else {
+			i++;
+		}
+	}
+
+	return true;
+}
+
+BlobRef BlobStore::relocate(BlobRef ref) {
+	assert(in_compaction(ref));
+
+	int len = 0;
+	const BYTE* rec = record(ref);
+	const BYTE* data = record_data(rec, &len);
+	blobs_[compact_blob_].dead_ += (data - rec) + len;
+	dead_bytes_ += (data - rec) + len;
+
+	return add(data, len);
 }
 
-void BlobStore::stats(uint64_t* allocated_bytes, uint64_t* used_bytes) const {
+void BlobStore::end_compaction() {
+	assert(compact_blob_ != NO_BLOB);
 
-	Blob* b = blobs_;
-	size_t num_blobs = 0;
-	while (b != NULL) {
-		b = b->next_;
-		num_blobs ++;
+	dead_bytes_ -= blobs_[compact_blob_].dead_;
+	free_blob(compact_blob_, true);
+	compact_blob_ = NO_BLOB;
+	compactions_ ++;
+}
+
+bool BlobStore::load(SnapshotReader* reader, uint64_t len) {
+	if (len > reader->remaining()) {
+		return false;
 	}
 
-	*allocated_bytes = num_blobs * blob_size_;
-	*used_bytes = (num_blobs - 1) * blob_size_ + (size_t)(curr_blob_mem_pos_ - curr_blob_->mem_);
-}
\ No newline at end of file
+	reset();
+
+	uint64_t left = len;
+	do {
+		size_t n = left < blob_size_ ? left : blob_size_;
+		new_blob();
+		if (!reader->read(blobs_[curr_blob_].mem_, n)) {
+			return false;
+		}
+		curr_blob_mem_pos_ += n;
+		left -= n;
+	} while (left > 0);
+
+	return true;
+}
+
+bool BlobStore::ref_at(uint64_t offset, BlobRef* ref) const {
+	uint64_t b = offset / blob_size_;
+	if (b >= blobs_.size() || blobs_[b].mem_ == NULL) {
+		return false;
+	}
+	const BYTE* rec = blobs_[b].mem_ + offset % blob_size_;
+	const BYTE* end = (b == curr_blob_) ? curr_blob_mem_pos_ : blobs_[b].mem_ + blob_size_;
+
+	// Decodes the header without going past the end of the chunk.
+	uint64_t len = 0;
+	const BYTE* p = rec;
+	for (int shift = 0; ; shift += 7) {
+		if (p >= end || shift > 28) {
+			return false;
+		}
+		len |= (uint64_t)(*p & 0x7F) << shift;
+		if (!(*p++ & 0x80)) {
+			break;
+		}
+	}
+	if (len == 0 || len > (uint64_t)(end - p)) {
+		return false;
+	}
+	*ref = (b << 32) | (offset % blob_size_);
+	return true;
+}
+
+bool BlobStore::set_mapped(const std::string& dir) {
+	assert(num_blobs_ == 1 && curr_blob_mem_pos_ == blobs_[curr_blob_].mem_);
+
+	reset();
+	map_dir_ = dir;
+	try {
+		new_blob();
+	} catch (std::bad_alloc&) {
+		// Back to a chunk in memory, for the store to stay usable.
+		map_dir_.clear();
+		new_blob();
+		return false;
+	}
+	return true;
+}
+
+void BlobStore::save_mapping(SnapshotWriter* writer) const {
+	writer->write_value((uint64_t)blob_size_);
+	writer->write_value((uint32_t)blobs_.size());
+	for (size_t b = 0; b < blobs_.size(); b++) {
+		writer->write_value((uint8_t)(blobs_[b].mem_ != NULL));
+		writer->write_value(blobs_[b].dead_);
+	}
+	writer->write_value(curr_blob_);
+	writer->write_value((uint64_t)(curr_blob_mem_pos_ - blobs_[curr_blob_].mem_));
+	writer->write_value(compactions_);
+}
+
+bool BlobStore::open_mapped(const std::string& dir, SnapshotReader* reader, bool read_only) {
+	uint64_t blob_size = 0, curr_pos = 0;
+	uint32_t num_ids = 0, curr = 0;
+
+	reset();
+	map_dir_ = dir;
+
+	if (!reader->read_value(&blob_size) || blob_size != blob_size_ ||
+	    !reader->read_value(&num_ids) || num_ids > reader->remaining() / 9) {
+		return false;
+	}
+
+	blobs_.resize(num_ids, Blob());
+	for (uint32_t b = 0; b < num_ids; b++) {
+		uint8_t present = 0;
+		Blob& blob = blobs_[b];
+		if (!reader->read_value(&present) || !reader->read_value(&blob.dead_) || blob.dead_ > blob_size_) {
+			return false;
+		}
+		if (!present) {
+			blob.dead_ = 0;
+			continue;
+		}
+		blob.file_ = new MappedFile();
+		if (!blob.file_->open(blob_path(b), read_only) || blob.file_->size() != blob_size_) {
+			delete blob.file_;
+			blob.file_ = NULL;
+			return false;
+		}
+		blob.mem_ = blob.file_->mem();
+		num_blobs_ ++;
+		dead_bytes_ += blob.dead_;
+	}
+
+	if (!reader->read_value(&curr) || !reader->read_value(&curr_pos) || !reader->read_value(&compactions_) ||
+	    curr >= num_ids || blobs_[curr].mem_ == NULL || curr_pos > blob_size_) {
+		return false;
+	}
+	curr_blob_ = curr;
+	curr_blob_mem_pos_ = blobs_[curr].mem_ + curr_pos;
+	curr_blob_mem_end_ = blobs_[curr].mem_ + blob_size_;
+	return true;
+}
+
+bool BlobStore::sync() {
+	bool ok = true;
+	for (size_t b = 0; b < blobs_.size(); b++) {
+		if (blobs_[b].file_ && !blobs_[b].file_->sync()) {
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+void BlobStore::stats(uint64_t* allocated_bytes, uint64_t* used_bytes, uint64_t* dead_bytes,
+                      uint64_t* compactions) const {
+
+	*allocated_bytes = num_blobs_ * blob_size_;
+	*used_bytes = this->used_bytes();
+	*dead_bytes = dead_bytes_;
+	*compactions = compactions_;
+}
@@ -1,56 +1,209 @@
 #pragma once
 
 
+#include <string>
+#include <vector>
 #include "bubo-types.h"
+#include "utils.h"
+#include "snapshot.h"
+#include "mapped-file.h"
 
 #define BLOB_SIZE (20 << 20)
 
+// Freed records smaller than this are kept in free lists by exact size, bigger ones in a single list.
+#define BLOB_FREE_CLASSES 512
+
+// Smallest record: a one byte header and a one byte sequence.
+#define BLOB_MIN_RECORD 2
+
+/*
+ * A reference to a record: the id of its chunk in the high 32 bits, and its offset in the chunk
+ * in the low 32 bits. References hold no pointers, so they stay valid in a mapped file that is
+ * mapped again, at another address or by another process.
+ */
+typedef uint64_t BlobRef;
+
+/*
+ * BlobStore copies byte sequences into large chunks of memory. Every sequence is stored as a
+ * record, prefixed with its length in the packed encoding:
+ *    +--------+-----------------+--------+-----------------+--
+ *    | len1   | len1 bytes ...  | len2   | len2 bytes ...  |..
+ *    +--------+-----------------+--------+-----------------+--
+ * so that the length of a stored sequence never needs to be derived from its contents.
+ *
+ * Removed records go into free lists, by size, and add() reuses them before taking new space:
+ * first a free record of exactly the right size, else the smallest bigger one that leaves a
+ * reusable remainder, which goes back into the free lists.
+ *
+ * Chunks that end up mostly dead can be given back by compaction, which the owner of the
+ * records drives, since only it knows where the live records are referenced from:
+ * begin_compaction() picks a chunk, the owner relocate()s every live record in it, and
+ * end_compaction() frees it.
+ *
+ * With set_mapped(), every chunk is a file of a directory, blob.<id>, mapped into memory
+ * instead of allocated, and save_mapping() and open_mapped() let another BlobStore map the
+ * same files again.
+ */
+
 class BlobStore {
 public:
-    BlobStore() : blob_size_(BLOB_SIZE),
-                  blobs_(new Blob(blob_size_)),
-                  curr_blob_(blobs_),
-                  curr_blob_mem_end_(blobs_->mem_ + BLOB_SIZE),
-                  curr_blob_mem_pos_(blobs_->mem_) {}
-
-    BlobStore(size_t blob_size) : blob_size_(blob_size),
-                                  blobs_(new Blob(blob_size_)),
-                                  curr_blob_(blobs_),
-                                  curr_blob_mem_end_(blobs_->mem_ + blob_size),
-                                  curr_blob_mem_pos_(blobs_->mem_) {}
+    BlobStore() : BlobStore(BLOB_SIZE) {}
+
+    BlobStore(size_t blob_size) : blob_size_(blob_size), free_(BLOB_FREE_CLASSES) {
+        new_blob();
+    }
     virtual ~BlobStore() {
 
-        remove_blob(blobs_);
-        curr_blob_ = blobs_ = NULL;
+        for (size_t b = 0; b < blobs_.size(); b++) {
+            free_blob(b, false);
+        }
+        blobs_.clear();
         curr_blob_mem_pos_ = curr_blob_mem_end_ = NULL;
     }
 
-    BYTE* add(const BYTE* seq_str, int len);
+    // Returns a reference to the new record.
+    BlobRef add(const BYTE* seq_str, int len);
 
-    void stats(uint64_t* allocated_bytes, uint64_t* used_bytes) const;
+    // Frees the record at ref (as returned by add()) for reuse by later add()s.
+    void remove(BlobRef ref);
 
-protected:
-    struct Blob {
-        BYTE* mem_;
-        Blob* next_;
-        Blob(size_t size) : mem_(new BYTE[size]), next_(NULL) {}
-        ~Blob() {
-            delete [] mem_;
-        }
-    };
+    // Returns the address of the record at ref.
+    inline const BYTE* record(BlobRef ref) const {
+        return blobs_[ref >> 32].mem_ + (uint32_t)ref;
+    }
 
-    const size_t blob_size_;
+    // Whether ref is within a chunk this store maps, for references another process may have just written.
+    inline bool maps(BlobRef ref) const {
+        return (ref >> 32) < blobs_.size() && blobs_[ref >> 32].mem_ != NULL && (uint32_t)ref < blob_size_;
+    }
 
-    Blob *blobs_,
-         *curr_blob_;
+    // Returns the byte sequence of the record at rec, and sets len to its length.
+    static inline const BYTE* record_data(const BYTE* rec, int* len) {
+        int header_len = 0;
+        *len = bubo_utils::decode_packed(rec, &header_len);
+        return rec + header_len;
+    }
 
-    BYTE *curr_blob_mem_end_,
-         *curr_blob_mem_pos_;
+    // Returns the size of the record at rec, header included.
+    static inline size_t record_size(const BYTE* rec) {
+        int len = 0;
+        const BYTE* data = record_data(rec, &len);
+        return (data - rec) + len;
+    }
 
+    /*
+     * Replaces the contents of the store with len bytes of records read from a snapshot, laid
+     * out so that no record crosses a multiple of blob_size(). Returns false on a read failure.
+     */
+    bool load(SnapshotReader* reader, uint64_t len);
+
+    // Sets ref to the record at offset in what load() read. Returns false if there is no valid record there.
+    bool ref_at(uint64_t offset, BlobRef* ref) const;
+
+    /*
+     * Puts the chunks into files of dir from now on. Only for an empty store.
+     * Return value: false if the first chunk could not be created. True otherwise.
+     */
+    bool set_mapped(const std::string& dir);
+
+    /*
+     * Writes out the state of a mapped store that is not in its files: which chunks there are,
+     * with their dead bytes, and how far the current one is filled. The free lists are not
+     * written; the records in them stay dead until their chunk is compacted.
+     */
+    void save_mapping(SnapshotWriter* writer) const;
+
+    // Maps the chunks of dir, as written by save_mapping(), into an empty store. Returns false on failure.
+    bool open_mapped(const std::string& dir, SnapshotReader* reader, bool read_only);
+
+    // Writes the chunks of a mapped store back to their files. Returns false on failure.
+    bool sync();
+
+    /*
+     * Picks the chunk with the most dead bytes, other than the one being filled, if at least
+     * min_dead_ratio of it is dead, and stops reusing its free records.
+     *
+     * Return value: true if a compaction was started. False otherwise.
+     */
+    bool begin_compaction(double min_dead_ratio);
+
+    bool compacting() const {
+        return compact_blob_ != NO_BLOB;
+    }
 
-    void remove_blob(Blob* p);
-};
+    // Whether ref is in the chunk being compacted.
+    inline bool in_compaction(BlobRef ref) const {
+        return (ref >> 32) == compact_blob_;
+    }
+
+    // Copies the record at ref, which is in the chunk being compacted, out of it. Returns the copy.
+    BlobRef relocate(BlobRef ref);
+
+    // Frees the chunk being compacted, once none of its records is referenced anymore.
+    void end_compaction();
+
+    uint64_t dead_bytes() const {
+        return dead_bytes_;
+    }
 
+    // Bytes of the chunks handed out so far, including the free records.
+    uint64_t used_bytes() const {
+        return (num_blobs_ - 1) * blob_size_ + (size_t)(curr_blob_mem_pos_ - blobs_[curr_blob_].mem_);
+    }
 
+    size_t blob_size() const {
+        return blob_size_;
+    }
 
+    /*
+     * @allocated_bytes: size of all the chunks of memory.
+     * @used_bytes: bytes of the chunks handed out so far, including the free records.
+     * @dead_bytes: bytes of the free records, waiting to be reused or compacted away.
+     * @compactions: number of chunks freed by compaction.
+     */
+    void stats(uint64_t* allocated_bytes, uint64_t* used_bytes, uint64_t* dead_bytes,
+               uint64_t* compactions) const;
 
+protected:
+    static const uint32_t NO_BLOB = 0xFFFFFFFF;
+
+    struct Blob {
+        BYTE* mem_;             // NULL for an id that is not in use
+        uint64_t dead_;         // bytes of removed records
+        MappedFile* file_;      // for a mapped store
+    };
+
+    const size_t blob_size_;
+
+    // Indexed by chunk id. Ids freed by compaction are given to the next new chunks.
+    std::vector<Blob> blobs_;
+    size_t num_blobs_ = 0;
+    uint32_t curr_blob_ = NO_BLOB;      // being filled
+
+    BYTE *curr_blob_mem_end_ = NULL,
+         *curr_blob_mem_pos_ = NULL;
+
+    // free_[n] holds the free records of n bytes; nonempty_ has bit n set when free_[n] is not empty.
+    std::vector<std::vector<BlobRef>> free_;
+    uint64_t nonempty_[BLOB_FREE_CLASSES / 64] = {};
+    // Free records of BLOB_FREE_CLASSES bytes or more, with their sizes.
+    std::vector<std::pair<BlobRef, size_t>> free_large_;
+    uint64_t dead_bytes_ = 0;
+
+    uint32_t compact_blob_ = NO_BLOB;
+    uint64_t compactions_ = 0;
+
+    std::string map_dir_;               // empty unless mapped
+
+    // Allocates (or maps) a chunk and makes it the current one.
+    void new_blob();
+    // Releases the memory of a chunk, and with remove_file, its file too.
+    void free_blob(uint32_t id, bool remove_file);
+    // Frees every chunk and forgets the free records.
+    void reset();
+    std::string blob_path(uint32_t id) const;
+
+    void push_free(BlobRef ref, size_t size);
+    BlobRef pop_free(size_t size);
+    bool take_free(size_t size, BlobRef* ref);
+};
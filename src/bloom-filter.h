@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+// Bits of a filter for every entry it is sized for: about 1% false positives once it holds that many.
+#define BLOOM_BITS_PER_ENTRY 10
+
+// Most entries a filter may be sized for, 5 GB of it.
+#define MAX_FILTER_ENTRIES (1ULL << 32)
+
+// 64-bit words of a block, one cache line; every entry sets one bit in each.
+#define BLOOM_BLOCK_WORDS 8
+
+/*
+ * BlockedBloomFilter tells, from the 32-bit hash of an entry alone, that the entry was never
+ * added, or that it may have been. Unlike a plain Bloom filter, whose bits for an entry are
+ * spread over the whole array, all the bits of an entry are in one 64 byte block, so that
+ * adding or checking it touches a single cache line: one bit in each of the BLOOM_BLOCK_WORDS
+ * words of the block. The block comes from the high bits of the hash, and the bit of every
+ * word from the top bits of the hash times an odd constant of its own (as in the split block
+ * filters of Parquet).
+ *
+ * Bits are never cleared but all at once, so an entry removed from the set it goes with still
+ * passes until the filter is cleared and filled again.
+ */
+class BlockedBloomFilter {
+public:
+    // A filter for up to capacity entries (at least one block).
+    explicit BlockedBloomFilter(uint64_t capacity) : capacity_(capacity) {
+        num_blocks_ = blocks_for(capacity);
+        void* mem = NULL;
+        if (posix_memalign(&mem, sizeof(Block), num_blocks_ * sizeof(Block)) != 0) {
+            throw std::bad_alloc();
+        }
+        blocks_ = (Block*)mem;
+        clear();
+    }
+
+    ~BlockedBloomFilter() {
+        free(blocks_);
+    }
+
+    inline void add(uint32_t h) {
+        Block& block = blocks_[block_of(h)];
+        for (int i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+            block.words_[i] |= bit_of(h, i);
+        }
+    }
+
+    // Returns false if no entry with hash h was added since the last clear(). True otherwise.
+    inline bool may_contain(uint32_t h) const {
+        const Block& block = blocks_[block_of(h)];
+        for (int i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+            if (!(block.words_[i] & bit_of(h, i))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void clear() {
+        memset(blocks_, 0, num_blocks_ * sizeof(Block));
+    }
+
+    uint64_t capacity() const {
+        return capacity_;
+    }
+
+    uint64_t bytes() const {
+        return num_blocks_ * sizeof(Block);
+    }
+
+    // Bytes of a filter for up to capacity entries.
+    static uint64_t bytes_for(uint64_t capacity) {
+        return blocks_for(capacity) * sizeof(Block);
+    }
+
+    /*
+     * Share of the hashes never added that may_contain() lets through, given the bits set: for
+     * every block, the product of the shares of set bits of its words, averaged over the blocks.
+     * Goes over the whole filter.
+     */
+    double false_positive_rate() const {
+        double sum = 0;
+        for (uint64_t b = 0; b < num_blocks_; b++) {
+            double rate = 1;
+            for (int i = 0; i < BLOOM_BLOCK_WORDS && rate > 0; i++) {
+                rate *= __builtin_popcountll(blocks_[b].words_[i]) / 64.0;
+            }
+            sum += rate;
+        }
+        return sum / num_blocks_;
+    }
+
+private:
+    static const uint64_t BLOCK_BITS = BLOOM_BLOCK_WORDS * 64;
+
+    struct Block {
+        uint64_t words_[BLOOM_BLOCK_WORDS];
+    };
+
+    Block* blocks_;
+    uint64_t num_blocks_;
+    uint64_t capacity_;
+
+    static uint64_t blocks_for(uint64_t capacity) {
+        uint64_t blocks = (capacity * BLOOM_BITS_PER_ENTRY + BLOCK_BITS - 1) / BLOCK_BITS;
+        return blocks ? blocks : 1;
+    }
+
+    inline uint64_t block_of(uint32_t h) const {
+        return ((uint64_t)h * num_blocks_) >> 32;
+    }
+
+    static inline uint64_t bit_of(uint32_t h, int word) {
+        static const uint32_t salts[BLOOM_BLOCK_WORDS] = {
+            0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+            0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31,
+        };
+        return (uint64_t)1 << ((h * salts[word]) >> 26);
+    }
+
+    BlockedBloomFilter(const BlockedBloomFilter&);
+    BlockedBloomFilter& operator=(const BlockedBloomFilter&);
+};
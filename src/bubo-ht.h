@@ -3,70 +3,220 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <new>
+#include <string>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "bubo-types.h"
 #include "blob-store.h"
+#include "bloom-filter.h"
+#include "snapshot.h"
+#include "mapped-file.h"
 #include "utils.h"
 
 
 #define DEFAULT_INIT_HASH_TABLE_SZ (4 << 10)
 #define DEFAULT_MAX_HASH_TABLE_SZ (512 << 20)
 
-#define RESIZE_THRESHOLD_PCT 97
+// Open addressing needs headroom that chaining did not: the table is rehashed
+// once live entries plus tombstones fill this share of the slots.
+#define RESIZE_THRESHOLD_PCT 87
+
+// Number of slots whose control bytes are probed together.
+#define GROUP_WIDTH 16
+
+// With incremental resizing, number of groups of the old table migrated by each operation.
+#define DEFAULT_RESIZE_STEP_GROUPS 8
+
+// A BlobStore chunk is compacted once this share of its bytes belongs to erased entries.
+#define DEFAULT_COMPACT_DEAD_RATIO 0.5
+
+// With automatic compaction, number of groups scanned for records to relocate by each insert() and erase().
+#define DEFAULT_COMPACT_STEP_GROUPS 8
+
+#define MAP_TABLE_MAGIC "BUBOTABL"
+#define MAP_TABLE_VERSION 1
+
+// Bytes before the control bytes in a mapped table file, for a BuboMapHeader.
+#define MAP_HEADER_SIZE 64
 
 /*
   BuboHashSet is a simple hash set in which one can insert any BYTE pointer except NULL, and do lookups.
 
-  Internally, it is an array of 'struct Entry' type objects. Whenever there is a collision, a chain is
-  started from the spine array.
-
-      ^    |       |
-      |    +-------+
-      |    |Entry {|
-           | val   |
-      S    | next  |
-      P    |}      |    <---- CHAIN -------->
-      I    +-------+
-      N    |Entry {|    +-------+    +-------+
-      E    | val   |    |Entry {|    |Entry {|
-           | next ----->| val   |    | val   |
-      |    |}      |    | next ----> | next --->
-      |    +-------+    |}      |    |}      |
-      |    |Entry {|    +-------+    +-------+
-      v    | val   |
-           | next  |
-           |}      |
-           +-------+
-           |       |
+  Inserted values are copied into the BlobStore as length-prefixed records, and the slots hold
+  references (BlobRef) to those records. The equality functor is called with a stored record and a candidate entry.
+  erase() hands the record back to the BlobStore, whose free lists reuse it for later inserts.
+
+  Internally, it is an open addressing table split into groups of GROUP_WIDTH slots. Each slot
+  has a one byte control word kept in a separate array, so that a whole group of control words
+  can be compared against a fingerprint with a single SSE2 instruction.
+
+                 group 0                          group 1
+          +----+----+----+-- ... --+----+----+----+----+-- ... --+----+
+   ctrl_  | h2 | E  | h2 |         | D  | h2 | h2 | E  |         | E  |
+          +----+----+----+-- ... --+----+----+----+----+-- ... --+----+
+  hashes_ | h  |    | h  |         |    | h  | h  |    |         |    |
+          +----+----+----+-- ... --+----+----+----+----+-- ... --+----+
+   slots_ |val |    |val |         |    |val |val |    |         |    |
+          +----+----+----+-- ... --+----+----+----+----+-- ... --+----+
+
+     h2 : full slot, holds the low 7 bits of the value's hash (the fingerprint).
+     E  : empty slot (CTRL_EMPTY).
+     D  : deleted slot, a tombstone left behind by erase() (CTRL_DELETED).
+     h  : the full hash of the value in a full slot.
+
+  The remaining hash bits (h1) pick the home group. A lookup compares the fingerprint against the
+  16 control bytes of the group, then checks the full hash of the slots that match, and only calls
+  the equality functor (which reads the blob) when that matches too. Resizing never reads the
+  blobs either, as the stored hash is all it needs to place an entry in the new table. If
+  the group has an empty slot, the value cannot be further along; otherwise the next group of a
+  triangular sequence (home + 1, + 3, + 6, ..) is probed, which visits every group since the
+  number of groups is a power of two.
+
+  erase() may only turn a slot back to empty if its group already has an empty slot (no probe
+  sequence ever passes such a group). Otherwise it leaves a tombstone, which later inserts reuse
+  and rehashing drops.
+
+  By default a resize rehashes the whole table within the insert() that triggers it. With
+  set_incremental_resize(), the old table is kept next to the new one instead, and every
+  insert(), contains() and erase() first migrates a bounded number of old groups. Lookups check
+  the new table, then the part of the old one not migrated yet; migrated old slots are turned
+  into tombstones so that probe sequences through the old table stay intact. This bounds the
+  work of any single operation at the cost of keeping both tables until the migration is done.
+
+  compact() gives BlobStore chunks that are mostly dead back to the system. Once the BlobStore has
+  picked a chunk, every call scans a bounded number of groups and relocates the records of that
+  chunk found there, updating their slots; the chunk is freed once the whole table is scanned.
+  A rehash moves slots around, so it restarts the scan, and no scanning happens while an
+  incremental resize is in progress. With set_auto_compact(), insert() and erase() do the
+  same, whenever there are enough dead bytes.
+
+  set_mapped() puts the table and the records into files of a directory, mapped into memory, so
+  that the kernel pages them in and out and the set may outgrow the RAM. The table file holds a
+  BuboMapHeader, then the control bytes, the hashes and the slots, so that the slots' references
+  are all there is to it: sync() writes everything back and returns the little state that is not
+  in the files, and open_mapped() maps the files again, in the same or another process, without
+  reading them.
+
+  set_filter() puts a BlockedBloomFilter of the hashes of the entries in front of the table, so
+  that lookups of most values that are not there stop before probing it. insert() adds to the
+  filter, but erase() cannot take anything out of it, so that every entry erased since it was
+  last filled keeps letting some lookups through; rehash() and rebuild_filter() fill it anew,
+  from the stored hashes, sized for whichever is larger of the table and the expected number
+  of entries. An incremental resize fills a new filter as it migrates the old table, and keeps
+  both until it is done. A read-only table has no filter, as its owner may add to it meanwhile.
+
+  set_clock() keeps one reference bit per slot, in an array next to the control bytes, which
+  insert() and the lookups set for the entries they find or add, and evict() makes a CLOCK out
+  of: a hand goes round the slots, clearing the bits it finds set, and erases the first entry it
+  finds with a clear bit, which was not touched since the hand last went by. This approximates
+  evicting the least recently used entry, with no list to keep in order. Bits go along with the
+  entries when they move to a new table, and start clear after load() and open_mapped().
 
   Only disallowed value in the Bubo Hash Set is a NULL value for the BYTE pointer.
+ */
 
-  This is half as efficient as it could be. Instead of the next pointers, we should write
-  a collision bit into a bit set. If a subsequent insert lands in a bucket i
-  where the collision bit is set, we check for equality with val and if not we go
-  to bucket i+1 instead of following next
+#define CTRL_EMPTY   ((int8_t)0x80)
+#define CTRL_DELETED ((int8_t)0xFE)
 
+/*
+ * A group of GROUP_WIDTH control bytes. Every match function returns a bit mask with
+ * bit i set when slot i of the group satisfies it.
  */
+struct BuboCtrlGroup {
+#ifdef __SSE2__
+    __m128i ctrl_;
 
+    explicit BuboCtrlGroup(const int8_t* p) : ctrl_(_mm_loadu_si128((const __m128i*)p)) {}
+
+    inline uint32_t match(int8_t h2) const {
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl_));
+    }
+
+    inline uint32_t match_empty() const {
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(CTRL_EMPTY), ctrl_));
+    }
+
+    // Both CTRL_EMPTY and CTRL_DELETED have the sign bit set, full slots do not.
+    inline uint32_t match_empty_or_deleted() const {
+        return _mm_movemask_epi8(ctrl_);
+    }
+#else
+    const int8_t* ctrl_;
+
+    explicit BuboCtrlGroup(const int8_t* p) : ctrl_(p) {}
+
+    inline uint32_t match(int8_t h2) const {
+        uint32_t mask = 0;
+        for (int i = 0; i < GROUP_WIDTH; i++) {
+            mask |= (uint32_t)(ctrl_[i] == h2) << i;
+        }
+        return mask;
+    }
+
+    inline uint32_t match_empty() const {
+        return match(CTRL_EMPTY);
+    }
+
+    inline uint32_t match_empty_or_deleted() const {
+        uint32_t mask = 0;
+        for (int i = 0; i < GROUP_WIDTH; i++) {
+            mask |= (uint32_t)(ctrl_[i] < 0) << i;
+        }
+        return mask;
+    }
+#endif
+
+    inline uint32_t match_full() const {
+        return ~match_empty_or_deleted() & ((1 << GROUP_WIDTH) - 1);
+    }
+};
+
+
+/* Start of a mapped table file. */
+struct BuboMapHeader {
+    char magic_[8];             // MAP_TABLE_MAGIC
+    uint32_t version_;
+    uint32_t table_size_;
+    uint64_t generation_;       // number of the last sync()
+    uint32_t dirty_;            // whether the files were modified since that sync()
+};
 
 struct BuboHashStat {
-    uint64_t spine_len;         // Essentially, the size of the spine array.
-    uint64_t spine_use;         // Current number spine entries being used.
+    uint64_t spine_len;         // Essentially, the number of slots in the table.
+    uint64_t spine_use;         // Current number of slots that are not empty (entries and tombstones).
     uint64_t entries;           // Total number of hash set entries that have been added.
+    uint64_t tombstones;        // Number of slots holding an erased entry marker.
     uint64_t ht_bytes;          // Current bytes used by the bubo hash set.
-    uint64_t collision_slots;   // Number of spine slots that have collisions.
-    uint64_t total_chain_len;   // Sum of all chain nodes. This also correspond to the number of collisions.
-    uint64_t max_chain_len;     // Maximum chain length among all spine entries.
-    uint64_t dist_1_2;          // Among the collision slots, number of chains with length [1,2]
-    uint64_t dist_3_5;          // Among the collision slots, number of chains with length [3,5]
-    uint64_t dist_6_9;          // Among the collision slots, number of chains with length [6,9]
-    uint64_t dist_10_;          // Among the collision slots, number of chains with length [10 or more]
-    double  avg_chain_len;      // The average chain length among collision slots.
+    // The probe lengths, up to avg_probe_len, and filter_fpr, are only filled in by get_detailed_stats().
+    uint64_t displaced;         // Number of entries not stored in their home group.
+    uint64_t total_probe_len;   // Sum of extra groups probed to reach each entry.
+    uint64_t max_probe_len;     // Maximum probe length among all entries.
+    uint64_t dist_1_2;          // Among the displaced entries, number with probe length [1,2]
+    uint64_t dist_3_5;          // Among the displaced entries, number with probe length [3,5]
+    uint64_t dist_6_9;          // Among the displaced entries, number with probe length [6,9]
+    uint64_t dist_10_;          // Among the displaced entries, number with probe length [10 or more]
+    double  avg_probe_len;      // The average probe length among displaced entries.
+
+    uint64_t resize_old_len;    // Slots of the table being migrated by an incremental resize, else 0.
+    uint64_t resize_migrated;   // Among those, number of slots already migrated.
 
     uint64_t blob_allocated_bytes; //blobstore allocated
     uint64_t blob_used_bytes;      //blobstore used
+    uint64_t blob_dead_bytes;      //blobstore used by erased entries, to be reused
+    uint64_t blob_compactions;     //blobstore chunks freed by compaction
+
+    uint64_t filter_bytes;      // Bytes of the filter, 0 without one.
+    uint64_t filter_capacity;   // Entries the filter is sized for.
+    uint64_t filter_stale;      // Entries erased since the filter was last filled.
+    double filter_fpr;          // Estimated share of the lookups of missing values that get past the filter.
 
-    uint64_t bytes;             // Total bytes of hash set plus blobstore.
+    uint64_t evictions;         // Entries erased by evict().
+
+    uint64_t bytes;             // Total bytes of hash set plus blobstore and filter.
 };
 
 
@@ -76,30 +226,413 @@ class BuboHashSet {
 public:
     BuboHashSet() : BuboHashSet(DEFAULT_INIT_HASH_TABLE_SZ, DEFAULT_MAX_HASH_TABLE_SZ) {}
 
-    BuboHashSet(uint32_t table_size, uint32_t max_table_size) : table_size_(table_size),
-                                                                max_table_size_(max_table_size),
-                                                                table_curr_use_(0),
-                                                                table_collisions_(0),
+    /*
+     * Both sizes are rounded up to a power of two, and to at least one group.
+     * max_table_size caps the regular growth; past it the table only grows when
+     * it is about to run out of empty slots.
+     * hash is the hash functor to use, for functors that carry state (such as a seed).
+     */
+    BuboHashSet(uint32_t table_size, uint32_t max_table_size, const H& hash = H(),
+                size_t blob_size = BLOB_SIZE) : table_size_(round_table_size(table_size)),
+                                                                max_table_size_(round_table_size(max_table_size)),
+                                                                group_mask_(table_size_ / GROUP_WIDTH - 1),
                                                                 num_entries_(0),
-                                                                table_(new Entry[table_size_]()),
-                                                                blob_store_(new BlobStore()) {}
+                                                                num_tombstones_(0),
+                                                                ctrl_(new int8_t[table_size_]),
+                                                                hashes_(new uint32_t[table_size_]),
+                                                                slots_(new Slot[table_size_]),
+                                                                old_table_size_(0),
+                                                                old_group_mask_(0),
+                                                                old_ctrl_(NULL),
+                                                                old_hashes_(NULL),
+                                                                old_slots_(NULL),
+                                                                migrate_pos_(0),
+                                                                resize_step_(0),
+                                                                blob_store_(new BlobStore(blob_size)),
+                                                                hash(hash) {
+        memset(ctrl_, CTRL_EMPTY, table_size_);
+    }
 
     ~BuboHashSet() {
-        clear();
+        // A mapped table is left as it is in its file.
+        finish_resize();
         delete blob_store_;
-        delete [] table_;
+        delete filter_;
+        delete [] clock_;
+        free_table(table_file_, ctrl_, hashes_, slots_);
+    }
+
+    /*
+     * Moves the table and the records of an empty set into files of dir (which must exist),
+     * replacing any set there. Running out of disk space then shows as std::bad_alloc, as
+     * running out of memory does otherwise.
+     *
+     * Return value: false if the files could not be created, in which case the set stays in
+     * memory. True otherwise.
+     */
+    bool set_mapped(const std::string& dir) {
+        assert(num_entries_ == 0 && !table_file_ && !old_ctrl_);
+
+        if (!blob_store_->set_mapped(dir)) {
+            return false;
+        }
+        map_dir_ = dir;
+
+        MappedFile* file = NULL;
+        int8_t* ctrl = NULL;
+        uint32_t* hashes = NULL;
+        Slot* slots = NULL;
+        try {
+            allocate_table(table_size_, &file, &ctrl, &hashes, &slots);
+        } catch (std::bad_alloc&) {
+            map_dir_.clear();
+            return false;
+        }
+        free_table(NULL, ctrl_, hashes_, slots_);
+        table_file_ = file;
+        ctrl_ = ctrl;
+        hashes_ = hashes;
+        slots_ = slots;
+        dirty_ = true;
+        return true;
+    }
+
+    /*
+     * Writes a mapped set back to its files, marks them as in sync, and writes what open_mapped()
+     * needs besides the files to the snapshot writer. Any migration in progress is completed first.
+     *
+     * Return value: false if writing the files failed. True otherwise.
+     */
+    bool sync(SnapshotWriter* writer) {
+        assert(table_file_ && !read_only_);
+
+        complete_migration();
+        bool ok = blob_store_->sync() && table_file_->sync();
+
+        // Only once the rest is on disk.
+        BuboMapHeader* header = (BuboMapHeader*)table_file_->mem();
+        header->generation_ = ++generation_;
+        header->dirty_ = 0;
+        ok = table_file_->sync() && ok;
+        dirty_ = false;
+
+        writer->write_value(table_size_);
+        writer->write_value(num_entries_);
+        writer->write_value(num_tombstones_);
+        writer->write_value(generation_);
+        blob_store_->save_mapping(writer);
+        return ok;
+    }
+
+    /*
+     * Maps the files of dir, as left by the sync() that wrote the snapshot reader's contents, into
+     * a new set. Nothing but headers is read, so it takes the same time whatever the size of the
+     * set, unless it has a filter, which is filled from the table. A read_only set maps the files read-only, and only allows contains().
+     *
+     * Return value: false if the files are missing, were modified after that sync(), or do not
+     * match it. True otherwise.
+     */
+    bool open_mapped(const std::string& dir, SnapshotReader* reader, bool read_only) {
+        assert(num_entries_ == 0 && !table_file_ && !old_ctrl_);
+
+        uint32_t table_size = 0;
+        uint64_t num_entries = 0, num_tombstones = 0, generation = 0;
+
+        if (!reader->read_value(&table_size) || !reader->read_value(&num_entries) ||
+            !reader->read_value(&num_tombstones) || !reader->read_value(&generation)) {
+            return false;
+        }
+        if (table_size < GROUP_WIDTH || (table_size & (table_size - 1)) != 0 ||
+            num_entries + num_tombstones > table_size) {
+            return false;
+        }
+
+        MappedFile* file = new MappedFile();
+        if (!file->open(dir + "/table", read_only) || file->size() != table_file_size(table_size)) {
+            delete file;
+            return false;
+        }
+        const BuboMapHeader* header = (const BuboMapHeader*)file->mem();
+        if (memcmp(header->magic_, MAP_TABLE_MAGIC, sizeof(header->magic_)) != 0 ||
+            header->version_ != MAP_TABLE_VERSION || header->table_size_ != table_size ||
+            header->generation_ != generation || header->dirty_ != 0 ||
+            !blob_store_->open_mapped(dir, reader, read_only)) {
+            delete file;
+            return false;
+        }
+
+        free_table(NULL, ctrl_, hashes_, slots_);
+        map_dir_ = dir;
+        table_file_ = file;
+        table_size_ = table_size;
+        group_mask_ = table_size_ / GROUP_WIDTH - 1;
+        ctrl_ = (int8_t*)(file->mem() + MAP_HEADER_SIZE);
+        hashes_ = (uint32_t*)(ctrl_ + table_size_);
+        slots_ = (Slot*)(hashes_ + table_size_);
+        num_entries_ = num_entries;
+        num_tombstones_ = num_tombstones;
+        generation_ = generation;
+        read_only_ = read_only;
+        dirty_ = false;
+        layout_ ++;
+        if (read_only_) {
+            delete filter_;
+            filter_ = NULL;
+        }
+        rebuild_filter();
+        if (clock_) {
+            set_clock(true);
+        }
+        return true;
+    }
+
+    /*
+     * Switches between stop-the-world resizing (step_groups == 0) and incremental resizing,
+     * where each operation migrates at most step_groups groups of the old table.
+     * Any migration in progress is completed first.
+     */
+    void set_incremental_resize(uint32_t step_groups) {
+        complete_migration();
+        resize_step_ = step_groups;
+    }
+
+    /*
+     * Puts a filter, sized for at least expected_entries entries, in front of the table, or
+     * drops it with 0. Does nothing for a read-only table.
+     */
+    void set_filter(uint64_t expected_entries) {
+        filter_entries_ = expected_entries;
+        if (expected_entries == 0) {
+            delete filter_;
+            delete old_filter_;
+            filter_ = NULL;
+            old_filter_ = NULL;
+            return;
+        }
+        rebuild_filter();
+    }
+
+    /*
+     * Fills the filter anew with the hashes of the entries, so that those erased no longer
+     * get through, and sizes it for the entries of the table if they outgrew it. Any migration
+     * in progress is completed first.
+     */
+    void rebuild_filter() {
+        if (filter_entries_ == 0 || read_only_) {
+            return;
+        }
+        complete_migration();
+
+        delete filter_;
+        filter_ = NULL;
+        filter_ = new BlockedBloomFilter(filter_capacity(table_size_));
+        for (uint32_t idx = 0; idx < table_size_; idx++) {
+            if (ctrl_[idx] >= 0) {
+                filter_->add(hashes_[idx]);
+            }
+        }
+        filter_stale_ = 0;
+    }
+
+    /*
+     * Keeps (or with false, drops) the reference bits of the entries for evict(), all clear to
+     * start with. Any migration in progress is completed first.
+     */
+    void set_clock(bool clock) {
+        complete_migration();
+        delete [] clock_;
+        clock_ = clock ? new uint64_t[clock_words(table_size_)]() : NULL;
+        clock_hand_ = 0;
+    }
+
+    /*
+     * Erases the entry that the clock hand stops at: the first one past it whose reference bit is
+     * clear, after clearing those that are set on the way. Needs set_clock(). The hand only goes
+     * over the current table: during an incremental resize, the entries still in the old table are
+     * only evicted once migrated, or after completing the migration if nothing else is left. keep,
+     * if not NULL, is an entry (of keep_len bytes and hash keep_h) never to pick, such as the one
+     * just inserted.
+     *
+     * Return value: false if the set has no entry other than keep. True otherwise.
+     */
+    bool evict(const BYTE* keep = NULL, int keep_len = 0, uint32_t keep_h = 0) {
+        assert(clock_ && !read_only_);
+        mark_dirty();
+        migrate_step();
+
+        uint32_t keep_idx;
+        for (;;) {
+            keep_idx = table_size_;
+            if (keep) {
+                find_index(keep, keep_len, keep_h, &keep_idx);
+            }
+            if (num_entries_ - old_entries_ > (keep_idx < table_size_ ? 1u : 0u)) {
+                break;
+            }
+            if (!old_ctrl_) {
+                return false;
+            }
+            complete_migration();
+        }
+
+        // Two turns at most: the first one clears every bit.
+        for (;;) {
+            uint32_t idx = clock_hand_;
+            clock_hand_ = (clock_hand_ + 1) & (table_size_ - 1);
+            if (ctrl_[idx] < 0 || idx == keep_idx) {
+                continue;
+            }
+            uint64_t bit = 1ULL << (idx & 63);
+            if (clock_[idx >> 6] & bit) {
+                clock_[idx >> 6] &= ~bit;
+                continue;
+            }
+            erase_slot(idx);
+            evictions_ ++;
+            return true;
+        }
+    }
+
+    /*
+     * Bytes that the next insert() of a new entry would add to bytes() by resizing the table, 0 if
+     * it would not resize it. An incremental resize keeps both tables until the migration ends.
+     */
+    uint64_t growth_bytes() const {
+        uint32_t new_size = resize_target(num_entries_ + num_tombstones_ + 1);
+        if (new_size == 0) {
+            return 0;
+        }
+        uint64_t bytes = table_bytes(new_size);
+        if (filter_) {
+            bytes += BlockedBloomFilter::bytes_for(filter_capacity(new_size));
+        }
+        if (resize_step_ == 0) {
+            bytes -= table_bytes(table_size_) + (filter_ ? filter_->bytes() : 0);
+        }
+        return bytes;
+    }
+
+    /*
+     * Evicts entries until the next insert() of a new entry fits the table as it is, and then
+     * drops the tombstones with a rehash in place if that is needed too: for a set at its budget
+     * of bytes, instead of letting insert() grow the table (see growth_bytes()). Needs set_clock().
+     *
+     * Return value: the number of entries evicted.
+     */
+    uint64_t make_room() {
+        assert(clock_ && !read_only_);
+        mark_dirty();
+        complete_migration();
+
+        uint64_t evicted = 0;
+        while (100 * (num_entries_ + 1) > (uint64_t)table_size_ * RESIZE_THRESHOLD_PCT && evict()) {
+            evicted ++;
+        }
+        if (resize_target(num_entries_ + num_tombstones_ + 1) != 0) {
+            rehash(table_size_);
+            complete_migration();
+        }
+        return evicted;
+    }
+
+    /*
+     * Bytes of the tables, the filters, the reference bits and the records of the entries (not
+     * the free records of the BlobStore, which later inserts reuse). Unlike get_stats(), does not
+     * go over the table.
+     */
+    uint64_t bytes() const {
+        uint64_t bytes = table_bytes(table_size_) + (old_ctrl_ ? table_bytes(old_table_size_) : 0) +
+                         blob_store_->used_bytes() - blob_store_->dead_bytes();
+        if (filter_) {
+            bytes += filter_->bytes();
+        }
+        if (old_filter_) {
+            bytes += old_filter_->bytes();
+        }
+        return bytes;
+    }
+
+    /*
+     * Sets the share of dead bytes a BlobStore chunk needs for compact() to pick it, and whether
+     * insert() and erase() compact on their own, step_groups groups at a time (0 to not).
+     */
+    void set_auto_compact(double dead_ratio, uint32_t step_groups) {
+        compact_ratio_ = dead_ratio;
+        compact_step_ = step_groups;
+    }
+
+    /*
+     * Scans up to step_groups groups of the table for records of the chunk being compacted, and
+     * relocates them, starting a compaction first if there is none and some chunk is sparse enough.
+     *
+     * Return value: true if there is compaction work left. False otherwise.
+     */
+    bool compact(uint32_t step_groups) {
+        assert(!read_only_);
+        mark_dirty();
+
+        if (!blob_store_->compacting()) {
+            if (!blob_store_->begin_compaction(compact_ratio_)) {
+                return false;
+            }
+            compact_pos_ = 0;
+        }
+
+        if (old_ctrl_) {
+            // rehash() reset the scan, which resumes on the new table once the migration is done.
+            return true;
+        }
+
+        uint32_t end = compact_pos_ + step_groups;
+        if (end > group_mask_ + 1) {
+            end = group_mask_ + 1;
+        }
+        for (; compact_pos_ < end; compact_pos_++) {
+            uint32_t base = compact_pos_ * GROUP_WIDTH;
+            for (uint32_t m = BuboCtrlGroup(ctrl_ + base).match_full(); m; m &= m - 1) {
+                uint32_t idx = base + __builtin_ctz(m);
+                if (blob_store_->in_compaction(slots_[idx].ref_)) {
+                    slots_[idx].ref_ = blob_store_->relocate(slots_[idx].ref_);
+                }
+            }
+        }
+
+        if (compact_pos_ <= group_mask_) {
+            return true;
+        }
+
+        blob_store_->end_compaction();
+        if (!blob_store_->begin_compaction(compact_ratio_)) {
+            return false;
+        }
+        compact_pos_ = 0;
+        return true;
     }
 
     // Returns true if inserted val is a new entry. Else false.
     inline bool insert(const BYTE* entry_buf, int entry_len) {
-        assert(entry_buf);
-        uint32_t idx = hash(entry_buf, entry_len) % table_size_;
+        return insert(entry_buf, entry_len, hash(entry_buf, entry_len));
+    }
+
+    /*
+     * The methods that take an h do the same as those that do not, for callers that have h,
+     * the hash of the entry, already.
+     */
+    inline bool insert(const BYTE* entry_buf, int entry_len, uint32_t h) {
+        assert(entry_buf && !read_only_);
+        mark_dirty();
+        migrate_step();
+        auto_compact();
 
-        bool found = find_at(&table_[idx], entry_buf, entry_len);
+        bool found = find_and_touch(entry_buf, entry_len, h);
 
         if (!found) {
-            BYTE* blob_ptr = blob_store_->add(entry_buf, entry_len);
-            insert_value_into_table_at_index(blob_ptr, table_, idx);
+            BlobRef ref = blob_store_->add(entry_buf, entry_len);
+            touch(clock_, insert_value_into_table(ref, h, ctrl_, hashes_, slots_, group_mask_));
+            if (filter_) {
+                filter_->add(h);
+            }
+            num_entries_ ++;
         }
 
         maybe_resize();
@@ -108,53 +641,77 @@ public:
     }
 
     inline bool contains(const BYTE* entry_buf, int entry_len) {
+        return contains(entry_buf, entry_len, hash(entry_buf, entry_len));
+    }
+
+    inline bool contains(const BYTE* entry_buf, int entry_len, uint32_t h) {
         assert(entry_buf);
-        uint32_t idx = hash(entry_buf, entry_len) % table_size_;
+        migrate_step();
 
-        return find_at(&table_[idx], entry_buf, entry_len);
+        return find_and_touch(entry_buf, entry_len, h);
     }
 
-    inline void erase(BYTE* val) {
-        int len = bubo_utils::get_entry_len(val);
-        uint32_t idx = hash(val, len) % table_size_;
+    /*
+     * As contains(), but without the migration work, so that it only reads the set, and any
+     * number of lookup()s may run at the same time (as long as nothing else does).
+     */
+    inline bool lookup(const BYTE* entry_buf, int entry_len) const {
+        return lookup(entry_buf, entry_len, hash(entry_buf, entry_len));
+    }
 
-        Entry** erase_entry = NULL;
-        bool is_spine_entry = false;
-        bool found = find_at(&table_[idx], val, len, &erase_entry, &is_spine_entry);
+    inline bool lookup(const BYTE* entry_buf, int entry_len, uint32_t h) const {
+        assert(entry_buf);
 
-        if (found) {
-            assert(erase_entry);
+        return find_and_touch(entry_buf, entry_len, h);
+    }
 
-            if (is_spine_entry) {
-                // Indicates that value to be removed is in the spine.
-                // The spine may or may not have a chain, which affects the counters.
-                bool deleted = erase_spine_entry(&table_[idx]);
-                if (!deleted) {
-                    // spine did not have a chain. hence decrement table use.
-                    table_curr_use_ --;
-                }
+    // Returns true if the entry was in the set.
+    inline bool erase(const BYTE* val, int len) {
+        return erase(val, len, hash(val, len));
+    }
 
-            } else {
-                // erase_entry holds the pointer to the next_ pointer which points to the
-                // Entry to be deleted.
-                erase_next(erase_entry);
-            }
+    inline bool erase(const BYTE* val, int len, uint32_t h) {
+        assert(val && !read_only_);
+        mark_dirty();
+        migrate_step();
+        auto_compact();
+
+        uint32_t idx = 0;
+
+        if (!may_contain(h)) {
+            return false;
+        }
+        if (find_index(val, len, h, &idx)) {
+            erase_slot(idx);
+        } else if (old_ctrl_ && find_in(old_ctrl_, old_hashes_, old_slots_, old_group_mask_, val, len, h, &idx)) {
+            // Nothing is inserted into the old table, so a tombstone is always fine there.
+            old_ctrl_[idx] = CTRL_DELETED;
+            blob_store_->remove(old_slots_[idx].ref_);
             num_entries_ --;
+            old_entries_ --;
+            filter_stale_ ++;
+        } else {
+            return false;
         }
+        return true;
     }
 
 
     inline void clear() {
-        // clear() does not deallocate the spine.
-        for (uint32_t idx = 0; idx < table_size_; idx++) {
-            Entry* p = table_[idx].next_;
-            while (p) {
-               Entry* q = p->next_;
-               delete p;
-               p = q;
-            }
-            table_[idx].val_ = NULL;
-            table_[idx].next_ = NULL;
+        // clear() does not deallocate the table, but drops the one left from an incremental resize.
+        assert(!read_only_);
+        mark_dirty();
+        finish_resize();
+        memset(ctrl_, CTRL_EMPTY, table_size_);
+        num_entries_ = 0;
+        num_tombstones_ = 0;
+        layout_ ++;
+        if (filter_) {
+            filter_->clear();
+        }
+        filter_stale_ = 0;
+        if (clock_) {
+            set_clock(true);
         }
     }
 
@@ -162,189 +719,730 @@ public:
         return num_entries_;
     }
 
+    /*
+     * Calls fn(entry, len) for the entries of the slots from *pos on, in slot order, until it has
+     * done so max_entries times, and moves *pos past the last slot visited. Returns false once
+     * *pos is past the last slot. Any migration in progress is completed first, so that all the
+     * entries are in the one table. Entries only change slots when the table is resized (or
+     * cleared, or loaded), after which layout() is different, and the positions mean nothing.
+     */
+    template<typename Fn>
+    bool scan(uint32_t* pos, uint32_t max_entries, Fn fn) {
+        complete_migration();
+
+        uint32_t idx = *pos;
+        for (uint32_t n = 0; idx < table_size_ && n < max_entries; idx++) {
+            // A read-only table may be changed by its owner meanwhile, slots included.
+            if (ctrl_[idx] < 0 || (read_only_ && !blob_store_->maps(slots_[idx].ref_))) {
+                continue;
+            }
+            int len = 0;
+            const BYTE* entry = BlobStore::record_data(blob_store_->record(slots_[idx].ref_), &len);
+            fn(entry, len);
+            n++;
+        }
+        *pos = idx;
+        return idx < table_size_;
+    }
+
+    inline uint64_t layout() const {
+        return layout_;
+    }
+
+    /*
+     * Writes the table and the records of its entries to a snapshot. The records are packed in
+     * slot order, without the free ones, and every slot refers to its record by offset, so that
+     * load() neither rehashes nor reinserts anything. Any migration in progress is completed first.
+     */
+    void save(SnapshotWriter* writer) {
+        complete_migration();
+
+        writer->write_value(table_size_);
+        writer->write_value(num_entries_);
+        writer->write_value(num_tombstones_);
+        writer->write_value((uint64_t)blob_store_->blob_size());
+        writer->write(ctrl_, table_size_);
+
+        // The hashes of the slots that are not full were never set; they go out as zeros.
+        uint32_t hashes[GROUP_WIDTH];
+        for (uint32_t base = 0; base < table_size_; base += GROUP_WIDTH) {
+            for (int i = 0; i < GROUP_WIDTH; i++) {
+                hashes[i] = ctrl_[base + i] < 0 ? 0 : hashes_[base + i];
+            }
+            writer->write(hashes, sizeof(hashes));
+        }
 
+        uint64_t records_len = pack_records([](const BYTE*, size_t, uint64_t, size_t) {});
+        writer->write_value(records_len);
+        pack_records([writer](const BYTE* rec, size_t size, uint64_t, size_t pad) {
+            writer->write_zeros(pad);
+            writer->write(rec, size);
+        });
+        pack_records([writer](const BYTE*, size_t, uint64_t offset, size_t) {
+            writer->write_value(offset);
+        });
+    }
+
+    /*
+     * Replaces the contents of the set with a snapshot written by save(), reading the table with
+     * a few bulk reads. The snapshot must have been written with the same blob size.
+     *
+     * Return value: false if the snapshot is truncated or inconsistent, in which case the set is
+     * left empty. True otherwise.
+     */
+    bool load(SnapshotReader* reader) {
+        uint32_t table_size = 0;
+        uint64_t num_entries = 0, num_tombstones = 0, blob_size = 0;
+
+        assert(!read_only_);
+        mark_dirty();
+        finish_resize();
+        compact_pos_ = 0;
+        compact_check_dead_ = 0;
+        memset(ctrl_, CTRL_EMPTY, table_size_);
+        num_entries_ = 0;
+        num_tombstones_ = 0;
+        layout_ ++;
+        if (filter_) {
+            filter_->clear();
+        }
+        filter_stale_ = 0;
+
+        if (!reader->read_value(&table_size) || !reader->read_value(&num_entries) ||
+            !reader->read_value(&num_tombstones) || !reader->read_value(&blob_size)) {
+            return false;
+        }
+        if (table_size < GROUP_WIDTH || (table_size & (table_size - 1)) != 0 ||
+            num_entries + num_tombstones > table_size || blob_size != blob_store_->blob_size() ||
+            (uint64_t)table_size * (sizeof(int8_t) + sizeof(uint32_t)) > reader->remaining()) {
+            return false;
+        }
+
+        if (table_size != table_size_) {
+            free_table(table_file_, ctrl_, hashes_, slots_);
+            table_size_ = table_size;
+            group_mask_ = table_size_ / GROUP_WIDTH - 1;
+            allocate_table(table_size_, &table_file_, &ctrl_, &hashes_, &slots_);
+        }
+
+        bool ok = reader->read(ctrl_, table_size_) &&
+                  reader->read(hashes_, (size_t)table_size_ * sizeof(uint32_t)) &&
+                  load_records(reader, num_entries, num_tombstones);
+        if (!ok) {
+            memset(ctrl_, CTRL_EMPTY, table_size_);
+            return false;
+        }
+
+        num_entries_ = num_entries;
+        num_tombstones_ = num_tombstones;
+        rebuild_filter();
+        if (clock_) {
+            set_clock(true);
+        }
+        return true;
+    }
+
+
+    /*
+     * Fills in stat from counters kept up to date by the operations, without going over the
+     * table or the filters: the probe lengths and filter_fpr are left at 0.
+     */
     void get_stats(BuboHashStat* stat) const {
+        memset(stat, 0, sizeof(BuboHashStat));
 
         stat->spine_len = table_size_;
-        stat->spine_use = table_curr_use_;
+        // Entries still waiting in the old table do not use slots of the new one.
+        stat->spine_use = num_entries_ - old_entries_ + num_tombstones_;
         stat->entries = num_entries_;
-        stat->total_chain_len = 0;
-        stat->collision_slots = 0;
-        stat->max_chain_len = 0;
-        stat->avg_chain_len = 0;
-        stat->dist_1_2 = 0;
-        stat->dist_3_5 = 0;
-        stat->dist_6_9 = 0;
-        stat->dist_10_ = 0;
+        stat->tombstones = num_tombstones_;
+        stat->resize_old_len = old_table_size_;
+        stat->resize_migrated = (uint64_t)migrate_pos_ * GROUP_WIDTH;
 
-        stat->ht_bytes = table_size_ * sizeof(Entry);
+        stat->ht_bytes = table_bytes(table_size_) + (old_ctrl_ ? table_bytes(old_table_size_) : 0);
 
-        for (uint32_t idx = 0; idx < table_size_; idx++) {
-            Entry* p = &table_[idx];
-            uint64_t chain_len = 0;
+        uint64_t allocated_bytes = 0, used_bytes = 0, dead_bytes = 0, compactions = 0;
+        blob_store_->stats(&allocated_bytes, &used_bytes, &dead_bytes, &compactions);
+        stat->blob_allocated_bytes = allocated_bytes;
+        stat->blob_used_bytes = used_bytes;
+        stat->blob_dead_bytes = dead_bytes;
+        stat->blob_compactions = compactions;
 
-            p = p->next_;
-            if (p) stat->collision_slots ++;
+        if (filter_) {
+            stat->filter_stale = filter_stale_;
+            stat->filter_bytes = filter_->bytes();
+            stat->filter_capacity = filter_->capacity();
+        }
+        if (old_filter_) {
+            stat->filter_bytes += old_filter_->bytes();
+        }
 
-            while (p) {
-                stat->ht_bytes += sizeof(Entry);
-                chain_len ++;
-                p = p->next_;
-            }
+        stat->evictions = evictions_;
 
-            if (chain_len >=1 && chain_len <=2) stat->dist_1_2 ++;
-            else if (chain_len >=3 && chain_len <=5) stat->dist_3_5 ++;
-            else if (chain_len >=6 && chain_len <=9) stat->dist_6_9 ++;
-            else if (chain_len >=10) stat->dist_10_ ++;
+        stat->bytes = stat->ht_bytes + stat->blob_allocated_bytes + stat->filter_bytes;
+    }
 
-            stat->total_chain_len += chain_len;
-            if (chain_len > stat->max_chain_len) stat->max_chain_len = chain_len;
+    // As get_stats(), along with the probe lengths and filter_fpr, which go over the table and the filters.
+    void get_detailed_stats(BuboHashStat* stat) const {
+        get_stats(stat);
+
+        add_probe_stats(stat, ctrl_, hashes_, table_size_, group_mask_);
+        if (old_ctrl_) {
+            add_probe_stats(stat, old_ctrl_, old_hashes_, old_table_size_, old_group_mask_);
         }
 
-        if (stat->collision_slots > 0) {
-            stat->avg_chain_len = (double) stat->total_chain_len/ (double)stat->collision_slots;
+        if (stat->displaced > 0) {
+            stat->avg_probe_len = (double) stat->total_probe_len/ (double)stat->displaced;
         } else {
-            assert(stat->total_chain_len == 0);
+            assert(stat->total_probe_len == 0);
         }
 
-        uint64_t allocated_bytes = 0, used_bytes = 0;
-        blob_store_->stats(&allocated_bytes, &used_bytes);
-        stat->blob_allocated_bytes = allocated_bytes;
-        stat->blob_used_bytes = used_bytes;
-
-        stat->bytes = stat->ht_bytes + stat->blob_allocated_bytes;
+        if (filter_) {
+            stat->filter_fpr = filter_->false_positive_rate();
+        }
+        if (old_filter_) {
+            // A lookup gets past the filters unless both stop it.
+            stat->filter_fpr = 1 - (1 - stat->filter_fpr) * (1 - old_filter_->false_positive_rate());
+        }
     }
 
 protected:
-    struct Entry {
-        const BYTE* val_;
-        Entry* next_;
-        Entry() : val_(NULL), next_(NULL) {}
-        Entry(const BYTE* v, Entry* n) : val_(v), next_(n) {}
+    struct Slot {
+        BlobRef ref_;
     };
 
     uint32_t table_size_;
     uint32_t max_table_size_;
+    uint32_t group_mask_;       // number of groups - 1
 
-    uint64_t table_curr_use_;
-    uint64_t table_collisions_;
     uint64_t num_entries_;
-    Entry* table_;
+    uint64_t num_tombstones_;
+
+    int8_t* ctrl_;
+    uint32_t* hashes_;
+    Slot* slots_;
+
+    // Table being migrated by an incremental resize; old_ctrl_ is NULL when there is none.
+    uint32_t old_table_size_;
+    uint32_t old_group_mask_;
+    int8_t* old_ctrl_;
+    uint32_t* old_hashes_;
+    Slot* old_slots_;
+    uint64_t old_entries_ = 0;  // entries still in the old table
+    uint32_t migrate_pos_;      // next old group to migrate
+    uint32_t resize_step_;      // old groups migrated per operation, 0 for stop-the-world resizing
 
     BlobStore* blob_store_;
 
+    // Set for a mapped table; old_table_file_ goes with old_ctrl_.
+    std::string map_dir_;
+    MappedFile* table_file_ = NULL;
+    MappedFile* old_table_file_ = NULL;
+    uint64_t generation_ = 0;
+    bool dirty_ = false;
+    bool read_only_ = false;
+
+    double compact_ratio_ = DEFAULT_COMPACT_DEAD_RATIO;
+    uint32_t compact_step_ = 0;         // groups scanned by each operation, 0 for no automatic compaction
+    uint32_t compact_pos_ = 0;          // next group to scan
+    uint64_t compact_check_dead_ = 0;   // dead bytes at which to next look for a chunk to compact
+    uint64_t layout_ = 0;               // changes whenever entries may have changed slots
+
+    // Filter of the hashes of the entries, NULL without one; old_filter_ goes with old_ctrl_.
+    BlockedBloomFilter* filter_ = NULL;
+    BlockedBloomFilter* old_filter_ = NULL;
+    uint64_t filter_entries_ = 0;       // expected entries, 0 for no filter
+    uint64_t filter_stale_ = 0;         // entries erased since the filter was last filled
+
+    // Reference bits of the slots, NULL without set_clock(); old_clock_ goes with old_ctrl_.
+    uint64_t* clock_ = NULL;
+    uint64_t* old_clock_ = NULL;
+    uint32_t clock_hand_ = 0;           // next slot evict() looks at
+    uint64_t evictions_ = 0;
+
     H hash;
     E equals;
 
-    void insert_value_into_table_at_index(const BYTE* value, Entry* table, uint32_t index) {
-        if (table[index].val_ == NULL) {
-            // not found, and spine doesn't have an entry.
-            table[index].val_ = value;
-            table[index].next_ = NULL;
-            table_curr_use_ ++;
-        } else {
-            // not found, but spine has an entry. insert new item right next to spine.
-            table[index].next_ = new Entry(value, table[index].next_);
-            table_collisions_ ++;
+    static uint32_t round_table_size(uint32_t size) {
+        uint32_t rounded = GROUP_WIDTH;
+        while (rounded < size) {
+            rounded <<= 1;
         }
-        num_entries_ ++;
+        return rounded;
+    }
+
+    static inline int8_t h2(uint32_t h) {
+        return (int8_t)(h & 0x7F);
+    }
+
+    static inline uint32_t home_group(uint32_t h, uint32_t group_mask) {
+        return (h >> 7) & group_mask;
+    }
+
+    // Returns false if the filters tell that no entry has hash h. True otherwise.
+    inline bool may_contain(uint32_t h) const {
+        return !filter_ || filter_->may_contain(h) || (old_filter_ && old_filter_->may_contain(h));
+    }
+
+    static inline uint32_t clock_words(uint32_t table_size) {
+        return (table_size + 63) / 64;
+    }
+
+    // Bytes of a table of table_size slots, with its reference bits if any.
+    uint64_t table_bytes(uint32_t table_size) const {
+        return (uint64_t)table_size * (sizeof(Slot) + sizeof(uint32_t) + sizeof(int8_t)) +
+               (clock_ ? clock_words(table_size) * sizeof(uint64_t) : 0);
     }
 
     /*
-     * Checks if the val is present in the chain at spine_entry.
-     * Returns true if found.
-     *
-     * Optionally, if valid erase_entry pointer is given, set it to the address of the
-     * previous entry's next pointer (note that this pointer is invalid if it is a spine
-     * entry. Therefore, caller should handle spine case separately).
-     *
-     * The optional boolean pointer is_spine_entry is set if the found value is a spine entry.
+     * Sets the reference bit of slot idx, if clock has any. Lookups running at the same time may
+     * set bits of the same word, hence the atomic operation, only done if the bit is clear.
      */
-    inline bool find_at(Entry* spine_entry, const BYTE* val, int len, Entry*** erase_entry = NULL, bool* is_spine_entry=NULL) {
-        if (is_spine_entry) {
-            *is_spine_entry = false;
+    static inline void touch(uint64_t* clock, uint32_t idx) {
+        if (!clock) {
+            return;
+        }
+        uint64_t bit = 1ULL << (idx & 63);
+        if (!(__atomic_load_n(&clock[idx >> 6], __ATOMIC_RELAXED) & bit)) {
+            __atomic_fetch_or(&clock[idx >> 6], bit, __ATOMIC_RELAXED);
         }
+    }
 
-        bool head_entry = true;
-        Entry** p = &spine_entry;
-        for (; *p; p = &(*p)->next_) {
-            if (equals((*p)->val_, val, len)) {
+    static inline bool touched(const uint64_t* clock, uint32_t idx) {
+        return clock && (clock[idx >> 6] & (1ULL << (idx & 63)));
+    }
 
-                if (erase_entry) {
-                    *erase_entry = p;
-                }
+    // Looks val up in the current table, then in the old one, and sets its reference bit if found.
+    inline bool find_and_touch(const BYTE* val, int len, uint32_t h) const {
+        uint32_t idx = 0;
 
-                if (is_spine_entry && head_entry) {
-                    *is_spine_entry = true;
+        if (!may_contain(h)) {
+            return false;
+        }
+        if (find_index(val, len, h, &idx)) {
+            touch(clock_, idx);
+            return true;
+        }
+        if (old_ctrl_ && find_in(old_ctrl_, old_hashes_, old_slots_, old_group_mask_, val, len, h, &idx)) {
+            touch(old_clock_, idx);
+            return true;
+        }
+        return false;
+    }
+
+    // Erases the entry of slot idx of the current table.
+    inline void erase_slot(uint32_t idx) {
+        // A slot can only go back to empty if no probe sequence runs through its group,
+        // which is the case exactly when the group already has an empty slot.
+        uint32_t base = idx & ~(GROUP_WIDTH - 1);
+        if (BuboCtrlGroup(ctrl_ + base).match_empty()) {
+            ctrl_[idx] = CTRL_EMPTY;
+        } else {
+            ctrl_[idx] = CTRL_DELETED;
+            num_tombstones_ ++;
+        }
+        blob_store_->remove(slots_[idx].ref_);
+        num_entries_ --;
+        filter_stale_ ++;
+    }
+
+    // Entries the filter of a table of table_size slots is sized for.
+    uint64_t filter_capacity(uint32_t table_size) const {
+        uint64_t capacity = (uint64_t)table_size * RESIZE_THRESHOLD_PCT / 100;
+        return capacity > filter_entries_ ? capacity : filter_entries_;
+    }
+
+    /*
+     * Looks up val in the current table. Returns true if found, and sets found_idx to
+     * the index of its slot.
+     */
+    inline bool find_index(const BYTE* val, int len, uint32_t h, uint32_t* found_idx) const {
+        return find_in(ctrl_, hashes_, slots_, group_mask_, val, len, h, found_idx);
+    }
+
+    inline bool find_in(const int8_t* ctrl, const uint32_t* hashes, const Slot* slots, uint32_t group_mask,
+                        const BYTE* val, int len, uint32_t h, uint32_t* found_idx) const {
+        uint32_t group = home_group(h, group_mask);
+        int8_t fp = h2(h);
+
+        for (uint32_t step = 1; step <= group_mask + 1; step++) {
+            uint32_t base = group * GROUP_WIDTH;
+            BuboCtrlGroup g(ctrl + base);
+
+            for (uint32_t m = g.match(fp); m; m &= m - 1) {
+                uint32_t idx = base + __builtin_ctz(m);
+                // A read-only table may be changed by its owner meanwhile, slots included.
+                if (hashes[idx] == h && (!read_only_ || blob_store_->maps(slots[idx].ref_)) &&
+                    equals(blob_store_->record(slots[idx].ref_), val, len)) {
+                    *found_idx = idx;
+                    return true;
                 }
+            }
 
-                return true;
+            if (g.match_empty()) {
+                return false;
             }
-            head_entry = false;
+            group = (group + step) & group_mask;
         }
 
         return false;
     }
 
     /*
-     * Erases the entry pointed to by prev_next, the next_ pointer of the previous chain entry.
-     * Only chain entries to be erased this way.
+     * Puts value into the first empty or deleted slot on its probe sequence, and returns the slot.
+     * The caller makes sure value is not in the table yet, and accounts for the entry.
      */
-    inline void erase_next(Entry** prev_next ) {
-        assert(prev_next && *prev_next);
+    uint32_t insert_value_into_table(BlobRef value, uint32_t h,
+                                     int8_t* ctrl, uint32_t* hashes, Slot* slots, uint32_t group_mask) {
+        uint32_t group = home_group(h, group_mask);
+
+        for (uint32_t step = 1; ; step++) {
+            uint32_t base = group * GROUP_WIDTH;
+            uint32_t m = BuboCtrlGroup(ctrl + base).match_empty_or_deleted();
+            if (m) {
+                uint32_t idx = base + __builtin_ctz(m);
+                if (ctrl[idx] == CTRL_DELETED) {
+                    num_tombstones_ --;
+                }
+                ctrl[idx] = h2(h);
+                hashes[idx] = h;
+                slots[idx].ref_ = value;
+                return idx;
+            }
+            group = (group + step) & group_mask;
+        }
+    }
 
-        Entry* tmp = (*prev_next)->next_;
-        delete (*prev_next);
-        *prev_next = tmp;
+    /* Number of groups probed past the home group of h before reaching group. */
+    static inline uint64_t probe_length(uint32_t h, uint32_t group, uint32_t group_mask) {
+        uint32_t g = home_group(h, group_mask);
+        uint64_t len = 0;
+        for (uint32_t step = 1; g != group; step++) {
+            g = (g + step) & group_mask;
+            len ++;
+        }
+        return len;
+    }
+
+    /* Adds the probe lengths of the entries of one table to stat. Returns the number of entries. */
+    void add_probe_stats(BuboHashStat* stat, const int8_t* ctrl, const uint32_t* hashes,
+                         uint32_t table_size, uint32_t group_mask) const {
+        for (uint32_t idx = 0; idx < table_size; idx++) {
+            if (ctrl[idx] < 0) {
+                continue;
+            }
+
+            uint64_t probe_len = probe_length(hashes[idx], idx / GROUP_WIDTH, group_mask);
+
+            if (probe_len > 0) stat->displaced ++;
+
+            if (probe_len >=1 && probe_len <=2) stat->dist_1_2 ++;
+            else if (probe_len >=3 && probe_len <=5) stat->dist_3_5 ++;
+            else if (probe_len >=6 && probe_len <=9) stat->dist_6_9 ++;
+            else if (probe_len >=10) stat->dist_10_ ++;
+
+            stat->total_probe_len += probe_len;
+            if (probe_len > stat->max_probe_len) stat->max_probe_len = probe_len;
+        }
     }
 
     /*
-     * Erase a spine entry. The head entry may or may not have chains.
-     * Return value of true indicates a delete is performed.
+     * Size of the table that a set of used entries and tombstones needs rehashing to, 0 if the
+     * current table is fine as it is.
      */
-    inline bool erase_spine_entry(Entry* spine_entry) {
-        Entry* p = spine_entry;
-        if (!p->next_) { // no chain
-            p->val_ = NULL;
-            return false;
+    uint32_t resize_target(uint64_t used) const {
+        if (100 * used <= (uint64_t)table_size_ * RESIZE_THRESHOLD_PCT) {
+            return 0;
         }
 
-        // there is chain. swap the first chain entry into spine entry, and delete that entry.
-        Entry* tmp = p->next_;
-        spine_entry->val_ = p->next_->val_;
-        spine_entry->next_ = p->next_->next_;
+        if (num_tombstones_ > num_entries_) {
+            // Mostly erased entries; rehashing in place is enough.
+            return table_size_;
+        } else if (table_size_ < max_table_size_) {
+            return table_size_ * 2;
+        } else if (num_tombstones_ * 16 >= table_size_) {
+            return table_size_;
+        } else if (used * 16 >= (uint64_t)table_size_ * 15) {
+            // Unlike chains, open addressing cannot go beyond one entry per slot.
+            return table_size_ * 2;
+        }
+        return 0;
+    }
 
-        delete tmp;
-        return true;
+    inline void maybe_resize() {
+        uint32_t new_size = resize_target(num_entries_ + num_tombstones_);
+        if (new_size != 0) {
+            rehash(new_size);
+        }
     }
 
+    static size_t table_file_size(uint32_t table_size) {
+        return MAP_HEADER_SIZE + (size_t)table_size * (sizeof(int8_t) + sizeof(uint32_t) + sizeof(Slot));
+    }
 
-    inline void maybe_resize() {
-        if (100 * num_entries_ / table_size_ > RESIZE_THRESHOLD_PCT && table_size_ < max_table_size_) {
-            uint32_t new_size = table_size_ * 2;
-            table_curr_use_ = 0;
-            num_entries_ = 0;
-            table_collisions_ = 0;
+    /*
+     * Allocates the arrays of a table of size slots, all empty, in memory, or for a mapped set,
+     * in a new table file (which replaces the current one, still mapped until freed).
+     */
+    void allocate_table(uint32_t size, MappedFile** file, int8_t** ctrl, uint32_t** hashes, Slot** slots) {
+        if (map_dir_.empty()) {
+            *file = NULL;
+            *ctrl = new int8_t[size];
+            *hashes = new uint32_t[size];
+            *slots = new Slot[size];
+        } else {
+            MappedFile* f = new MappedFile();
+            if (!f->create(map_dir_ + "/table", table_file_size(size))) {
+                delete f;
+                throw std::bad_alloc();
+            }
+            BuboMapHeader* header = (BuboMapHeader*)f->mem();
+            memcpy(header->magic_, MAP_TABLE_MAGIC, sizeof(header->magic_));
+            header->version_ = MAP_TABLE_VERSION;
+            header->table_size_ = size;
+            header->generation_ = generation_;
+            header->dirty_ = 1;
+
+            *file = f;
+            *ctrl = (int8_t*)(f->mem() + MAP_HEADER_SIZE);
+            *hashes = (uint32_t*)(*ctrl + size);
+            *slots = (Slot*)(*hashes + size);
+        }
+        memset(*ctrl, CTRL_EMPTY, size);
+    }
 
-            Entry* new_table = new Entry[new_size]();
+    static void free_table(MappedFile* file, int8_t* ctrl, uint32_t* hashes, Slot* slots) {
+        if (file) {
+            delete file;
+        } else {
+            delete [] ctrl;
+            delete [] hashes;
+            delete [] slots;
+        }
+    }
 
+    /*
+     * The first modification after a sync() or open_mapped() marks the files as out of sync.
+     * Incremental resizes only start in insert(), so the files are marked while one is going on.
+     */
+    inline void mark_dirty() {
+        if (!dirty_ && table_file_) {
+            ((BuboMapHeader*)table_file_->mem())->dirty_ = 1;
+            dirty_ = true;
+        }
+    }
+
+    void rehash(uint32_t new_size) {
+        // A resize can only start once the previous one is done.
+        complete_migration();
+        compact_pos_ = 0;
+
+        uint32_t new_group_mask = new_size / GROUP_WIDTH - 1;
+        MappedFile* new_file = NULL;
+        int8_t* new_ctrl = NULL;
+        uint32_t* new_hashes = NULL;
+        Slot* new_slots = NULL;
+        BlockedBloomFilter* new_filter = filter_ ? new BlockedBloomFilter(filter_capacity(new_size)) : NULL;
+        uint64_t* new_clock = NULL;
+        try {
+            new_clock = clock_ ? new uint64_t[clock_words(new_size)]() : NULL;
+            allocate_table(new_size, &new_file, &new_ctrl, &new_hashes, &new_slots);
+        } catch (std::bad_alloc&) {
+            delete new_filter;
+            delete [] new_clock;
+            throw;
+        }
+        filter_stale_ = 0;
+        clock_hand_ = 0;
+
+        if (resize_step_ > 0) {
+            old_clock_ = clock_;
+            old_filter_ = filter_;
+            old_table_file_ = table_file_;
+            old_ctrl_ = ctrl_;
+            old_hashes_ = hashes_;
+            old_slots_ = slots_;
+            old_table_size_ = table_size_;
+            old_group_mask_ = group_mask_;
+            old_entries_ = num_entries_;
+            migrate_pos_ = 0;
+        } else {
             for (uint32_t idx = 0; idx < table_size_; idx++) {
-                Entry* p = &table_[idx];
-                while (p && p->val_) {
-                    int len = bubo_utils::get_entry_len(p->val_);
-                    uint32_t new_idx = hash(p->val_, len) % new_size;
-                    insert_value_into_table_at_index(p->val_, new_table, new_idx);
-                    p = p->next_;
+                if (ctrl_[idx] < 0) {
+                    continue;
+                }
+                uint32_t new_idx = insert_value_into_table(slots_[idx].ref_, hashes_[idx], new_ctrl, new_hashes, new_slots, new_group_mask);
+                if (new_filter) {
+                    new_filter->add(hashes_[idx]);
+                }
+                if (touched(clock_, idx)) {
+                    touch(new_clock, new_idx);
+                }
+            }
+
+            free_table(table_file_, ctrl_, hashes_, slots_);
+            delete filter_;
+            delete [] clock_;
+        }
+        filter_ = new_filter;
+        clock_ = new_clock;
+
+        table_file_ = new_file;
+        ctrl_ = new_ctrl;
+        hashes_ = new_hashes;
+        slots_ = new_slots;
+        table_size_ = new_size;
+        group_mask_ = new_group_mask;
+        num_tombstones_ = 0;
+        layout_ ++;
+    }
+
+    /*
+     * Lays out the records of the full slots, in slot order, as save() writes them: one after the
+     * other, except that a record that would cross a multiple of the blob size starts at the next
+     * one instead, so that load() can read them back into whole chunks. Calls
+     * fn(rec, size, offset, pad) for every record, pad being the bytes skipped before it.
+     * Returns the length of the layout.
+     */
+    template<typename Fn>
+    uint64_t pack_records(Fn fn) const {
+        uint64_t blob_size = blob_store_->blob_size();
+        uint64_t offset = 0;
+
+        for (uint32_t idx = 0; idx < table_size_; idx++) {
+            if (ctrl_[idx] < 0) {
+                continue;
+            }
+            const BYTE* rec = blob_store_->record(slots_[idx].ref_);
+            size_t size = BlobStore::record_size(rec);
+            size_t pad = 0;
+            if (offset / blob_size != (offset + size - 1) / blob_size) {
+                pad = blob_size - offset % blob_size;
+            }
+            fn(rec, size, offset + pad, pad);
+            offset += pad + size;
+        }
+        return offset;
+    }
+
+    /* Reads the records of a snapshot and points the full slots, checked against the counts, at them. */
+    bool load_records(SnapshotReader* reader, uint64_t num_entries, uint64_t num_tombstones) {
+        uint64_t records_len = 0, full = 0, deleted = 0;
+
+        for (uint32_t idx = 0; idx < table_size_; idx++) {
+            if (ctrl_[idx] == CTRL_DELETED) {
+                deleted ++;
+            } else if (ctrl_[idx] >= 0) {
+                if (ctrl_[idx] != h2(hashes_[idx])) {
+                    return false;
                 }
+                full ++;
+            } else if (ctrl_[idx] != CTRL_EMPTY) {
+                return false;
+            }
+        }
+        if (full != num_entries || deleted != num_tombstones) {
+            return false;
+        }
+
+        if (!reader->read_value(&records_len) || !blob_store_->load(reader, records_len)) {
+            return false;
+        }
+
+        for (uint32_t idx = 0; idx < table_size_; idx++) {
+            if (ctrl_[idx] < 0) {
+                continue;
+            }
+            uint64_t offset = 0;
+            if (!reader->read_value(&offset)) {
+                return false;
+            }
+            if (!blob_store_->ref_at(offset, &slots_[idx].ref_)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    inline void auto_compact() {
+        if (compact_step_ == 0) {
+            return;
+        }
+        if (!blob_store_->compacting()) {
+            // Picking a chunk goes over all of them, so only look again once more bytes are dead.
+            if (blob_store_->dead_bytes() < compact_check_dead_ ||
+                blob_store_->dead_bytes() < compact_ratio_ * blob_store_->blob_size()) {
+                return;
             }
+            compact_check_dead_ = blob_store_->dead_bytes() + blob_store_->blob_size() / 16;
+        }
+        if (!compact(compact_step_)) {
+            return;
+        }
+        compact_check_dead_ = 0;
+    }
+
+    /* Moves the entries of one group of the old table into the current table. */
+    void migrate_group(uint32_t group) {
+        uint32_t base = group * GROUP_WIDTH;
+
+        for (uint32_t m = BuboCtrlGroup(old_ctrl_ + base).match_full(); m; m &= m - 1) {
+            uint32_t idx = base + __builtin_ctz(m);
+            uint32_t new_idx = insert_value_into_table(old_slots_[idx].ref_, old_hashes_[idx], ctrl_, hashes_, slots_, group_mask_);
+            if (filter_) {
+                filter_->add(old_hashes_[idx]);
+            }
+            if (touched(old_clock_, idx)) {
+                touch(clock_, new_idx);
+            }
+            old_ctrl_[idx] = CTRL_DELETED;
+            old_entries_ --;
+        }
+    }
+
+    inline void migrate_step() {
+        if (!old_ctrl_) {
+            return;
+        }
 
-            clear(); //clear() operates on table_
-            Entry* tmp = table_;
-            table_ = new_table;
+        uint32_t end = migrate_pos_ + resize_step_;
+        if (end > old_group_mask_ + 1) {
+            end = old_group_mask_ + 1;
+        }
+        for (; migrate_pos_ < end; migrate_pos_++) {
+            migrate_group(migrate_pos_);
+        }
 
-            delete [] tmp;
+        if (migrate_pos_ > old_group_mask_) {
+            finish_resize();
+        }
+    }
+
+    void complete_migration() {
+        if (!old_ctrl_) {
+            return;
+        }
+        for (; migrate_pos_ <= old_group_mask_; migrate_pos_++) {
+            migrate_group(migrate_pos_);
+        }
+        finish_resize();
+    }
 
-            table_size_ = new_size;
+    /* Drops the old table of an incremental resize, migrated or not. */
+    void finish_resize() {
+        if (old_ctrl_) {
+            free_table(old_table_file_, old_ctrl_, old_hashes_, old_slots_);
         }
+        delete old_filter_;
+        old_filter_ = NULL;
+        delete [] old_clock_;
+        old_clock_ = NULL;
+        old_table_file_ = NULL;
+        old_ctrl_ = NULL;
+        old_hashes_ = NULL;
+        old_slots_ = NULL;
+        old_table_size_ = 0;
+        old_group_mask_ = 0;
+        old_entries_ = 0;
+        migrate_pos_ = 0;
     }
 };
@@ -1,4 +1,5 @@
 #include "bubo-types.h"
+#include "blob-store.h"
 #include "utils.h"
 
 
@@ -6,7 +7,10 @@
 std::size_t CharPtrHash::operator()(const char* b) const {
     int len = strlen(b);
     const unsigned char *p = (const unsigned char*)b;
-    return bubo_utils::hash_byte_sequence(p, len);
+    if (function_ == BUBO_HASH_JENKINS) {
+        return bubo_utils::hash_byte_sequence(p, len);
+    }
+    return bubo_utils::wyhash_byte_sequence(p, len, seed_);
 }
 
 bool CharPtrEqual::operator()(const char* a, const char* b) const {
@@ -15,12 +19,17 @@ bool CharPtrEqual::operator()(const char* a, const char* b) const {
 
 
 uint32_t BytePtrHash::operator()(const BYTE* p, int len) const {
-    return bubo_utils::hash_byte_sequence(p, len);
+    if (function_ == BUBO_HASH_JENKINS) {
+        return bubo_utils::hash_byte_sequence(p, len);
+    }
+    uint64_t h = bubo_utils::wyhash_byte_sequence(p, len, seed_);
+    return (uint32_t)(h ^ (h >> 32));
 }
 
 bool BytePtrEqual::operator()(const BYTE* a, const BYTE* b, int blen) const {
 
-	int alen = bubo_utils::get_entry_len(a);
+    int alen = 0;
+    const BYTE* adata = BlobStore::record_data(a, &alen);
 
-    return (alen == blen) && !memcmp(a, b, alen);
+    return (alen == blen) && !memcmp(adata, b, alen);
 }
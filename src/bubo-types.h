@@ -5,8 +5,18 @@
 
 typedef unsigned char BYTE;
 
+// Hash functions that CharPtrHash and BytePtrHash can be set up with.
+enum BuboHashFunction {
+    BUBO_HASH_JENKINS,      // bubo_utils::hash_byte_sequence, byte at a time and unseeded
+    BUBO_HASH_WYHASH        // bubo_utils::wyhash_byte_sequence
+};
+
 struct CharPtrHash {
+    CharPtrHash(BuboHashFunction function = BUBO_HASH_WYHASH, uint64_t seed = 0) : function_(function), seed_(seed) {}
     std::size_t operator()(const char* b) const;
+
+    BuboHashFunction function_;
+    uint64_t seed_;
 };
 
 struct CharPtrEqual {
@@ -16,9 +26,14 @@ struct CharPtrEqual {
 
 
 struct BytePtrHash {
+    BytePtrHash(BuboHashFunction function = BUBO_HASH_WYHASH, uint64_t seed = 0) : function_(function), seed_(seed) {}
     uint32_t operator()(const BYTE* b, int len) const;
+
+    BuboHashFunction function_;
+    uint64_t seed_;
 };
 
+// Compares a record stored in a BlobStore with a byte sequence of length blen.
 struct BytePtrEqual {
     bool operator()(const BYTE* a, const BYTE* b, int blen) const;
 };
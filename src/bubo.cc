@@ -1,14 +1,23 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <random>
+#include <string>
 
 #include "bubo.h"
 #include "utils.h"
 #include "persistent-string.h"
 #include "test.h"
+#include "bench.h"
+#include "snapshot.h"
 
 
 using namespace v8;
 
-Nan::Persistent<Function> Bubo::constructor;
+thread_local Nan::Persistent<Function> Bubo::constructor;
+thread_local Nan::Persistent<FunctionTemplate> Bubo::constructor_template;
 
 NAN_METHOD(NewInstance) {
 
@@ -35,49 +44,302 @@ NAN_METHOD(Bubo::New)
     info.GetReturnValue().Set(info.This());
 }
 
-Bubo::Bubo()
+Bubo::Bubo() : attrs_table_(NULL), strings_table_(NULL), shared_(NULL), async_lock_(NULL),
+               hash_function_(BUBO_HASH_WYHASH),
+               hash_seed_(0),
+               resize_step_groups_(0),
+               compact_ratio_(DEFAULT_COMPACT_DEAD_RATIO),
+               auto_compact_(false),
+               filter_entries_(0),
+               sketch_(false),
+               sketch_only_(false),
+               sketch_precision_(HLL_DEFAULT_PRECISION),
+               typed_values_(false),
+               num_shards_(1),
+               max_generations_(1),
+               max_bytes_(0),
+               read_only_(false)
 {
 }
 
 Bubo::~Bubo()
 {
+    delete attrs_table_;
+    if (shared_) {
+        SharedSet::detach(shared_);
+    } else {
+        delete strings_table_;
+    }
+    delete async_lock_;
 }
 
 NAN_METHOD(Bubo::Initialize)
 {
-    strings_table_ = new StringsTable();
-    attrs_table_ = new AttributesTable(strings_table_);
+    // Unless a seed is given, every instance hashes differently, so that crafted tags and
+    // values cannot be lined up against the table.
+    std::random_device rd;
+    hash_seed_ = ((uint64_t)rd() << 32) | rd();
+
     if (info[0]->IsUndefined()) {
+        create_tables();
         return;
     }
-
     Local<Object> opts = info[0].As<Object>();
 
+    Local<String> hash = Nan::New("hash").ToLocalChecked();
+    if (Nan::Has(opts, hash).FromJust()) {
+        Local<Value> hash_value = Nan::Get(opts, hash).ToLocalChecked();
+        v8::String::Utf8Value hash_name(hash_value);
+        if (! hash_value->IsString()) {
+            return Nan::ThrowError("hash must be 'wyhash' or 'jenkins'");
+        } else if (! strcmp(*hash_name, "wyhash")) {
+            hash_function_ = BUBO_HASH_WYHASH;
+        } else if (! strcmp(*hash_name, "jenkins")) {
+            hash_function_ = BUBO_HASH_JENKINS;
+        } else {
+            return Nan::ThrowError("hash must be 'wyhash' or 'jenkins'");
+        }
+    }
+
+    Local<String> hashSeed = Nan::New("hashSeed").ToLocalChecked();
+    if (Nan::Has(opts, hashSeed).FromJust()) {
+        Local<Value> seed_value = Nan::Get(opts, hashSeed).ToLocalChecked();
+        if (! seed_value->IsNumber()) {
+            return Nan::ThrowError("hashSeed must be a number");
+        }
+        hash_seed_ = (uint64_t)Nan::To<int64_t>(seed_value).FromJust();
+    }
+
+    Local<String> incrementalResize = Nan::New("incrementalResize").ToLocalChecked();
+    if (Nan::Has(opts, incrementalResize).FromJust()) {
+        Local<Value> incremental_value = Nan::Get(opts, incrementalResize).ToLocalChecked();
+        if (! incremental_value->IsBoolean()) {
+            return Nan::ThrowError("incrementalResize must be a boolean");
+        }
+        if (incremental_value->BooleanValue()) {
+            resize_step_groups_ = DEFAULT_RESIZE_STEP_GROUPS;
+        }
+    }
+
+    Local<String> compactRatio = Nan::New("compactRatio").ToLocalChecked();
+    if (Nan::Has(opts, compactRatio).FromJust()) {
+        Local<Value> ratio_value = Nan::Get(opts, compactRatio).ToLocalChecked();
+        if (! ratio_value->IsNumber() || ! (Nan::To<double>(ratio_value).FromJust() > 0) ||
+            Nan::To<double>(ratio_value).FromJust() > 1) {
+            return Nan::ThrowError("compactRatio must be a number in (0, 1]");
+        }
+        compact_ratio_ = Nan::To<double>(ratio_value).FromJust();
+    }
+
+    Local<String> autoCompact = Nan::New("autoCompact").ToLocalChecked();
+    if (Nan::Has(opts, autoCompact).FromJust()) {
+        Local<Value> auto_value = Nan::Get(opts, autoCompact).ToLocalChecked();
+        if (! auto_value->IsBoolean()) {
+            return Nan::ThrowError("autoCompact must be a boolean");
+        }
+        auto_compact_ = auto_value->BooleanValue();
+    }
+
+    Local<String> bloomFilter = Nan::New("bloomFilter").ToLocalChecked();
+    if (Nan::Has(opts, bloomFilter).FromJust()) {
+        Local<Value> filter_value = Nan::Get(opts, bloomFilter).ToLocalChecked();
+        if (! filter_value->IsNumber() || ! (Nan::To<double>(filter_value).FromJust() >= 1) ||
+            Nan::To<double>(filter_value).FromJust() > MAX_FILTER_ENTRIES) {
+            return Nan::ThrowError("bloomFilter must be a number of entries in [1, 2^32]");
+        }
+        filter_entries_ = Nan::To<int64_t>(filter_value).FromJust();
+    }
+
+    Local<String> sketch = Nan::New("sketch").ToLocalChecked();
+    if (Nan::Has(opts, sketch).FromJust()) {
+        Local<Value> sketch_value = Nan::Get(opts, sketch).ToLocalChecked();
+        if (sketch_value->IsBoolean()) {
+            sketch_ = sketch_value->BooleanValue();
+        } else if (sketch_value->IsString() && strcmp(*v8::String::Utf8Value(sketch_value), "only") == 0) {
+            sketch_ = true;
+            sketch_only_ = true;
+        } else {
+            return Nan::ThrowError("sketch must be a boolean or 'only'");
+        }
+    }
+
+    Local<String> sketchPrecision = Nan::New("sketchPrecision").ToLocalChecked();
+    if (Nan::Has(opts, sketchPrecision).FromJust()) {
+        Local<Value> precision_value = Nan::Get(opts, sketchPrecision).ToLocalChecked();
+        if (!precision_value->IsUint32()) {
+            return Nan::ThrowError("sketchPrecision must be an integer in [4, 16]");
+        }
+        sketch_precision_ = Nan::To<uint32_t>(precision_value).FromJust();
+        if (sketch_precision_ < HLL_MIN_PRECISION || sketch_precision_ > HLL_MAX_PRECISION) {
+            return Nan::ThrowError("sketchPrecision must be an integer in [4, 16]");
+        }
+    }
+
+    Local<String> typedValues = Nan::New("typedValues").ToLocalChecked();
+    if (Nan::Has(opts, typedValues).FromJust()) {
+        Local<Value> typed_value = Nan::Get(opts, typedValues).ToLocalChecked();
+        if (! typed_value->IsBoolean()) {
+            return Nan::ThrowError("typedValues must be a boolean");
+        }
+        typed_values_ = typed_value->BooleanValue();
+    }
+
+    Local<String> shards = Nan::New("shards").ToLocalChecked();
+    if (Nan::Has(opts, shards).FromJust()) {
+        Local<Value> shards_value = Nan::Get(opts, shards).ToLocalChecked();
+        if (! shards_value->IsUint32() || Nan::To<uint32_t>(shards_value).FromJust() < 1 ||
+            Nan::To<uint32_t>(shards_value).FromJust() > MAX_SHARDS) {
+            return Nan::ThrowError("shards must be an integer in [1, 64]");
+        }
+        num_shards_ = Nan::To<uint32_t>(shards_value).FromJust();
+    }
+
+    Local<String> generations = Nan::New("generations").ToLocalChecked();
+    if (Nan::Has(opts, generations).FromJust()) {
+        Local<Value> generations_value = Nan::Get(opts, generations).ToLocalChecked();
+        if (! generations_value->IsUint32() || Nan::To<uint32_t>(generations_value).FromJust() < 2 ||
+            Nan::To<uint32_t>(generations_value).FromJust() > MAX_GENERATIONS) {
+            return Nan::ThrowError("generations must be an integer in [2, 64]");
+        }
+        max_generations_ = Nan::To<uint32_t>(generations_value).FromJust();
+    }
+
+    Local<String> maxBytes = Nan::New("maxBytes").ToLocalChecked();
+    if (Nan::Has(opts, maxBytes).FromJust()) {
+        Local<Value> max_bytes_value = Nan::Get(opts, maxBytes).ToLocalChecked();
+        if (! max_bytes_value->IsNumber() || ! (Nan::To<double>(max_bytes_value).FromJust() >= 1) ||
+            Nan::To<double>(max_bytes_value).FromJust() > (double)(1ULL << 53)) {
+            return Nan::ThrowError("maxBytes must be a number of bytes in [1, 2^53]");
+        }
+        max_bytes_ = Nan::To<int64_t>(max_bytes_value).FromJust();
+    }
+
     Local<String> ignoredAttributes = Nan::New("ignoredAttributes").ToLocalChecked();
-    if (! Nan::Has(opts, ignoredAttributes).FromJust()) {
+    if (Nan::Has(opts, ignoredAttributes).FromJust()) {
+        Local<Value> ignored_value = Nan::Get(opts, ignoredAttributes).ToLocalChecked();
+        if (! ignored_value->IsArray()) {
+            return Nan::ThrowError("ignoredAttributes must be an array");
+        }
+        Local<Array> ignored_array = Nan::To<Object>(ignored_value).ToLocalChecked().As<Array>();
+        for (uint32_t i = 0; i < ignored_array->Length(); ++i) {
+            v8::Local<v8::Value> ignored_value_string = Nan::Get(ignored_array, i).ToLocalChecked();
+            v8::Local<v8::String> ignored_string(ignored_value_string->ToString());
+            v8::String::Utf8Value ignored_utf8_value(ignored_string);
+            std::string ignored_std_str(*ignored_utf8_value);
+
+            ignored_attributes_.push_back(ignored_std_str);
+        }
+    }
+
+    Local<String> mapDir = Nan::New("mapDir").ToLocalChecked();
+    if (Nan::Has(opts, mapDir).FromJust()) {
+        Local<Value> dir_value = Nan::Get(opts, mapDir).ToLocalChecked();
+        if (! dir_value->IsString()) {
+            return Nan::ThrowError("mapDir must be a string");
+        }
+        v8::String::Utf8Value dir(dir_value);
+        map_dir_ = *dir;
+        if (max_generations_ > 1) {
+            return Nan::ThrowError("generations cannot be used with mapDir");
+        }
+    }
+
+    Local<String> shared = Nan::New("shared").ToLocalChecked();
+    if (Nan::Has(opts, shared).FromJust()) {
+        Local<Value> shared_value = Nan::Get(opts, shared).ToLocalChecked();
+        if (! shared_value->IsString()) {
+            return Nan::ThrowError("shared must be a string");
+        }
+        v8::String::Utf8Value name(shared_value);
+        if (! attach_shared(*name)) {
+            return Nan::ThrowError("cannot create files in mapDir");
+        }
         return;
     }
 
-    Local<Value> ignored_value = Nan::Get(opts, ignoredAttributes).ToLocalChecked();
-    if (! ignored_value->IsArray()) {
-        return Nan::ThrowError("ignoredAttributes must be an array");
+    if (! create_tables()) {
+        return Nan::ThrowError("cannot create files in mapDir");
     }
-    Local<Array> ignored_array = Nan::To<Object>(ignored_value).ToLocalChecked().As<Array>();
-    for (uint32_t i = 0; i < ignored_array->Length(); ++i) {
-        v8::Local<v8::Value> ignored_value_string = Nan::Get(ignored_array, i).ToLocalChecked();
-        v8::Local<v8::String> ignored_string(ignored_value_string->ToString());
-        v8::String::Utf8Value ignored_utf8_value(ignored_string);
-        std::string ignored_std_str(*ignored_utf8_value);
+}
 
-        ignored_attributes_.push_back(ignored_std_str);
+bool Bubo::create_tables()
+{
+    delete attrs_table_;
+    delete strings_table_;
+
+    strings_table_ = new StringsTable(CharPtrHash(hash_function_, hash_seed_));
+    attrs_table_ = new AttributesTable(strings_table_, BytePtrHash(hash_function_, hash_seed_), num_shards_);
+    attrs_table_->set_incremental_resize(resize_step_groups_);
+    attrs_table_->set_auto_compact(compact_ratio_, auto_compact_);
+    attrs_table_->set_generations(max_generations_);
+    attrs_table_->set_max_bytes(max_bytes_);
+    attrs_table_->set_filter(filter_entries_);
+    attrs_table_->set_typed_values(typed_values_);
+    if (sketch_) {
+        attrs_table_->set_sketch(sketch_precision_, !sketch_only_);
+    }
+    if (! ignored_attributes_.empty()) {
+        attrs_table_->set_ignored_attributes(&ignored_attributes_);
+    }
+
+    if (! map_dir_.empty()) {
+        if (mkdir(map_dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+        return attrs_table_->set_mapped(map_dir_);
     }
+    return true;
+}
+
+bool Bubo::attach_shared(const std::string& name)
+{
+    shared_ = SharedSet::attach(name, [this]() -> SharedSet* {
+        if (! create_tables()) {
+            return NULL;
+        }
+        SharedSet* set = new SharedSet(strings_table_, attrs_table_);
+        strings_table_ = NULL;
+        attrs_table_ = NULL;
+        set->hash_function_ = hash_function_;
+        set->hash_seed_ = hash_seed_;
+        set->typed_values_ = typed_values_;
+        set->num_shards_ = num_shards_;
+        set->ignored_attributes_ = ignored_attributes_;
+        set->map_dir_ = map_dir_;
+        set->attrs_table_->set_ignored_attributes(set->ignored_attributes_.empty() ? NULL : &set->ignored_attributes_);
+        set->attrs_table_->set_concurrent();
+        return set;
+    });
+    if (! shared_) {
+        return false;
+    }
+
+    // What save() and sync() write depends on these.
+    hash_function_ = shared_->hash_function_;
+    hash_seed_ = shared_->hash_seed_;
+    typed_values_ = shared_->typed_values_;
+    num_shards_ = shared_->num_shards_;
+    ignored_attributes_ = shared_->ignored_attributes_;
+    map_dir_ = shared_->map_dir_;
 
-    attrs_table_->set_ignored_attributes(&ignored_attributes_);
+    delete attrs_table_;
+    strings_table_ = shared_->strings_table_;
+    attrs_table_ = new AttributesTable(shared_->attrs_table_, &shared_->lock_);
+    sketch_ = attrs_table_->has_sketch();
+    sketch_only_ = !attrs_table_->keeps_entries();
+    max_generations_ = attrs_table_->max_generations();
+    max_bytes_ = attrs_table_->max_bytes();
+    return true;
 }
 
 JS_METHOD(Bubo, Add)
 {
     Nan::HandleScope scope;
+
+    if (read_only_) {
+        return Nan::ThrowError("Add: the set is read-only");
+    }
+
     int num_arguments = info.Length();
 
     if (num_arguments < 1) {
@@ -97,20 +359,193 @@ JS_METHOD(Bubo, Add)
         return Nan::ThrowError("point too big");
     }
 
-    static PersistentString attr_str("attr_str");
+    static thread_local PersistentString attr_str("attr_str");
+    static thread_local PersistentString evicted("evicted");
 
     if (should_get_attr_str) {
         Local<Object> result = info[1].As<Object>();
         Nan::Set(result, attr_str, attrs);
+        if (max_bytes_) {
+            Nan::Set(result, evicted, Nan::New<Number>(attrs_table_->last_evicted()));
+        }
     }
 
     info.GetReturnValue().Set(!found);
 }
 
+/*
+ * Adds every point of an array. Returns a Uint8Array with, for each point, 1 if it
+ * was new and 0 if it was already in the set.
+ */
+JS_METHOD(Bubo, AddMany)
+{
+    Nan::HandleScope scope;
+
+    if (read_only_) {
+        return Nan::ThrowError("AddMany: the set is read-only");
+    }
+
+    if (info.Length() < 1 || !info[0]->IsArray()) {
+        return Nan::ThrowError("AddMany: invalid arguments");
+    }
+
+    Local<Array> points = info[0].As<Array>();
+    uint32_t length = points->Length();
+
+    Local<ArrayBuffer> buffer = ArrayBuffer::New(Isolate::GetCurrent(), length);
+    uint8_t* is_new = static_cast<uint8_t*>(buffer->GetContents().Data());
+
+    int error = 0;
+    attrs_table_->add_many(points, is_new, &error);
+    if (error) {
+        return Nan::ThrowError("point too big");
+    }
+
+    info.GetReturnValue().Set(Uint8Array::New(buffer, 0, length));
+}
+
+/*
+ * Runs the batch of an addManyAsync() or containsManyAsync() call, whose points were encoded
+ * on the main thread, on the libuv thread pool. The instance is kept alive until it is done.
+ */
+class BatchWorker : public Nan::AsyncWorker {
+public:
+    BatchWorker(Bubo* bubo, bool add, uint32_t length, Nan::Callback* callback)
+        : Nan::AsyncWorker(callback, "bubo:batch"), bubo_(bubo), add_(add), flags_(length) {
+        SaveToPersistent("bubo", bubo->handle());
+    }
+
+    void Execute() {
+        bubo_->attrs_table_->run_batch(batch_, add_, flags_.data());
+    }
+
+    void WorkComplete() {
+        bubo_->batch_done();
+        Nan::AsyncWorker::WorkComplete();
+    }
+
+    void HandleOKCallback() {
+        Nan::HandleScope scope;
+
+        Local<ArrayBuffer> buffer = ArrayBuffer::New(Isolate::GetCurrent(), flags_.size());
+        if (! flags_.empty()) {
+            memcpy(buffer->GetContents().Data(), flags_.data(), flags_.size());
+        }
+        Local<Value> argv[] = {Nan::Null(), Uint8Array::New(buffer, 0, flags_.size())};
+        callback->Call(2, argv, async_resource);
+    }
+
+    EntryBatch batch_;
+    std::vector<uint8_t> flags_;
+
+private:
+    Bubo* bubo_;
+    bool add_;
+};
+
+void Bubo::queue_batch(NAN_METHOD_ARGS_TYPE info, bool add, const char* name)
+{
+    if (add && read_only_) {
+        return Nan::ThrowError((std::string(name) + ": the set is read-only").c_str());
+    }
+    if (!add && sketch_only_) {
+        return Nan::ThrowError((std::string(name) + ": the set only keeps a sketch").c_str());
+    }
+    if (info.Length() < 2 || !info[0]->IsArray() || !info[1]->IsFunction()) {
+        return Nan::ThrowError((std::string(name) + ": invalid arguments").c_str());
+    }
+
+    // From now on, the set is used from other threads too.
+    if (! lock()) {
+        async_lock_ = new StripedLock();
+        attrs_table_->set_concurrent(async_lock_);
+    }
+
+    Local<Array> points = info[0].As<Array>();
+    Nan::Callback* callback = new Nan::Callback(info[1].As<Function>());
+    BatchWorker* worker = new BatchWorker(this, add, points->Length(), callback);
+
+    int error = 0;
+    attrs_table_->encode_many(points, add, worker->flags_.data(), &error, &worker->batch_);
+    if (error) {
+        delete worker;
+        return Nan::ThrowError("point too big");
+    }
+
+    batch_queue_.push_back(worker);
+    if (batch_queue_.size() == 1) {
+        Nan::AsyncQueueWorker(worker);
+    }
+}
+
+void Bubo::batch_done()
+{
+    batch_queue_.pop_front();
+    if (! batch_queue_.empty()) {
+        Nan::AsyncQueueWorker(batch_queue_.front());
+    }
+}
+
+/*
+ * addManyAsync(points, callback): as addMany, but only reads the points on the calling thread,
+ * and adds them on the libuv thread pool, after the batches queued before on this instance.
+ * callback gets an error or null, and the Uint8Array of is-new flags. index.js turns it into
+ * a Promise.
+ */
+JS_METHOD(Bubo, AddManyAsync)
+{
+    Nan::HandleScope scope;
+    queue_batch(info, true, "AddManyAsync");
+}
+
+// containsManyAsync(points, callback): as addManyAsync, for containsMany.
+JS_METHOD(Bubo, ContainsManyAsync)
+{
+    Nan::HandleScope scope;
+    queue_batch(info, false, "ContainsManyAsync");
+}
+
+/*
+ * Adds rowCount points given as columns, an object with an array of values per key.
+ * Returns a Uint8Array with, for each row, 1 if it was new and 0 otherwise.
+ */
+JS_METHOD(Bubo, AddColumns)
+{
+    Nan::HandleScope scope;
+
+    if (read_only_) {
+        return Nan::ThrowError("AddColumns: the set is read-only");
+    }
+
+    if (info.Length() < 2 || !info[0]->IsObject() || !info[1]->IsNumber()) {
+        return Nan::ThrowError("AddColumns: invalid arguments");
+    }
+
+    Local<Object> columns = info[0].As<Object>();
+    uint32_t row_count = Nan::To<uint32_t>(info[1]).FromJust();
+
+    Local<ArrayBuffer> buffer = ArrayBuffer::New(Isolate::GetCurrent(), row_count);
+    uint8_t* is_new = static_cast<uint8_t*>(buffer->GetContents().Data());
+
+    int error = 0;
+    attrs_table_->add_columns(columns, row_count, is_new, &error);
+    if (error == ATTRS_ERR_BAD_COLUMN) {
+        return Nan::ThrowError("columns must be arrays");
+    } else if (error) {
+        return Nan::ThrowError("point too big");
+    }
+
+    info.GetReturnValue().Set(Uint8Array::New(buffer, 0, row_count));
+}
+
 JS_METHOD(Bubo, Contains)
 {
     Nan::HandleScope scope;
 
+    if (sketch_only_) {
+        return Nan::ThrowError("Contains: the set only keeps a sketch");
+    }
+
     if (info.Length() < 1) {
         return Nan::ThrowError("Contains: invalid arguments");
     }
@@ -127,11 +562,81 @@ JS_METHOD(Bubo, Contains)
     info.GetReturnValue().Set(found);
 }
 
+/*
+ * Looks up every point of an array. Returns a Uint8Array with, for each point, 1 if it
+ * is in the set and 0 otherwise.
+ */
+JS_METHOD(Bubo, ContainsMany)
+{
+    Nan::HandleScope scope;
+
+    if (sketch_only_) {
+        return Nan::ThrowError("ContainsMany: the set only keeps a sketch");
+    }
+
+    if (info.Length() < 1 || !info[0]->IsArray()) {
+        return Nan::ThrowError("ContainsMany: invalid arguments");
+    }
+
+    Local<Array> points = info[0].As<Array>();
+    uint32_t length = points->Length();
+
+    Local<ArrayBuffer> buffer = ArrayBuffer::New(Isolate::GetCurrent(), length);
+    uint8_t* is_present = static_cast<uint8_t*>(buffer->GetContents().Data());
+
+    int error = 0;
+    attrs_table_->contains_many(points, is_present, &error);
+    if (error) {
+        return Nan::ThrowError("point too big");
+    }
+
+    info.GetReturnValue().Set(Uint8Array::New(buffer, 0, length));
+}
+
+/*
+ * Looks up rowCount points given as columns. Returns a Uint8Array with, for each row,
+ * 1 if it is in the set and 0 otherwise.
+ */
+JS_METHOD(Bubo, ContainsColumns)
+{
+    Nan::HandleScope scope;
+
+    if (sketch_only_) {
+        return Nan::ThrowError("ContainsColumns: the set only keeps a sketch");
+    }
+
+    if (info.Length() < 2 || !info[0]->IsObject() || !info[1]->IsNumber()) {
+        return Nan::ThrowError("ContainsColumns: invalid arguments");
+    }
+
+    Local<Object> columns = info[0].As<Object>();
+    uint32_t row_count = Nan::To<uint32_t>(info[1]).FromJust();
+
+    Local<ArrayBuffer> buffer = ArrayBuffer::New(Isolate::GetCurrent(), row_count);
+    uint8_t* is_present = static_cast<uint8_t*>(buffer->GetContents().Data());
+
+    int error = 0;
+    attrs_table_->contains_columns(columns, row_count, is_present, &error);
+    if (error == ATTRS_ERR_BAD_COLUMN) {
+        return Nan::ThrowError("columns must be arrays");
+    } else if (error) {
+        return Nan::ThrowError("point too big");
+    }
+
+    info.GetReturnValue().Set(Uint8Array::New(buffer, 0, row_count));
+}
 
 JS_METHOD(Bubo, Delete)
 {
     Nan::HandleScope scope;
 
+    if (read_only_) {
+        return Nan::ThrowError("Delete: the set is read-only");
+    }
+    if (sketch_only_) {
+        return Nan::ThrowError("Delete: the set only keeps a sketch");
+    }
+
     if (info.Length() < 1) {
         return Nan::ThrowError("Delete: invalid arguments");
     }
@@ -143,6 +648,336 @@ JS_METHOD(Bubo, Delete)
     return;
 }
 
+/*
+ * readEntries(cursor[, maxEntries[, asStrings]]): returns an array of the next objects of the
+ * set, up to maxEntries (1024 by default) of them, and an empty one past the last. cursor is an
+ * object, {} to start with, that keeps where the reading is at between calls. With asStrings, the
+ * objects come as their 'key1=value1,key2=value2' strings, built natively. Throws if the set was
+ * resized since the previous call. index.js builds entries(), forEach() and stream() on it.
+ */
+JS_METHOD(Bubo, ReadEntries)
+{
+    Nan::HandleScope scope;
+
+    if (sketch_only_) {
+        return Nan::ThrowError("ReadEntries: the set only keeps a sketch");
+    }
+
+    if (info.Length() < 1 || !info[0]->IsObject() ||
+        (info.Length() >= 2 && !info[1]->IsUndefined() && (!info[1]->IsUint32() || Nan::To<uint32_t>(info[1]).FromJust() < 1))) {
+        return Nan::ThrowError("ReadEntries: invalid arguments");
+    }
+    Local<Object> cursor_obj = info[0].As<Object>();
+    uint32_t max_entries = DEFAULT_READ_ENTRIES;
+    if (info.Length() >= 2 && !info[1]->IsUndefined()) {
+        max_entries = Nan::To<uint32_t>(info[1]).FromJust();
+    }
+    bool as_strings = info.Length() >= 3 && info[2]->BooleanValue();
+
+    static thread_local PersistentString generation_str("generation");
+    static thread_local PersistentString shard_str("shard");
+    static thread_local PersistentString pos_str("pos");
+    static thread_local PersistentString layout_str("layout");
+
+    ScanCursor cursor;
+    Local<Value> layout = Nan::Get(cursor_obj, layout_str).ToLocalChecked();
+    if (layout->IsNumber()) {
+        double generation = Nan::To<double>(Nan::Get(cursor_obj, generation_str).ToLocalChecked()).FromJust();
+        if (!(generation >= 0 && generation <= (double)(1ULL << 53))) {
+            return Nan::ThrowError("ReadEntries: invalid arguments");
+        }
+        cursor.generation_ = (uint64_t)generation;
+        cursor.shard_ = Nan::To<uint32_t>(Nan::Get(cursor_obj, shard_str).ToLocalChecked()).FromJust();
+        cursor.pos_ = Nan::To<uint32_t>(Nan::Get(cursor_obj, pos_str).ToLocalChecked()).FromJust();
+        cursor.layout_ = (uint64_t)Nan::To<double>(layout).FromJust();
+    }
+
+    Local<Array> points = Nan::New<Array>();
+    ScanResult result = attrs_table_->read_entries(&cursor, max_entries, points, as_strings);
+    if (result == SCAN_INVALID) {
+        return Nan::ThrowError("ReadEntries: invalid arguments");
+    }
+    if (result == SCAN_STALE) {
+        return Nan::ThrowError("the set was resized while reading its entries");
+    }
+
+    Nan::Set(cursor_obj, generation_str, Nan::New<Number>((double)cursor.generation_));
+    Nan::Set(cursor_obj, shard_str, Nan::New<Number>(cursor.shard_));
+    Nan::Set(cursor_obj, pos_str, Nan::New<Number>(cursor.pos_));
+    Nan::Set(cursor_obj, layout_str, Nan::New<Number>((double)cursor.layout_));
+    info.GetReturnValue().Set(points);
+}
+
+JS_METHOD(Bubo, Compact)
+{
+    Nan::HandleScope scope;
+
+    if (read_only_) {
+        return Nan::ThrowError("Compact: the set is read-only");
+    }
+
+    uint32_t step_groups = DEFAULT_COMPACT_CALL_GROUPS;
+    if (info.Length() >= 1 && !info[0]->IsUndefined()) {
+        if (!info[0]->IsNumber() || Nan::To<int64_t>(info[0]).FromJust() < 1) {
+            return Nan::ThrowError("Compact: invalid arguments");
+        }
+        step_groups = Nan::To<uint32_t>(info[0]).FromJust();
+    }
+
+    info.GetReturnValue().Set(attrs_table_->compact(step_groups));
+}
+
+// Fills the filter of the set anew, without the entries deleted since it was last filled.
+JS_METHOD(Bubo, RebuildFilter)
+{
+    Nan::HandleScope scope;
+
+    attrs_table_->rebuild_filter();
+}
+
+/*
+ * cardinality(): for a set with a sketch, the estimated number of distinct objects added to it
+ * (or to the sets whose sketches were merged into it), deleted or not. Otherwise, the number of
+ * objects in the set.
+ */
+JS_METHOD(Bubo, Cardinality)
+{
+    Nan::HandleScope scope;
+
+    info.GetReturnValue().Set(Nan::New<Number>(attrs_table_->cardinality()));
+}
+
+// sketch(): the sketch of the set, serialized into a Buffer, for mergeSketch().
+JS_METHOD(Bubo, Sketch)
+{
+    Nan::HandleScope scope;
+
+    if (!attrs_table_->has_sketch()) {
+        return Nan::ThrowError("Sketch: the set has no sketch");
+    }
+
+    std::string data;
+    {
+        SharedGuard guard(lock());
+        attrs_table_->serialize_sketch(&data);
+    }
+    info.GetReturnValue().Set(Nan::CopyBuffer(data.data(), data.size()).ToLocalChecked());
+}
+
+/*
+ * mergeSketch(buffer): merges a sketch from sketch() into that of the set, whose cardinality()
+ * then estimates the number of distinct objects of both. The sketches must have the same
+ * precision, and come from sets with the same typedValues.
+ */
+JS_METHOD(Bubo, MergeSketch)
+{
+    Nan::HandleScope scope;
+
+    if (read_only_) {
+        return Nan::ThrowError("MergeSketch: the set is read-only");
+    }
+    if (!attrs_table_->has_sketch()) {
+        return Nan::ThrowError("MergeSketch: the set has no sketch");
+    }
+    if (info.Length() < 1 || !node::Buffer::HasInstance(info[0])) {
+        return Nan::ThrowError("MergeSketch: invalid arguments");
+    }
+
+    SharedGuard guard(lock());
+    if (!attrs_table_->merge_sketch((const BYTE*)node::Buffer::Data(info[0]), node::Buffer::Length(info[0]))) {
+        return Nan::ThrowError("MergeSketch: not a sketch of the same precision and typedValues");
+    }
+}
+
+/*
+ * rotate(): for a set created with generations, starts a new generation, and drops the oldest
+ * one if that makes more than generations, with the objects not added again since it was the
+ * current one. Returns the number of objects dropped.
+ */
+JS_METHOD(Bubo, Rotate)
+{
+    Nan::HandleScope scope;
+
+    if (read_only_) {
+        return Nan::ThrowError("Rotate: the set is read-only");
+    }
+    if (max_generations_ == 1) {
+        return Nan::ThrowError("Rotate: the set has no generations");
+    }
+
+    info.GetReturnValue().Set(Nan::New<Number>(attrs_table_->rotate()));
+}
+
+/*
+ * Writes the set to a snapshot file. The file is written next to path and renamed over it once
+ * complete, so that path always holds a whole snapshot.
+ */
+JS_METHOD(Bubo, Save)
+{
+    Nan::HandleScope scope;
+
+    if (info.Length() < 1 || !info[0]->IsString()) {
+        return Nan::ThrowError("Save: invalid arguments");
+    }
+    if (sketch_only_) {
+        return Nan::ThrowError("Save: the set only keeps a sketch");
+    }
+    // A snapshot holds a single generation.
+    if (max_generations_ > 1) {
+        return Nan::ThrowError("Save: the set has generations");
+    }
+    v8::String::Utf8Value path(info[0]);
+
+    // Saving completes any incremental resize, which is a change to the set.
+    ExclusiveGuard guard(lock());
+    if (!write_snapshot(*path, false)) {
+        return Nan::ThrowError("cannot write snapshot");
+    }
+}
+
+/*
+ * Writes a set created with mapDir back to its files, and the rest of it (the settings and the
+ * strings table) to a snapshot in the same directory, for Bubo.open() to map it again.
+ */
+JS_METHOD(Bubo, Sync)
+{
+    Nan::HandleScope scope;
+
+    if (map_dir_.empty()) {
+        return Nan::ThrowError("Sync: the set is not mapped");
+    }
+    if (read_only_) {
+        return Nan::ThrowError("Sync: the set is read-only");
+    }
+    if (sketch_only_) {
+        return Nan::ThrowError("Sync: the set only keeps a sketch");
+    }
+    ExclusiveGuard guard(lock());
+    if (!write_snapshot(map_dir_ + "/" + MAP_SNAPSHOT_NAME, true)) {
+        return Nan::ThrowError("cannot sync mapped files");
+    }
+}
+
+/*
+ * A snapshot is a header with the settings that shape the entries, then the strings table and
+ * the attributes table (see their save() methods), or for a mapped set, what their sync() writes.
+ */
+bool Bubo::write_snapshot(const std::string& path, bool mapped)
+{
+    std::string tmp_path = path + ".tmp";
+
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+
+    SnapshotWriter writer(file);
+    const char* magic = mapped ? SNAPSHOT_MAP_MAGIC : SNAPSHOT_MAGIC;
+    writer.write(magic, strlen(magic));
+    writer.write_value((uint32_t)SNAPSHOT_VERSION);
+    writer.write_value((uint32_t)hash_function_);
+    writer.write_value(hash_seed_);
+    writer.write_value((uint8_t)typed_values_);
+    writer.write_value(num_shards_);
+    writer.write_value((uint32_t)ignored_attributes_.size());
+    for (size_t i = 0; i < ignored_attributes_.size(); i++) {
+        writer.write_string(ignored_attributes_[i].c_str());
+    }
+    strings_table_->save(&writer);
+
+    bool ok = true;
+    if (mapped) {
+        ok = attrs_table_->sync(&writer);
+    } else {
+        attrs_table_->save(&writer);
+    }
+
+    ok = writer.finish() && ok;
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+const char* Bubo::restore(const std::string& path, const std::string& map_dir, bool read_only)
+{
+    // The sketch of a snapshot is made anew from its entries, which a sketch alone would not keep.
+    if (sketch_only_) {
+        return "a set that only keeps a sketch cannot be loaded";
+    }
+    if (max_generations_ > 1 && !map_dir.empty()) {
+        return "generations cannot be used with mapDir";
+    }
+
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return "cannot open snapshot";
+    }
+
+    SnapshotReader reader(file);
+    const char* error = NULL;
+    const char* expected_magic = map_dir.empty() ? SNAPSHOT_MAGIC : SNAPSHOT_MAP_MAGIC;
+    char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+    uint32_t version = 0, hash_function = 0, num_ignored = 0, num_shards = 1;
+    uint8_t typed_values = 0;
+
+    if (!reader.read(magic, sizeof(magic)) || memcmp(magic, expected_magic, sizeof(magic)) != 0) {
+        error = "not a bubo snapshot";
+    } else if (!reader.read_value(&version) || (version != 1 && version != SNAPSHOT_VERSION)) {
+        error = "unsupported snapshot version";
+    } else if (!reader.read_value(&hash_function) || !reader.read_value(&hash_seed_) ||
+               !reader.read_value(&typed_values) ||
+               // Version 1 snapshots predate shards, and hold a single one.
+               (version > 1 && !reader.read_value(&num_shards)) || !reader.read_value(&num_ignored) ||
+               (hash_function != BUBO_HASH_JENKINS && hash_function != BUBO_HASH_WYHASH) ||
+               num_shards < 1 || num_shards > MAX_SHARDS) {
+        error = "snapshot is corrupt";
+    }
+
+    ignored_attributes_.clear();
+    for (uint32_t i = 0; !error && i < num_ignored; i++) {
+        char* ignored = reader.read_string();
+        if (!ignored) {
+            error = "snapshot is corrupt";
+            break;
+        }
+        ignored_attributes_.push_back(ignored);
+        free(ignored);
+    }
+
+    if (!error) {
+        hash_function_ = (BuboHashFunction)hash_function;
+        typed_values_ = typed_values != 0;
+        num_shards_ = num_shards;
+        if (!map_dir.empty()) {
+            // Maps the existing files below, rather than have create_tables() make new ones.
+            map_dir_.clear();
+        }
+        if (!create_tables()) {
+            error = "cannot create files in mapDir";
+        } else if (!strings_table_->load(&reader)) {
+            error = "snapshot is corrupt";
+        } else if (!map_dir.empty() && !attrs_table_->open_mapped(map_dir, &reader, read_only)) {
+            error = "mapped files do not match their last sync";
+        } else if (map_dir.empty() && !attrs_table_->load(&reader)) {
+            error = "snapshot is corrupt";
+        } else if (!reader.finish()) {
+            error = "snapshot checksum mismatch";
+        }
+    }
+    if (!error && !map_dir.empty()) {
+        map_dir_ = map_dir;
+        read_only_ = read_only;
+    }
+
+    fclose(file);
+    return error;
+}
+
 JS_METHOD(Bubo, Test)
 {
     Nan::HandleScope scope;
@@ -152,28 +987,266 @@ JS_METHOD(Bubo, Test)
     return;
 }
 
-JS_METHOD(Bubo, Stats)
+JS_METHOD(Bubo, Bench)
 {
     Nan::HandleScope scope;
 
     if (info.Length() < 1) {
-        return Nan::ThrowError("Stats: invalid arguments");
+        return Nan::ThrowError("Bench: invalid arguments");
+    }
+
+    Local<Object> results = info[0].As<Object>();
+    int num_entries = 1000000;
+    if (info.Length() >= 2 && info[1]->IsNumber()) {
+        num_entries = Nan::To<int32_t>(info[1]).FromJust();
+    }
+
+    benchall(results, num_entries);
+
+    return;
+}
+
+void Bubo::write_stats(NAN_METHOD_ARGS_TYPE info, bool detailed, const char* name)
+{
+    if (info.Length() < 1) {
+        return Nan::ThrowError((std::string(name) + ": invalid arguments").c_str());
     }
 
     Local<Object> stats = info[0].As<Object>();
-    static PersistentString strings_table("strings_table");
+    // stats() only reads counters, those of the shards with their own locks held shared, so it
+    // runs alongside a batch of another thread; detailedStats() goes over the tables.
+    SharedGuard shared_guard(detailed ? NULL : lock());
+    ExclusiveGuard exclusive_guard(detailed ? lock() : NULL);
+    static thread_local PersistentString strings_table("strings_table");
 
     v8::Local<v8::Object> strings_stats = Nan::New<v8::Object>();
-    strings_table_->stats(strings_stats);
+    strings_table_->stats(strings_stats, detailed);
     Nan::Set(stats, strings_table, strings_stats);
 
-    static PersistentString attrs_table("attrs_table");
+    static thread_local PersistentString attrs_table("attrs_table");
 
     v8::Local<v8::Object> attr_stats = Nan::New<v8::Object>();
-    attrs_table_->stats(attr_stats);
+    attrs_table_->stats(attr_stats, detailed);
     Nan::Set(stats, attrs_table, attr_stats);
+}
 
-    return;
+/*
+ * stats(result): sets the stats of the set on result, from counters, in a time that does not
+ * depend on its size.
+ */
+JS_METHOD(Bubo, Stats)
+{
+    Nan::HandleScope scope;
+    write_stats(info, false, "Stats");
+}
+
+/*
+ * detailedStats(result): as stats(), along with the probe lengths of the hash tables, the false
+ * positive rate of the filters and the number of values of every key, which go over the tables,
+ * the filters and the keys.
+ */
+JS_METHOD(Bubo, DetailedStats)
+{
+    Nan::HandleScope scope;
+    write_stats(info, true, "DetailedStats");
+}
+
+/*
+ * Bubo.load(path[, options]): creates a set from a snapshot written by save(). The hash, seed,
+ * typed values, ignored attributes and shards come from the snapshot; the other options apply as given.
+ */
+NAN_METHOD(Bubo::Load)
+{
+    if (info.Length() < 1 || !info[0]->IsString()) {
+        return Nan::ThrowError("Load: invalid arguments");
+    }
+    if (info[1]->IsObject() && Nan::Has(info[1].As<Object>(), Nan::New("shared").ToLocalChecked()).FromJust()) {
+        return Nan::ThrowError("Load: a shared set cannot be loaded");
+    }
+    v8::String::Utf8Value path(info[0]);
+
+    const unsigned argc = 1;
+    Local<Value> argv[argc] = {info[1]};
+    Local<Function> cons = Nan::New<Function>(Bubo::constructor);
+    Nan::MaybeLocal<Object> instance = Nan::NewInstance(cons, argc, argv);
+    if (instance.IsEmpty()) {
+        return;
+    }
+
+    Bubo* obj = Nan::ObjectWrap::Unwrap<Bubo>(instance.ToLocalChecked());
+    const char* error = obj->restore(*path, "", false);
+    if (error) {
+        return Nan::ThrowError(error);
+    }
+    info.GetReturnValue().Set(instance.ToLocalChecked());
+}
+
+/*
+ * Bubo.open(dir[, options]): maps the files of a set created with mapDir again, as of its last
+ * sync(). options.readOnly maps them read-only, for contains() only; the settings come from the
+ * files as for load(), and mapDir may not be given.
+ */
+NAN_METHOD(Bubo::Open)
+{
+    if (info.Length() < 1 || !info[0]->IsString()) {
+        return Nan::ThrowError("Open: invalid arguments");
+    }
+    v8::String::Utf8Value dir(info[0]);
+
+    bool read_only = false;
+    if (info[1]->IsObject()) {
+        Local<Object> opts = info[1].As<Object>();
+        if (Nan::Has(opts, Nan::New("mapDir").ToLocalChecked()).FromJust()) {
+            return Nan::ThrowError("Open: mapDir is the directory opened");
+        }
+        if (Nan::Has(opts, Nan::New("shared").ToLocalChecked()).FromJust()) {
+            return Nan::ThrowError("Open: a shared set cannot be opened");
+        }
+        Local<String> readOnly = Nan::New("readOnly").ToLocalChecked();
+        if (Nan::Has(opts, readOnly).FromJust()) {
+            Local<Value> read_only_value = Nan::Get(opts, readOnly).ToLocalChecked();
+            if (! read_only_value->IsBoolean()) {
+                return Nan::ThrowError("readOnly must be a boolean");
+            }
+            read_only = read_only_value->BooleanValue();
+        }
+    }
+
+    const unsigned argc = 1;
+    Local<Value> argv[argc] = {info[1]};
+    Local<Function> cons = Nan::New<Function>(Bubo::constructor);
+    Nan::MaybeLocal<Object> instance = Nan::NewInstance(cons, argc, argv);
+    if (instance.IsEmpty()) {
+        return;
+    }
+
+    Bubo* obj = Nan::ObjectWrap::Unwrap<Bubo>(instance.ToLocalChecked());
+    const char* error = obj->restore(std::string(*dir) + "/" + MAP_SNAPSHOT_NAME, *dir, read_only);
+    if (error) {
+        return Nan::ThrowError(error);
+    }
+    info.GetReturnValue().Set(instance.ToLocalChecked());
+}
+
+bool Bubo::unwrap_sets(NAN_METHOD_ARGS_TYPE info, const char* name, Bubo** a, Bubo** b)
+{
+    Local<FunctionTemplate> tpl = Nan::New(constructor_template);
+    if (info.Length() < 2 || !tpl->HasInstance(info[0]) || !tpl->HasInstance(info[1])) {
+        Nan::ThrowError((std::string(name) + ": invalid arguments").c_str());
+        return false;
+    }
+    *a = Nan::ObjectWrap::Unwrap<Bubo>(info[0].As<Object>());
+    *b = Nan::ObjectWrap::Unwrap<Bubo>(info[1].As<Object>());
+
+    // Typed values are encoded differently, and cannot be translated from one set to the other.
+    if ((*a)->typed_values_ != (*b)->typed_values_) {
+        Nan::ThrowError((std::string(name) + ": the sets must both have typedValues or neither").c_str());
+        return false;
+    }
+    if ((*a)->sketch_only_ || (*b)->sketch_only_) {
+        Nan::ThrowError((std::string(name) + ": the set only keeps a sketch").c_str());
+        return false;
+    }
+    return true;
+}
+
+void Bubo::combine(NAN_METHOD_ARGS_TYPE info, SetOp op, const char* name)
+{
+    Bubo* a = NULL;
+    Bubo* b = NULL;
+    if (!unwrap_sets(info, name, &a, &b)) {
+        return;
+    }
+
+    Local<Function> cons = Nan::New<Function>(Bubo::constructor);
+    Nan::MaybeLocal<Object> instance = Nan::NewInstance(cons, 0, NULL);
+    if (instance.IsEmpty()) {
+        return;
+    }
+
+    // The settings of a, but neither mapped nor shared, and without generations or a cap, which
+    // would drop or evict objects of the result as it is filled.
+    Bubo* obj = Nan::ObjectWrap::Unwrap<Bubo>(instance.ToLocalChecked());
+    obj->hash_function_ = a->hash_function_;
+    obj->hash_seed_ = a->hash_seed_;
+    obj->resize_step_groups_ = a->resize_step_groups_;
+    obj->compact_ratio_ = a->compact_ratio_;
+    obj->auto_compact_ = a->auto_compact_;
+    obj->filter_entries_ = a->filter_entries_;
+    obj->sketch_ = a->sketch_;
+    obj->sketch_precision_ = a->sketch_precision_;
+    obj->typed_values_ = a->typed_values_;
+    obj->num_shards_ = a->num_shards_;
+    obj->ignored_attributes_ = a->ignored_attributes_;
+    if (!obj->create_tables()) {
+        return Nan::ThrowError((std::string(name) + ": cannot create the set").c_str());
+    }
+
+    if (!combine_sets(a->attrs_table_, b->attrs_table_, op, obj->attrs_table_)) {
+        return Nan::ThrowError("the set was resized while reading its entries");
+    }
+    info.GetReturnValue().Set(instance.ToLocalChecked());
+}
+
+/*
+ * Bubo.union(a, b), Bubo.intersect(a, b) and Bubo.difference(a, b): return a new set of the
+ * objects of a or b (resp. of both, of a but not b), computed on the entries of the sets, with
+ * the settings of a.
+ */
+NAN_METHOD(Bubo::Union)
+{
+    combine(info, SET_UNION, "Union");
+}
+
+NAN_METHOD(Bubo::Intersect)
+{
+    combine(info, SET_INTERSECTION, "Intersect");
+}
+
+NAN_METHOD(Bubo::Difference)
+{
+    combine(info, SET_DIFFERENCE, "Difference");
+}
+
+// Bubo.intersectionSize(a, b): the number of objects of both a and b.
+NAN_METHOD(Bubo::IntersectionSize)
+{
+    Bubo* a = NULL;
+    Bubo* b = NULL;
+    if (!unwrap_sets(info, "IntersectionSize", &a, &b)) {
+        return;
+    }
+
+    // The smaller set is the one read.
+    if (b->attrs_table_->size() < a->attrs_table_->size()) {
+        std::swap(a, b);
+    }
+    uint64_t count = 0;
+    bool missing = false;
+    if (!count_common(a->attrs_table_, b->attrs_table_, false, &count, &missing)) {
+        return Nan::ThrowError("the set was resized while reading its entries");
+    }
+    info.GetReturnValue().Set(Nan::New<Number>((double)count));
+}
+
+// Bubo.isSubset(a, b): whether every object of a is in b.
+NAN_METHOD(Bubo::IsSubset)
+{
+    Bubo* a = NULL;
+    Bubo* b = NULL;
+    if (!unwrap_sets(info, "IsSubset", &a, &b)) {
+        return;
+    }
+
+    if (a->attrs_table_->size() > b->attrs_table_->size()) {
+        return info.GetReturnValue().Set(false);
+    }
+    uint64_t count = 0;
+    bool missing = false;
+    if (!count_common(a->attrs_table_, b->attrs_table_, true, &count, &missing)) {
+        return Nan::ThrowError("the set was resized while reading its entries");
+    }
+    info.GetReturnValue().Set(!missing);
 }
 
 void
@@ -188,15 +1261,50 @@ Bubo::Init(Handle<Object> exports)
 
     // Prototype
     Nan::SetPrototypeMethod(tpl, "add", JS_METHOD_NAME(Add));
+    Nan::SetPrototypeMethod(tpl, "addMany", JS_METHOD_NAME(AddMany));
+    Nan::SetPrototypeMethod(tpl, "addColumns", JS_METHOD_NAME(AddColumns));
     Nan::SetPrototypeMethod(tpl, "contains", JS_METHOD_NAME(Contains));
+    Nan::SetPrototypeMethod(tpl, "containsMany", JS_METHOD_NAME(ContainsMany));
+    Nan::SetPrototypeMethod(tpl, "addManyAsync", JS_METHOD_NAME(AddManyAsync));
+    Nan::SetPrototypeMethod(tpl, "containsManyAsync", JS_METHOD_NAME(ContainsManyAsync));
+    Nan::SetPrototypeMethod(tpl, "containsColumns", JS_METHOD_NAME(ContainsColumns));
     Nan::SetPrototypeMethod(tpl, "delete", JS_METHOD_NAME(Delete));
+    Nan::SetPrototypeMethod(tpl, "readEntries", JS_METHOD_NAME(ReadEntries));
+    Nan::SetPrototypeMethod(tpl, "compact", JS_METHOD_NAME(Compact));
+    Nan::SetPrototypeMethod(tpl, "rebuildFilter", JS_METHOD_NAME(RebuildFilter));
+    Nan::SetPrototypeMethod(tpl, "cardinality", JS_METHOD_NAME(Cardinality));
+    Nan::SetPrototypeMethod(tpl, "sketch", JS_METHOD_NAME(Sketch));
+    Nan::SetPrototypeMethod(tpl, "mergeSketch", JS_METHOD_NAME(MergeSketch));
+    Nan::SetPrototypeMethod(tpl, "rotate", JS_METHOD_NAME(Rotate));
+    Nan::SetPrototypeMethod(tpl, "save", JS_METHOD_NAME(Save));
+    Nan::SetPrototypeMethod(tpl, "sync", JS_METHOD_NAME(Sync));
     Nan::SetPrototypeMethod(tpl, "test", JS_METHOD_NAME(Test));
+    Nan::SetPrototypeMethod(tpl, "bench", JS_METHOD_NAME(Bench));
     Nan::SetPrototypeMethod(tpl, "stats", JS_METHOD_NAME(Stats));
+    Nan::SetPrototypeMethod(tpl, "detailedStats", JS_METHOD_NAME(DetailedStats));
 
     constructor.Reset(tpl->GetFunction());
+    constructor_template.Reset(tpl);
 
-    Nan::Set(exports, Nan::New("Bubo").ToLocalChecked(),
-        Nan::GetFunction(Nan::New<FunctionTemplate>(NewInstance)).ToLocalChecked());
+    Local<Function> new_instance = Nan::GetFunction(Nan::New<FunctionTemplate>(NewInstance)).ToLocalChecked();
+    Nan::Set(new_instance, Nan::New("load").ToLocalChecked(),
+        Nan::GetFunction(Nan::New<FunctionTemplate>(Bubo::Load)).ToLocalChecked());
+    Nan::Set(new_instance, Nan::New("open").ToLocalChecked(),
+        Nan::GetFunction(Nan::New<FunctionTemplate>(Bubo::Open)).ToLocalChecked());
+    Nan::Set(new_instance, Nan::New("union").ToLocalChecked(),
+        Nan::GetFunction(Nan::New<FunctionTemplate>(Bubo::Union)).ToLocalChecked());
+    Nan::Set(new_instance, Nan::New("intersect").ToLocalChecked(),
+        Nan::GetFunction(Nan::New<FunctionTemplate>(Bubo::Intersect)).ToLocalChecked());
+    Nan::Set(new_instance, Nan::New("difference").ToLocalChecked(),
+        Nan::GetFunction(Nan::New<FunctionTemplate>(Bubo::Difference)).ToLocalChecked());
+    Nan::Set(new_instance, Nan::New("intersectionSize").ToLocalChecked(),
+        Nan::GetFunction(Nan::New<FunctionTemplate>(Bubo::IntersectionSize)).ToLocalChecked());
+    Nan::Set(new_instance, Nan::New("isSubset").ToLocalChecked(),
+        Nan::GetFunction(Nan::New<FunctionTemplate>(Bubo::IsSubset)).ToLocalChecked());
+    // So that instances are instanceof Bubo, and index.js can add methods to them.
+    Nan::Set(new_instance, Nan::New("prototype").ToLocalChecked(),
+        Nan::Get(Nan::New<Function>(constructor), Nan::New("prototype").ToLocalChecked()).ToLocalChecked());
+    Nan::Set(exports, Nan::New("Bubo").ToLocalChecked(), new_instance);
 }
 
 void
@@ -205,4 +1313,5 @@ InitModule(Handle<Object> exports)
     Bubo::Init(exports);
 }
 
-NODE_MODULE(bubo, InitModule)
+// Loadable by worker threads too, each of which calls InitModule() for its own isolate.
+NAN_MODULE_WORKER_ENABLED(bubo, InitModule)
@@ -5,15 +5,29 @@
 #include "js-method.h"
 #include "attrs-table.h"
 #include "strings-table.h"
+#include "shared-set.h"
+#include "set-ops.h"
 
+#include <deque>
 #include <unordered_set>
 
+class BatchWorker;
+
 
 class Bubo : public Nan::ObjectWrap {
 public:
     static void Init(v8::Handle<v8::Object> exports);
     static NAN_METHOD(New);
-    static Nan::Persistent<v8::Function> constructor;
+    static NAN_METHOD(Load);
+    static NAN_METHOD(Open);
+    static NAN_METHOD(Union);
+    static NAN_METHOD(Intersect);
+    static NAN_METHOD(Difference);
+    static NAN_METHOD(IntersectionSize);
+    static NAN_METHOD(IsSubset);
+    // Per thread, as each worker thread has an isolate of its own.
+    static thread_local Nan::Persistent<v8::Function> constructor;
+    static thread_local Nan::Persistent<v8::FunctionTemplate> constructor_template;
 
 private:
     explicit Bubo();
@@ -21,13 +35,87 @@ private:
 
     NAN_METHOD(Initialize);
 
+    // (Re)creates the tables with the settings below. Returns false if the files of map_dir_ could not be created.
+    bool create_tables();
+    /*
+     * Attaches to the set shared under name, creating it with the settings below if there is
+     * none, and takes its settings. Returns false if it had to be created and could not be.
+     */
+    bool attach_shared(const std::string& name);
+    // Writes a snapshot, or with mapped, the snapshot that goes with the files of a mapped set.
+    bool write_snapshot(const std::string& path, bool mapped);
+    /*
+     * Replaces the tables and the settings that shape their contents with a snapshot, or with a
+     * map_dir, maps the files of that directory. Returns an error message or NULL.
+     */
+    const char* restore(const std::string& path, const std::string& map_dir, bool read_only);
+
+    /*
+     * Sets a and b to the two sets of a set operation, info[0] and info[1]. Throws, and returns
+     * false, if they are not sets that can be combined.
+     */
+    static bool unwrap_sets(NAN_METHOD_ARGS_TYPE info, const char* name, Bubo** a, Bubo** b);
+    // Returns a new set, with the settings of info[0], of info[0] op info[1].
+    static void combine(NAN_METHOD_ARGS_TYPE info, SetOp op, const char* name);
+
+    // The lock the tables take, if any: that of the shared set, or of a set with async batches.
+    StripedLock* lock() {
+        return shared_ ? &shared_->lock_ : async_lock_;
+    }
+    /*
+     * Encodes the points of addManyAsync() or containsManyAsync() and queues the batch to run
+     * on the libuv thread pool after those queued before it, calling back with the flags.
+     */
+    void queue_batch(NAN_METHOD_ARGS_TYPE info, bool add, const char* name);
+    // Called by the running worker once done, to start the next one.
+    void batch_done();
+    // Sets the stats of the tables on the object info[0], with the walks of detailedStats() if detailed.
+    void write_stats(NAN_METHOD_ARGS_TYPE info, bool detailed, const char* name);
+    friend class BatchWorker;
+
     JS_METHOD_DECL(Add);
+    JS_METHOD_DECL(AddMany);
+    JS_METHOD_DECL(AddColumns);
     JS_METHOD_DECL(Contains);
+    JS_METHOD_DECL(ContainsMany);
+    JS_METHOD_DECL(AddManyAsync);
+    JS_METHOD_DECL(ContainsManyAsync);
+    JS_METHOD_DECL(ContainsColumns);
     JS_METHOD_DECL(Delete);
+    JS_METHOD_DECL(ReadEntries);
+    JS_METHOD_DECL(Compact);
+    JS_METHOD_DECL(RebuildFilter);
+    JS_METHOD_DECL(Cardinality);
+    JS_METHOD_DECL(Sketch);
+    JS_METHOD_DECL(MergeSketch);
+    JS_METHOD_DECL(Rotate);
+    JS_METHOD_DECL(Save);
+    JS_METHOD_DECL(Sync);
     JS_METHOD_DECL(Stats);
+    JS_METHOD_DECL(DetailedStats);
     JS_METHOD_DECL(Test);
+    JS_METHOD_DECL(Bench);
 
     AttributesTable* attrs_table_;
     StringsTable* strings_table_;
+    SharedSet* shared_;         // NULL unless shared, in which case it owns strings_table_
+    StripedLock* async_lock_;   // of an unshared set, from its first async batch on
+    std::deque<BatchWorker*> batch_queue_;     // the first one is running
+
+    BuboHashFunction hash_function_;
+    uint64_t hash_seed_;
+    uint32_t resize_step_groups_;
+    double compact_ratio_;
+    bool auto_compact_;
+    uint64_t filter_entries_;   // expected entries of the filter, 0 for none
+    bool sketch_;               // whether to keep a HyperLogLog sketch
+    bool sketch_only_;          // and nothing else
+    uint32_t sketch_precision_;
+    bool typed_values_;
+    uint32_t num_shards_;
+    uint32_t max_generations_;  // 1 unless windowed
+    uint64_t max_bytes_;        // 0 for no cap
     std::vector<std::string> ignored_attributes_;
+    std::string map_dir_;       // empty unless mapped
+    bool read_only_;
 };
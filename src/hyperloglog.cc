@@ -0,0 +1,126 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include "hyperloglog.h"
+
+HyperLogLog::HyperLogLog(uint32_t precision, uint8_t flags)
+    : precision_(precision), flags_(flags), num_registers_(1u << precision) {
+    assert(precision >= HLL_MIN_PRECISION && precision <= HLL_MAX_PRECISION);
+    registers_ = new uint8_t[num_registers_];
+    clear();
+}
+
+HyperLogLog::~HyperLogLog() {
+    delete [] registers_;
+}
+
+bool HyperLogLog::raise(uint32_t idx, uint8_t rank) {
+    uint8_t current = __atomic_load_n(&registers_[idx], __ATOMIC_RELAXED);
+    while (current < rank) {
+        if (__atomic_compare_exchange_n(&registers_[idx], &current, rank, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool HyperLogLog::add(uint64_t h) {
+    uint32_t idx = h >> (64 - precision_);
+    uint64_t rest = h << precision_;
+    // The other 64 - precision bits all zero give the largest rank.
+    uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - precision_ + 1;
+    return raise(idx, rank);
+}
+
+void HyperLogLog::clear() {
+    memset(registers_, 0, num_registers_);
+}
+
+/* sigma() and tau() of Ertl's paper, by their series. */
+static double hll_sigma(double x) {
+    if (x == 1) {
+        return INFINITY;
+    }
+    double y = 1, z = x, previous;
+    do {
+        x *= x;
+        previous = z;
+        z += x * y;
+        y += y;
+    } while (z != previous);
+    return z;
+}
+
+static double hll_tau(double x) {
+    if (x == 0 || x == 1) {
+        return 0;
+    }
+    double y = 1, z = 1 - x, previous;
+    do {
+        x = sqrt(x);
+        previous = z;
+        y *= 0.5;
+        z -= (1 - x) * (1 - x) * y;
+    } while (z != previous);
+    return z / 3;
+}
+
+double HyperLogLog::estimate() const {
+    uint32_t q = 64 - precision_;
+    uint32_t counts[64 + 2] = { 0 };
+
+    // The number of registers holding every rank, 0 to q + 1.
+    for (uint32_t i = 0; i < num_registers_; i++) {
+        counts[__atomic_load_n(&registers_[i], __ATOMIC_RELAXED)] ++;
+    }
+
+    double m = num_registers_;
+    double z = m * hll_tau(1 - counts[q + 1] / m);
+    for (uint32_t k = q; k >= 1; k--) {
+        z = 0.5 * (z + counts[k]);
+    }
+    z += m * hll_sigma(counts[0] / m);
+    return m * m / (2 * log(2) * z);
+}
+
+bool HyperLogLog::merge(const HyperLogLog& other) {
+    if (other.precision_ != precision_ || other.flags_ != flags_) {
+        return false;
+    }
+    for (uint32_t i = 0; i < num_registers_; i++) {
+        raise(i, __atomic_load_n(&other.registers_[i], __ATOMIC_RELAXED));
+    }
+    return true;
+}
+
+void HyperLogLog::serialize(std::string* out) const {
+    char header[HLL_HEADER_SIZE] = { 0 };
+    memcpy(header, HLL_MAGIC, 4);
+    header[4] = HLL_VERSION;
+    header[5] = precision_;
+    header[6] = flags_;
+    out->append(header, sizeof(header));
+
+    size_t start = out->size();
+    out->resize(start + num_registers_);
+    for (uint32_t i = 0; i < num_registers_; i++) {
+        (*out)[start + i] = __atomic_load_n(&registers_[i], __ATOMIC_RELAXED);
+    }
+}
+
+bool HyperLogLog::merge_serialized(const BYTE* data, size_t len) {
+    if (len != HLL_HEADER_SIZE + num_registers_ || memcmp(data, HLL_MAGIC, 4) != 0 ||
+        data[4] != HLL_VERSION || data[5] != precision_ || data[6] != flags_ || data[7] != 0) {
+        return false;
+    }
+    const BYTE* registers = data + HLL_HEADER_SIZE;
+    for (uint32_t i = 0; i < num_registers_; i++) {
+        if (registers[i] > 64 - precision_ + 1) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < num_registers_; i++) {
+        raise(i, registers[i]);
+    }
+    return true;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include "bubo-types.h"
+
+// A sketch has 2^precision registers of one byte.
+#define HLL_MIN_PRECISION 4
+#define HLL_MAX_PRECISION 16
+#define HLL_DEFAULT_PRECISION 12
+
+// A serialized sketch: the magic, the version, the precision, the flags and a zero byte, then the registers.
+#define HLL_MAGIC "BHLL"
+#define HLL_VERSION 1
+#define HLL_HEADER_SIZE 8
+
+/*
+ * HyperLogLog estimates the number of distinct 64-bit hashes added to it, in 2^precision bytes
+ * whatever that number, with a standard error of about 1.04 / sqrt(2^precision): 1.6% with the
+ * default 4 KB. The first precision bits of a hash pick a register, which keeps the largest
+ * number of leading zeros (plus one) seen in the other bits. estimate() uses the estimator of
+ * Ertl ("New cardinality estimation algorithms for HyperLogLog sketches", 2017), which needs
+ * neither the bias tables nor the switch to linear counting of the original one.
+ *
+ * Sketches of the same precision merge by keeping the larger of every register, which gives the
+ * sketch of the union. The flags go along with the registers, for the user to tell sketches of
+ * differently made hashes apart; only sketches with the same flags merge.
+ *
+ * Registers are updated with atomic operations, so add() and merge() may run on several threads
+ * at a time, alongside the methods that read the registers.
+ */
+class HyperLogLog {
+public:
+    HyperLogLog(uint32_t precision, uint8_t flags = 0);
+    ~HyperLogLog();
+
+    // Returns true if a register grew, in which case h was never added before.
+    bool add(uint64_t h);
+
+    double estimate() const;
+
+    void clear();
+
+    uint32_t precision() const {
+        return precision_;
+    }
+
+    uint8_t flags() const {
+        return flags_;
+    }
+
+    size_t bytes() const {
+        return num_registers_;
+    }
+
+    // Raises the registers to those of other. Returns false if other differs in precision or flags.
+    bool merge(const HyperLogLog& other);
+
+    // Appends the serialized sketch to out.
+    void serialize(std::string* out) const;
+
+    /*
+     * As merge(), with a sketch serialized by serialize().
+     *
+     * Return value: false if data is not a serialized sketch, or differs in precision or flags.
+     * True otherwise.
+     */
+    bool merge_serialized(const BYTE* data, size_t len);
+
+private:
+    uint32_t precision_;
+    uint8_t flags_;
+    uint32_t num_registers_;
+    uint8_t* registers_;
+
+    // Raises register idx to rank. Returns true if it grew.
+    bool raise(uint32_t idx, uint8_t rank);
+
+    HyperLogLog(const HyperLogLog&);
+    HyperLogLog& operator=(const HyperLogLog&);
+};
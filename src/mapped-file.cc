@@ -0,0 +1,83 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mapped-file.h"
+
+bool MappedFile::create(const std::string& path, size_t size) {
+    unmap();
+
+    // Unlinking first leaves the old file to whoever still maps it, where truncating it would not.
+    unlink(path.c_str());
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        unlink(path.c_str());
+        return false;
+    }
+
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        unlink(path.c_str());
+        return false;
+    }
+
+    path_ = path;
+    mem_ = (BYTE*)mem;
+    size_ = size;
+    read_only_ = false;
+    return true;
+}
+
+bool MappedFile::open(const std::string& path, bool read_only) {
+    unmap();
+
+    int fd = ::open(path.c_str(), read_only ? O_RDONLY : O_RDWR);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    void* mem = mmap(NULL, st.st_size, read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        return false;
+    }
+
+    path_ = path;
+    mem_ = (BYTE*)mem;
+    size_ = st.st_size;
+    read_only_ = read_only;
+    return true;
+}
+
+bool MappedFile::sync() {
+    if (!mem_ || read_only_) {
+        return true;
+    }
+    return msync(mem_, size_, MS_SYNC) == 0;
+}
+
+void MappedFile::unmap() {
+    if (mem_) {
+        munmap(mem_, size_);
+    }
+    mem_ = NULL;
+    size_ = 0;
+}
+
+void MappedFile::remove() {
+    unmap();
+    if (!path_.empty()) {
+        unlink(path_.c_str());
+    }
+    path_.clear();
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+#include "bubo-types.h"
+
+/*
+ * A file mapped into memory with MAP_SHARED: the kernel pages it in and out as needed, so what
+ * is mapped may be bigger than the RAM, and what is written to it outlives the process.
+ */
+class MappedFile {
+public:
+    MappedFile() : mem_(NULL), size_(0), read_only_(false) {}
+    ~MappedFile() {
+        unmap();
+    }
+
+    /*
+     * Creates a file of size bytes, all zeros, at path, and maps it. A file already at path is
+     * replaced, without disturbing anything that maps it.
+     */
+    bool create(const std::string& path, size_t size);
+
+    // Maps the whole of the file at path.
+    bool open(const std::string& path, bool read_only);
+
+    // Writes the modified pages back to the file.
+    bool sync();
+
+    void unmap();
+
+    // Unmaps the file and deletes it.
+    void remove();
+
+    BYTE* mem() const {
+        return mem_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    std::string path_;
+    BYTE* mem_;
+    size_t size_;
+    bool read_only_;
+
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+};
@@ -0,0 +1,251 @@
+#include <algorithm>
+#include "set-ops.h"
+#include "attrs-table.h"
+#include "utils.h"
+
+/*
+ * Walks the tuples of an entry, calling fn(tag_seq, val_seq, value, value_len) for each: val_seq
+ * is the sequence number of a string value, or 0 for a typed value of another kind, and value
+ * and value_len the bytes of the value part. Returns false if the entry does not decode or as
+ * soon as fn does.
+ */
+template<typename Fn>
+static bool walk_tuples(const BYTE* entry, int len, bool typed_values, Fn fn) {
+    const BYTE* end = entry + len;
+    int decoded_len = 0;
+
+    uint32_t num_tuples = bubo_utils::decode_packed(entry, &decoded_len);
+    const BYTE* p = entry + decoded_len;
+
+    for (uint32_t i = 0; i < num_tuples; i++) {
+        if (p >= end) {
+            return false;
+        }
+        uint32_t tag_seq = bubo_utils::decode_packed(p, &decoded_len);
+        p += decoded_len;
+        if (p >= end) {
+            return false;
+        }
+
+        const BYTE* value = p;
+        uint32_t val_seq = 0;
+        if (!typed_values) {
+            val_seq = bubo_utils::decode_packed(p, &decoded_len);
+            p += decoded_len;
+        } else {
+            uint64_t code = bubo_utils::decode_packed64(p, &decoded_len);
+            p += decoded_len;
+            if ((code & VAL_KIND_MASK) == VAL_STRING) {
+                val_seq = code >> VAL_KIND_BITS;
+            } else if ((code & VAL_KIND_MASK) == VAL_DOUBLE || (code & VAL_KIND_MASK) == VAL_DATE) {
+                p += sizeof(double);
+            }
+        }
+        if (p > end || !fn(tag_seq, val_seq, value, (int)(p - value))) {
+            return false;
+        }
+    }
+    return p == end;
+}
+
+void EntryTranslator::resolve(const BYTE* entry, int len) {
+    if (identity()) {
+        return;
+    }
+    walk_tuples(entry, len, typed_values_, [&](uint32_t tag_seq, uint32_t val_seq, const BYTE*, int) {
+        if (tag_seq >= tags_.size()) {
+            tags_.resize(tag_seq + 1);
+        }
+        Tag& tag = tags_[tag_seq];
+        if (!tag.from_) {
+            tag.from_ = from_->find_tag_entry(tag_seq);
+            if (!tag.from_) {
+                return false;
+            }
+        }
+        if (val_seq == 0) {
+            return true;
+        }
+        if (val_seq >= tag.vals_.size()) {
+            tag.vals_.resize(val_seq + 1);
+        }
+        if (!tag.vals_[val_seq].str_) {
+            tag.vals_[val_seq].str_ = StringsTable::find_val_str(tag.from_, val_seq);
+        }
+        return tag.vals_[val_seq].str_ != NULL;
+    });
+}
+
+uint32_t EntryTranslator::to_seq(Tag* tag, Val* val) {
+    EntryToken token;
+
+    if (tag->to_seq_ == 0) {
+        bool found = add_ ? (to_->check_and_add_tag(tag->from_->tag_, &token, &tag->to_), true)
+                          : to_->find_tag(tag->from_->tag_, &token, &tag->to_);
+        tag->to_seq_ = found ? token.tag_seq_no_ : UNKNOWN_SEQ;
+    }
+    if (tag->to_seq_ == UNKNOWN_SEQ || !val) {
+        return tag->to_seq_;
+    }
+    if (val->to_seq_ == 0) {
+        bool found = add_ ? (to_->check_and_add_val(tag->to_, val->str_, &token), true)
+                          : to_->find_val(tag->to_, val->str_, &token);
+        val->to_seq_ = found ? token.val_seq_no_ : UNKNOWN_SEQ;
+    }
+    return val->to_seq_;
+}
+
+bool EntryTranslator::translate(const BYTE* entry, int len, uint32_t row, EntryBatch* batch) {
+    if (identity()) {
+        batch->add(entry, len, row);
+        return true;
+    }
+
+    // Every packed number of the entry takes at least 1 byte, and at most 5 once translated.
+    buf_.resize(5 * (size_t)len);
+    BYTE* out = buf_.data();
+    int encoded_len = 0;
+
+    bubo_utils::encode_packed(bubo_utils::decode_packed(entry), out, &encoded_len);
+    out += encoded_len;
+
+    bool ok = walk_tuples(entry, len, typed_values_, [&](uint32_t tag_seq, uint32_t val_seq, const BYTE* value, int value_len) {
+        if (tag_seq >= tags_.size() || !tags_[tag_seq].from_) {
+            return false;
+        }
+        Tag* tag = &tags_[tag_seq];
+        Val* val = NULL;
+        if (val_seq != 0) {
+            if (val_seq >= tag->vals_.size() || !tag->vals_[val_seq].str_) {
+                return false;
+            }
+            val = &tag->vals_[val_seq];
+        }
+
+        if (to_seq(tag, val) == UNKNOWN_SEQ) {
+            return false;
+        }
+        bubo_utils::encode_packed(tag->to_seq_, out, &encoded_len);
+        out += encoded_len;
+
+        if (!val) {
+            memcpy(out, value, value_len);
+            out += value_len;
+        } else if (typed_values_) {
+            bubo_utils::encode_packed64(((uint64_t)val->to_seq_ << VAL_KIND_BITS) | VAL_STRING, out, &encoded_len);
+            out += encoded_len;
+        } else {
+            bubo_utils::encode_packed(val->to_seq_, out, &encoded_len);
+            out += encoded_len;
+        }
+        return true;
+    });
+
+    if (ok) {
+        batch->add(buf_.data(), out - buf_.data(), row);
+    }
+    return ok;
+}
+
+/*
+ * Adds the entries of batch, read from source, to result, translated by translator, which goes
+ * from the strings table of source to that of result. flags receives their is-new flags.
+ */
+static void add_translated(AttributesTable* source, const EntryBatch& batch, EntryTranslator* translator,
+                           AttributesTable* result, EntryBatch* translated, std::vector<uint8_t>* flags) {
+    source->resolve_batch(batch, translator);
+    translated->clear();
+    result->translate_batch(batch, translator, translated);
+    flags->assign(batch.size(), 0);
+    result->run_batch(*translated, true, flags->data());
+}
+
+/*
+ * Reads the entries of source a batch at a time, and for each batch, sets flags to whether each
+ * of its entries is in other, if there is one. Calls fn(batch, flags) after every batch, until it
+ * returns false.
+ */
+template<typename Fn>
+static bool for_each_batch(AttributesTable* source, AttributesTable* other, Fn fn) {
+    EntryTranslator probe(source->strings_table(), other ? other->strings_table() : NULL,
+                          source->typed_values(), false);
+    ScanCursor cursor;
+    EntryBatch batch, translated;
+    std::vector<uint8_t> flags;
+    ScanResult result;
+
+    do {
+        batch.clear();
+        result = source->read_batch(&cursor, SET_OP_BATCH_ENTRIES, &batch);
+        if (result == SCAN_STALE) {
+            return false;
+        }
+        // Entries with a tag or value that other lacks are not translated, and keep a 0 flag.
+        flags.assign(batch.size(), 0);
+        if (other) {
+            source->resolve_batch(batch, &probe);
+            translated.clear();
+            other->translate_batch(batch, &probe, &translated);
+            other->run_batch(translated, false, flags.data());
+        }
+        if (!fn(batch, flags)) {
+            break;
+        }
+    } while (result == SCAN_MORE);
+
+    return true;
+}
+
+bool combine_sets(AttributesTable* a, AttributesTable* b, SetOp op, AttributesTable* result) {
+    EntryBatch kept, translated;
+    std::vector<uint8_t> new_flags;
+
+    if (op == SET_UNION) {
+        for (AttributesTable* source : { a, b }) {
+            EntryTranslator adder(source->strings_table(), result->strings_table(), source->typed_values(), true);
+            bool ok = for_each_batch(source, NULL, [&](const EntryBatch& batch, const std::vector<uint8_t>&) {
+                add_translated(source, batch, &adder, result, &translated, &new_flags);
+                return true;
+            });
+            if (!ok) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // An intersection reads the smaller set, and looks its entries up in the larger one.
+    if (op == SET_INTERSECTION && b->size() < a->size()) {
+        std::swap(a, b);
+    }
+    uint8_t keep = op == SET_INTERSECTION ? 1 : 0;
+    EntryTranslator adder(a->strings_table(), result->strings_table(), a->typed_values(), true);
+
+    return for_each_batch(a, b, [&](const EntryBatch& batch, const std::vector<uint8_t>& in_b) {
+        kept.clear();
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (in_b[i] == keep) {
+                kept.add(batch.entry(i), batch.lens_[i], kept.size());
+            }
+        }
+        add_translated(a, kept, &adder, result, &translated, &new_flags);
+        return true;
+    });
+}
+
+bool count_common(AttributesTable* a, AttributesTable* b, bool stop_at_missing, uint64_t* count, bool* missing) {
+    *count = 0;
+    *missing = false;
+
+    return for_each_batch(a, b, [&](const EntryBatch& batch, const std::vector<uint8_t>& in_b) {
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (in_b[i]) {
+                (*count)++;
+            } else if (stop_at_missing) {
+                *missing = true;
+                return false;
+            }
+        }
+        return true;
+    });
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "bubo-types.h"
+#include "strings-table.h"
+#include "sharded-set.h"
+
+class AttributesTable;
+
+// Entries read from a set at a time by the set operations.
+#define SET_OP_BATCH_ENTRIES 4096
+
+/*
+ * EntryTranslator re-encodes entries of one strings table (from) with the sequence numbers of
+ * another (to), for the set operations between tables with different strings tables. It keeps
+ * a translation table, indexed by the sequence numbers of from, that it fills in as it meets
+ * them: first the strings of from they stand for, which resolve() notes with from locked, then
+ * the sequence numbers of these strings in to, which translate() looks up (or adds) with to
+ * locked. As the strings of a strings table stay where they are, no step needs both tables.
+ *
+ * Tuples keep their order, which is that of their tags' strings, and typed values other than
+ * strings are copied as they are, so the tables must both have typed values, or neither.
+ */
+class EntryTranslator {
+public:
+    /*
+     * @add: whether translate() adds the tags and values to lacks, or leaves out the entries
+     *       that have one.
+     */
+    EntryTranslator(const StringsTable* from, StringsTable* to, bool typed_values, bool add)
+        : from_(from), to_(to), typed_values_(typed_values), add_(add) {}
+
+    // Whether entries of from are already entries of to, as when both are the same table.
+    bool identity() const {
+        return from_ == to_;
+    }
+
+    bool adds() const {
+        return add_;
+    }
+
+    // Notes the strings of the tuples of entry that are not in the translation table yet. Needs from locked.
+    void resolve(const BYTE* entry, int len);
+
+    /*
+     * Appends entry, re-encoded for to, to batch, as the entry of row. Needs to locked, exclusively
+     * with add.
+     *
+     * Return value: false, and nothing appended, if to lacks a tag or value of the entry (unless
+     * add), or if resolve() has not seen the entry.
+     */
+    bool translate(const BYTE* entry, int len, uint32_t row, EntryBatch* batch);
+
+private:
+    // Sequence number of a string that to lacks, once looked up.
+    static const uint32_t UNKNOWN_SEQ = 0xFFFFFFFF;
+
+    struct Val {
+        const char* str_ = NULL;
+        uint32_t to_seq_ = 0;       // 0 until looked up
+    };
+
+    struct Tag {
+        const StringsTable::TagEntry* from_ = NULL;
+        StringsTable::TagEntry* to_ = NULL;
+        uint32_t to_seq_ = 0;       // 0 until looked up
+        std::vector<Val> vals_;     // indexed by the sequence numbers of the values in from
+    };
+
+    const StringsTable* from_;
+    StringsTable* to_;
+    bool typed_values_;
+    bool add_;
+    std::vector<Tag> tags_;         // indexed by the sequence numbers of the tags in from
+    std::vector<BYTE> buf_;         // the entry being translated
+
+    // Returns the sequence number in to of the string val of tag, or UNKNOWN_SEQ.
+    uint32_t to_seq(Tag* tag, Val* val);
+};
+
+enum SetOp {
+    SET_UNION,
+    SET_INTERSECTION,
+    SET_DIFFERENCE,
+};
+
+/*
+ * Adds the entries of a op b to result, which must be a table with neither a lock nor a shared
+ * strings table. The entries are read a batch at a time, one table after the other, so that the
+ * locks of two tables are never held at once; changes made to a or b meanwhile may or may not be
+ * seen.
+ *
+ * Return value: false if a or b was resized while its entries were being read. True otherwise.
+ */
+bool combine_sets(AttributesTable* a, AttributesTable* b, SetOp op, AttributesTable* result);
+
+/*
+ * Counts the entries of a that are in b into count, in the same way. With stop_at_missing, stops
+ * at the first one that is not, and sets missing.
+ *
+ * Return value: false if a or b was resized while its entries were being read. True otherwise.
+ */
+bool count_common(AttributesTable* a, AttributesTable* b, bool stop_at_missing, uint64_t* count, bool* missing);
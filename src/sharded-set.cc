@@ -0,0 +1,537 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <new>
+#include "sharded-set.h"
+
+// Entries hashed by each task of a batch, before they are grouped by shard.
+#define BATCH_HASH_CHUNK 4096
+
+ShardedSet::ShardedSet(uint32_t num_shards, const BytePtrHash& hash) : hash_(hash) {
+    assert(num_shards >= 1 && num_shards <= MAX_SHARDS);
+
+    // Sized first, as new_generation() makes one set per shard.
+    shards_.resize(num_shards);
+    shards_ = new_generation();
+    if (num_shards > 1) {
+        uint32_t cores = std::max(1u, std::thread::hardware_concurrency());
+        pool_ = new ThreadPool(std::min(num_shards, cores));
+    }
+}
+
+ShardedSet::~ShardedSet() {
+    delete pool_;
+    for (uint32_t g = 0; g < num_generations(); g++) {
+        for (size_t s = 0; s < shards_.size(); s++) {
+            delete generation(g)[s];
+        }
+    }
+    if (locks_) {
+        for (size_t s = 0; s < shards_.size(); s++) {
+            locks_[s].~StripedLock();
+        }
+        free(locks_);
+    }
+}
+
+void ShardedSet::set_concurrent() {
+    if (locks_) {
+        return;
+    }
+    // Allocated by hand, as new only aligns to alignof(StripedLock) from C++17.
+    void* mem = NULL;
+    if (posix_memalign(&mem, alignof(StripedLock), shards_.size() * sizeof(StripedLock)) != 0) {
+        throw std::bad_alloc();
+    }
+    locks_ = static_cast<StripedLock*>(mem);
+    for (size_t s = 0; s < shards_.size(); s++) {
+        new (&locks_[s]) StripedLock();
+    }
+}
+
+ShardedSet::Generation ShardedSet::new_generation() {
+    Generation generation;
+    for (size_t s = 0; s < shards_.size(); s++) {
+        AttributesHashSet* shard = new AttributesHashSet(DEFAULT_INIT_HASH_TABLE_SZ, DEFAULT_MAX_HASH_TABLE_SZ, hash_);
+        shard->set_incremental_resize(resize_step_groups_);
+        shard->set_auto_compact(compact_dead_ratio_, compact_step_groups_);
+        shard->set_filter(filter_entries_);
+        shard->set_clock(clock_);
+        generation.push_back(shard);
+    }
+    return generation;
+}
+
+bool ShardedSet::insert_in(uint32_t s, const BYTE* entry, int len, uint32_t h, uint64_t shard_max_bytes,
+                           uint64_t* evicted) {
+    AttributesHashSet* shard = shards_[s];
+    if (shard_max_bytes != 0) {
+        // Growing the table has to fit too: if it would not, the entry takes the slot of one evicted.
+        uint64_t growth = shard->growth_bytes();
+        if (growth != 0 && shard_bytes(s) + growth > shard_max_bytes && !shard->contains(entry, len, h)) {
+            uint64_t n = shard->make_room();
+            if (evicted) {
+                (*evicted) += n;
+            }
+        }
+    }
+    if (!shard->insert(entry, len, h)) {
+        return false;
+    }
+    // Moved from the generation it was in, if any.
+    for (size_t g = old_generations_.size(); g > 0; g--) {
+        if (old_generations_[g - 1][s]->erase(entry, len, h)) {
+            return false;
+        }
+    }
+    if (shard_max_bytes == 0) {
+        return true;
+    }
+
+    uint32_t g = 0;
+    uint32_t current = num_generations() - 1;
+    while (g <= current && shard_bytes(s) > shard_max_bytes) {
+        bool done = g < current ? generation(g)[s]->evict() : shard->evict(entry, len, h);
+        if (!done) {
+            g++;
+            continue;
+        }
+        if (evicted) {
+            (*evicted) ++;
+        }
+    }
+    return true;
+}
+
+uint64_t ShardedSet::shard_bytes(uint32_t s) const {
+    uint64_t bytes = 0;
+    for (uint32_t g = 0; g < num_generations(); g++) {
+        bytes += generation(g)[s]->bytes();
+    }
+    return bytes;
+}
+
+bool ShardedSet::contains_in(uint32_t s, const BYTE* entry, int len, uint32_t h) {
+    if (shards_[s]->contains(entry, len, h)) {
+        return true;
+    }
+    for (size_t g = old_generations_.size(); g > 0; g--) {
+        if (old_generations_[g - 1][s]->contains(entry, len, h)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ShardedSet::lookup_in(uint32_t s, const BYTE* entry, int len, uint32_t h) const {
+    if (shards_[s]->lookup(entry, len, h)) {
+        return true;
+    }
+    for (size_t g = old_generations_.size(); g > 0; g--) {
+        if (old_generations_[g - 1][s]->lookup(entry, len, h)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ShardedSet::insert(const BYTE* entry, int len, uint64_t max_bytes, uint64_t* evicted) {
+    uint32_t h = 0;
+    uint32_t s = shard_of(entry, len, &h);
+
+    if (locks_) {
+        // Most entries are in the current generation already, and finding them only needs the lock shared.
+        SharedGuard guard(&locks_[s]);
+        if (shards_[s]->lookup(entry, len, h)) {
+            return false;
+        }
+    }
+    ExclusiveGuard guard(lock(s));
+    return insert_in(s, entry, len, h, shard_max_bytes(max_bytes), evicted);
+}
+
+bool ShardedSet::contains(const BYTE* entry, int len) {
+    uint32_t h = 0;
+    uint32_t s = shard_of(entry, len, &h);
+    ExclusiveGuard guard(lock(s));
+    return contains_in(s, entry, len, h);
+}
+
+bool ShardedSet::lookup(const BYTE* entry, int len) const {
+    uint32_t h = 0;
+    uint32_t s = shard_of(entry, len, &h);
+    SharedGuard guard(lock(s));
+    return lookup_in(s, entry, len, h);
+}
+
+void ShardedSet::erase(const BYTE* entry, int len) {
+    uint32_t h = 0;
+    uint32_t s = shard_of(entry, len, &h);
+    ExclusiveGuard guard(lock(s));
+    for (uint32_t g = num_generations(); g > 0; g--) {
+        if (generation(g - 1)[s]->erase(entry, len, h)) {
+            return;
+        }
+    }
+}
+
+void ShardedSet::set_generations(uint32_t max_generations) {
+    assert(max_generations >= 1 && max_generations <= MAX_GENERATIONS);
+    max_generations_ = max_generations;
+}
+
+uint64_t ShardedSet::rotate() {
+    Generation next = new_generation();
+    old_generations_.push_back(shards_);
+    shards_ = next;
+
+    uint64_t dropped = 0;
+    if (num_generations() > max_generations_) {
+        for (size_t s = 0; s < shards_.size(); s++) {
+            dropped += old_generations_.front()[s]->size();
+            delete old_generations_.front()[s];
+        }
+        old_generations_.pop_front();
+        first_generation_ ++;
+    }
+    compact_shard_ = 0;
+    return dropped;
+}
+
+void ShardedSet::set_clock(bool clock) {
+    clock_ = clock;
+    for (uint32_t g = 0; g < num_generations(); g++) {
+        for (size_t s = 0; s < shards_.size(); s++) {
+            generation(g)[s]->set_clock(clock);
+        }
+    }
+}
+
+uint64_t ShardedSet::bytes() const {
+    uint64_t bytes = 0;
+    for (size_t s = 0; s < shards_.size(); s++) {
+        SharedGuard guard(lock(s));
+        bytes += shard_bytes(s);
+    }
+    return bytes;
+}
+
+void ShardedSet::insert_batch(const EntryBatch& batch, uint8_t* flags, uint64_t max_bytes, uint64_t* evicted) {
+    run_batch(batch, flags, true, max_bytes, evicted);
+}
+
+void ShardedSet::contains_batch(const EntryBatch& batch, uint8_t* flags) {
+    run_batch(batch, flags, false, 0, NULL);
+}
+
+void ShardedSet::run_batch(const EntryBatch& batch, uint8_t* flags, bool insert, uint64_t max_bytes, uint64_t* evicted) {
+    uint32_t num_entries = batch.size();
+    uint32_t num_shards = shards_.size();
+    std::vector<uint32_t> hashes(num_entries);
+    std::vector<uint8_t> shards(num_entries);
+
+    std::function<void(uint32_t)> hash_chunk = [&](uint32_t chunk) {
+        uint32_t end = std::min(num_entries, (chunk + 1) * BATCH_HASH_CHUNK);
+        for (uint32_t i = chunk * BATCH_HASH_CHUNK; i < end; i++) {
+            hashes[i] = hash_(batch.entry(i), batch.lens_[i]);
+            shards[i] = shard_of(hashes[i]);
+        }
+    };
+
+    // Groups the entries by shard, in order: those of shard s are order[starts[s]] to order[starts[s + 1] - 1].
+    std::vector<uint32_t> starts(num_shards + 1, 0);
+    std::vector<uint32_t> order(num_entries);
+
+    std::function<void(uint32_t)> run_shard = [&](uint32_t s) {
+        if (starts[s] == starts[s + 1]) {
+            return;
+        }
+
+        if (insert) {
+            ExclusiveGuard guard(lock(s));
+            uint64_t shard_evicted = 0;
+            for (uint32_t k = starts[s]; k < starts[s + 1]; k++) {
+                uint32_t i = order[k];
+                flags[batch.rows_[i]] = insert_in(s, batch.entry(i), batch.lens_[i], hashes[i],
+                                                  shard_max_bytes(max_bytes), &shard_evicted);
+            }
+            if (evicted && shard_evicted) {
+                __atomic_fetch_add(evicted, shard_evicted, __ATOMIC_RELAXED);
+            }
+        } else if (locks_) {
+            SharedGuard guard(lock(s));
+            for (uint32_t k = starts[s]; k < starts[s + 1]; k++) {
+                uint32_t i = order[k];
+                flags[batch.rows_[i]] = lookup_in(s, batch.entry(i), batch.lens_[i], hashes[i]);
+            }
+        } else {
+            for (uint32_t k = starts[s]; k < starts[s + 1]; k++) {
+                uint32_t i = order[k];
+                flags[batch.rows_[i]] = contains_in(s, batch.entry(i), batch.lens_[i], hashes[i]);
+            }
+        }
+    };
+
+    uint32_t num_chunks = (num_entries + BATCH_HASH_CHUNK - 1) / BATCH_HASH_CHUNK;
+    if (pool_) {
+        pool_->run(num_chunks, hash_chunk);
+    } else {
+        for (uint32_t c = 0; c < num_chunks; c++) {
+            hash_chunk(c);
+        }
+    }
+
+    for (uint32_t i = 0; i < num_entries; i++) {
+        starts[shards[i] + 1] ++;
+    }
+    for (uint32_t s = 0; s < num_shards; s++) {
+        starts[s + 1] += starts[s];
+    }
+    std::vector<uint32_t> next(starts.begin(), starts.end() - 1);
+    for (uint32_t i = 0; i < num_entries; i++) {
+        order[next[shards[i]]++] = i;
+    }
+
+    if (pool_) {
+        pool_->run(num_shards, run_shard);
+    } else {
+        run_shard(0);
+    }
+}
+
+uint64_t ShardedSet::size() const {
+    uint64_t size = 0;
+    for (uint32_t g = 0; g < num_generations(); g++) {
+        for (size_t s = 0; s < shards_.size(); s++) {
+            size += generation(g)[s]->size();
+        }
+    }
+    return size;
+}
+
+ScanResult ShardedSet::scan(ScanCursor* cursor, uint32_t max_entries,
+                            const std::function<void(const BYTE*, int)>& fn) {
+    uint32_t seen = 0;
+    uint64_t end = first_generation_ + num_generations();
+
+    if (cursor->shard_ > shards_.size() || cursor->generation_ >= end) {
+        return SCAN_INVALID;
+    }
+    // The generation of the cursor was dropped: the scan goes on with the oldest one left.
+    if (cursor->generation_ < first_generation_) {
+        cursor->generation_ = first_generation_;
+        cursor->shard_ = 0;
+        cursor->pos_ = 0;
+    }
+
+    while (cursor->generation_ < end && seen < max_entries) {
+        if (cursor->shard_ == shards_.size()) {
+            if (cursor->generation_ + 1 == end) {
+                break;
+            }
+            cursor->generation_ ++;
+            cursor->shard_ = 0;
+        }
+        AttributesHashSet* shard = generation(cursor->generation_ - first_generation_)[cursor->shard_];
+        ExclusiveGuard guard(lock(cursor->shard_));
+
+        if (cursor->pos_ == 0) {
+            cursor->layout_ = shard->layout();
+        } else if (cursor->layout_ != shard->layout()) {
+            return SCAN_STALE;
+        }
+        bool more = shard->scan(&cursor->pos_, max_entries - seen, [&](const BYTE* entry, int len) {
+            fn(entry, len);
+            seen++;
+        });
+        if (!more) {
+            cursor->shard_ ++;
+            cursor->pos_ = 0;
+        }
+    }
+    bool done = cursor->generation_ + 1 >= end && cursor->shard_ == shards_.size();
+    return done ? SCAN_DONE : SCAN_MORE;
+}
+
+void ShardedSet::set_incremental_resize(uint32_t step_groups) {
+    resize_step_groups_ = step_groups;
+    for (uint32_t g = 0; g < num_generations(); g++) {
+        for (size_t s = 0; s < shards_.size(); s++) {
+            generation(g)[s]->set_incremental_resize(step_groups);
+        }
+    }
+}
+
+void ShardedSet::set_auto_compact(double dead_ratio, uint32_t step_groups) {
+    compact_dead_ratio_ = dead_ratio;
+    compact_step_groups_ = step_groups;
+    for (uint32_t g = 0; g < num_generations(); g++) {
+        for (size_t s = 0; s < shards_.size(); s++) {
+            generation(g)[s]->set_auto_compact(dead_ratio, step_groups);
+        }
+    }
+}
+
+void ShardedSet::set_filter(uint64_t expected_entries) {
+    // Any generation may end up with all the entries.
+    filter_entries_ = (expected_entries + shards_.size() - 1) / shards_.size();
+    for (uint32_t g = 0; g < num_generations(); g++) {
+        for (size_t s = 0; s < shards_.size(); s++) {
+            generation(g)[s]->set_filter(filter_entries_);
+        }
+    }
+}
+
+void ShardedSet::rebuild_filter() {
+    for (uint32_t g = 0; g < num_generations(); g++) {
+        for (size_t s = 0; s < shards_.size(); s++) {
+            generation(g)[s]->rebuild_filter();
+        }
+    }
+}
+
+bool ShardedSet::compact(uint32_t step_groups) {
+    // A shard with nothing to compact says so, and the next one gets the call.
+    uint32_t num_sets = num_generations() * shards_.size();
+    for (uint32_t n = 0; n < num_sets; n++) {
+        if (generation(compact_shard_ / shards_.size())[compact_shard_ % shards_.size()]->compact(step_groups)) {
+            return true;
+        }
+        compact_shard_ = (compact_shard_ + 1) % num_sets;
+    }
+    return false;
+}
+
+void ShardedSet::save(SnapshotWriter* writer) {
+    for (size_t s = 0; s < shards_.size(); s++) {
+        shards_[s]->save(writer);
+    }
+}
+
+bool ShardedSet::load(SnapshotReader* reader) {
+    for (size_t s = 0; s < shards_.size(); s++) {
+        if (!shards_[s]->load(reader)) {
+            for (size_t c = 0; c < s; c++) {
+                shards_[c]->clear();
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string ShardedSet::shard_dir(const std::string& dir, uint32_t shard) const {
+    return shards_.size() == 1 ? dir : dir + "/shard." + std::to_string(shard);
+}
+
+bool ShardedSet::set_mapped(const std::string& dir) {
+    for (size_t s = 0; s < shards_.size(); s++) {
+        std::string sub = shard_dir(dir, s);
+        if (shards_.size() > 1 && mkdir(sub.c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+        if (!shards_[s]->set_mapped(sub)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ShardedSet::sync(SnapshotWriter* writer) {
+    bool ok = true;
+    for (size_t s = 0; s < shards_.size(); s++) {
+        ok = shards_[s]->sync(writer) && ok;
+    }
+    return ok;
+}
+
+bool ShardedSet::open_mapped(const std::string& dir, SnapshotReader* reader, bool read_only) {
+    for (size_t s = 0; s < shards_.size(); s++) {
+        if (!shards_[s]->open_mapped(shard_dir(dir, s), reader, read_only)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Adds the stats of a shard to stat, which get_stats() and the like then finish with finish_stats().
+static void add_stats(BuboHashStat* stat, const BuboHashStat& shard) {
+    stat->spine_len += shard.spine_len;
+    stat->spine_use += shard.spine_use;
+    stat->entries += shard.entries;
+    stat->tombstones += shard.tombstones;
+    stat->ht_bytes += shard.ht_bytes;
+    stat->displaced += shard.displaced;
+    stat->total_probe_len += shard.total_probe_len;
+    stat->max_probe_len = std::max(stat->max_probe_len, shard.max_probe_len);
+    stat->dist_1_2 += shard.dist_1_2;
+    stat->dist_3_5 += shard.dist_3_5;
+    stat->dist_6_9 += shard.dist_6_9;
+    stat->dist_10_ += shard.dist_10_;
+    stat->resize_old_len += shard.resize_old_len;
+    stat->resize_migrated += shard.resize_migrated;
+    stat->blob_allocated_bytes += shard.blob_allocated_bytes;
+    stat->blob_used_bytes += shard.blob_used_bytes;
+    stat->blob_dead_bytes += shard.blob_dead_bytes;
+    stat->blob_compactions += shard.blob_compactions;
+    stat->filter_bytes += shard.filter_bytes;
+    stat->filter_capacity += shard.filter_capacity;
+    stat->filter_stale += shard.filter_stale;
+    stat->filter_fpr += shard.filter_fpr;
+    stat->evictions += shard.evictions;
+    stat->bytes += shard.bytes;
+}
+
+static void finish_stats(BuboHashStat* stat, uint32_t num_sets) {
+    if (stat->displaced > 0) {
+        stat->avg_probe_len = (double)stat->total_probe_len / (double)stat->displaced;
+    }
+    stat->filter_fpr /= num_sets;
+}
+
+void ShardedSet::get_stats(BuboHashStat* stat, bool detailed) const {
+    memset(stat, 0, sizeof(BuboHashStat));
+
+    for (uint32_t g = 0; g < num_generations(); g++) {
+        for (size_t s = 0; s < shards_.size(); s++) {
+            SharedGuard guard(lock(s));
+            BuboHashStat shard;
+            if (detailed) {
+                generation(g)[s]->get_detailed_stats(&shard);
+            } else {
+                generation(g)[s]->get_stats(&shard);
+            }
+            add_stats(stat, shard);
+        }
+    }
+    finish_stats(stat, num_generations() * shards_.size());
+}
+
+void ShardedSet::get_shard_stats(uint32_t shard, BuboHashStat* stat, bool detailed) const {
+    memset(stat, 0, sizeof(BuboHashStat));
+    SharedGuard guard(lock(shard));
+
+    for (uint32_t g = 0; g < num_generations(); g++) {
+        BuboHashStat part;
+        if (detailed) {
+            generation(g)[shard]->get_detailed_stats(&part);
+        } else {
+            generation(g)[shard]->get_stats(&part);
+        }
+        add_stats(stat, part);
+    }
+    finish_stats(stat, num_generations());
+}
+
+void ShardedSet::get_generation_stats(uint32_t g, BuboHashStat* stat) const {
+    memset(stat, 0, sizeof(BuboHashStat));
+
+    for (size_t s = 0; s < shards_.size(); s++) {
+        SharedGuard guard(lock(s));
+        BuboHashStat shard;
+        generation(g)[s]->get_stats(&shard);
+        add_stats(stat, shard);
+    }
+    finish_stats(stat, shards_.size());
+}
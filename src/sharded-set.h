@@ -0,0 +1,276 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+#include "bubo-types.h"
+#include "bubo-ht.h"
+#include "shared-set.h"
+#include "snapshot.h"
+#include "thread-pool.h"
+
+// Most shards a set may be split into.
+#define MAX_SHARDS 64
+
+// Most generations a windowed set may keep.
+#define MAX_GENERATIONS 64
+
+typedef BuboHashSet<BytePtrHash, BytePtrEqual> AttributesHashSet;
+
+// Entries encoded up front for a batch operation, one after the other.
+struct EntryBatch {
+    std::vector<BYTE> bytes_;
+    std::vector<uint32_t> offsets_;     // of every entry in bytes_
+    std::vector<uint32_t> lens_;
+    std::vector<uint32_t> rows_;        // index of the point of every entry, in the points of the batch
+
+    void add(const BYTE* entry, int len, uint32_t row) {
+        offsets_.push_back(bytes_.size());
+        lens_.push_back(len);
+        rows_.push_back(row);
+        bytes_.insert(bytes_.end(), entry, entry + len);
+    }
+
+    void clear() {
+        bytes_.clear();
+        offsets_.clear();
+        lens_.clear();
+        rows_.clear();
+    }
+
+    size_t size() const {
+        return rows_.size();
+    }
+
+    const BYTE* entry(size_t i) const {
+        return &bytes_[offsets_[i]];
+    }
+};
+
+// Where a scan of a ShardedSet is at. A new cursor starts at the beginning.
+struct ScanCursor {
+    uint64_t generation_ = 0;   // number of the generation (see ShardedSet::rotate())
+    uint32_t shard_ = 0;
+    uint32_t pos_ = 0;          // slot of the shard
+    uint64_t layout_ = 0;       // of the shard, when the scan got to it
+};
+
+enum ScanResult {
+    SCAN_MORE,                  // there may be more entries
+    SCAN_DONE,                  // the scan went past the last entry
+    SCAN_STALE,                 // the shard of the cursor was resized since its last scan
+    SCAN_INVALID,               // the cursor is past the last shard or generation, so not from scan()
+};
+
+/*
+ * ShardedSet splits the entries of an AttributesTable between num_shards BuboHashSets, each with
+ * its own BlobStore, picking the shard of an entry from its hash. Every shard resizes, allocates
+ * chunks and compacts on its own, so that a resize only stops the operations on its shard, and
+ * is 1/num_shards of the work.
+ *
+ * The batch methods hash the entries of a batch, group them by shard, and run every shard's
+ * group on a ThreadPool, up to one thread per shard. With a single shard, the set is just its
+ * BuboHashSet, and nothing runs on other threads.
+ *
+ * For a set that several threads share, set_concurrent() gives every shard a StripedLock, which
+ * the methods that work on entries (one entry or a batch) take, shared for lookups and
+ * exclusively for changes. The other methods work on the whole set, and need the caller to make
+ * sure nothing else uses it meanwhile.
+ *
+ * A windowed set (see set_generations()) keeps its entries in up to max_generations generations,
+ * each with num_shards BuboHashSets of its own. Entries are added to the current generation;
+ * rotate() starts a new one, and drops the oldest as a whole once there are too many, freeing
+ * its tables and chunks without going through its entries. An entry is only ever in one
+ * generation, that of its last insert(): inserting an entry of an older generation moves it
+ * to the current one, so that it outlives its generation. Lookups and erase() go through the
+ * generations of the entry's shard, newest first.
+ *
+ * With set_clock(), insert() and the batch inserts take a budget of bytes for the whole set, of
+ * which every shard gets an equal share: once a shard (all its generations) takes more than its
+ * share, it evicts entries, oldest generation first, with the CLOCK of its BuboHashSets (see
+ * BuboHashSet::evict()), until it fits again, or only has the entry just inserted left. A table
+ * that would grow past the share evicts to make room instead (see BuboHashSet::make_room()).
+ */
+class ShardedSet {
+public:
+    ShardedSet(uint32_t num_shards, const BytePtrHash& hash);
+    ~ShardedSet();
+
+    void set_concurrent();
+
+    uint32_t num_shards() const {
+        return shards_.size();
+    }
+
+    /*
+     * As the BuboHashSet methods of the same names, on the shard of the entry. insert() evicts
+     * entries to fit max_bytes, if not 0 (see set_clock()), and adds the number it evicted to
+     * evicted.
+     */
+    bool insert(const BYTE* entry, int len, uint64_t max_bytes = 0, uint64_t* evicted = NULL);
+    bool contains(const BYTE* entry, int len);
+    bool lookup(const BYTE* entry, int len) const;
+    void erase(const BYTE* entry, int len);
+
+    /*
+     * Sets the number of generations rotate() keeps, between 1 (the default, for a set that is
+     * not windowed) and MAX_GENERATIONS. Must be set before anything is added.
+     */
+    void set_generations(uint32_t max_generations);
+
+    uint32_t max_generations() const {
+        return max_generations_;
+    }
+
+    // Number of live generations, the current one included.
+    uint32_t num_generations() const {
+        return old_generations_.size() + 1;
+    }
+
+    /*
+     * Starts a new, empty, current generation, with the settings of the set, and drops the
+     * oldest one if that makes more than max_generations.
+     *
+     * Return value: the number of entries dropped.
+     */
+    uint64_t rotate();
+
+    /*
+     * Keeps the reference bits of the entries in every shard (see BuboHashSet::set_clock()), so
+     * that the inserts can evict entries to fit a budget. Must be set before anything is added.
+     */
+    void set_clock(bool clock);
+
+    // Bytes of the entries as BuboHashSet::bytes() counts them, for all the shards, each read with its lock held shared.
+    uint64_t bytes() const;
+
+    /*
+     * Inserts (resp. looks up, as contains() does, or lookup() for a concurrent set) every entry
+     * of a batch, in order within each shard, and sets flags[row] for the row of each entry to 1
+     * if it was new (resp. is present), 0 otherwise. insert_batch() evicts entries as insert()
+     * does.
+     */
+    void insert_batch(const EntryBatch& batch, uint8_t* flags, uint64_t max_bytes = 0, uint64_t* evicted = NULL);
+    void contains_batch(const EntryBatch& batch, uint8_t* flags);
+
+    uint64_t size() const;
+
+    /*
+     * Calls fn(entry, len) for up to max_entries entries from cursor on, one shard after the
+     * other, and one generation after the other, oldest first. Moves cursor past them. Entries
+     * added or erased between two scans (or moved to the current generation, or dropped with
+     * theirs) may or may not be seen, but the others are seen once, unless their shard is
+     * resized in between: the scan then stops with SCAN_STALE. A cursor with a shard or a
+     * generation that the set never had is left as it is, with SCAN_INVALID. Takes the locks of
+     * the shards exclusively, as resizes in progress are completed first.
+     */
+    ScanResult scan(ScanCursor* cursor, uint32_t max_entries, const std::function<void(const BYTE*, int)>& fn);
+
+    void set_incremental_resize(uint32_t step_groups);
+    void set_auto_compact(double dead_ratio, uint32_t step_groups);
+
+    // As for BuboHashSet, every shard's filter being sized for its share of expected_entries.
+    void set_filter(uint64_t expected_entries);
+    void rebuild_filter();
+
+    // Does up to step_groups groups of compaction work, one shard after the other. Returns true if there is more to do.
+    bool compact(uint32_t step_groups);
+
+    // As for BuboHashSet, one shard after the other. load() leaves every shard empty on failure.
+    void save(SnapshotWriter* writer);
+    bool load(SnapshotReader* reader);
+
+    /*
+     * As for BuboHashSet. With more than one shard, every shard has a directory of its own in dir,
+     * shard.<n>, which set_mapped() creates.
+     */
+    bool set_mapped(const std::string& dir);
+    bool sync(SnapshotWriter* writer);
+    bool open_mapped(const std::string& dir, SnapshotReader* reader, bool read_only);
+
+    /*
+     * Sums up the stats of the shards, with BuboHashSet::get_detailed_stats() if detailed, else
+     * get_stats(); max_probe_len is the largest, avg_probe_len the average over all of them,
+     * and filter_fpr the average over the shards, which lookups go to evenly. Takes the lock of
+     * every shard shared while reading it, so that the caller only needs to keep the generations
+     * as they are.
+     */
+    void get_stats(BuboHashStat* stat, bool detailed = false) const;
+
+    // As get_stats(), for a shard of every generation (resp. for every shard of generation g, oldest first).
+    void get_shard_stats(uint32_t shard, BuboHashStat* stat, bool detailed = false) const;
+    void get_generation_stats(uint32_t g, BuboHashStat* stat) const;
+
+private:
+    typedef std::vector<AttributesHashSet*> Generation;
+
+    Generation shards_;                 // of the current generation
+    std::deque<Generation> old_generations_;   // oldest first
+    uint32_t max_generations_ = 1;
+    uint64_t first_generation_ = 0;     // number of the oldest live generation, which rotate() counts
+
+    StripedLock* locks_ = NULL;         // one per shard, for a concurrent set
+    ThreadPool* pool_ = NULL;           // with more than one shard
+    BytePtrHash hash_;
+    uint32_t compact_shard_ = 0;        // shard compact() works on, over all the generations, oldest first
+
+    // Settings that every new generation gets.
+    uint32_t resize_step_groups_ = 0;
+    double compact_dead_ratio_ = DEFAULT_COMPACT_DEAD_RATIO;
+    uint32_t compact_step_groups_ = 0;
+    uint64_t filter_entries_ = 0;       // per shard
+    bool clock_ = false;
+
+    // Returns the shard of an entry, and sets h to its hash.
+    inline uint32_t shard_of(const BYTE* entry, int len, uint32_t* h) const {
+        *h = hash_(entry, len);
+        return shard_of(*h);
+    }
+
+    inline uint32_t shard_of(uint32_t h) const {
+        // Mixed (with the murmur3 finalizer) so that the shard says nothing about the hash bits
+        // that pick slots within it.
+        h ^= h >> 16;
+        h *= 0x85ebca6b;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35;
+        h ^= h >> 16;
+        return ((uint64_t)h * shards_.size()) >> 32;
+    }
+
+    StripedLock* lock(uint32_t shard) const {
+        return locks_ ? &locks_[shard] : NULL;
+    }
+
+    std::string shard_dir(const std::string& dir, uint32_t shard) const;
+
+    // Generation g, oldest first, of num_generations().
+    const Generation& generation(uint32_t g) const {
+        return g < old_generations_.size() ? old_generations_[g] : shards_;
+    }
+
+    Generation new_generation();
+
+    /*
+     * The entry methods on shard s, through its generations, with the lock of the shard held as
+     * the methods of the same names take it. insert_in() returns true if the entry was new to
+     * every generation. With shard_max_bytes (if not 0), it makes room in the current table
+     * rather than grow it past shard_max_bytes, and evicts entries of the shard other than the
+     * one inserted until it fits, adding the number it evicted to evicted.
+     */
+    bool insert_in(uint32_t s, const BYTE* entry, int len, uint32_t h, uint64_t shard_max_bytes, uint64_t* evicted);
+    uint64_t shard_bytes(uint32_t s) const;
+    uint64_t shard_max_bytes(uint64_t max_bytes) const {
+        return max_bytes ? std::max<uint64_t>(max_bytes / shards_.size(), 1) : 0;
+    }
+    bool contains_in(uint32_t s, const BYTE* entry, int len, uint32_t h);
+    bool lookup_in(uint32_t s, const BYTE* entry, int len, uint32_t h) const;
+
+    void run_batch(const EntryBatch& batch, uint8_t* flags, bool insert, uint64_t max_bytes, uint64_t* evicted);
+
+    ShardedSet(const ShardedSet&);
+    ShardedSet& operator=(const ShardedSet&);
+};
@@ -0,0 +1,50 @@
+#include <atomic>
+#include <unordered_map>
+#include "shared-set.h"
+#include "attrs-table.h"
+#include "strings-table.h"
+
+// Sets by name, and the mutex that goes with them and with the reference counts.
+static std::mutex g_shared_sets_mutex;
+static std::unordered_map<std::string, SharedSet*> g_shared_sets;
+
+uint32_t StripedLock::stripe() {
+    static std::atomic<uint32_t> next_stripe(0);
+    static thread_local uint32_t thread_stripe = next_stripe++ % LOCK_STRIPES;
+    return thread_stripe;
+}
+
+SharedSet::~SharedSet() {
+    delete attrs_table_;
+    delete strings_table_;
+}
+
+SharedSet* SharedSet::attach(const std::string& name, const std::function<SharedSet*()>& create) {
+    std::lock_guard<std::mutex> guard(g_shared_sets_mutex);
+
+    std::unordered_map<std::string, SharedSet*>::iterator it = g_shared_sets.find(name);
+    SharedSet* set;
+    if (it != g_shared_sets.end()) {
+        set = it->second;
+    } else {
+        set = create();
+        if (set == NULL) {
+            return NULL;
+        }
+        set->name_ = name;
+        g_shared_sets[name] = set;
+    }
+    set->refs_ ++;
+    return set;
+}
+
+void SharedSet::detach(SharedSet* set) {
+    {
+        std::lock_guard<std::mutex> guard(g_shared_sets_mutex);
+        if (--set->refs_ > 0) {
+            return;
+        }
+        g_shared_sets.erase(set->name_);
+    }
+    delete set;
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "bubo-types.h"
+
+class StringsTable;
+class AttributesTable;
+
+// Number of stripes of a StripedLock: threads past this many share stripes with others.
+#define LOCK_STRIPES 16
+
+/*
+ * A reader-writer lock made of one mutex per stripe. Each thread is given a stripe of its own,
+ * which is all a reader locks, so that readers of different threads do not contend with each
+ * other, not even on a shared counter; a writer locks every stripe, in order.
+ */
+class StripedLock {
+public:
+    void lock_shared() {
+        stripes_[stripe()].mutex_.lock();
+    }
+
+    void unlock_shared() {
+        stripes_[stripe()].mutex_.unlock();
+    }
+
+    void lock() {
+        for (int s = 0; s < LOCK_STRIPES; s++) {
+            stripes_[s].mutex_.lock();
+        }
+    }
+
+    void unlock() {
+        for (int s = LOCK_STRIPES - 1; s >= 0; s--) {
+            stripes_[s].mutex_.unlock();
+        }
+    }
+
+private:
+    struct alignas(64) Stripe {
+        std::mutex mutex_;
+    };
+
+    Stripe stripes_[LOCK_STRIPES];
+
+    // The stripe of the calling thread, handed out round robin as threads first lock.
+    static uint32_t stripe();
+};
+
+// Holds a lock shared (resp. exclusively) for the scope of the guard. A NULL lock is not locked.
+class SharedGuard {
+public:
+    explicit SharedGuard(StripedLock* lock) : lock_(lock) {
+        if (lock_) {
+            lock_->lock_shared();
+        }
+    }
+    ~SharedGuard() {
+        if (lock_) {
+            lock_->unlock_shared();
+        }
+    }
+
+private:
+    StripedLock* lock_;
+
+    SharedGuard(const SharedGuard&);
+    SharedGuard& operator=(const SharedGuard&);
+};
+
+class ExclusiveGuard {
+public:
+    explicit ExclusiveGuard(StripedLock* lock) : lock_(lock) {
+        if (lock_) {
+            lock_->lock();
+        }
+    }
+    ~ExclusiveGuard() {
+        if (lock_) {
+            lock_->unlock();
+        }
+    }
+
+private:
+    StripedLock* lock_;
+
+    ExclusiveGuard(const ExclusiveGuard&);
+    ExclusiveGuard& operator=(const ExclusiveGuard&);
+};
+
+/*
+ * The contents of a set that Bubo instances of several threads (the main one and worker_threads)
+ * share by name: the strings table and the attributes table that owns the entries, with the
+ * settings that shape them. Each instance has an AttributesTable of its own in front of these,
+ * for what is bound to its isolate (the shape cache) and for its scratch buffers, and goes
+ * through lock_ for everything else.
+ */
+class SharedSet {
+public:
+    // Takes ownership of the tables.
+    SharedSet(StringsTable* strings_table, AttributesTable* attrs_table)
+        : strings_table_(strings_table), attrs_table_(attrs_table),
+          hash_function_(BUBO_HASH_WYHASH), hash_seed_(0), typed_values_(false), num_shards_(1), refs_(0) {}
+    ~SharedSet();
+
+    /*
+     * Returns the set registered under name, with a reference taken for the caller. If there is
+     * none, registers the one create() returns, unless it returns NULL; NULL is returned then.
+     */
+    static SharedSet* attach(const std::string& name, const std::function<SharedSet*()>& create);
+
+    // Drops a reference taken by attach(). The last one unregisters and deletes the set.
+    static void detach(SharedSet* set);
+
+    StringsTable* strings_table_;
+    AttributesTable* attrs_table_;
+    StripedLock lock_;
+
+    // Settings of the instance that created the set, which the instances attaching to it take.
+    BuboHashFunction hash_function_;
+    uint64_t hash_seed_;
+    bool typed_values_;
+    uint32_t num_shards_;
+    std::vector<std::string> ignored_attributes_;
+    std::string map_dir_;       // empty unless mapped
+
+private:
+    std::string name_;
+    uint32_t refs_;
+
+    SharedSet(const SharedSet&);
+    SharedSet& operator=(const SharedSet&);
+};
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <string.h>
+#include "snapshot.h"
+#include "utils.h"
+
+static const uint64_t SNAPSHOT_CHECKSUM_SEED = 0x6275626f736e6170ull;
+
+SnapshotWriter::SnapshotWriter(FILE* file) : file_(file),
+                                             buf_(new BYTE[SNAPSHOT_BLOCK_SIZE]),
+                                             pos_(0),
+                                             checksum_(SNAPSHOT_CHECKSUM_SEED),
+                                             failed_(false) {
+}
+
+SnapshotWriter::~SnapshotWriter() {
+    delete [] buf_;
+}
+
+void SnapshotWriter::flush() {
+    if (pos_ == 0) {
+        return;
+    }
+    checksum_ = bubo_utils::wyhash_byte_sequence(buf_, pos_, checksum_);
+    if (fwrite(buf_, 1, pos_, file_) != pos_) {
+        failed_ = true;
+    }
+    pos_ = 0;
+}
+
+void SnapshotWriter::write(const void* data, size_t len) {
+    const BYTE* p = (const BYTE*)data;
+
+    while (len > 0) {
+        size_t n = SNAPSHOT_BLOCK_SIZE - pos_;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(buf_ + pos_, p, n);
+        pos_ += n;
+        p += n;
+        len -= n;
+
+        if (pos_ == SNAPSHOT_BLOCK_SIZE) {
+            flush();
+        }
+    }
+}
+
+void SnapshotWriter::write_zeros(size_t len) {
+    static const BYTE zeros[256] = {};
+
+    while (len > 0) {
+        size_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+        write(zeros, n);
+        len -= n;
+    }
+}
+
+void SnapshotWriter::write_string(const char* s) {
+    uint32_t len = strlen(s);
+    write_value(len);
+    write(s, len);
+}
+
+bool SnapshotWriter::finish() {
+    flush();
+    if (fwrite(&checksum_, 1, sizeof(checksum_), file_) != sizeof(checksum_)) {
+        failed_ = true;
+    }
+    if (fflush(file_) != 0) {
+        failed_ = true;
+    }
+    return !failed_;
+}
+
+
+SnapshotReader::SnapshotReader(FILE* file) : file_(file),
+                                             buf_(new BYTE[SNAPSHOT_BLOCK_SIZE]),
+                                             pos_(0),
+                                             avail_(0),
+                                             data_left_(0),
+                                             checksum_(SNAPSHOT_CHECKSUM_SEED),
+                                             failed_(false) {
+    long size = -1;
+    if (fseek(file_, 0, SEEK_END) == 0) {
+        size = ftell(file_);
+    }
+    if (size < (long)sizeof(uint64_t) || fseek(file_, 0, SEEK_SET) != 0) {
+        failed_ = true;
+    } else {
+        data_left_ = size - sizeof(uint64_t);
+    }
+}
+
+SnapshotReader::~SnapshotReader() {
+    delete [] buf_;
+}
+
+// Reads len bytes (a multiple of SNAPSHOT_BLOCK_SIZE, or the rest of the file) and checksums them.
+bool SnapshotReader::read_blocks(BYTE* data, size_t len) {
+    if (fread(data, 1, len, file_) != len) {
+        failed_ = true;
+        return false;
+    }
+    data_left_ -= len;
+
+    for (size_t off = 0; off < len; off += SNAPSHOT_BLOCK_SIZE) {
+        size_t n = len - off < SNAPSHOT_BLOCK_SIZE ? len - off : SNAPSHOT_BLOCK_SIZE;
+        checksum_ = bubo_utils::wyhash_byte_sequence(data + off, n, checksum_);
+    }
+    return true;
+}
+
+bool SnapshotReader::read(void* data, size_t len) {
+    BYTE* p = (BYTE*)data;
+
+    if (failed_ || len > remaining()) {
+        failed_ = true;
+        return false;
+    }
+
+    while (len > 0) {
+        if (pos_ == avail_) {
+            // Whole blocks go straight to their destination.
+            size_t direct = len < data_left_ ? len : data_left_;
+            if (direct < data_left_) {
+                direct -= direct % SNAPSHOT_BLOCK_SIZE;
+            }
+            if (direct >= SNAPSHOT_BLOCK_SIZE || (direct > 0 && direct == data_left_)) {
+                if (!read_blocks(p, direct)) {
+                    return false;
+                }
+                p += direct;
+                len -= direct;
+                continue;
+            }
+
+            size_t n = data_left_ < SNAPSHOT_BLOCK_SIZE ? data_left_ : SNAPSHOT_BLOCK_SIZE;
+            if (!read_blocks(buf_, n)) {
+                return false;
+            }
+            pos_ = 0;
+            avail_ = n;
+        }
+
+        size_t n = avail_ - pos_;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(p, buf_ + pos_, n);
+        pos_ += n;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool SnapshotReader::read_string_len(uint32_t* len) {
+    if (!read_value(len) || *len > SNAPSHOT_MAX_STRING_LEN || *len > remaining()) {
+        failed_ = true;
+        return false;
+    }
+    return true;
+}
+
+char* SnapshotReader::read_string() {
+    uint32_t len = 0;
+    if (!read_string_len(&len)) {
+        return NULL;
+    }
+
+    char* s = (char*)malloc(len + 1);
+    if (!read(s, len)) {
+        free(s);
+        return NULL;
+    }
+    s[len] = '\0';
+    return s;
+}
+
+bool SnapshotReader::finish() {
+    uint64_t checksum = 0;
+
+    if (failed_ || remaining() != 0) {
+        return false;
+    }
+    if (fread(&checksum, 1, sizeof(checksum), file_) != sizeof(checksum)) {
+        return false;
+    }
+    return checksum == checksum_;
+}
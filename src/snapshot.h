@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include "bubo-types.h"
+
+#define SNAPSHOT_MAGIC "BUBOSNAP"
+#define SNAPSHOT_VERSION 2
+
+// The snapshot of a mapped set holds what is not in its files, and goes in its directory.
+#define SNAPSHOT_MAP_MAGIC "BUBOMETA"
+#define MAP_SNAPSHOT_NAME "meta"
+
+// Unit of the buffered reads and writes, and of the checksum.
+#define SNAPSHOT_BLOCK_SIZE (1 << 20)
+
+// Longest tag or value a snapshot may hold; anything longer means the file is corrupt.
+#define SNAPSHOT_MAX_STRING_LEN (64 << 20)
+
+/*
+ * A snapshot file is the sequence of whatever the save() methods write, in the byte order of the
+ * machine that wrote it, followed by an 8 byte checksum: wyhash chained over every
+ * SNAPSHOT_BLOCK_SIZE bytes of the file before it.
+ */
+class SnapshotWriter {
+public:
+    SnapshotWriter(FILE* file);
+    ~SnapshotWriter();
+
+    void write(const void* data, size_t len);
+    void write_zeros(size_t len);
+    // A string as its length (uint32_t) and its bytes, without the terminating NUL.
+    void write_string(const char* s);
+
+    template<typename T> void write_value(const T& value) {
+        write(&value, sizeof(value));
+    }
+
+    // Writes out the checksum. Returns false if any write failed.
+    bool finish();
+
+private:
+    FILE* file_;
+    BYTE* buf_;
+    size_t pos_;
+    uint64_t checksum_;
+    bool failed_;
+
+    void flush();
+};
+
+class SnapshotReader {
+public:
+    SnapshotReader(FILE* file);
+    ~SnapshotReader();
+
+    // Return value: false if the file ends before len bytes (or after an earlier failure).
+    bool read(void* data, size_t len);
+    // Returns a NUL terminated copy of a string written by write_string(), to be free()d, or NULL.
+    char* read_string();
+    // Reads the length of such a string, whose bytes are to be read() next. Returns false if it is not valid.
+    bool read_string_len(uint32_t* len);
+
+    template<typename T> bool read_value(T* value) {
+        return read(value, sizeof(*value));
+    }
+
+    // Bytes left to read before the checksum, to check sizes read from the file against.
+    uint64_t remaining() const {
+        return data_left_ + (avail_ - pos_);
+    }
+
+    // Returns true if everything was read and the checksum matches.
+    bool finish();
+
+private:
+    FILE* file_;
+    BYTE* buf_;
+    size_t pos_;
+    size_t avail_;
+    uint64_t data_left_;        // bytes of the file not read into buf_ yet, before the checksum
+    uint64_t checksum_;
+    bool failed_;
+
+    bool read_blocks(BYTE* data, size_t len);
+};
@@ -1,29 +1,72 @@
 #include <stdlib.h>
 #include <assert.h>
+#include <new>
 #include "strings-table.h"
 #include "utils.h"
 #include "persistent-string.h"
 
 StringsTable::~StringsTable() {
     for (tags_t::iterator t = tags_.begin(); t != tags_.end(); t++) {
-        if (t->first) {
-            free((void*)t->first);
-        }
-        if (t->second) {
-            for (values_t::iterator n = t->second->vals_.begin(); n != t->second->vals_.end(); n++) {
-                if (n->first) {
-                    free((void*)n->first);
-                }
-            }
-            t->second->vals_.clear();
-        }
         delete t->second;
     }
     tags_.clear();
+    for (size_t i = 0; i < chunks_.size(); i++) {
+        free(chunks_[i]);
+    }
+}
+
+char* StringsTable::alloc_str(uint32_t len) {
+    size_t size = sizeof(len) + len + 1;
+    char* str = NULL;
+
+    if (size > chunk_left_) {
+        // A string that would waste much of a new chunk gets its own, and the current one stays.
+        size_t chunk_size = size > STRINGS_CHUNK_SIZE / 4 ? size : STRINGS_CHUNK_SIZE;
+        char* chunk = (char*)malloc(chunk_size);
+        if (!chunk) {
+            throw std::bad_alloc();
+        }
+        chunks_.push_back(chunk);
+        allocated_bytes_ += chunk_size;
+        if (chunk_size == size) {
+            str = chunk;
+        } else {
+            chunk_pos_ = chunk;
+            chunk_left_ = chunk_size;
+        }
+    }
+    if (!str) {
+        str = chunk_pos_;
+        chunk_pos_ += size;
+        chunk_left_ -= size;
+    }
+    used_bytes_ += size;
+    num_strings_ ++;
+
+    memcpy(str, &len, sizeof(len));
+    str += sizeof(len);
+    str[len] = '\0';
+    return str;
+}
+
+const char* StringsTable::load_str(SnapshotReader* reader) {
+    uint32_t len = 0;
+    if (!reader->read_string_len(&len)) {
+        return NULL;
+    }
+    char* str = alloc_str(len);
+    return reader->read(str, len) ? str : NULL;
 }
 
 /* Return true if both the tag and tagname are found in the strings table */
 bool StringsTable::check_and_add(const char* tag, const char* val, EntryToken* token) {
+    TagEntry* te = NULL;
+
+    bool found = check_and_add_tag(tag, token, &te);
+    return check_and_add_val(te, val, token) && found;
+}
+
+bool StringsTable::check_and_add_tag(const char* tag, EntryToken* token, TagEntry** tag_entry) {
 
     bool found = true;
 
@@ -32,10 +75,12 @@ bool StringsTable::check_and_add(const char* tag, const char* val, EntryToken* t
 
     tags_t::iterator ti = tags_.find(tag);
     if (ti == tags_.end()) {
-        tagstr = strdup(tag);
-        allocated_bytes_ += strlen(tagstr) + 1;
-        te = new TagEntry(last_tag_seq_no_++);
+        tagstr = intern(tag);
+        te = new TagEntry(last_tag_seq_no_++, hash_);
+        te->tag_ = tagstr;
         tags_.insert(std::make_pair(tagstr, te));
+        tags_by_seq_.resize(last_tag_seq_no_, NULL);
+        tags_by_seq_[te->tag_seq_no_] = te;
         found = false;
     } else {
         tagstr = ti->first;
@@ -43,16 +88,26 @@ bool StringsTable::check_and_add(const char* tag, const char* val, EntryToken* t
     }
     token->tag_ = tagstr;
     token->tag_seq_no_ = te->tag_seq_no_;
+    *tag_entry = te;
+
+    return found;
+}
+
+bool StringsTable::check_and_add_val(TagEntry* te, const char* val, EntryToken* token) {
+
+    bool found = true;
 
     const char* valstr = NULL;
     uint64_t valseq = 0;
 
     values_t::iterator vi = te->vals_.find(val);
     if (vi == te->vals_.end()) {
-        valstr = strdup(val);
-        allocated_bytes_ += strlen(valstr) + 1;
+        valstr = intern(val);
         valseq = te->last_val_seq_no_++;
         te->vals_.insert(std::make_pair(valstr, valseq));
+        te->vals_by_seq_.resize(te->last_val_seq_no_, NULL);
+        te->vals_by_seq_[valseq] = valstr;
+        num_vals_ ++;
         found = false;
 
     } else {
@@ -65,6 +120,29 @@ bool StringsTable::check_and_add(const char* tag, const char* val, EntryToken* t
     return found;
 }
 
+bool StringsTable::find_tag(const char* tag, EntryToken* token, TagEntry** tag_entry) const {
+    tags_t::const_iterator ti = tags_.find(tag);
+    if (ti == tags_.end()) {
+        return false;
+    }
+    token->tag_ = ti->first;
+    token->tag_seq_no_ = ti->second->tag_seq_no_;
+    *tag_entry = ti->second;
+
+    return true;
+}
+
+bool StringsTable::find_val(const TagEntry* te, const char* val, EntryToken* token) const {
+    values_t::const_iterator vi = te->vals_.find(val);
+    if (vi == te->vals_.end()) {
+        return false;
+    }
+    token->val_ = vi->first;
+    token->val_seq_no_ = vi->second;
+
+    return true;
+}
+
 size_t StringsTable::get_num_tags() const {
     return tags_.size();
 }
@@ -77,20 +155,97 @@ size_t StringsTable::get_num_vals(const char* tag) const {
     return 0;
 }
 
-void StringsTable::stats(v8::Local<v8::Object>& stats) const {
-    static PersistentString allocated_bytes("allocated_bytes");
-    static PersistentString num_tags("num_tags");
-    static PersistentString num_vals_str("num_vals_all");
+void StringsTable::save(SnapshotWriter* writer) const {
+    writer->write_value(last_tag_seq_no_);
+    writer->write_value((uint64_t)tags_.size());
+
+    for (tags_t::const_iterator t = tags_.begin(); t != tags_.end(); t++) {
+        writer->write_string(t->first);
+        writer->write_value(t->second->tag_seq_no_);
+        writer->write_value(t->second->last_val_seq_no_);
+        writer->write_value((uint64_t)t->second->vals_.size());
+
+        for (values_t::const_iterator v = t->second->vals_.begin(); v != t->second->vals_.end(); v++) {
+            writer->write_string(v->first);
+            writer->write_value(v->second);
+        }
+    }
+}
+
+bool StringsTable::load(SnapshotReader* reader) {
+    uint64_t num_tags = 0;
+
+    assert(tags_.empty());
+    if (!reader->read_value(&last_tag_seq_no_) || !reader->read_value(&num_tags)) {
+        return false;
+    }
+    // Every tag takes at least 20 bytes, which bounds what a corrupt count can reserve. Tags
+    // are never removed, so their sequence numbers are 1 to num_tags.
+    if (num_tags > reader->remaining() / 20 || last_tag_seq_no_ != num_tags + 1) {
+        return false;
+    }
+    tags_.reserve(num_tags);
+    tags_by_seq_.assign(last_tag_seq_no_, NULL);
+
+    for (uint64_t i = 0; i < num_tags; i++) {
+        uint32_t tag_seq = 0, last_val_seq = 0;
+        uint64_t num_vals = 0;
+
+        // Strings read before a failure stay in the chunks until the table is deleted.
+        const char* tag = load_str(reader);
+        if (!tag) {
+            return false;
+        }
+        if (!reader->read_value(&tag_seq) || !reader->read_value(&last_val_seq) ||
+            !reader->read_value(&num_vals) || tag_seq == 0 || tag_seq >= last_tag_seq_no_ ||
+            num_vals > reader->remaining() / 12 || last_val_seq != num_vals + 1) {
+            return false;
+        }
+
+        TagEntry* te = new TagEntry(tag_seq, hash_);
+        te->last_val_seq_no_ = last_val_seq;
+        te->tag_ = tag;
+        if (tags_by_seq_[tag_seq] || !tags_.insert(std::make_pair(tag, te)).second) {
+            delete te;
+            return false;
+        }
+        tags_by_seq_[tag_seq] = te;
+        te->vals_.reserve(num_vals);
+        te->vals_by_seq_.assign(last_val_seq, NULL);
+
+        for (uint64_t j = 0; j < num_vals; j++) {
+            uint64_t val_seq = 0;
+            const char* val = load_str(reader);
+            if (!val) {
+                return false;
+            }
+            if (!reader->read_value(&val_seq) || val_seq == 0 || val_seq >= last_val_seq || te->vals_by_seq_[val_seq] ||
+                !te->vals_.insert(std::make_pair(val, val_seq)).second) {
+                return false;
+            }
+            te->vals_by_seq_[val_seq] = val;
+            num_vals_ ++;
+        }
+    }
+    return true;
+}
+
+void StringsTable::stats(v8::Local<v8::Object>& stats, bool detailed) const {
+    static thread_local PersistentString allocated_bytes("allocated_bytes");
+    static thread_local PersistentString used_bytes("used_bytes");
+    static thread_local PersistentString num_tags("num_tags");
+    static thread_local PersistentString num_vals_str("num_vals_all");
 
 
     Nan::Set(stats, allocated_bytes, Nan::New<v8::Number>(allocated_bytes_));
+    Nan::Set(stats, used_bytes, Nan::New<v8::Number>(used_bytes_));
     Nan::Set(stats, num_tags, Nan::New<v8::Number>(tags_.size()));
+    Nan::Set(stats, num_vals_str, Nan::New<v8::Number>(num_vals_));
 
-    uint64_t num_vals_all = 0;
+    if (!detailed) {
+        return;
+    }
     for (tags_t::const_iterator t = tags_.begin(); t != tags_.end(); t++) {
-        size_t num_vals = t->second->vals_.size();
-        Nan::Set(stats, Nan::New(t->first).ToLocalChecked(), Nan::New<v8::Number>(num_vals));
-        num_vals_all += num_vals;
+        Nan::Set(stats, Nan::New(t->first).ToLocalChecked(), Nan::New<v8::Number>(t->second->vals_.size()));
     }
-    Nan::Set(stats, num_vals_str, Nan::New<v8::Number>(num_vals_all));
 }
@@ -3,10 +3,18 @@
 #include <stdint.h>
 #include <string.h>
 #include <unordered_map>
+#include <vector>
 #include "bubo-types.h"
+#include "snapshot.h"
 
 struct EntryToken;
 
+// Size of the chunks the strings of a StringsTable are copied into. Longer strings get a chunk of their own.
+#define STRINGS_CHUNK_SIZE (64 << 10)
+
+// Bytes counted by StringsTable::bytes() for every string on top of its own: its node and bucket in a map, and its TagEntry or array slot.
+#define STRINGS_ENTRY_OVERHEAD 64
+
 /*
  * StringsTable is a two-level map of tags and values.
  * +--------+------------------+
@@ -34,44 +42,131 @@ struct EntryToken;
  * |        | +----------------------------------------------------------------------+
  * |        | last_val_seq_no_ |
  * +--------+------------------+
+ *
+ * The other way around, tags_by_seq_ and the vals_by_seq_ of every tag map sequence numbers back
+ * to the strings, so that decoding an entry is a matter of indexing arrays.
+ *
+ * Every string (the keys of the maps, which the arrays and the tokens point to as well) is
+ * interned once, in large chunks of memory, right after its length as a uint32_t.
  */
 
 class StringsTable {
 public:
-    StringsTable() : tags_(), last_tag_seq_no_(1), allocated_bytes_(0) {}
+    StringsTable(const CharPtrHash& hash = CharPtrHash()) : hash_(hash), tags_(0, hash), last_tag_seq_no_(1), chunk_left_(0),
+                                                           allocated_bytes_(0), used_bytes_(0), num_strings_(0), num_vals_(0) {}
     virtual ~StringsTable();
 
     /* Checks for the presence of the given tag and val in the internal maps.
      * If found, fill up the corresponding sequnce numbers and char pointers into token.
      * If not found, add entry/entries in the map(s) (note: the 'char*' key gets
-     * created in the heap) and fill up the corresponding sequnce numbers and char
+     * interned in the table's chunks) and fill up the corresponding sequnce numbers and char
      * pointers into token.
      *
      * Return value: true if both tag and tagname are found. False otherwise.
      */
     bool check_and_add(const char* tag, const char* val, EntryToken* token);
 
+    struct TagEntry;
+
+    /* The two halves of check_and_add(), for callers that look up many values of one tag:
+     * check_and_add_tag() fills in the tag part of token, and returns the tag's entry for
+     * check_and_add_val() to fill in the value part.
+     *
+     * Return value: true if the tag (resp. value) was found. False otherwise.
+     */
+    bool check_and_add_tag(const char* tag, EntryToken* token, TagEntry** tag_entry);
+    bool check_and_add_val(TagEntry* tag_entry, const char* val, EntryToken* token);
+
+    /* Read-only versions of the above, which fill in token (and tag_entry) the same way if
+     * the tag (resp. value) is known, and leave the table untouched otherwise.
+     *
+     * Return value: true if the tag (resp. value) was found. False otherwise.
+     */
+    bool find_tag(const char* tag, EntryToken* token, TagEntry** tag_entry) const;
+    bool find_val(const TagEntry* tag_entry, const char* val, EntryToken* token) const;
+
+    /* Reverse lookups, for decoding entries: find_tag_entry() returns the tag of a sequence
+     * number, and find_val_str() the value of a sequence number within a tag.
+     *
+     * Return value: NULL if there is no such tag (resp. value).
+     */
+    const TagEntry* find_tag_entry(uint32_t tag_seq_no) const {
+        return tag_seq_no < tags_by_seq_.size() ? tags_by_seq_[tag_seq_no] : NULL;
+    }
+    static inline const char* find_val_str(const TagEntry* tag_entry, uint64_t val_seq_no);
+
+    // The length of a string of the table (a tag_ or val_ it filled in), without a strlen().
+    static inline uint32_t str_len(const char* str) {
+        uint32_t len;
+        memcpy(&len, str - sizeof(len), sizeof(len));
+        return len;
+    }
+
     /* returns number of tag entries in the internal map */
     size_t get_num_tags() const;
     /* returns number of tagname entries corresponding to the tag in the internal map */
     size_t get_num_vals(const char* tag) const;
 
-    void stats(v8::Local<v8::Object>& stats) const;
+    /* Sets the sizes of the table on stats, from counters. With detailed, also the number of
+     * values of every tag, under the name of the tag, which goes over the tags.
+     */
+    void stats(v8::Local<v8::Object>& stats, bool detailed = false) const;
+
+    /* An estimate of the memory of the table: its chunks, plus STRINGS_ENTRY_OVERHEAD for every
+     * string, for the maps and arrays, without going over them.
+     */
+    uint64_t bytes() const {
+        return allocated_bytes_ + num_strings_ * STRINGS_ENTRY_OVERHEAD;
+    }
+
+    /* Writes every tag and value, with their sequence numbers, to a snapshot. */
+    void save(SnapshotWriter* writer) const;
+    /* Reads what save() wrote into an empty table.
+     *
+     * Return value: false if the snapshot is truncated or inconsistent. True otherwise.
+     */
+    bool load(SnapshotReader* reader);
 
 protected:
 
     typedef std::unordered_map<const char*, uint64_t, CharPtrHash, CharPtrEqual> values_t;
-
-    struct TagEntry {
-        uint32_t tag_seq_no_;
-        uint32_t last_val_seq_no_;
-        values_t vals_;
-        TagEntry(uint64_t s) : tag_seq_no_(s), last_val_seq_no_(1), vals_() {}
-    };
     typedef std::unordered_map<const char*, TagEntry*, CharPtrHash, CharPtrEqual> tags_t;
 
+    CharPtrHash hash_;
     tags_t tags_;
     uint32_t last_tag_seq_no_;
+    std::vector<TagEntry*> tags_by_seq_;    // indexed by tag_seq_no_, NULL where there is none
+
+    std::vector<char*> chunks_;
+    char* chunk_pos_;                       // free space of the chunk being filled
+    size_t chunk_left_;
+
+    uint64_t allocated_bytes_;              // size of the chunks
+    uint64_t used_bytes_;                   // bytes of the chunks taken by strings
+    uint64_t num_strings_;                  // tags and values
+    uint64_t num_vals_;                     // values of all the tags
 
-    uint64_t allocated_bytes_;
+    // Makes room for a string of len bytes, with its length in front and a NUL after. Returns the string.
+    char* alloc_str(uint32_t len);
+    char* intern(const char* str) {
+        uint32_t len = strlen(str);
+        char* copy = alloc_str(len);
+        memcpy(copy, str, len);
+        return copy;
+    }
+    // Reads a string written by SnapshotWriter::write_string() into the chunks. Returns NULL on failure.
+    const char* load_str(SnapshotReader* reader);
 };
+
+struct StringsTable::TagEntry {
+    uint32_t tag_seq_no_;
+    uint32_t last_val_seq_no_;
+    values_t vals_;
+    const char* tag_;                       // the key of this entry in tags_
+    std::vector<const char*> vals_by_seq_;  // the keys of vals_, indexed by sequence number
+    TagEntry(uint64_t s, const CharPtrHash& hash) : tag_seq_no_(s), last_val_seq_no_(1), vals_(0, hash), tag_(NULL) {}
+};
+
+inline const char* StringsTable::find_val_str(const TagEntry* tag_entry, uint64_t val_seq_no) {
+    return val_seq_no < tag_entry->vals_by_seq_.size() ? tag_entry->vals_by_seq_[val_seq_no] : NULL;
+}
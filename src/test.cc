@@ -1,6 +1,12 @@
 #include <assert.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <thread>
 #include <unordered_set>
 #include "bubo-types.h"
 #include "utils.h"
@@ -8,6 +14,10 @@
 #include "strings-table.h"
 #include "attrs-table.h"
 #include "bubo-ht.h"
+#include "shared-set.h"
+#include "sharded-set.h"
+#include "set-ops.h"
+#include "hyperloglog.h"
 
 static std::vector<std::string> ignored_attributes;
 
@@ -58,6 +68,33 @@ static void test_hash_function_diff_input() {
     assert(s1 != s2 || !memcmp(a, b, 5));
 }
 
+static void test_wyhash() {
+    BYTE a[100];
+    for (int i = 0; i < 100; i++) {
+        a[i] = i;
+    }
+
+    // every length takes a different path: empty, 1-3, 4-16, 17-48 and over 48 bytes.
+    for (int len = 0; len < 100; len++) {
+        uint64_t h = bubo_utils::wyhash_byte_sequence(a, len, 7);
+        assert(h == bubo_utils::wyhash_byte_sequence(a, len, 7));
+        assert(h != bubo_utils::wyhash_byte_sequence(a, len, 8));
+        if (len > 0) {
+            assert(h != bubo_utils::wyhash_byte_sequence(a, len - 1, 7));
+
+            a[len - 1] ^= 0x01;
+            assert(h != bubo_utils::wyhash_byte_sequence(a, len, 7));
+            a[len - 1] ^= 0x01;
+        }
+    }
+
+    // the functors pick the hash function, and the seed.
+    assert(BytePtrHash(BUBO_HASH_JENKINS, 1)(a, 10) == bubo_utils::hash_byte_sequence(a, 10));
+    assert(BytePtrHash(BUBO_HASH_JENKINS, 1)(a, 10) == BytePtrHash(BUBO_HASH_JENKINS, 2)(a, 10));
+    assert(BytePtrHash(BUBO_HASH_WYHASH, 1)(a, 10) != BytePtrHash(BUBO_HASH_WYHASH, 2)(a, 10));
+    assert(CharPtrHash(BUBO_HASH_WYHASH, 1)("host") == bubo_utils::wyhash_byte_sequence((const BYTE*)"host", 4, 1));
+}
+
 struct TestBytePtrHash {
     uint32_t operator()(const BYTE* b) const;
 };
@@ -157,6 +194,40 @@ static void test_encode_decode_result_match() {
         bubo_utils::encode_packed(vals[i], buf, &buflen);
         size_t result = bubo_utils::decode_packed(buf);
         assert(vals[i] == result);
+
+        int decoded_len = 0;
+        result = bubo_utils::decode_packed(buf, &decoded_len);
+        assert(vals[i] == result);
+        assert(decoded_len == buflen);
+    }
+
+    uint64_t vals64[] = { 0x0, 0x7F, 0x80, 0xFFFFFFFFull, 0x7FFFFFFFFull, 0xFFFFFFFFFFFFFFFFull };
+    for (size_t i = 0; i < sizeof(vals64)/sizeof(uint64_t); i++) {
+        BYTE buf[10];
+        int buflen = 0;
+        bubo_utils::encode_packed64(vals64[i], buf, &buflen);
+        assert(buflen <= 10);
+
+        int decoded_len = 0;
+        assert(vals64[i] == bubo_utils::decode_packed64(buf, &decoded_len));
+        assert(decoded_len == buflen);
+    }
+}
+
+static void test_append_number() {
+    // the strings of JavaScript's String(number).
+    struct { double d; const char* str; } numbers[] = {
+        { 0, "0" }, { -0.0, "0" }, { 1, "1" }, { -42, "-42" }, { 0.1, "0.1" }, { -1.5, "-1.5" },
+        { 0.1 + 0.2, "0.30000000000000004" }, { 123.456, "123.456" }, { 1e20, "100000000000000000000" },
+        { 1e21, "1e+21" }, { 1.5e300, "1.5e+300" }, { 1e-6, "0.000001" }, { 1.5e-7, "1.5e-7" },
+        { 9007199254740993.0, "9007199254740992" }, { 1152921504606846976.0, "1152921504606847000" },
+        { 5e-324, "5e-324" }, { 1.7976931348623157e308, "1.7976931348623157e+308" },
+        { 1.0 / 0.0, "Infinity" }, { -1.0 / 0.0, "-Infinity" }, { 0.0 / 0.0, "NaN" },
+    };
+    for (size_t i = 0; i < sizeof(numbers) / sizeof(numbers[0]); i++) {
+        std::string str("x=");
+        bubo_utils::append_number(numbers[i].d, &str);
+        assert(str == std::string("x=") + numbers[i].str);
     }
 }
 
@@ -284,9 +355,95 @@ static void test_strings_table_sizes() {
     assert(et.tag_seq_no_ == 2);
     assert(et.val_seq_no_ == 1);
 
+    // find_tag / find_val fill in the same tokens, but never add.
+    StringsTable::TagEntry* te = NULL;
+    EntryToken found;
+    assert(st->find_tag("tag1", &found, &te) == true);
+    assert(found.tag_seq_no_ == 1);
+    assert(st->find_val(te, "blah", &found) == true);
+    assert(found.val_seq_no_ == 2);
+    assert(st->find_val(te, "unknown", &found) == false);
+    assert(st->find_tag("unknown", &found, &te) == false);
+    assert(st->get_num_tags() == 2);
+    assert(st->get_num_vals("tag1") == 2);
+
     delete st;
 }
 
+static void test_strings_table_snapshot() {
+    StringsTable st;
+    StringsTable loaded;
+    EntryToken et;
+    StringsTable::TagEntry* te = NULL;
+    char tag[32], val[32];
+
+    for (int t = 0; t < 10; t++) {
+        for (int v = 0; v < 100; v++) {
+            snprintf(tag, sizeof(tag), "tag%d", t);
+            snprintf(val, sizeof(val), "val%d", v * t);
+            st.check_and_add(tag, val, &et);
+        }
+    }
+
+    FILE* file = tmpfile();
+    SnapshotWriter writer(file);
+    st.save(&writer);
+    assert(writer.finish());
+
+    SnapshotReader reader(file);
+    assert(loaded.load(&reader));
+    assert(reader.finish());
+    assert(loaded.get_num_tags() == 10);
+
+    // the same sequence numbers, so that saved entries still decode the same.
+    for (int t = 0; t < 10; t++) {
+        snprintf(tag, sizeof(tag), "tag%d", t);
+        assert(loaded.get_num_vals(tag) == st.get_num_vals(tag));
+        for (int v = 0; v < 100; v++) {
+            EntryToken loaded_et;
+            snprintf(val, sizeof(val), "val%d", v * t);
+            assert(st.find_tag(tag, &et, &te) && st.find_val(te, val, &et));
+            assert(loaded.find_tag(tag, &loaded_et, &te) && loaded.find_val(te, val, &loaded_et));
+            assert(loaded_et.tag_seq_no_ == et.tag_seq_no_);
+            assert(loaded_et.val_seq_no_ == et.val_seq_no_);
+        }
+    }
+
+    // and the same reverse lookups.
+    for (int t = 0; t < 10; t++) {
+        snprintf(tag, sizeof(tag), "tag%d", t);
+        assert(loaded.find_tag(tag, &et, &te));
+        const StringsTable::TagEntry* reverse = loaded.find_tag_entry(et.tag_seq_no_);
+        assert(reverse == te && strcmp(reverse->tag_, tag) == 0);
+        for (int v = 0; v < 100; v++) {
+            snprintf(val, sizeof(val), "val%d", v * t);
+            assert(loaded.find_val(te, val, &et));
+            assert(strcmp(StringsTable::find_val_str(te, et.val_seq_no_), val) == 0);
+        }
+        assert(StringsTable::find_val_str(te, 0) == NULL);
+        assert(StringsTable::find_val_str(te, te->last_val_seq_no_) == NULL);
+    }
+    assert(loaded.find_tag_entry(0) == NULL && loaded.find_tag_entry(11) == NULL);
+
+    // strings longer than a quarter of a chunk get one of their own, and keep their length.
+    std::string long_val(STRINGS_CHUNK_SIZE, 'x');
+    assert(loaded.check_and_add("tag1", long_val.c_str(), &et) == false);
+    assert(StringsTable::str_len(et.val_) == STRINGS_CHUNK_SIZE && strcmp(et.val_, long_val.c_str()) == 0);
+    assert(loaded.check_and_add("tag1", "short", &et) == false);
+    assert(StringsTable::str_len(et.val_) == 5 && strcmp(et.val_, "short") == 0);
+    assert(StringsTable::str_len(loaded.find_tag_entry(2)->tag_) == 4);
+
+    // new tags and values get new sequence numbers.
+    assert(loaded.check_and_add("tag0", "new", &et) == false);
+    assert(et.val_seq_no_ == 2);
+    assert(loaded.check_and_add("newtag", "new", &et) == false);
+    assert(et.tag_seq_no_ == 11);
+    assert(strcmp(loaded.find_tag_entry(11)->tag_, "newtag") == 0);
+    assert(strcmp(StringsTable::find_val_str(loaded.find_tag_entry(11), et.val_seq_no_), "new") == 0);
+
+    fclose(file);
+}
+
 static void test_strings_table_entry_buf_basic() {
     // tests if basic functionality of prepare_entry_buffer() is allright.
     StringsTable* st = new StringsTable();
@@ -321,6 +478,13 @@ static void test_strings_table_entry_buf_basic() {
     v8::String::Utf8Value k(attrstr);
 
     assert(!strcmp(*k, "host=myname.mydomain.com,ip=127.12.33.22,proxy=sfdc1,rate=99"));
+
+    // the same string, decoded from the entry.
+    std::string decoded;
+    assert(at->entry_attr_str(buf, buflen, &decoded));
+    assert(decoded == "host=myname.mydomain.com,ip=127.12.33.22,proxy=sfdc1,rate=99");
+    buf[8] = 0x02;
+    assert(!at->entry_attr_str(buf, buflen, &decoded));
 }
 
 static void test_strings_table_entry_buf_repeated() {
@@ -471,10 +635,10 @@ void test_hash_set() {
     assert(stat.spine_len == 4096); // initial spine size
     assert(stat.spine_use == 0);
     assert(stat.entries == 0);
-    assert(stat.ht_bytes == 4096 * 16);
-    assert(stat.collision_slots == 0);
-    assert(stat.total_chain_len == 0);
-    assert(stat.max_chain_len == 0);
+    assert(stat.ht_bytes == 4096 * 13);
+    assert(stat.displaced == 0);
+    assert(stat.total_probe_len == 0);
+    assert(stat.max_probe_len == 0);
     assert(stat.blob_allocated_bytes == (20 << 20));
     assert(stat.blob_used_bytes == 0);
 
@@ -498,12 +662,12 @@ void test_hash_set() {
     assert(stat.spine_len == 4096); // initial spine size
     assert(stat.spine_use == 1);
     assert(stat.entries == 1);
-    assert(stat.ht_bytes == 4096 * 16);
-    assert(stat.collision_slots == 0);
-    assert(stat.total_chain_len == 0);
-    assert(stat.max_chain_len == 0);
+    assert(stat.ht_bytes == 4096 * 13);
+    assert(stat.displaced == 0);
+    assert(stat.total_probe_len == 0);
+    assert(stat.max_probe_len == 0);
     assert(stat.blob_allocated_bytes == (20 << 20));
-    assert(stat.blob_used_bytes == 8);
+    assert(stat.blob_used_bytes == 9); // one byte of length, then the entry
 
     // (3) test repeated addition.
     // add the entry to set the second time. since its not a new entry, it should return false.
@@ -512,18 +676,18 @@ void test_hash_set() {
     assert(stat.spine_len == 4096);
     assert(stat.spine_use == 1);
     assert(stat.entries == 1);
-    assert(stat.ht_bytes == 4096 * 16);
-    assert(stat.collision_slots == 0);
-    assert(stat.total_chain_len == 0);
-    assert(stat.max_chain_len == 0);
+    assert(stat.ht_bytes == 4096 * 13);
+    assert(stat.displaced == 0);
+    assert(stat.total_probe_len == 0);
+    assert(stat.max_probe_len == 0);
     assert(stat.blob_allocated_bytes == (20 << 20));
-    assert(stat.blob_used_bytes == 8);
+    assert(stat.blob_used_bytes == 9); // one byte of length, then the entry
 
 }
 
 void test_hash_set_add_many_erase() {
 
-    BuboHashSet<BytePtrHash, BytePtrEqual> bubo_hash_set(512, 2048);
+    BuboHashSet<BytePtrHash, BytePtrEqual> bubo_hash_set(512, 16384);
     BuboHashStat stat;
 
     BYTE test[20];
@@ -547,10 +711,10 @@ void test_hash_set_add_many_erase() {
     }
     bubo_hash_set.get_stats(&stat);
 
-    assert(stat.spine_len == 2048);
+    assert(stat.spine_len == 16384);
     assert(stat.entries == 10000);
     assert(stat.blob_allocated_bytes == (20 << 20));
-    assert(stat.blob_used_bytes == 80000);
+    assert(stat.blob_used_bytes == 90000);
 
     // remove 30 * 30 = 900 values
     for (int i = 20; i < 50; i ++) {
@@ -558,26 +722,1244 @@ void test_hash_set_add_many_erase() {
             // create a unique entry conforming to the above layout.
             test[2] = 0x80 | (i & 0x7F);
             test[4] = 0x80 | (j & 0x7F);
-            bubo_hash_set.erase(test);
+            bubo_hash_set.erase(test, 8);
         }
     }
     bubo_hash_set.get_stats(&stat);
-    assert(stat.spine_len == 2048);
+    assert(stat.spine_len == 16384);
     assert(stat.entries == 9100);
     assert(stat.blob_allocated_bytes == (20 << 20));
-    assert(stat.blob_used_bytes == 80000);
+    assert(stat.blob_used_bytes == 90000);
+    assert(stat.blob_dead_bytes == 8100);
+
+    for (int i = 0; i < 100; i ++) {
+        for (int j = 0; j < 100; j++) {
+            test[2] = 0x80 | (i & 0x7F);
+            test[4] = 0x80 | (j & 0x7F);
+            bool erased = (i >= 20 && i < 50 && j >= 30 && j < 60);
+            assert(bubo_hash_set.contains(test, 8) == !erased);
+        }
+    }
+
+    // adding new entries of the same size reuses the space of the erased ones.
+    test[5] = 0x45;
+    for (int i = 20; i < 50; i ++) {
+        for (int j = 30; j < 60; j++) {
+            test[2] = 0x80 | (i & 0x7F);
+            test[4] = 0x80 | (j & 0x7F);
+            bubo_hash_set.insert(test, 8);
+        }
+    }
+    bubo_hash_set.get_stats(&stat);
+    assert(stat.entries == 10000);
+    assert(stat.blob_used_bytes == 90000);
+    assert(stat.blob_dead_bytes == 0);
+}
+
+void test_blob_store_free_lists() {
+    BlobStore store(1 << 10);
+    BYTE seq[1024];
+    uint64_t allocated = 0, used = 0, dead = 0, compactions = 0;
+    int len = 0;
+
+    memset(seq, 0x42, sizeof(seq));
+    BlobRef small = store.add(seq, 9);
+    BlobRef big = store.add(seq, 20);
+    BlobRef large = store.add(seq, 600);
+    store.stats(&allocated, &used, &dead, &compactions);
+    assert(used == 10 + 21 + 602);
+    assert(dead == 0);
+
+    // exact size first.
+    store.remove(small);
+    store.remove(big);
+    store.stats(&allocated, &used, &dead, &compactions);
+    assert(dead == 10 + 21);
+    assert(store.add(seq, 9) == small);
+
+    // a bigger record is split, and the rest is reused in turn.
+    assert(store.add(seq, 4) == big);
+    assert(store.add(seq, 15) == big + 5);
+    BlobStore::record_data(store.record(big + 5), &len);
+    assert(len == 15);
+    store.stats(&allocated, &used, &dead, &compactions);
+    assert(dead == 0);
+    assert(used == 10 + 21 + 602);
+
+    // no reuse that would leave a remainder too small to be a record.
+    store.remove(large);
+    assert(store.add(seq, 599) != large);
+    assert(store.add(seq, 500) == large);
+    store.stats(&allocated, &used, &dead, &compactions);
+    assert(dead == 602 - 502);
+}
+
+static void make_compaction_entry(BYTE* entry, uint32_t i) {
+    memset(entry, 0x11, 8);
+    memcpy(entry, &i, sizeof(i));
+}
+
+void test_hash_set_compaction() {
+    // 4KB chunks of 9 byte records.
+    BuboHashSet<BytePtrHash, BytePtrEqual> bubo_hash_set(16, 1 << 16, BytePtrHash(), 4096);
+    BuboHashStat stat;
+    BYTE entry[8];
+
+    assert(bubo_hash_set.compact(16) == false);
+
+    for (uint32_t i = 0; i < 4500; i++) {
+        make_compaction_entry(entry, i);
+        bubo_hash_set.insert(entry, 8);
+    }
+    bubo_hash_set.get_stats(&stat);
+    assert(stat.blob_allocated_bytes == 10 * 4096);
+
+    // leave one record in four of the first chunks.
+    for (uint32_t i = 0; i < 4000; i++) {
+        if (i % 4) {
+            make_compaction_entry(entry, i);
+            bubo_hash_set.erase(entry, 8);
+        }
+    }
+    bubo_hash_set.get_stats(&stat);
+    assert(stat.blob_dead_bytes == 3000 * 9);
+
+    int calls = 0;
+    while (bubo_hash_set.compact(16)) {
+        calls ++;
+        // entries added meanwhile, which may resize the table, do not go into compacted chunks.
+        make_compaction_entry(entry, 10000 + calls);
+        bubo_hash_set.insert(entry, 8);
+    }
+    assert(calls > 1);
+
+    bubo_hash_set.get_stats(&stat);
+    assert(stat.blob_compactions > 0);
+    assert(stat.blob_allocated_bytes <= 5 * 4096);
+    assert(stat.entries == 1500 + (uint32_t)calls);
+
+    for (uint32_t i = 0; i < 4500; i++) {
+        make_compaction_entry(entry, i);
+        assert(bubo_hash_set.contains(entry, 8) == (i >= 4000 || i % 4 == 0));
+    }
+    for (int c = 1; c <= calls; c++) {
+        make_compaction_entry(entry, 10000 + c);
+        assert(bubo_hash_set.contains(entry, 8));
+    }
+}
+
+void test_hash_set_auto_compaction() {
+    BuboHashSet<BytePtrHash, BytePtrEqual> bubo_hash_set(16, 1 << 16, BytePtrHash(), 4096);
+    BuboHashStat stat;
+    BYTE entry[16];
+
+    bubo_hash_set.set_incremental_resize(1);
+    bubo_hash_set.set_auto_compact(0.5, 4);
+
+    for (uint32_t i = 0; i < 4500; i++) {
+        make_compaction_entry(entry, i);
+        bubo_hash_set.insert(entry, 8);
+    }
+    for (uint32_t i = 0; i < 4000; i++) {
+        if (i % 4) {
+            make_compaction_entry(entry, i);
+            bubo_hash_set.erase(entry, 8);
+        }
+    }
+
+    // bigger entries do not fit in the holes left, but drive the compaction along.
+    memset(entry + 8, 0x22, 8);
+    for (uint32_t i = 0; i < 2000; i++) {
+        make_compaction_entry(entry, i);
+        bubo_hash_set.insert(entry, 16);
+    }
+
+    bubo_hash_set.get_stats(&stat);
+    assert(stat.entries == 3500);
+    assert(stat.blob_compactions > 0);
+    // (1500 * 9 + 2000 * 17) bytes of live records take 12 chunks.
+    assert(stat.blob_allocated_bytes <= 14 * 4096);
+
+    for (uint32_t i = 0; i < 4500; i++) {
+        make_compaction_entry(entry, i);
+        assert(bubo_hash_set.contains(entry, 8) == (i >= 4000 || i % 4 == 0));
+        assert(bubo_hash_set.contains(entry, 16) == (i < 2000));
+    }
+}
+
+struct TestConstHash {
+    uint32_t operator()(const BYTE* b, int len) const { return 0x1234; }
+};
+
+static int make_snapshot_entry(BYTE* entry, uint32_t i) {
+    int len = 4 + i % 60;
+    memset(entry, 0x22, len);
+    memcpy(entry, &i, sizeof(i));
+    return len;
+}
+
+void test_hash_set_snapshot() {
+    // Small chunks, so that records get moved past chunk boundaries on save.
+    BuboHashSet<BytePtrHash, BytePtrEqual> bubo_hash_set(16, 1 << 16, BytePtrHash(), 1024);
+    BuboHashSet<BytePtrHash, BytePtrEqual> loaded(16, 1 << 16, BytePtrHash(), 1024);
+    BuboHashStat stat;
+    BYTE entry[64];
+    int len = 0;
+
+    for (uint32_t i = 0; i < 3000; i++) {
+        len = make_snapshot_entry(entry, i);
+        bubo_hash_set.insert(entry, len);
+    }
+    for (uint32_t i = 0; i < 3000; i += 3) {
+        len = make_snapshot_entry(entry, i);
+        bubo_hash_set.erase(entry, len);
+    }
+
+    FILE* file = tmpfile();
+    SnapshotWriter writer(file);
+    bubo_hash_set.save(&writer);
+    assert(writer.finish());
+
+    SnapshotReader reader(file);
+    assert(loaded.load(&reader));
+    assert(reader.finish());
+
+    loaded.get_stats(&stat);
+    assert(stat.entries == 2000);
+    // the free records are not saved.
+    assert(stat.blob_dead_bytes == 0);
+    for (uint32_t i = 0; i < 3000; i++) {
+        len = make_snapshot_entry(entry, i);
+        assert(loaded.contains(entry, len) == (i % 3 != 0));
+    }
+
+    // the loaded set goes on as usual.
+    for (uint32_t i = 0; i < 3000; i += 3) {
+        len = make_snapshot_entry(entry, i);
+        assert(loaded.insert(entry, len));
+        len = make_snapshot_entry(entry, i + 1);
+        loaded.erase(entry, len);
+    }
+    assert(loaded.size() == 2000);
+
+    // a flipped byte fails the checksum, if not the load itself.
+    fseek(file, 100, SEEK_SET);
+    int c = fgetc(file);
+    fseek(file, 100, SEEK_SET);
+    fputc(c ^ 0x01, file);
+    fflush(file);
+
+    SnapshotReader corrupt_reader(file);
+    assert(!loaded.load(&corrupt_reader) || !corrupt_reader.finish());
+
+    // a truncated snapshot does not load, and leaves the set empty.
+    fseek(file, 0, SEEK_SET);
+    FILE* truncated = tmpfile();
+    BYTE buf[2048];
+    fwrite(buf, 1, fread(buf, 1, sizeof(buf), file), truncated);
+    SnapshotReader truncated_reader(truncated);
+    assert(!loaded.load(&truncated_reader));
+    assert(loaded.size() == 0);
+
+    fclose(truncated);
+    fclose(file);
+}
+
+static void remove_dir(const char* dir) {
+    DIR* d = opendir(dir);
+    struct dirent* e = NULL;
+    while (d && (e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") && strcmp(e->d_name, "..")) {
+            unlink((std::string(dir) + "/" + e->d_name).c_str());
+        }
+    }
+    if (d) {
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+void test_hash_set_mapped() {
+    char dir[] = "/tmp/bubo-test-XXXXXX";
+    assert(mkdtemp(dir));
+    BYTE entry[64];
+    int len = 0;
+
+    FILE* meta = tmpfile();
+    {
+        BuboHashSet<BytePtrHash, BytePtrEqual> bubo_hash_set(16, 1 << 16, BytePtrHash(), 4096);
+        assert(bubo_hash_set.set_mapped(dir));
+        bubo_hash_set.set_incremental_resize(2);
+        bubo_hash_set.set_auto_compact(0.5, 4);
+
+        // grows the table and the chunks, erases, and compacts.
+        for (uint32_t i = 0; i < 5000; i++) {
+            len = make_snapshot_entry(entry, i);
+            assert(bubo_hash_set.insert(entry, len));
+        }
+        for (uint32_t i = 0; i < 4000; i++) {
+            if (i % 4) {
+                len = make_snapshot_entry(entry, i);
+                bubo_hash_set.erase(entry, len);
+            }
+        }
+        while (bubo_hash_set.compact(64)) {
+        }
+
+        SnapshotWriter writer(meta);
+        assert(bubo_hash_set.sync(&writer));
+        assert(writer.finish());
+    }
+
+    // mapped again, without the records being read.
+    for (int read_only = 1; read_only >= 0; read_only--) {
+        BuboHashSet<BytePtrHash, BytePtrEqual> reopened(16, 1 << 16, BytePtrHash(), 4096);
+        SnapshotReader reader(meta);
+        assert(reopened.open_mapped(dir, &reader, read_only));
+        assert(reader.finish());
+        assert(reopened.size() == 2000);
+        for (uint32_t i = 0; i < 5000; i++) {
+            len = make_snapshot_entry(entry, i);
+            assert(reopened.contains(entry, len) == (i >= 4000 || i % 4 == 0));
+        }
+        if (!read_only) {
+            len = make_snapshot_entry(entry, 100000);
+            assert(reopened.insert(entry, len));
+        }
+    }
+
+    // modified since the sync.
+    BuboHashSet<BytePtrHash, BytePtrEqual> stale(16, 1 << 16, BytePtrHash(), 4096);
+    SnapshotReader reader(meta);
+    assert(!stale.open_mapped(dir, &reader, true));
+
+    fclose(meta);
+    remove_dir(dir);
+}
+
+void test_hash_set_probing() {
+    // every entry has the same hash, so they all probe the same sequence of groups.
+    BuboHashSet<TestConstHash, BytePtrEqual> bubo_hash_set(16, 1024);
+    BuboHashStat stat;
+
+    BYTE test[4];
+    test[0] = 0x01;
+    test[1] = 0x01;
+
+    for (int i = 0; i < 100; i++) {
+        test[2] = 0x80 | (i & 0x7F);
+        test[3] = 0x01;
+        assert(true == bubo_hash_set.insert(test, 4));
+    }
+
+    bubo_hash_set.get_stats(&stat);
+    assert(stat.entries == 100 && stat.displaced == 0);
+    bubo_hash_set.get_detailed_stats(&stat);
+    assert(stat.entries == 100);
+    assert(stat.displaced == 100 - GROUP_WIDTH);
+    assert(stat.max_probe_len == (100 + GROUP_WIDTH - 1) / GROUP_WIDTH - 1);
+
+    // erase entries from the (full) home group: they leave tombstones behind, so the
+    // displaced entries must still be found.
+    for (int i = 0; i < 10; i++) {
+        test[2] = 0x80 | (i & 0x7F);
+        bubo_hash_set.erase(test, 4);
+    }
+    bubo_hash_set.get_stats(&stat);
+    assert(stat.entries == 90);
+    assert(stat.tombstones == 10);
+
+    for (int i = 0; i < 100; i++) {
+        test[2] = 0x80 | (i & 0x7F);
+        assert(bubo_hash_set.contains(test, 4) == (i >= 10));
+    }
+
+    // re-inserting reuses the tombstones.
+    for (int i = 0; i < 10; i++) {
+        test[2] = 0x80 | (i & 0x7F);
+        assert(true == bubo_hash_set.insert(test, 4));
+    }
+    bubo_hash_set.get_stats(&stat);
+    assert(stat.entries == 100);
+    assert(stat.tombstones == 0);
+}
+
+// same group and fingerprint for every entry, but a distinct full hash per third byte.
+struct TestCountingHash {
+    static int calls;
+    uint32_t operator()(const BYTE* b, int len) const { calls ++; return 0x1234 | ((uint32_t)b[2] << 24); }
+};
+int TestCountingHash::calls = 0;
+
+struct TestCountingEqual {
+    static int calls;
+    bool operator()(const BYTE* a, const BYTE* b, int blen) const { calls ++; return BytePtrEqual()(a, b, blen); }
+};
+int TestCountingEqual::calls = 0;
+
+void test_hash_set_stored_hashes() {
+    BuboHashSet<TestCountingHash, TestCountingEqual> bubo_hash_set(16, 1024);
+    BuboHashStat stat;
+
+    BYTE test[4];
+    test[0] = 0x01;
+    test[1] = 0x01;
+    test[3] = 0x01;     // test[2..3] is a two byte value
+
+    // the table gets resized a few times on the way, without hashing any stored entry again.
+    for (int i = 0; i < 100; i++) {
+        test[2] = 0x80 | i;
+        assert(true == bubo_hash_set.insert(test, 4));
+    }
+    bubo_hash_set.get_stats(&stat);
+    assert(stat.spine_len > 16);
+    assert(TestCountingHash::calls == 100);
+
+    // only the entry with the same full hash gets compared.
+    TestCountingEqual::calls = 0;
+    test[2] = 0x80 | 50;
+    assert(bubo_hash_set.contains(test, 4));
+    assert(TestCountingEqual::calls == 1);
+
+    TestCountingEqual::calls = 0;
+    test[2] = 0x80 | 100;
+    assert(!bubo_hash_set.contains(test, 4));
+    assert(TestCountingEqual::calls == 0);
+}
+
+void test_hash_set_max_size() {
+    // the table grows past max_table_size rather than running out of slots.
+    BuboHashSet<BytePtrHash, BytePtrEqual> bubo_hash_set(16, 64);
+    BuboHashStat stat;
+
+    BYTE test[4];
+    test[0] = 0x01;
+    test[1] = 0x01;
+
+    for (int i = 0; i < 1000; i++) {
+        int len = 0;
+        bubo_utils::encode_packed(i + 1, test + 2, &len);
+        assert(true == bubo_hash_set.insert(test, 2 + len));
+    }
+
+    bubo_hash_set.get_stats(&stat);
+    assert(stat.entries == 1000);
+    assert(stat.spine_len > 1000);
+}
+
+void test_hash_set_incremental_resize() {
+    BuboHashSet<BytePtrHash, BytePtrEqual> bubo_hash_set(64, 1 << 20);
+    bubo_hash_set.set_incremental_resize(1);
+    BuboHashStat stat;
+
+    BYTE test[8];
+    test[0] = 0x01;
+    test[1] = 0x01;
+
+    // fill up the table until a resize kicks in, which should leave the old table in place.
+    int n = 0;
+    do {
+        int len = 0;
+        bubo_utils::encode_packed(++n, test + 2, &len);
+        assert(true == bubo_hash_set.insert(test, 2 + len));
+        bubo_hash_set.get_stats(&stat);
+    } while (stat.resize_old_len == 0);
+
+    assert(stat.resize_old_len == 64);
+    assert(stat.spine_len == 128);
+    assert(stat.entries == (uint64_t)n);
+    // the entries waiting in the old table use no slot of the new one yet.
+    assert(stat.spine_use < stat.entries);
+
+    // entries are found, and erasable, on either side of the migration.
+    for (int i = 1; i <= n; i++) {
+        int len = 0;
+        bubo_utils::encode_packed(i, test + 2, &len);
+        assert(bubo_hash_set.contains(test, 2 + len));
+        assert(false == bubo_hash_set.insert(test, 2 + len));
+    }
+
+    // one group per operation: the 4 groups of the old table are long migrated by now.
+    bubo_hash_set.get_stats(&stat);
+    assert(stat.resize_old_len == 0);
+    assert(stat.resize_migrated == 0);
+    assert(stat.entries == (uint64_t)n);
+    assert(stat.spine_use == (uint64_t)n);
+
+    for (int i = 1; i <= n; i += 2) {
+        int len = 0;
+        bubo_utils::encode_packed(i, test + 2, &len);
+        bubo_hash_set.erase(test, 2 + len);
+    }
+    for (int i = 1; i <= n; i++) {
+        int len = 0;
+        bubo_utils::encode_packed(i, test + 2, &len);
+        assert(bubo_hash_set.contains(test, 2 + len) == (i % 2 == 0));
+    }
+}
+
+void test_hash_set_clock() {
+    for (uint32_t step_groups : { 0, 1 }) {
+        BuboHashSet<BytePtrHash, BytePtrEqual> bubo_hash_set(64, 1 << 20);
+        bubo_hash_set.set_incremental_resize(step_groups);
+        bubo_hash_set.set_clock(true);
+        BuboHashStat stat;
+        BYTE entry[64];
+        const uint32_t num_entries = 1000;
+
+        for (uint32_t i = 0; i < num_entries; i++) {
+            int len = make_snapshot_entry(entry, i);
+            assert(bubo_hash_set.insert(entry, len));
+        }
+        uint64_t bytes = bubo_hash_set.bytes();
+
+        // Every entry was touched when it was added: the hand goes round once, clearing them all.
+        assert(bubo_hash_set.evict());
+        assert(bubo_hash_set.size() == num_entries - 1);
+
+        // The entries touched since stay, as long as there are others.
+        for (uint32_t i = 0; i < num_entries / 2; i++) {
+            int len = make_snapshot_entry(entry, i);
+            bubo_hash_set.contains(entry, len);
+        }
+        for (uint32_t n = 0; n < 400; n++) {
+            assert(bubo_hash_set.evict());
+        }
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < num_entries; i++) {
+            int len = make_snapshot_entry(entry, i);
+            if (bubo_hash_set.lookup(entry, len)) {
+                kept += i < num_entries / 2;
+            }
+        }
+        assert(kept >= num_entries / 2 - 1);
+        bubo_hash_set.get_stats(&stat);
+        assert(stat.evictions == 401 && stat.entries == num_entries - 401);
+        assert(bubo_hash_set.bytes() < bytes);
+        assert(bubo_hash_set.bytes() == stat.ht_bytes + stat.blob_used_bytes - stat.blob_dead_bytes);
+
+        // The hand stops when there is nothing left, or nothing but the entry to keep.
+        while (bubo_hash_set.evict()) {
+        }
+        assert(bubo_hash_set.size() == 0);
+        int len0 = make_snapshot_entry(entry, 0);
+        assert(bubo_hash_set.insert(entry, len0));
+        BYTE keep[64];
+        int keep_len = make_snapshot_entry(keep, 1);
+        assert(bubo_hash_set.insert(keep, keep_len));
+        uint32_t keep_h = BytePtrHash()(keep, keep_len);
+        assert(bubo_hash_set.evict(keep, keep_len, keep_h));
+        assert(!bubo_hash_set.evict(keep, keep_len, keep_h));
+        assert(bubo_hash_set.size() == 1 && bubo_hash_set.lookup(keep, keep_len));
+
+        // At the resize threshold, make_room() evicts instead of letting the next insert grow the table.
+        uint32_t i = 2;
+        while (bubo_hash_set.growth_bytes() == 0) {
+            int len = make_snapshot_entry(entry, i++);
+            assert(bubo_hash_set.insert(entry, len));
+        }
+        bubo_hash_set.get_stats(&stat);
+        uint64_t spine_len = stat.spine_len;
+        assert(bubo_hash_set.make_room() > 0);
+        assert(bubo_hash_set.growth_bytes() == 0);
+        int len = make_snapshot_entry(entry, i);
+        assert(bubo_hash_set.insert(entry, len));
+        bubo_hash_set.get_stats(&stat);
+        assert(stat.spine_len == spine_len && stat.resize_old_len == 0);
+    }
+
+    // A sharded set that outgrows its budget evicts, one shard at a time, to fit again.
+    ShardedSet sharded_set(4, BytePtrHash());
+    sharded_set.set_clock(true);
+    BYTE entry[64];
+    uint64_t evicted = 0;
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        int len = make_snapshot_entry(entry, i);
+        assert(sharded_set.insert(entry, len, 0, &evicted));
+    }
+    uint64_t max_bytes = 2 * sharded_set.bytes();
+    assert(evicted == 0);
+
+    for (uint32_t i = 1000; i < 20000; i++) {
+        int len = make_snapshot_entry(entry, i);
+        assert(sharded_set.insert(entry, len, max_bytes, &evicted));
+        assert(sharded_set.contains(entry, len));
+    }
+    assert(evicted > 0 && sharded_set.size() == 20000 - evicted);
+    assert(sharded_set.bytes() <= max_bytes);
+
+    EntryBatch batch;
+    std::vector<uint8_t> flags(5000);
+    for (uint32_t i = 20000; i < 25000; i++) {
+        int len = make_snapshot_entry(entry, i);
+        batch.add(entry, len, i - 20000);
+    }
+    uint64_t batch_evicted = 0;
+    sharded_set.insert_batch(batch, &flags[0], max_bytes, &batch_evicted);
+    assert(batch_evicted > 0 && sharded_set.size() == 25000 - evicted - batch_evicted);
+    assert(sharded_set.bytes() <= max_bytes);
+
+    BuboHashStat stat;
+    sharded_set.get_stats(&stat);
+    assert(stat.evictions == evicted + batch_evicted);
+
+    // With a table at its budget, an insert evicts a few entries to make room rather than growing
+    // the table and evicting to pay for it, and never the entry it inserts.
+    for (uint32_t step_groups : { 0, 1 }) {
+        ShardedSet small_set(1, BytePtrHash());
+        small_set.set_incremental_resize(step_groups);
+        small_set.set_clock(true);
+        uint64_t small_evicted = 0;
+        for (uint32_t i = 0; i < 50000; i++) {
+            uint64_t before = small_evicted;
+            int len = make_snapshot_entry(entry, i);
+            assert(small_set.insert(entry, len, 100000, &small_evicted));
+            assert(small_set.contains(entry, len));
+            assert(small_evicted - before <= 8);
+            assert(small_set.bytes() <= 100000);
+        }
+        assert(small_evicted > 0);
+    }
+}
+
+void test_bloom_filter() {
+    BlockedBloomFilter filter(10000);
+    assert(filter.bytes() % 64 == 0 && filter.bytes() * 8 >= 10000 * BLOOM_BITS_PER_ENTRY);
+    assert(filter.false_positive_rate() == 0);
+
+    BytePtrHash hash;
+    for (uint32_t i = 0; i < 10000; i++) {
+        filter.add(hash((const BYTE*)&i, sizeof(i)));
+    }
+    for (uint32_t i = 0; i < 10000; i++) {
+        assert(filter.may_contain(hash((const BYTE*)&i, sizeof(i))));
+    }
+
+    // Full up, the filter lets about 1% of the others through, as it estimates.
+    uint32_t passed = 0;
+    for (uint32_t i = 10000; i < 110000; i++) {
+        passed += filter.may_contain(hash((const BYTE*)&i, sizeof(i)));
+    }
+    double rate = filter.false_positive_rate();
+    assert(rate > 0.002 && rate < 0.03);
+    assert(passed > 100000 * rate / 2 && passed < 100000 * rate * 2);
+
+    filter.clear();
+    assert(filter.false_positive_rate() == 0);
+    assert(!filter.may_contain(hash((const BYTE*)&passed, sizeof(passed))));
+}
+
+void test_hash_set_filter() {
+    for (uint32_t step_groups : { 0, 1 }) {
+        BuboHashSet<BytePtrHash, BytePtrEqual> bubo_hash_set(64, 1 << 20);
+        bubo_hash_set.set_incremental_resize(step_groups);
+        bubo_hash_set.set_filter(1000);
+        BuboHashStat stat;
+        BYTE entry[64];
+        const uint32_t num_entries = 5000;
+
+        bubo_hash_set.get_detailed_stats(&stat);
+        assert(stat.filter_capacity == 1000 && stat.filter_bytes > 0 && stat.filter_fpr == 0);
+
+        // The filter follows the table as it grows, incrementally or not.
+        for (uint32_t i = 0; i < num_entries; i++) {
+            int len = make_snapshot_entry(entry, i);
+            assert(bubo_hash_set.insert(entry, len));
+        }
+        for (uint32_t i = 0; i < num_entries; i++) {
+            int len = make_snapshot_entry(entry, i);
+            assert(bubo_hash_set.contains(entry, len) && bubo_hash_set.lookup(entry, len));
+            assert(!bubo_hash_set.insert(entry, len));
+        }
+        for (uint32_t i = num_entries; i < 2 * num_entries; i++) {
+            int len = make_snapshot_entry(entry, i);
+            assert(!bubo_hash_set.contains(entry, len) && !bubo_hash_set.lookup(entry, len));
+        }
+        bubo_hash_set.get_detailed_stats(&stat);
+        assert(stat.resize_old_len == 0);
+        assert(stat.filter_capacity >= num_entries && stat.filter_stale == 0);
+        assert(stat.filter_fpr > 0 && stat.filter_fpr < 0.03);
+        assert(stat.bytes == stat.ht_bytes + stat.blob_allocated_bytes + stat.filter_bytes);
+
+        // Erased entries stay in the filter until it is rebuilt.
+        for (uint32_t i = 0; i < num_entries; i += 2) {
+            int len = make_snapshot_entry(entry, i);
+            bubo_hash_set.erase(entry, len);
+        }
+        bubo_hash_set.get_detailed_stats(&stat);
+        assert(stat.filter_stale == num_entries / 2);
+        double stale_fpr = stat.filter_fpr;
+
+        bubo_hash_set.rebuild_filter();
+        bubo_hash_set.get_detailed_stats(&stat);
+        assert(stat.filter_stale == 0 && stat.filter_fpr < stale_fpr);
+        for (uint32_t i = 0; i < num_entries; i++) {
+            int len = make_snapshot_entry(entry, i);
+            assert(bubo_hash_set.contains(entry, len) == (i % 2 == 1));
+        }
+
+        // And what a snapshot brings back is in the filter of the set that loads it.
+        FILE* file = tmpfile();
+        SnapshotWriter writer(file);
+        bubo_hash_set.save(&writer);
+        assert(writer.finish());
+
+        BuboHashSet<BytePtrHash, BytePtrEqual> loaded;
+        loaded.set_filter(10);
+        SnapshotReader reader(file);
+        assert(loaded.load(&reader) && reader.finish());
+        for (uint32_t i = 0; i < num_entries; i++) {
+            int len = make_snapshot_entry(entry, i);
+            assert(loaded.contains(entry, len) == (i % 2 == 1));
+        }
+        fclose(file);
+
+        bubo_hash_set.clear();
+        bubo_hash_set.get_detailed_stats(&stat);
+        assert(stat.filter_fpr == 0);
+        bubo_hash_set.set_filter(0);
+        bubo_hash_set.get_detailed_stats(&stat);
+        assert(stat.filter_bytes == 0);
+    }
+
+    // Shards split the expected entries between their filters.
+    ShardedSet sharded_set(4, BytePtrHash());
+    BuboHashStat stat;
+    sharded_set.set_filter(1 << 20);
+    sharded_set.get_shard_stats(0, &stat);
+    assert(stat.filter_capacity == (1 << 18));
+    sharded_set.get_stats(&stat);
+    assert(stat.filter_capacity == (1 << 20));
+}
+
+void test_hyperloglog() {
+    // Within 4 standard errors, at every range of the estimator.
+    for (uint32_t precision : { HLL_MIN_PRECISION, HLL_DEFAULT_PRECISION, HLL_MAX_PRECISION }) {
+        HyperLogLog sketch(precision);
+        double error = 4 * 1.04 / sqrt((double)(1 << precision));
+        assert(sketch.estimate() == 0);
+
+        uint64_t added = 0;
+        for (uint64_t n : { 10, 1000, 100000, 1000000 }) {
+            for (; added < n; added++) {
+                sketch.add(bubo_utils::wyhash_byte_sequence((const BYTE*)&added, sizeof(added), 0));
+            }
+            assert(fabs(sketch.estimate() - n) <= error * n + 1);
+        }
+
+        // adding the same hashes again changes nothing.
+        double estimate = sketch.estimate();
+        for (uint64_t i = 0; i < 1000; i++) {
+            assert(!sketch.add(bubo_utils::wyhash_byte_sequence((const BYTE*)&i, sizeof(i), 0)));
+        }
+        assert(sketch.estimate() == estimate);
+    }
+
+    // Sketches of two overlapping halves merge into that of their union, serialized or not.
+    HyperLogLog a(HLL_DEFAULT_PRECISION), b(HLL_DEFAULT_PRECISION), merged(HLL_DEFAULT_PRECISION);
+    for (uint64_t i = 0; i < 60000; i++) {
+        a.add(bubo_utils::wyhash_byte_sequence((const BYTE*)&i, sizeof(i), 0));
+    }
+    for (uint64_t i = 40000; i < 100000; i++) {
+        b.add(bubo_utils::wyhash_byte_sequence((const BYTE*)&i, sizeof(i), 0));
+    }
+    std::string serialized;
+    b.serialize(&serialized);
+    assert(serialized.size() == HLL_HEADER_SIZE + b.bytes());
+    assert(merged.merge(a));
+    assert(merged.merge_serialized((const BYTE*)serialized.data(), serialized.size()));
+    assert(fabs(merged.estimate() - 100000) <= 0.065 * 100000);
+    assert(a.merge(b) && a.estimate() == merged.estimate());
+
+    // but not with sketches of another precision or flags, or damaged ones.
+    HyperLogLog other(HLL_DEFAULT_PRECISION + 1), typed(HLL_DEFAULT_PRECISION, 1);
+    assert(!merged.merge(other) && !merged.merge(typed));
+    assert(!merged.merge_serialized((const BYTE*)serialized.data(), serialized.size() - 1));
+    serialized[HLL_HEADER_SIZE] = 100;
+    assert(!merged.merge_serialized((const BYTE*)serialized.data(), serialized.size()));
+
+    merged.clear();
+    assert(merged.estimate() == 0);
+}
+
+void test_hash_set_shared() {
+    // Small, so that it resizes (incrementally) while the threads go.
+    BuboHashSet<BytePtrHash, BytePtrEqual> bubo_hash_set(64, 1 << 20);
+    bubo_hash_set.set_incremental_resize(1);
+    StripedLock lock;
+
+    const int num_threads = 8;
+    const uint32_t num_entries = 20000;
+    std::vector<uint32_t> added(num_threads, 0);
+    std::vector<std::thread> threads;
+
+    // Every thread goes over all the entries, each from a different one, the way AttributesTable
+    // adds to a shared set: a lookup with the lock shared, then an insert if not found.
+    for (int t = 0; t < num_threads; t++) {
+        threads.push_back(std::thread([&, t]() {
+            BYTE entry[64];
+            for (uint32_t n = 0; n < num_entries; n++) {
+                uint32_t i = (n + t * (num_entries / num_threads)) % num_entries;
+                int len = make_snapshot_entry(entry, i);
+                {
+                    SharedGuard guard(&lock);
+                    if (bubo_hash_set.lookup(entry, len)) {
+                        continue;
+                    }
+                }
+                ExclusiveGuard guard(&lock);
+                added[t] += bubo_hash_set.insert(entry, len);
+            }
+        }));
+    }
+    for (int t = 0; t < num_threads; t++) {
+        threads[t].join();
+    }
+
+    // Each entry was new to exactly one of them.
+    uint32_t total_added = 0;
+    for (int t = 0; t < num_threads; t++) {
+        total_added += added[t];
+    }
+    assert(total_added == num_entries);
+    assert(bubo_hash_set.size() == num_entries);
+
+    BYTE entry[64];
+    for (uint32_t i = 0; i < num_entries; i++) {
+        int len = make_snapshot_entry(entry, i);
+        assert(bubo_hash_set.lookup(entry, len));
+    }
+}
+
+void test_sharded_set() {
+    ShardedSet sharded_set(8, BytePtrHash());
+    EntryBatch batch;
+    BuboHashStat stat;
+    BYTE entry[64];
+    const uint32_t num_entries = 20000;
+    std::vector<uint8_t> flags(2 * num_entries);
+
+    // A batch with every entry twice: only the first of each is new.
+    for (uint32_t i = 0; i < 2 * num_entries; i++) {
+        int len = make_snapshot_entry(entry, i % num_entries);
+        batch.add(entry, len, i);
+    }
+    sharded_set.insert_batch(batch, &flags[0]);
+    for (uint32_t i = 0; i < 2 * num_entries; i++) {
+        assert(flags[i] == (i < num_entries));
+    }
+    assert(sharded_set.size() == num_entries);
+
+    // Every shard got some, and the stats add up.
+    uint64_t shard_entries = 0;
+    for (uint32_t s = 0; s < sharded_set.num_shards(); s++) {
+        sharded_set.get_shard_stats(s, &stat);
+        assert(stat.entries > 0);
+        shard_entries += stat.entries;
+    }
+    sharded_set.get_stats(&stat);
+    assert(stat.entries == num_entries && shard_entries == num_entries);
+
+    // Single entries go to the same shards as batched ones.
+    for (uint32_t i = 0; i < num_entries; i += 2) {
+        int len = make_snapshot_entry(entry, i);
+        assert(sharded_set.contains(entry, len));
+        sharded_set.erase(entry, len);
+    }
+    batch.clear();
+    for (uint32_t i = 0; i < 2 * num_entries; i++) {
+        int len = make_snapshot_entry(entry, i);
+        batch.add(entry, len, i);
+    }
+    sharded_set.contains_batch(batch, &flags[0]);
+    for (uint32_t i = 0; i < 2 * num_entries; i++) {
+        assert(flags[i] == (i < num_entries && i % 2 == 1));
+    }
+    while (sharded_set.compact(1024)) {
+    }
+
+    // A snapshot loads into a set with as many shards.
+    FILE* file = tmpfile();
+    SnapshotWriter writer(file);
+    sharded_set.save(&writer);
+    assert(writer.finish());
+
+    ShardedSet loaded(8, BytePtrHash());
+    SnapshotReader reader(file);
+    assert(loaded.load(&reader));
+    assert(reader.finish());
+    assert(loaded.size() == num_entries / 2);
+    loaded.contains_batch(batch, &flags[0]);
+    for (uint32_t i = 0; i < 2 * num_entries; i++) {
+        assert(flags[i] == (i < num_entries && i % 2 == 1));
+    }
+    fclose(file);
+}
+
+void test_sharded_set_scan() {
+    ShardedSet sharded_set(4, BytePtrHash());
+    sharded_set.set_incremental_resize(1);
+    BYTE entry[64];
+    const uint32_t num_entries = 5000;
+
+    // Some shards are in the middle of a resize, which the scan completes.
+    for (uint32_t i = 0; i < num_entries; i++) {
+        int len = make_snapshot_entry(entry, i);
+        sharded_set.insert(entry, len);
+    }
+
+    // Every entry is seen once, whatever the batch size.
+    for (uint32_t batch_size = 1; batch_size <= 2 * num_entries; batch_size *= 7) {
+        std::vector<uint32_t> seen(num_entries, 0);
+        ScanCursor cursor;
+        ScanResult result = SCAN_MORE;
+        uint32_t total = 0;
+        while (result == SCAN_MORE) {
+            uint32_t batch = 0;
+            result = sharded_set.scan(&cursor, batch_size, [&](const BYTE* e, int len) {
+                // make_snapshot_entry() starts with the number of the entry.
+                uint32_t i = 0;
+                memcpy(&i, e, sizeof(i));
+                assert(i < num_entries && len == make_snapshot_entry(entry, i) && memcmp(e, entry, len) == 0);
+                seen[i]++;
+                batch++;
+            });
+            assert(batch <= batch_size);
+            total += batch;
+        }
+        assert(result == SCAN_DONE && total == num_entries);
+        for (uint32_t i = 0; i < num_entries; i++) {
+            assert(seen[i] == 1);
+        }
+        assert(sharded_set.scan(&cursor, batch_size, [](const BYTE*, int) { assert(false); }) == SCAN_DONE);
+    }
+
+    // Growing the shard of the cursor midway makes it stale.
+    ScanCursor cursor;
+    assert(sharded_set.scan(&cursor, 10, [](const BYTE*, int) {}) == SCAN_MORE);
+    for (uint32_t i = num_entries; i < 8 * num_entries; i++) {
+        int len = make_snapshot_entry(entry, i);
+        sharded_set.insert(entry, len);
+    }
+    assert(sharded_set.scan(&cursor, 10, [](const BYTE*, int) {}) == SCAN_STALE);
+
+    // Cursors past the last shard or generation are not the set's.
+    ScanCursor past_shard, past_generation;
+    past_shard.shard_ = 99;
+    past_generation.generation_ = 1;
+    assert(sharded_set.scan(&past_shard, 10, [](const BYTE*, int) { assert(false); }) == SCAN_INVALID);
+    assert(sharded_set.scan(&past_generation, 10, [](const BYTE*, int) { assert(false); }) == SCAN_INVALID);
+    assert(past_shard.shard_ == 99 && past_generation.generation_ == 1);
+}
+
+void test_sharded_set_concurrent() {
+    ShardedSet sharded_set(4, BytePtrHash());
+    sharded_set.set_concurrent();
+
+    const int num_threads = 4;
+    const uint32_t num_entries = 20000;
+    std::vector<uint32_t> added(num_threads, 0);
+    std::vector<std::thread> threads;
+
+    // Every thread adds all the entries, half of them one at a time and half in batches, which
+    // then run on the pool of the set, one batch at a time.
+    for (int t = 0; t < num_threads; t++) {
+        threads.push_back(std::thread([&, t]() {
+            BYTE entry[64];
+            EntryBatch batch;
+            std::vector<uint8_t> flags(num_entries);
+            for (uint32_t n = 0; n < num_entries; n++) {
+                uint32_t i = (n + t * (num_entries / num_threads)) % num_entries;
+                int len = make_snapshot_entry(entry, i);
+                if (i % 2) {
+                    added[t] += sharded_set.insert(entry, len);
+                } else {
+                    batch.add(entry, len, batch.size());
+                }
+            }
+            sharded_set.insert_batch(batch, &flags[0]);
+            for (size_t i = 0; i < batch.size(); i++) {
+                added[t] += flags[i];
+            }
+        }));
+    }
+    for (int t = 0; t < num_threads; t++) {
+        threads[t].join();
+    }
+
+    uint32_t total_added = 0;
+    for (int t = 0; t < num_threads; t++) {
+        total_added += added[t];
+    }
+    assert(total_added == num_entries);
+    assert(sharded_set.size() == num_entries);
+}
+
+void test_sharded_set_generations() {
+    ShardedSet sharded_set(4, BytePtrHash());
+    sharded_set.set_generations(3);
+    sharded_set.set_filter(1000);
+    EntryBatch batch;
+    BuboHashStat stat;
+    BYTE entry[64];
+    std::vector<uint8_t> flags(4000);
+
+    // Generation g gets the entries [g * 1000, g * 1000 + 2000), half of which were in g - 1.
+    for (uint32_t g = 0; g < 3; g++) {
+        if (g > 0) {
+            assert(sharded_set.rotate() == 0);
+        }
+        for (uint32_t i = g * 1000; i < g * 1000 + 2000; i++) {
+            int len = make_snapshot_entry(entry, i);
+            assert(sharded_set.insert(entry, len) == (g == 0 || i >= g * 1000 + 1000));
+        }
+    }
+    assert(sharded_set.num_generations() == 3);
+    assert(sharded_set.size() == 4000);
+
+    // Entries added again were moved to the current generation.
+    uint32_t expected[] = { 1000, 1000, 2000 };
+    for (uint32_t g = 0; g < 3; g++) {
+        sharded_set.get_generation_stats(g, &stat);
+        assert(stat.entries == expected[g] && stat.filter_bytes > 0);
+    }
+
+    // Every entry is seen once, one generation after the other.
+    ScanCursor cursor;
+    uint32_t seen = 0;
+    while (sharded_set.scan(&cursor, 333, [&](const BYTE*, int) { seen++; }) == SCAN_MORE) {
+    }
+    assert(seen == 4000);
+
+    // The oldest generation goes with its entries, but not those added since, in one batch or not.
+    batch.clear();
+    for (uint32_t i = 0; i < 500; i++) {
+        int len = make_snapshot_entry(entry, i);
+        batch.add(entry, len, i);
+    }
+    sharded_set.insert_batch(batch, &flags[0]);
+    for (uint32_t i = 0; i < 500; i++) {
+        assert(flags[i] == 0);
+    }
+    assert(sharded_set.rotate() == 500);
+    assert(sharded_set.num_generations() == 3 && sharded_set.size() == 3500);
+
+    batch.clear();
+    for (uint32_t i = 0; i < 4000; i++) {
+        int len = make_snapshot_entry(entry, i);
+        batch.add(entry, len, i);
+    }
+    sharded_set.contains_batch(batch, &flags[0]);
+    for (uint32_t i = 0; i < 4000; i++) {
+        assert(flags[i] == (i < 500 || i >= 1000));
+    }
+
+    // An erased entry leaves whichever generation it is in.
+    int len = make_snapshot_entry(entry, 1500);
+    sharded_set.erase(entry, len);
+    assert(!sharded_set.contains(entry, len) && sharded_set.size() == 3499);
+
+    // A cursor of a dropped generation goes on with the oldest one left.
+    cursor = ScanCursor();
+    assert(sharded_set.scan(&cursor, 10, [](const BYTE*, int) {}) == SCAN_MORE);
+    assert(sharded_set.rotate() == 999);
+    seen = 0;
+    while (sharded_set.scan(&cursor, 333, [&](const BYTE*, int) { seen++; }) == SCAN_MORE) {
+    }
+    assert(seen == 2500 && sharded_set.size() == 2500);
+
+    sharded_set.get_stats(&stat);
+    assert(stat.entries == 2500);
+}
+
+/*
+ * Appends to batch the entry of {host: host, pop: pop} (or with typed values, {host: host, n: n}),
+ * encoded for strings_table, as prepare_entry_buffer() would, with the next row.
+ */
+static void add_set_op_entry(StringsTable* strings_table, bool typed_values, const char* host, int n,
+                             EntryBatch* batch) {
+    BYTE entry[64];
+    BYTE* p = entry;
+    int len = 0;
+    EntryToken et;
+    char pop[16];
+
+    bubo_utils::encode_packed(2, p, &len);
+    p += len;
+    strings_table->check_and_add("host", host, &et);
+    bubo_utils::encode_packed(et.tag_seq_no_, p, &len);
+    p += len;
+    if (typed_values) {
+        bubo_utils::encode_packed64((uint64_t)et.val_seq_no_ << VAL_KIND_BITS | VAL_STRING, p, &len);
+    } else {
+        bubo_utils::encode_packed(et.val_seq_no_, p, &len);
+    }
+    p += len;
+
+    if (typed_values) {
+        StringsTable::TagEntry* te = NULL;
+        strings_table->check_and_add_tag("n", &et, &te);
+        bubo_utils::encode_packed(et.tag_seq_no_, p, &len);
+        p += len;
+        bubo_utils::encode_packed64((uint64_t)n << 1 << VAL_KIND_BITS | VAL_INT, p, &len);
+    } else {
+        snprintf(pop, sizeof(pop), "pop%d", n);
+        strings_table->check_and_add("pop", pop, &et);
+        bubo_utils::encode_packed(et.tag_seq_no_, p, &len);
+        p += len;
+        bubo_utils::encode_packed(et.val_seq_no_, p, &len);
+    }
+    p += len;
+    batch->add(entry, p - entry, batch->size());
+}
+
+void test_set_ops() {
+    char host[16];
+
+    for (int typed_values = 0; typed_values <= 1; typed_values++) {
+        // a has hosts 0 to 999, and b, with more shards, 500 to 1499, with other sequence numbers.
+        StringsTable a_strings, b_strings, result_strings;
+        AttributesTable a(&a_strings), b(&b_strings, BytePtrHash(), 4);
+        a.set_typed_values(typed_values);
+        b.set_typed_values(typed_values);
+        EntryBatch a_batch, b_batch, batch;
+        EntryToken et;
+
+        b_strings.check_and_add("other", "x", &et);
+        for (int i = 0; i < 1000; i++) {
+            snprintf(host, sizeof(host), "host%d", i);
+            add_set_op_entry(&a_strings, typed_values, host, i % 10, &a_batch);
+            snprintf(host, sizeof(host), "host%d", 1499 - i);
+            add_set_op_entry(&b_strings, typed_values, host, (1499 - i) % 10, &b_batch);
+        }
+        std::vector<uint8_t> flags(1000);
+        a.run_batch(a_batch, true, &flags[0]);
+        b.run_batch(b_batch, true, &flags[0]);
+        assert(a.size() == 1000 && b.size() == 1000);
+
+        uint64_t count = 0;
+        bool missing = false;
+        assert(count_common(&a, &b, false, &count, &missing) && count == 500 && !missing);
+        assert(count_common(&b, &a, true, &count, &missing) && missing);
+        assert(count_common(&a, &a, true, &count, &missing) && count == 1000 && !missing);
+
+        // result has hosts from..to-1, encoded for its own strings table.
+        auto check = [&](SetOp op, int from, int to) {
+            StringsTable strings;
+            AttributesTable result(&strings, BytePtrHash(), 2);
+            result.set_typed_values(typed_values);
+            assert(combine_sets(&a, &b, op, &result));
+            assert(result.size() == (uint64_t)(to - from));
+
+            batch.clear();
+            for (int i = 0; i < 1500; i++) {
+                snprintf(host, sizeof(host), "host%d", i);
+                add_set_op_entry(&strings, typed_values, host, i % 10, &batch);
+            }
+            std::vector<uint8_t> found(1500);
+            result.run_batch(batch, false, &found[0]);
+            for (int i = 0; i < 1500; i++) {
+                assert(found[i] == (i >= from && i < to));
+            }
+
+            // the result is a subset of a or b.
+            assert(count_common(&result, op == SET_DIFFERENCE ? &a : &b, true, &count, &missing));
+            assert(missing == (op == SET_UNION) && (missing || count == result.size()));
+        };
+        check(SET_UNION, 0, 1500);
+        check(SET_INTERSECTION, 500, 1000);
+        check(SET_DIFFERENCE, 0, 500);
+    }
+}
+
+void test_attrs_table_run_batch() {
+    char host[16];
+    StringsTable strings;
+    AttributesTable table(&strings, BytePtrHash(), 4);
+    StripedLock lock;
+    table.set_concurrent(&lock);
+
+    // Over several chunks, with every host twice, the second time in a later chunk.
+    const int num_hosts = RUN_BATCH_CHUNK_ENTRIES + 1000;
+    EntryBatch batch;
+    for (int i = 0; i < 2 * num_hosts; i++) {
+        snprintf(host, sizeof(host), "host%d", i % num_hosts);
+        add_set_op_entry(&strings, false, host, 0, &batch);
+    }
+    std::vector<uint8_t> flags(batch.size());
+    table.run_batch(batch, true, &flags[0]);
+    assert(table.size() == (uint64_t)num_hosts);
+    for (int i = 0; i < 2 * num_hosts; i++) {
+        assert(flags[i] == (i < num_hosts));
+    }
+
+    std::vector<uint8_t> found(batch.size());
+    table.run_batch(batch, false, &found[0]);
+    assert(std::count(found.begin(), found.end(), 1) == 2 * num_hosts);
+}
+
+void test_attrs_table_sketch() {
+    char host[16];
+
+    for (int typed_values = 0; typed_values <= 1; typed_values++) {
+        // a keeps hosts 0 to 999 and their sketch, b only the sketch of 500 to 1499, with other sequence numbers.
+        StringsTable a_strings, b_strings;
+        AttributesTable a(&a_strings), b(&b_strings, BytePtrHash(), 4);
+        a.set_typed_values(typed_values);
+        b.set_typed_values(typed_values);
+        a.set_sketch(HLL_DEFAULT_PRECISION, true);
+        b.set_sketch(HLL_DEFAULT_PRECISION, false);
+        EntryBatch a_batch, b_batch;
+        EntryToken et;
+
+        b_strings.check_and_add("other", "x", &et);
+        for (int i = 0; i < 1000; i++) {
+            snprintf(host, sizeof(host), "host%d", i);
+            add_set_op_entry(&a_strings, typed_values, host, i % 10, &a_batch);
+            snprintf(host, sizeof(host), "host%d", 1499 - i);
+            add_set_op_entry(&b_strings, typed_values, host, (1499 - i) % 10, &b_batch);
+        }
+        std::vector<uint8_t> flags(1000);
+        a.run_batch(a_batch, true, &flags[0]);
+        assert(a.size() == 1000 && std::count(flags.begin(), flags.end(), 1) == 1000);
+        assert(fabs(a.cardinality() - 1000) < 65);
+
+        // Without the entries, the flags tell whether the sketch grew, which it does not the second time.
+        b.run_batch(b_batch, true, &flags[0]);
+        assert(b.size() == 0 && std::count(flags.begin(), flags.end(), 1) > 500);
+        b.run_batch(b_batch, true, &flags[0]);
+        assert(std::count(flags.begin(), flags.end(), 1) == 0);
+        assert(fabs(b.cardinality() - 1000) < 65);
+
+        // The points both have hash the same, whatever their sequence numbers: the merge counts them once.
+        std::string sketch;
+        b.serialize_sketch(&sketch);
+        assert(a.merge_sketch((const BYTE*)sketch.data(), sketch.size()));
+        assert(fabs(a.cardinality() - 1500) < 100);
+
+        // Only sketches of tables with the same typed values merge.
+        StringsTable c_strings;
+        AttributesTable c(&c_strings);
+        c.set_typed_values(!typed_values);
+        c.set_sketch(HLL_DEFAULT_PRECISION, false);
+        assert(!c.merge_sketch((const BYTE*)sketch.data(), sketch.size()));
+    }
 }
 
 void testall() {
     test_hash_function_same_input();
     test_hash_function_diff_input();
     test_hash_function_use_in_set();
+    test_wyhash();
 
     test_entry_len();
     test_entry_tokens_sorting();
     test_encode_decode_result_match();
+    test_append_number();
 
     test_strings_table_sizes();
+    test_strings_table_snapshot();
     test_strings_table_entry_buf_basic();
     test_strings_table_entry_buf_repeated();
     test_strings_table_entry_buf_large_seq();
@@ -585,4 +1967,25 @@ void testall() {
 
     test_hash_set();
     test_hash_set_add_many_erase();
+    test_blob_store_free_lists();
+    test_hash_set_compaction();
+    test_hash_set_auto_compaction();
+    test_hash_set_snapshot();
+    test_hash_set_mapped();
+    test_hash_set_probing();
+    test_hash_set_stored_hashes();
+    test_hash_set_max_size();
+    test_hash_set_incremental_resize();
+    test_hash_set_clock();
+    test_bloom_filter();
+    test_hash_set_filter();
+    test_hyperloglog();
+    test_hash_set_shared();
+    test_sharded_set();
+    test_sharded_set_scan();
+    test_sharded_set_concurrent();
+    test_sharded_set_generations();
+    test_set_ops();
+    test_attrs_table_run_batch();
+    test_attrs_table_sketch();
 }
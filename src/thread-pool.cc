@@ -0,0 +1,74 @@
+#include "thread-pool.h"
+
+ThreadPool::ThreadPool(uint32_t num_threads) : next_task_(0) {
+    for (uint32_t t = 1; t < num_threads; t++) {
+        threads_.push_back(std::thread(&ThreadPool::work, this));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        stopping_ = true;
+    }
+    start_.notify_all();
+    for (size_t t = 0; t < threads_.size(); t++) {
+        threads_[t].join();
+    }
+}
+
+void ThreadPool::run(uint32_t num_tasks, const std::function<void(uint32_t)>& task) {
+    std::lock_guard<std::mutex> run_guard(run_mutex_);
+
+    if (threads_.empty() || num_tasks <= 1) {
+        for (uint32_t i = 0; i < num_tasks; i++) {
+            task(i);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        task_ = &task;
+        num_tasks_ = num_tasks;
+        next_task_ = 0;
+        busy_ = threads_.size();
+        loop_ ++;
+    }
+    start_.notify_all();
+
+    run_tasks();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this]() { return busy_ == 0; });
+    task_ = NULL;
+}
+
+void ThreadPool::run_tasks() {
+    for (uint32_t i = next_task_++; i < num_tasks_; i = next_task_++) {
+        (*task_)(i);
+    }
+}
+
+void ThreadPool::work() {
+    uint64_t loop = 0;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            start_.wait(lock, [this, loop]() { return stopping_ || loop_ != loop; });
+            if (stopping_) {
+                return;
+            }
+            loop = loop_;
+        }
+
+        run_tasks();
+
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            busy_ --;
+        }
+        done_.notify_one();
+    }
+}
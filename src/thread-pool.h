@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A fixed set of threads for parallel loops: run() hands out the tasks of a loop to the threads
+ * of the pool and to the calling thread, and returns once they are all done. Loops run one at a
+ * time; a thread calling run() while another loop runs waits for it to finish first.
+ */
+class ThreadPool {
+public:
+    // num_threads counts the calling thread of run(): a pool of one has no threads of its own.
+    explicit ThreadPool(uint32_t num_threads);
+    ~ThreadPool();
+
+    // Calls task(i) for every i < num_tasks, in any order and on any of the threads.
+    void run(uint32_t num_tasks, const std::function<void(uint32_t)>& task);
+
+    uint32_t num_threads() const {
+        return threads_.size() + 1;
+    }
+
+private:
+    std::vector<std::thread> threads_;
+
+    std::mutex run_mutex_;                  // held by the caller of run() for the whole loop
+    std::mutex mutex_;
+    std::condition_variable start_;         // a loop was started, or the pool is stopping
+    std::condition_variable done_;          // a thread of the pool is done with the loop
+
+    const std::function<void(uint32_t)>* task_ = NULL;
+    uint32_t num_tasks_ = 0;
+    std::atomic<uint32_t> next_task_;
+    uint64_t loop_ = 0;                     // number of the current loop
+    uint32_t busy_ = 0;                     // threads of the pool still in the current loop
+    bool stopping_ = false;
+
+    void work();
+    // Runs tasks of the current loop until there are none left.
+    void run_tasks();
+
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+};
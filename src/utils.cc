@@ -1,3 +1,6 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include "utils.h"
 #include "persistent-string.h"
 #include "strings-table.h"
@@ -16,4 +19,75 @@ void hex_out(const BYTE* data, int len, const char* hint) {
     printf("\n\n");
 }
 
+void append_number(double d, std::string* out) {
+    if (d != d) {
+        out->append("NaN");
+        return;
+    }
+    if (d == 0) {
+        out->push_back('0');
+        return;
+    }
+    if (d < 0) {
+        out->push_back('-');
+        d = -d;
+    }
+    if (isinf(d)) {
+        out->append("Infinity");
+        return;
+    }
+
+    char buf[32];
+    // Up to 2^53, the digits of an integer are all its own.
+    if (d < 9007199254740992.0 && d == floor(d)) {
+        snprintf(buf, sizeof(buf), "%llu", (unsigned long long)d);
+        out->append(buf);
+        return;
+    }
+
+    // %e rounds to the closest digits of a precision, so the first precision that reads back
+    // as d gives the digits JavaScript picks. 17 digits always do.
+    for (int precision = 1; precision <= 17; precision++) {
+        snprintf(buf, sizeof(buf), "%.*e", precision - 1, d);
+        if (strtod(buf, NULL) == d) {
+            break;
+        }
+    }
+
+    // buf is d.ddde[+-]xx: k digits, with the decimal point after n of them.
+    char digits[20];
+    int k = 0;
+    const char* p = buf;
+    for (; *p != 'e'; p++) {
+        if (*p != '.') {
+            digits[k++] = *p;
+        }
+    }
+    while (k > 1 && digits[k - 1] == '0') {
+        k--;
+    }
+    int n = atoi(p + 1) + 1;
+
+    if (k <= n && n <= 21) {
+        out->append(digits, k);
+        out->append(n - k, '0');
+    } else if (0 < n && n <= 21) {
+        out->append(digits, n);
+        out->push_back('.');
+        out->append(digits + n, k - n);
+    } else if (-6 < n && n <= 0) {
+        out->append("0.");
+        out->append(-n, '0');
+        out->append(digits, k);
+    } else {
+        out->push_back(digits[0]);
+        if (k > 1) {
+            out->push_back('.');
+            out->append(digits + 1, k - 1);
+        }
+        snprintf(buf, sizeof(buf), "e%c%d", n > 0 ? '+' : '-', abs(n - 1));
+        out->append(buf);
+    }
+}
+
 }
@@ -23,6 +23,12 @@ void initialize(std::vector<std::string> ignoredAttrs);
 
 void hex_out(const BYTE* data, int len, const char* hint=NULL);
 
+/*
+ * Appends d to out as JavaScript's String(d) writes it: the fewest digits that read back as d,
+ * without an exponent from 1e-7 up to 1e21, and as for instance 1.5e-7 or 1e+21 otherwise.
+ */
+void append_number(double d, std::string* out);
+
 // Using Google's protobuffer encoding (https://github.com/google/protobuf)
 inline void encode_packed(uint32_t val, BYTE* out, int* outlen) {
     int length = 1;
@@ -55,6 +61,46 @@ inline uint32_t decode_packed(const BYTE* in) {
     return result;
 }
 
+// Same as above, and sets inlen to the number of bytes the value was encoded in.
+inline uint32_t decode_packed(const BYTE* in, int* inlen) {
+    uint32_t result = 0;
+    int length = 0;
+    BYTE b;
+    do {
+        b = in[length];
+        result |= (uint32_t)(b & 0x7F) << (7 * length);
+        length++;
+    } while (b & 0x80);
+    *inlen = length;
+    return result;
+}
+
+// 64-bit versions of the above, for values that may not fit in 32 bits.
+inline void encode_packed64(uint64_t val, BYTE* out, int* outlen) {
+    int length = 1;
+    while (val >= 0x80) {
+        *out = static_cast<uint8_t>(val | 0x80);
+        val >>= 7;
+        out++;
+        length++;
+    }
+    *out = static_cast<uint8_t>(val);
+    *outlen = length;
+}
+
+inline uint64_t decode_packed64(const BYTE* in, int* inlen) {
+    uint64_t result = 0;
+    int length = 0;
+    BYTE b;
+    do {
+        b = in[length];
+        result |= (uint64_t)(b & 0x7F) << (7 * length);
+        length++;
+    } while (b & 0x80);
+    *inlen = length;
+    return result;
+}
+
 inline bool cmp(const v8::Local<v8::String>& lhs, const v8::Local<v8::String>& rhs) {
     const v8::String::Utf8Value lval(lhs);
     const v8::String::Utf8Value rval(rhs);
@@ -100,4 +146,87 @@ inline uint32_t hash_byte_sequence(const BYTE* data, int len) {
 }
 
 
+/*
+ * 64-bit seeded hash reading 8 bytes at a time, after wyhash by Wang Yi
+ * (https://github.com/wangyi-fudan/wyhash, public domain).
+ */
+namespace wy {
+
+static const uint64_t secret[4] = { 0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+                                    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull };
+
+// 64x64 -> 128 bit multiplication; a and b are replaced with the low and high halves.
+inline void mum(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32);
+    uint64_t c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+inline uint64_t mix(uint64_t a, uint64_t b) {
+    mum(&a, &b);
+    return a ^ b;
+}
+
+inline uint64_t r8(const BYTE* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+inline uint64_t r4(const BYTE* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+inline uint64_t r3(const BYTE* p, size_t k) { return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1]; }
+
+}
+
+inline uint64_t wyhash_byte_sequence(const BYTE* data, int len, uint64_t seed) {
+    const BYTE* p = data;
+    size_t n = len;
+    uint64_t a, b;
+
+    seed ^= wy::mix(seed ^ wy::secret[0], wy::secret[1]);
+
+    if (n <= 16) {
+        if (n >= 4) {
+            a = (wy::r4(p) << 32) | wy::r4(p + ((n >> 3) << 2));
+            b = (wy::r4(p + n - 4) << 32) | wy::r4(p + n - 4 - ((n >> 3) << 2));
+        } else if (n > 0) {
+            a = wy::r3(p, n);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = n;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wy::mix(wy::r8(p) ^ wy::secret[1], wy::r8(p + 8) ^ seed);
+                see1 = wy::mix(wy::r8(p + 16) ^ wy::secret[2], wy::r8(p + 24) ^ see1);
+                see2 = wy::mix(wy::r8(p + 32) ^ wy::secret[3], wy::r8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wy::mix(wy::r8(p) ^ wy::secret[1], wy::r8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wy::r8(p + i - 16);
+        b = wy::r8(p + i - 8);
+    }
+
+    a ^= wy::secret[1];
+    b ^= seed;
+    wy::mum(&a, &b);
+    return wy::mix(a ^ wy::secret[0] ^ n, b ^ wy::secret[1]);
+}
+
+
 }
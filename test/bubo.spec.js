@@ -2,6 +2,9 @@ var Bubo = require('../index');
 var _ = require('underscore');
 var expect = require('chai').expect;
 var util = require('util');
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
 
 function getAttributeString(point, ignoredAttributes) {
     ignoredAttributes = ignoredAttributes || [];
@@ -111,6 +114,209 @@ describe('bubo', function() {
         expect(found).equal(true);
     });
 
+    it('addMany and containsMany: handle arrays of points', function() {
+        var bubo = new Bubo(options);
+        var point2 = {name: 'apple', pop: 'NY'};
+        var point3 = {name: 'apple', pop: 'SF'};
+
+        add(bubo, point);
+
+        var is_new = bubo.addMany([point, point2, point2]);
+        expect(is_new).to.be.an.instanceof(Uint8Array);
+        expect(Array.prototype.slice.call(is_new)).deep.equal([0, 1, 0]);
+
+        var found = bubo.containsMany([point3, point, point2]);
+        expect(Array.prototype.slice.call(found)).deep.equal([0, 1, 1]);
+
+        expect(bubo.addMany([]).length).equal(0);
+        expect(function() { bubo.addMany(point); }).to.throw('AddMany: invalid arguments');
+        expect(function() { bubo.containsMany(); }).to.throw('ContainsMany: invalid arguments');
+    });
+
+    it('addManyAsync and containsManyAsync: handle arrays of points off the main thread', function() {
+        var bubo = new Bubo({shards: 2});
+        var points = [], i;
+
+        for (i = 0; i < 1000; i++) {
+            points.push({host: 'host' + (i % 500), value: i % 500});
+        }
+        expect(bubo).instanceof(Bubo);
+
+        // queued batches run in order, and the sync methods work alongside them.
+        var adding = bubo.addManyAsync(points);
+        var looking = bubo.containsManyAsync([points[0], {host: 'nohost'}]);
+        add(bubo, {host: 'sync', value: 1});
+
+        return Promise.all([adding, looking, bubo.addManyAsync([])]).then(function(results) {
+            var isNew = results[0];
+            expect(isNew).instanceof(Uint8Array);
+            for (i = 0; i < 1000; i++) {
+                expect(isNew[i]).equal(i < 500 ? 1 : 0);
+            }
+            expect(Array.prototype.slice.call(results[1])).deep.equal([1, 0]);
+            expect(results[2].length).equal(0);
+            expect(contains(bubo, {host: 'sync', value: 1})).equal(true);
+            expect(Array.prototype.slice.call(bubo.containsMany(points.slice(0, 2)))).deep.equal([1, 1]);
+
+            return bubo.addManyAsync([{too_big: new Array(5001).join('dave rules!! ')}]);
+        }).then(function() {
+            throw new Error('expected a rejection');
+        }, function(err) {
+            expect(err.message).equal('point too big');
+            return bubo.containsManyAsync('not an array');
+        }).then(function() {
+            throw new Error('expected a rejection');
+        }, function(err) {
+            expect(err.message).equal('ContainsManyAsync: invalid arguments');
+        });
+    });
+
+    it('addColumns and containsColumns: handle points given as columns', function() {
+        var bubo = new Bubo({ignoredAttributes: ['time']});
+
+        add(bubo, {host: 'a', pop: 'SF'});
+
+        var is_new = bubo.addColumns({
+            pop: ['SF', 'NY', 'NY', undefined],
+            host: ['a', 'b', 'b', 'c'],
+            time: [1, 2, 3, 4]
+        }, 4);
+        expect(Array.prototype.slice.call(is_new)).deep.equal([0, 1, 0, 1]);
+
+        // rows are the same points as their object counterparts.
+        expect(contains(bubo, {host: 'b', pop: 'NY', time: 5})).equal(true);
+        expect(contains(bubo, {host: 'c'})).equal(true);
+        expect(add(bubo, {pop: 'NY', host: 'b'})).equal(false);
+
+        var found = bubo.containsColumns({host: ['a', 'c', 'd'], pop: ['SF']}, 3);
+        expect(Array.prototype.slice.call(found)).deep.equal([1, 1, 0]);
+
+        expect(function() { bubo.addColumns({host: 'a'}, 1); }).to.throw('columns must be arrays');
+        expect(function() { bubo.containsColumns({host: ['a']}); }).to.throw('ContainsColumns: invalid arguments');
+    });
+
+    it('entries, forEach and stream: read the objects of the set', function(done) {
+        var bubo = new Bubo({shards: 2, typedValues: true, ignoredAttributes: ['time']});
+        var when = new Date(1450000000000);
+        var points = [
+            {host: 'a', value: 1, time: 1},
+            {host: 'b', value: -2.5, up: true, down: null},
+            {host: 'c', value: '1', when: when},
+        ];
+        var i;
+
+        for (i = 0; i < 1000; i++) {
+            points.push({host: 'h' + i, pop: 'p' + (i % 7)});
+        }
+        bubo.addMany(points);
+        bubo.delete(points[3]);
+        var expected = points.slice(0, 3).concat(points.slice(4)).map(function(point) {
+            return _.omit(point, 'time');
+        });
+
+        function sorted(objects) {
+            return _.sortBy(objects, function(point) { return point.host; });
+        }
+
+        var read = [];
+        var iterator = bubo.entries(100);
+        for (var item = iterator.next(); !item.done; item = iterator.next()) {
+            read.push(item.value);
+        }
+        expect(sorted(read)).deep.equal(sorted(expected));
+
+        read = [];
+        bubo.forEach(function(point) { read.push(point); });
+        expect(sorted(read)).deep.equal(sorted(expected));
+
+        // the values are strings without typedValues.
+        var untyped = new Bubo();
+        untyped.add({host: 'x', value: 1});
+        expect(untyped.readEntries({})).deep.equal([{host: 'x', value: '1'}]);
+        expect(function() { untyped.readEntries(); }).to.throw('ReadEntries: invalid arguments');
+
+        // a resize under a cursor stops the reading.
+        var cursor = {};
+        expect(bubo.readEntries(cursor, 10).length).equal(10);
+        for (i = 0; i < 100000; i++) {
+            add(bubo, {host: 'new' + i});
+        }
+        expect(function() { bubo.readEntries(cursor); }).to.throw('the set was resized while reading its entries');
+
+        // a cursor that readEntries did not move is rejected.
+        [{layout: 0, shard: 99, pos: 0, generation: 0}, {layout: 0, shard: 0, pos: 0, generation: 5},
+         {layout: 0, shard: 0, pos: 0, generation: -1}].forEach(function(tampered) {
+            expect(function() { bubo.readEntries(tampered); }).to.throw('ReadEntries: invalid arguments');
+        });
+
+        read = [];
+        untyped.addMany(_.range(5000).map(function(n) { return {n: n}; }));
+        untyped.stream({batchSize: 64})
+            .on('data', function(point) { read.push(point); })
+            .on('error', done)
+            .on('end', function() {
+                expect(read.length).equal(5001);
+                done();
+            });
+    });
+
+    it('readEntries: asStrings gives the attr_str of every object', function(done) {
+        var bubo = new Bubo({typedValues: true});
+        var points = [
+            {host: 'a', value: 1, ratio: 0.1, big: 1e21, small: 1.5e-7},
+            {host: 'b', value: -2.5, up: true, down: null, none: undefined, nan: NaN},
+            {host: 'c', when: new Date(1450000000000), n: -0},
+        ];
+        var expected = points.map(function(point) {
+            var result = {};
+            bubo.add(point, result);
+            return result.attr_str;
+        });
+        expect(expected[0]).equal('big=1e+21,host=a,ratio=0.1,small=1.5e-7,value=1');
+
+        expect(bubo.readEntries({}, 10, true).sort()).deep.equal(expected.sort());
+
+        var read = [];
+        bubo.stream({asStrings: true})
+            .on('data', function(str) { read.push(str); })
+            .on('error', done)
+            .on('end', function() {
+                expect(read.sort()).deep.equal(expected);
+                done();
+            });
+    });
+
+    it('union, intersect, difference: combine two sets natively', function() {
+        var a = new Bubo({shards: 2});
+        var b = new Bubo();
+        b.add({other: 'x'});
+        b.delete({other: 'x'});
+        a.addMany(_.range(1000).map(function(i) { return {host: 'h' + i, pop: 'p' + (i % 7)}; }));
+        b.addMany(_.range(500, 1500).map(function(i) { return {pop: 'p' + (i % 7), host: 'h' + i}; }));
+
+        function hosts(set) {
+            var read = [];
+            set.forEach(function(point) { read.push(Number(point.host.slice(1))); });
+            return read.sort(function(x, y) { return x - y; });
+        }
+
+        var union = Bubo.union(a, b);
+        expect(hosts(union)).deep.equal(_.range(1500));
+        expect(union.contains({host: 'h1499', pop: 'p' + (1499 % 7)})).equal(true);
+        expect(hosts(Bubo.intersect(a, b))).deep.equal(_.range(500, 1000));
+        expect(hosts(Bubo.intersect(b, a))).deep.equal(_.range(500, 1000));
+        expect(hosts(Bubo.difference(a, b))).deep.equal(_.range(500));
+        expect(hosts(Bubo.difference(b, a))).deep.equal(_.range(1000, 1500));
+        expect(Bubo.intersectionSize(a, b)).equal(500);
+        expect(Bubo.intersectionSize(a, a)).equal(1000);
+        expect(Bubo.isSubset(Bubo.intersect(a, b), b)).equal(true);
+        expect(Bubo.isSubset(a, b)).equal(false);
+
+        expect(function() { Bubo.union(a, {}); }).to.throw('Union: invalid arguments');
+        expect(function() { Bubo.intersectionSize(a, new Bubo({typedValues: true})); })
+            .to.throw('IntersectionSize: the sets must both have typedValues or neither');
+    });
+
     it('delete: removes a specified point', function() {
         var bubo = new Bubo(options);
 
@@ -123,6 +329,451 @@ describe('bubo', function() {
         expect(contains(bubo, point)).equal(false);
     });
 
+    it('does not remember the tags and values of lookups', function() {
+        var bubo = new Bubo();
+        add(bubo, {host: 'a', pop: 'SF'});
+
+        var s1 = {};
+        bubo.stats(s1);
+
+        expect(contains(bubo, {host: 'b', pop: 'SF'})).equal(false);
+        expect(contains(bubo, {host: 'a', pop: 'SF', rack: '1'})).equal(false);
+        bubo.delete({host: 'c', pop: 'NY'});
+        expect(Array.prototype.slice.call(bubo.containsMany([{host: 'd'}, {host: 'a', pop: 'SF'}]))).deep.equal([0, 1]);
+        expect(Array.prototype.slice.call(bubo.containsColumns({
+            host: ['a', 'e', 'a'],
+            pop: ['SF', 'SF', 'SF'],
+            rack: [undefined, undefined, '2']
+        }, 3))).deep.equal([1, 0, 0]);
+
+        var s2 = {};
+        bubo.stats(s2);
+        expect(s2.strings_table).deep.equal(s1.strings_table);
+
+        // a known point is still found and deleted.
+        expect(contains(bubo, {pop: 'SF', host: 'a'})).equal(true);
+        bubo.delete({host: 'a', pop: 'SF'});
+        expect(contains(bubo, {host: 'a', pop: 'SF'})).equal(false);
+    });
+
+    it('reuses the space of deleted points', function() {
+        var bubo = new Bubo();
+        var i;
+
+        for (i = 0; i < 1000; i++) {
+            add(bubo, {host: 'host' + i, pop: 'SF'});
+        }
+        var s1 = {};
+        bubo.stats(s1);
+
+        for (i = 0; i < 1000; i++) {
+            bubo.delete({host: 'host' + i, pop: 'SF'});
+        }
+        var s2 = {};
+        bubo.stats(s2);
+        expect(s2.attrs_table.blob_dead_bytes).equal(s1.attrs_table.blob_used_bytes);
+
+        for (i = 0; i < 1000; i++) {
+            add(bubo, {host: 'host' + i, pop: 'NY'});
+        }
+        var s3 = {};
+        bubo.stats(s3);
+        expect(s3.attrs_table.blob_used_bytes).equal(s1.attrs_table.blob_used_bytes);
+        expect(s3.attrs_table.blob_dead_bytes).equal(0);
+    });
+
+    it('compacts on demand or automatically', function() {
+        var bubo = new Bubo({compactRatio: 0.25});
+        var i;
+
+        for (i = 0; i < 1000; i++) {
+            add(bubo, {host: 'host' + i});
+        }
+        for (i = 0; i < 1000; i += 2) {
+            bubo.delete({host: 'host' + i});
+        }
+
+        // a single chunk, which is being filled, is never compacted.
+        expect(bubo.compact()).equal(false);
+        expect(bubo.compact(1)).equal(false);
+
+        var s1 = {};
+        bubo.stats(s1);
+        expect(s1.attrs_table.blob_compactions).equal(0);
+        for (i = 1; i < 1000; i += 2) {
+            expect(contains(bubo, {host: 'host' + i})).equal(true);
+        }
+
+        bubo = new Bubo({autoCompact: true});
+        expect(add(bubo, {host: 'a'})).equal(true);
+        bubo.delete({host: 'a'});
+        expect(contains(bubo, {host: 'a'})).equal(false);
+
+        expect(function() { bubo.compact(0); }).to.throw('Compact: invalid arguments');
+        expect(function() { return new Bubo({autoCompact: 1}); }).to.throw(Error);
+        expect(function() { return new Bubo({compactRatio: 0}); }).to.throw(Error);
+        expect(function() { return new Bubo({compactRatio: 2}); }).to.throw(Error);
+    });
+
+    it('filters lookups of missing objects with bloomFilter', function() {
+        var bubo = new Bubo({bloomFilter: 1000});
+        var i, stats;
+
+        // the keys and values of the missing objects are all known, so lookups get to the table.
+        for (i = 0; i < 2000; i++) {
+            add(bubo, {host: 'host' + i, port: i % 7});
+        }
+        for (i = 0; i < 2000; i++) {
+            expect(contains(bubo, {host: 'host' + i, port: i % 7})).equal(true);
+            expect(contains(bubo, {host: 'host' + i, port: (i + 1) % 7})).equal(false);
+        }
+
+        stats = {};
+        bubo.detailedStats(stats);
+        expect(stats.attrs_table.filter_capacity).least(2000);
+        expect(stats.attrs_table.filter_bytes).above(0);
+        expect(stats.attrs_table.filter_fpr).above(0).below(0.05);
+        expect(stats.attrs_table.filter_stale).equal(0);
+
+        for (i = 0; i < 2000; i += 2) {
+            bubo.delete({host: 'host' + i, port: i % 7});
+        }
+        stats = {};
+        bubo.stats(stats);
+        expect(stats.attrs_table.filter_stale).equal(1000);
+
+        bubo.rebuildFilter();
+        stats = {};
+        bubo.stats(stats);
+        expect(stats.attrs_table.filter_stale).equal(0);
+        for (i = 0; i < 2000; i++) {
+            expect(contains(bubo, {host: 'host' + i, port: i % 7})).equal(i % 2 === 1);
+        }
+
+        stats = {};
+        new Bubo().stats(stats);
+        expect(stats.attrs_table.filter_bytes).equal(0);
+
+        expect(function() { return new Bubo({bloomFilter: 0}); }).to.throw(Error);
+        expect(function() { return new Bubo({bloomFilter: '1000'}); }).to.throw(Error);
+    });
+
+    it('estimates the number of distinct objects with sketch', function() {
+        var a = new Bubo({sketch: true});
+        var b = new Bubo({sketch: 'only', sketchPrecision: 14});
+        var c = new Bubo({sketch: 'only'});
+        var i;
+
+        for (i = 0; i < 20000; i++) {
+            add(a, {host: 'host' + i, port: i % 7});
+        }
+        expect(a.cardinality()).within(19000, 21000);
+        expect(contains(a, {host: 'host0', port: 0})).equal(true);
+
+        // b only keeps a sketch, of another precision.
+        for (i = 0; i < 100; i++) {
+            add(b, {host: 'host' + i, port: i % 7});
+        }
+        expect(b.cardinality()).within(95, 105);
+        expect(function() { contains(b, {host: 'host0', port: 0}); }).to.throw(Error);
+        expect(function() { b.delete({host: 'host0', port: 0}); }).to.throw(Error);
+        expect(function() { a.mergeSketch(b.sketch()); }).to.throw(Error);
+
+        // the sketches of a and c overlap by half, and c was made with another dictionary.
+        for (i = 10000; i < 30000; i++) {
+            add(c, {port: i % 7, host: 'host' + i});
+        }
+        var sketch = c.sketch();
+        expect(Buffer.isBuffer(sketch)).equal(true);
+        a.mergeSketch(sketch);
+        a.mergeSketch(sketch);
+        expect(a.cardinality()).within(28500, 31500);
+
+        var stats = {};
+        a.stats(stats);
+        expect(stats.attrs_table.sketch_bytes).equal(4096);
+        expect(stats.attrs_table.sketch_cardinality).equal(a.cardinality());
+
+        expect(new Bubo().cardinality()).equal(0);
+        expect(function() { new Bubo().sketch(); }).to.throw(Error);
+        expect(function() { a.mergeSketch(Buffer.from('not a sketch')); }).to.throw(Error);
+        expect(function() { new Bubo({typedValues: true, sketch: true}).mergeSketch(sketch); }).to.throw(Error);
+        expect(function() { return new Bubo({sketch: 'yes'}); }).to.throw(Error);
+        expect(function() { return new Bubo({sketchPrecision: 17}); }).to.throw(Error);
+    });
+
+    it('drops the objects of the oldest generation with rotate', function() {
+        var bubo = new Bubo({generations: 3, shards: 2});
+        var i, stats;
+
+        // generation g gets hosts [g * 100, g * 100 + 200), half of which were in generation g - 1.
+        for (var g = 0; g < 3; g++) {
+            if (g > 0) {
+                expect(bubo.rotate()).equal(0);
+            }
+            for (i = g * 100; i < g * 100 + 200; i++) {
+                expect(add(bubo, {host: 'host' + i})).equal(g === 0 || i >= g * 100 + 100);
+            }
+        }
+
+        stats = {};
+        bubo.stats(stats);
+        expect(stats.attrs_table.attr_entries).equal(400);
+        expect(_.pluck(stats.attrs_table.generations, 'ht_entries')).eql([100, 100, 200]);
+
+        // hosts 0 to 49 are added again, and outlive their generation.
+        for (i = 0; i < 50; i++) {
+            add(bubo, {host: 'host' + i});
+        }
+        expect(bubo.rotate()).equal(50);
+        for (i = 0; i < 400; i++) {
+            expect(contains(bubo, {host: 'host' + i})).equal(i < 50 || i >= 100);
+        }
+        expect(_.pluck(bubo.readEntries({}, 1000), 'host').length).equal(350);
+
+        // the result of a set operation has a single generation.
+        var union = Bubo.union(bubo, new Bubo());
+        expect(union.cardinality()).equal(350);
+        expect(function() { union.rotate(); }).to.throw('Rotate: the set has no generations');
+
+        expect(function() { new Bubo().rotate(); }).to.throw(Error);
+        expect(function() { bubo.save(path.join(os.tmpdir(), 'bubo-spec-' + process.pid + '.gen')); }).to.throw(Error);
+        expect(function() { return new Bubo({generations: 1}); }).to.throw(Error);
+        expect(function() { return new Bubo({generations: 3, mapDir: os.tmpdir()}); }).to.throw(Error);
+    });
+
+    it('evicts the least recently touched objects past maxBytes', function() {
+        var bubo = new Bubo({maxBytes: 1 << 20});
+        var i, stats, added = 0, evicted = 0;
+
+        function touch(point) {
+            if (add(bubo, point)) {
+                added++;
+            }
+            evicted += result.evicted;
+        }
+
+        // 100 hot objects are added again all along, between 50000 others, and outlive them.
+        for (i = 0; i < 50000; i++) {
+            touch({host: 'host' + (i % 300), pop: 'pop' + Math.floor(i / 300)});
+            touch({host: 'hot', pop: 'pop' + (i % 100)});
+        }
+        expect(evicted).above(0);
+        for (i = 0; i < 100; i++) {
+            expect(contains(bubo, {host: 'hot', pop: 'pop' + i})).equal(true);
+        }
+
+        stats = {};
+        bubo.stats(stats);
+        expect(stats.attrs_table.evictions).equal(evicted);
+        expect(stats.attrs_table.attr_entries).equal(added - evicted);
+        expect(stats.attrs_table.max_bytes).equal(1 << 20);
+        expect(stats.attrs_table.accounted_bytes).most(1 << 20);
+
+        expect(function() { return new Bubo({maxBytes: 0}); }).to.throw(Error);
+        expect(function() { return new Bubo({maxBytes: 'big'}); }).to.throw(Error);
+
+        // the result of a set operation has no cap, and keeps every object.
+        var other = new Bubo();
+        other.addMany(_.range(20000).map(function(n) { return {host: 'other' + n}; }));
+        var union = Bubo.union(bubo, other);
+        stats = {};
+        union.stats(stats);
+        expect(union.cardinality()).equal(added - evicted + 20000);
+        expect(stats.attrs_table.evictions).equal(undefined);
+        expect(stats.attrs_table.max_bytes).equal(undefined);
+    });
+
+    it('saves and loads snapshots', function() {
+        var file = path.join(os.tmpdir(), 'bubo-spec-' + process.pid + '.snap');
+        var bubo = new Bubo({ignoredAttributes: ['time'], typedValues: true, hashSeed: 7});
+        var i;
+
+        for (i = 0; i < 1000; i++) {
+            add(bubo, {host: 'host' + i, value: i, time: i});
+        }
+        for (i = 0; i < 1000; i += 2) {
+            bubo.delete({host: 'host' + i, value: i});
+        }
+        bubo.save(file);
+        expect(fs.existsSync(file + '.tmp')).equal(false);
+
+        var loaded = Bubo.load(file, {autoCompact: true});
+        for (i = 0; i < 1000; i++) {
+            // the ignored attributes and typed values come with the snapshot.
+            expect(contains(loaded, {host: 'host' + i, value: i, time: -1})).equal(i % 2 === 1);
+            expect(contains(loaded, {host: 'host' + i, value: '' + i})).equal(false);
+        }
+        expect(add(loaded, {host: 'host0', value: 0})).equal(true);
+        expect(add(loaded, {host: 'host1', value: 1})).equal(false);
+
+        var s1 = {}, s2 = {};
+        bubo.stats(s1);
+        loaded.stats(s2);
+        expect(s2.attrs_table.ht_entries).equal(s1.attrs_table.ht_entries + 1);
+        expect(s2.strings_table.num_tags).equal(s1.strings_table.num_tags);
+
+        // a damaged snapshot is rejected.
+        var bytes = fs.readFileSync(file);
+        bytes[bytes.length - 20] ^= 1;
+        fs.writeFileSync(file, bytes);
+        expect(function() { Bubo.load(file); }).to.throw(Error);
+        fs.writeFileSync(file, 'not a snapshot at all');
+        expect(function() { Bubo.load(file); }).to.throw('not a bubo snapshot');
+        fs.unlinkSync(file);
+
+        expect(function() { Bubo.load(file); }).to.throw('cannot open snapshot');
+        expect(function() { bubo.save(); }).to.throw('Save: invalid arguments');
+    });
+
+    it('keeps its contents in mapped files', function() {
+        var dir = fs.mkdtempSync(path.join(os.tmpdir(), 'bubo-spec-'));
+        var bubo = new Bubo({mapDir: dir, typedValues: true});
+        var i;
+
+        for (i = 0; i < 1000; i++) {
+            add(bubo, {host: 'host' + i, value: i});
+        }
+        bubo.delete({host: 'host0', value: 0});
+        expect(function() { new Bubo().sync(); }).to.throw('Sync: the set is not mapped');
+        bubo.sync();
+
+        var reader = Bubo.open(dir, {readOnly: true});
+        for (i = 0; i < 1000; i++) {
+            expect(contains(reader, {host: 'host' + i, value: i})).equal(i > 0);
+        }
+        expect(function() { add(reader, {host: 'a'}); }).to.throw('Add: the set is read-only');
+        expect(function() { reader.delete({host: 'host1', value: 1}); }).to.throw(Error);
+
+        // changes after the last sync make the files unusable until the next one.
+        add(bubo, {host: 'new', value: 1});
+        expect(function() { Bubo.open(dir); }).to.throw('mapped files do not match their last sync');
+        bubo.sync();
+
+        var reopened = Bubo.open(dir);
+        expect(contains(reopened, {host: 'new', value: 1})).equal(true);
+        expect(add(reopened, {host: 'host0', value: 0})).equal(true);
+        reopened.sync();
+
+        expect(function() { Bubo.open(dir, {mapDir: dir}); }).to.throw(Error);
+        expect(function() { return new Bubo({mapDir: 1}); }).to.throw('mapDir must be a string');
+
+        fs.readdirSync(dir).forEach(function(file) {
+            fs.unlinkSync(path.join(dir, file));
+        });
+        fs.rmdirSync(dir);
+    });
+
+    it('shares a set between instances', function(done) {
+        var first = new Bubo({shared: 'spec-shared', typedValues: true});
+        var second = new Bubo({shared: 'spec-shared'});
+
+        expect(add(first, {host: 'a', value: 1})).equal(true);
+        expect(add(second, {host: 'a', value: 1})).equal(false);
+        expect(contains(second, {host: 'a', value: '1'})).equal(false);
+        second.delete({host: 'a', value: 1});
+        expect(contains(first, {host: 'a', value: 1})).equal(false);
+
+        expect(function() { return new Bubo({shared: 1}); }).to.throw('shared must be a string');
+        expect(function() { Bubo.load('snapshot', {shared: 'spec-shared'}); }).to.throw('Load: a shared set cannot be loaded');
+
+        var workerThreads;
+        try {
+            workerThreads = require('worker_threads');
+        } catch (err) {
+            return done();
+        }
+
+        // Workers add overlapping points: every one of them ends up in the set once.
+        var remaining = 4;
+        var isNew = 0;
+        for (var w = 0; w < 4; w++) {
+            var worker = new workerThreads.Worker(
+                'var Bubo = require(' + JSON.stringify(path.join(__dirname, '../index')) + ');' +
+                'var wt = require("worker_threads");' +
+                'var bubo = new Bubo({shared: "spec-shared"});' +
+                'var isNew = 0;' +
+                'for (var i = 0; i < 1000; i++) { isNew += bubo.add({host: "h" + ((i + wt.workerData * 250) % 1000), value: 2}); }' +
+                'wt.parentPort.postMessage(isNew);',
+                {eval: true, workerData: w});
+            worker.on('message', function(count) { isNew += count; });
+            worker.on('error', done);
+            worker.on('exit', function() {
+                if (--remaining > 0) {
+                    return;
+                }
+                expect(isNew).equal(1000);
+                for (var i = 0; i < 1000; i++) {
+                    expect(contains(first, {host: 'h' + i, value: 2})).equal(true);
+                }
+                done();
+            });
+        }
+    });
+
+    it('splits a set into shards', function() {
+        var bubo = new Bubo({shards: 4, typedValues: true});
+        var points = [], i;
+
+        for (i = 0; i < 2000; i++) {
+            points.push({host: 'host' + (i % 1000), value: i % 1000});
+        }
+        var isNew = bubo.addMany(points);
+        for (i = 0; i < 2000; i++) {
+            expect(isNew[i]).equal(i < 1000 ? 1 : 0);
+        }
+        expect(add(bubo, {host: 'host0', value: 0})).equal(false);
+        bubo.delete({host: 'host1', value: 1});
+        var isPresent = bubo.containsColumns({host: ['host0', 'host1', 'nohost'], value: [0, 1, 0]}, 3);
+        expect(Array.prototype.slice.call(isPresent)).deep.equal([1, 0, 0]);
+
+        var stats = {};
+        bubo.stats(stats);
+        expect(stats.attrs_table.shards.length).equal(4);
+        var entries = 0;
+        stats.attrs_table.shards.forEach(function(shard) {
+            expect(shard.ht_entries).above(0);
+            entries += shard.ht_entries;
+        });
+        expect(entries).equal(999);
+        expect(stats.attrs_table.ht_entries).equal(999);
+        stats = {};
+        new Bubo().stats(stats);
+        expect(stats.attrs_table.shards).equal(undefined);
+
+        // the shards come with a snapshot.
+        var file = path.join(os.tmpdir(), 'bubo-spec-shards-' + process.pid + '.snap');
+        bubo.save(file);
+        var loaded = Bubo.load(file);
+        fs.unlinkSync(file);
+        stats = {};
+        loaded.stats(stats);
+        expect(stats.attrs_table.shards.length).equal(4);
+        expect(Array.prototype.slice.call(loaded.containsMany(points.slice(0, 3)))).deep.equal([1, 0, 1]);
+
+        // and with mapped files, one directory per shard.
+        var dir = fs.mkdtempSync(path.join(os.tmpdir(), 'bubo-spec-'));
+        var mapped = new Bubo({mapDir: dir, shards: 2});
+        mapped.addMany(points);
+        mapped.sync();
+        expect(fs.existsSync(path.join(dir, 'shard.1'))).equal(true);
+        var reopened = Bubo.open(dir);
+        expect(contains(reopened, points[999])).equal(true);
+        fs.readdirSync(dir).forEach(function(file) {
+            var sub = path.join(dir, file);
+            if (fs.statSync(sub).isDirectory()) {
+                fs.readdirSync(sub).forEach(function(f) { fs.unlinkSync(path.join(sub, f)); });
+                fs.rmdirSync(sub);
+            } else {
+                fs.unlinkSync(sub);
+            }
+        });
+        fs.rmdirSync(dir);
+
+        expect(function() { return new Bubo({shards: 0}); }).to.throw('shards must be an integer in [1, 64]');
+        expect(function() { return new Bubo({shards: 65}); }).to.throw('shards must be an integer in [1, 64]');
+    });
+
     it('returns appropriate stats', function() {
         var bubo = new Bubo({
             ignoredAttributes: ['time', 'value', 'source_type']
@@ -137,10 +788,16 @@ describe('bubo', function() {
         bubo.stats(s1);
 
         expect(s1.strings_table.num_tags).equal(6); // 9 attributes. ignoring time, value, and source_type, 6.
+        expect(s1.strings_table.num_vals_all).equal(6);
+        expect(s1.strings_table.pop).equal(undefined); // only detailedStats goes over the tags.
+        expect(s1.attrs_table.ht_max_probe_len).equal(undefined);
+        s1 = {};
+        bubo.detailedStats(s1);
         expect(s1.strings_table.pop).equal(1);
+        expect(s1.attrs_table.ht_max_probe_len).equal(0);
         expect(s1.attrs_table.attr_entries).equal(1);
         expect(s1.attrs_table.blob_allocated_bytes).equal(20971520); //20MB default size
-        expect(s1.attrs_table.blob_used_bytes).equal(13); // 1 byte for size, 6 x 2 bytes since all small numbers.
+        expect(s1.attrs_table.blob_used_bytes).equal(14); // 1 byte for record length, 1 byte for size, 6 x 2 bytes since all small numbers.
 
         var point2 = {
             name: 'apple',
@@ -148,14 +805,39 @@ describe('bubo', function() {
         };
         found = add(bubo, point2);
         s1 = {};
-        bubo.stats(s1);
+        bubo.detailedStats(s1);
 
         expect(s1.strings_table.num_tags).equal(6); // no new tags. should be same.
         expect(s1.strings_table.name).equal(2);
         expect(s1.strings_table.pop).equal(2);
         expect(s1.attrs_table.attr_entries).equal(2);
         expect(s1.attrs_table.blob_allocated_bytes).equal(20971520); //20MB default size
-        expect(s1.attrs_table.blob_used_bytes).equal(18); // 1 byte for size + 2 x 2 bytes = 5. already have 13, so total 18.
+        expect(s1.attrs_table.blob_used_bytes).equal(20); // 1 byte for record length + 1 byte for size + 2 x 2 bytes = 6. already have 14, so total 20.
+    });
+
+    it('caches the key lists of points', function() {
+        var bubo = new Bubo({ignoredAttributes: ['time']});
+        var s1 = {};
+
+        for (var i = 0; i < 100; i++) {
+            add(bubo, {host: 'host' + i, pop: 'SF', time: i});
+        }
+        bubo.stats(s1);
+        expect(s1.attrs_table.shape_cache_misses).equal(1);
+        expect(s1.attrs_table.shape_cache_hits).equal(99);
+        expect(s1.attrs_table.shape_cache_hit_rate).equal(0.99);
+
+        // the same keys in another order make another shape, for the same points.
+        expect(add(bubo, {time: 0, pop: 'SF', host: 'host1'})).equal(false);
+        expect(result.attr_str).equal('host=host1,pop=SF');
+        expect(contains(bubo, {pop: 'SF', host: 'host2'})).equal(true);
+        expect(contains(bubo, {pop: 'NY', host: 'host2'})).equal(false);
+
+        s1 = {};
+        bubo.stats(s1);
+        expect(s1.attrs_table.shape_cache_misses).equal(3);
+        expect(s1.attrs_table.shape_cache_size).equal(3);
+        expect(s1.attrs_table.attr_entries).equal(100);
     });
 
     it('has an ignoredAttributes per Bubo', function() {
@@ -187,6 +869,83 @@ describe('bubo', function() {
         expect(function() { return new Bubo({ignoredAttributes: {}}); }).to.throw(Error);
     });
 
+    it('resizes incrementally when asked to', function() {
+        var bubo = new Bubo({incrementalResize: true});
+        var s1, i;
+        var resizing = false;
+
+        for (i = 0; i < 10000; i++) {
+            add(bubo, {host: 'host' + i});
+            s1 = {};
+            bubo.stats(s1);
+            if (s1.attrs_table.ht_resize_old_len > 0) {
+                resizing = true;
+                expect(s1.attrs_table.ht_resize_migrated).below(s1.attrs_table.ht_resize_old_len);
+            }
+        }
+        expect(resizing).to.be.true;
+        expect(s1.attrs_table.attr_entries).equal(10000);
+
+        for (i = 0; i < 10000; i++) {
+            expect(contains(bubo, {host: 'host' + i})).equal(true);
+        }
+
+        expect(function() { return new Bubo({incrementalResize: 1}); }).to.throw(Error);
+    });
+
+    it('supports both hash functions', function() {
+        _.each(['wyhash', 'jenkins'], function(hash) {
+            var bubo = new Bubo({hash: hash, hashSeed: 42});
+            for (var i = 0; i < 1000; i++) {
+                expect(add(bubo, {host: 'host' + i, pop: 'SF'})).equal(true);
+            }
+            for (i = 0; i < 1000; i++) {
+                expect(contains(bubo, {host: 'host' + i, pop: 'SF'})).equal(true);
+                expect(contains(bubo, {host: 'host' + i, pop: 'NY'})).equal(false);
+            }
+        });
+
+        expect(function() { return new Bubo({hash: 'md5'}); }).to.throw(Error);
+        expect(function() { return new Bubo({hash: 1}); }).to.throw(Error);
+        expect(function() { return new Bubo({hashSeed: 'abc'}); }).to.throw(Error);
+    });
+
+    it('supports typed values', function() {
+        var bubo = new Bubo({typedValues: true});
+        var values = [0, 1, -1, 2147483647, -2147483648, 2147483648, 1.5, -0.25, NaN, Infinity,
+                      true, false, null, undefined, new Date(1500000000000), '1', 'true', 'null'];
+
+        _.each(values, function(value) {
+            expect(add(bubo, {host: 'a', value: value})).equal(true);
+        });
+        _.each(values, function(value) {
+            expect(add(bubo, {host: 'a', value: value})).equal(false);
+            expect(contains(bubo, {host: 'a', value: value})).equal(true);
+        });
+
+        expect(contains(bubo, {host: 'a', value: -0})).equal(true);
+        expect(contains(bubo, {host: 'a', value: 0 / 0})).equal(true);
+        expect(contains(bubo, {host: 'a', value: 2})).equal(false);
+        expect(contains(bubo, {host: 'a', value: '0'})).equal(false);
+        expect(contains(bubo, {host: 'a', value: new Date(1500000000001)})).equal(false);
+
+        var s1 = {};
+        bubo.detailedStats(s1);
+        expect(s1.attrs_table.attr_entries).equal(values.length);
+        // only the strings are interned.
+        expect(s1.strings_table.value).equal(3);
+
+        expect(bubo.addColumns({host: ['a', 'a'], value: [1, '1']}, 2)).deep.equal(new Uint8Array([0, 0]));
+        expect(bubo.containsColumns({host: ['a', 'a'], value: [3, 3.5]}, 2)).deep.equal(new Uint8Array([0, 0]));
+
+        // without typedValues, values are compared as strings.
+        bubo = new Bubo();
+        expect(add(bubo, {host: 'a', value: 1})).equal(true);
+        expect(add(bubo, {host: 'a', value: '1'})).equal(false);
+
+        expect(function() { return new Bubo({typedValues: 'yes'}); }).to.throw(Error);
+    });
+
     it.skip('profiles the memory use of adding 7 million points', function() {
         this.timeout(900000);
         var bubo = new Bubo(options);
@@ -246,5 +1005,16 @@ describe('bubo', function() {
         } catch (err) {
             expect(err.message).equal('point too big');
         }
+
+        // Without a result object, and in batches, the same size rule holds.
+        expect(function() { bubo.add(point); }).to.throw('point too big');
+        expect(function() { bubo.addMany([{host: 'a'}, point]); }).to.throw('point too big');
+        expect(function() { bubo.addColumns({host: ['a'], too_big: [too_big_string]}, 1); }).to.throw('point too big');
+        expect(function() { bubo.containsMany([point]); }).to.throw('point too big');
+
+        // The limit is on the attribute string, "big=..." here, which must stay under 16KB.
+        var under = {big: too_big_string.slice(0, (16 << 10) - 5)};
+        expect(bubo.add(under)).equal(true);
+        expect(function() { bubo.add({big: under.big + 'x'}); }).to.throw('point too big');
     });
 });